@@ -3,8 +3,14 @@
 
 #include <machine/atomic.h>
 
+/*
+ * Spinlocks are ticket locks: every CPU wanting the lock takes the next
+ * ticket from sl_next and waits until sl_owner reaches it; this ensures the
+ * lock is handed out in the order in which it was requested.
+ */
 typedef struct {
-	atomic_t		sl_var;
+	atomic_t		sl_next;	/* Next ticket to hand out */
+	atomic_t		sl_owner;	/* Ticket currently holding the lock */
 } spinlock_t;
 
 #endif /* __SPINLOCK_H__ */
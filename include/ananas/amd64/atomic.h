@@ -26,4 +26,27 @@ static inline int atomic_read(atomic_t* a)
 	return *(volatile int*)&a->value;
 }
 
+/* Adds 'v' to the atomic and returns its previous value */
+static inline int atomic_add(atomic_t* a, int v)
+{
+	register int m = v;
+	__asm __volatile(
+		"lock xadd %0, (%1)"
+	: "+r" (m) : "r" (&a->value) : "memory");
+	return m;
+}
+
+/* Replaces the value by 'nv' if it is 'ov'; returns the previous value */
+static inline int atomic_cmpxchg(atomic_t* a, int ov, int nv)
+{
+	__asm __volatile(
+		"lock cmpxchg %2, (%1)"
+	: "+a" (ov) : "r" (&a->value), "r" (nv) : "memory");
+	return ov;
+}
+
+/* Keeps the compiler from moving memory accesses across this point */
+#define atomic_compiler_barrier() \
+	__asm __volatile("" : : : "memory")
+
 #endif /* __AMD64_ATOMIC_H__ */
@@ -85,6 +85,22 @@ struct FPUREGS {
 #define md_cpu_relax() \
 	__asm __volatile("hlt")
 
+/* Used in busy-wait loops; hints the CPU that we are spinning */
+#define md_cpu_pause() \
+	__asm __volatile("pause" : : : "memory")
+
+/* Returns the current value of the cycle counter */
+static inline uint64_t md_cpu_cycles()
+{
+	register uint64_t v;
+	__asm __volatile(
+		"rdtsc\n"
+		"shlq $32, %%rdx\n"
+		"orq %%rdx, %0\n"
+	: "=a" (v) : : "rdx");
+	return v;
+}
+
 #endif
 
 #define THREAD_MDFLAG_FULLRESTORE 0x0001 /* Perform a full register restore upon return */
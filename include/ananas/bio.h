@@ -5,15 +5,6 @@
 #ifndef __ANANAS_BIO_H__
 #define __ANANAS_BIO_H__
 
-/* Number of buckets used to hash a block number to */
-#define BIO_BUCKET_SIZE		16
-
-/* Number of BIO buffers available */
-#define BIO_NUM_BUFFERS		1024
-
-/* Amount of data available for BIO data, in bytes */
-#define BIO_DATA_SIZE		(512 * 1024)
-
 /* Size of a sector; any BIO block must be a multiple of this */
 #define BIO_SECTOR_SIZE		512
 
@@ -21,27 +12,88 @@
 #define BIO_IS_READ(bio)	((bio)->flags & BIO_FLAG_READ)
 #define BIO_IS_WRITE(bio)	((bio)->flags & BIO_FLAG_WRITE)
 #define BIO_IS_ERROR(bio)	((bio)->flags & BIO_FLAG_ERROR)
+#define BIO_IS_MAPPED(bio)	((bio)->flags & BIO_FLAG_MAPPED)
 #define BIO_DATA(bio)		((bio)->data)
 
+/* Maximum number of pieces a single buffer may consist of */
+#define BIO_MAX_VECS		32
+
+struct BIO;
+struct BIO_DATA_PAGE;
+
+typedef void (*bio_callback_t)(struct BIO* bio, void* arg);
+
+/*
+ * Completion of an asynchronous request; the callback is invoked once the
+ * data is available or the request failed. This may happen from interrupt
+ * context, so callbacks must not sleep. The structure is provided by the
+ * caller and must remain valid until the callback has been invoked.
+ */
+struct BIO_COMPLETION {
+	bio_callback_t		bc_func;
+	void*			bc_arg;
+	DQUEUE_FIELDS(struct BIO_COMPLETION);
+};
+DQUEUE_DEFINE(BIO_COMPLETION_LIST, struct BIO_COMPLETION);
+
 /*
- * A basic I/O buffer, the root of all I/O requests. 
+ * A piece of a buffer which spans multiple pages; a piece never crosses a
+ * page boundary.
+ */
+struct BIO_VEC {
+	void*			bv_data;
+	unsigned int		bv_length;
+};
+
+/*
+ * A basic I/O buffer, the root of all I/O requests. Buffers in the cache hold
+ * at most a page of data; buffers which are handed to drivers may describe a
+ * larger transfer as a list of pieces, in which case 'data' is NULL.
  */
 struct BIO {
 	uint32_t  	flags;
 #define BIO_FLAG_PENDING	0x0001	/* Block is pending read */
 #define BIO_FLAG_DIRTY		0x0002	/* I/O needs to be written */
+#define BIO_FLAG_MAPPED		0x0004	/* Data is the device's own memory */
 #define BIO_FLAG_ERROR		0x8000	/* Request failed */
 	device_t	  device;	/* Device I/O'ing from */
 	blocknr_t	  block;	/* Block number to I/O */
 	blocknr_t	  io_block;	/* Translated block number to I/O */
-	unsigned int	  length;	/* Length in bytes (<= PAGE_SIZE, so int will do) */
-	void*		  data;		/* Pointer to BIO data */
+	unsigned int	  length;	/* Length in bytes */
+	void*		  data;		/* Pointer to BIO data, if not using pieces */
+	unsigned int	  num_vecs;	/* Number of pieces, or 0 */
+	struct BIO_VEC*	  vec;		/* Pieces, if any */
+	struct BIO_DATA_PAGE* data_page; /* Page containing the data, if allocated by us */
+	int		  referenced;	/* Used since the clock hand passed */
 	semaphore_t       sem;          /* Semaphore for this BIO */
+	struct BIO_COMPLETION_LIST completions; /* Callbacks to invoke when no longer pending */
+	int		  dirty_queued;	/* On the dirty list */
+	uint64_t	  dirty_since;	/* Tick at which the buffer was queued as dirty */
 
 	DQUEUE_FIELDS_IT(struct BIO, chain);	/* Chain queue */
 	DQUEUE_FIELDS_IT(struct BIO, bucket);	/* Bucket queue */
+	DQUEUE_FIELDS_IT(struct BIO, dirty);	/* Dirty queue */
 };
 
+/*
+ * Drivers must use these to get at the data, as it may consist of multiple
+ * pieces; a buffer without pieces is treated as a single piece.
+ */
+static inline unsigned int bio_num_vecs(struct BIO* bio)
+{
+	return bio->num_vecs > 0 ? bio->num_vecs : 1;
+}
+
+static inline void* bio_vec_data(struct BIO* bio, unsigned int n)
+{
+	return bio->num_vecs > 0 ? bio->vec[n].bv_data : bio->data;
+}
+
+static inline unsigned int bio_vec_length(struct BIO* bio, unsigned int n)
+{
+	return bio->num_vecs > 0 ? bio->vec[n].bv_length : bio->length;
+}
+
 /* Flags of BIO_READ */
 #define BIO_READ_NODATA		0x0001	/* Caller is not interested in the data */
 
@@ -55,8 +107,53 @@ static inline struct BIO* bio_read(device_t dev, blocknr_t block, size_t len)
 	return bio_get(dev, block, len, 0);
 }
 
+/*
+ * Submits a request for a block without waiting for it; 'bc' (if not NULL)
+ * is invoked once the block is available, which may be before bio_submit()
+ * returns. Use bio_wait() or bio_wait_many() to wait for completion.
+ */
+struct BIO* bio_submit(device_t dev, blocknr_t block, size_t len, int flags, struct BIO_COMPLETION* bc);
+errorcode_t bio_wait(struct BIO* bio);
+/*
+ * Registers a completion with a buffer, or invokes it right away if the buffer
+ * is no longer pending.
+ */
+void bio_add_completion(struct BIO* bio, struct BIO_COMPLETION* bc);
+errorcode_t bio_wait_many(struct BIO** bio, unsigned int num);
+
+/*
+ * Submits reads for 'num' adjacent blocks of 'len' bytes, starting at 'block',
+ * without waiting for them; blocks which are not yet cached are read using as
+ * few device requests as possible.
+ */
+void bio_prefetch(device_t dev, blocknr_t block, size_t len, unsigned int num);
+
+/*
+ * Writes all dirty buffers of a device (or of all devices if 'dev' is NULL)
+ * and waits until this is done.
+ */
+void bio_sync(device_t dev);
+
 struct BIO* bio_get_next(device_t dev);
 void bio_free(struct BIO* bio);
 void bio_dump();
 
+/* Buffer cache statistics, since startup */
+struct BIO_STATS {
+	unsigned int	bs_hits;		/* Lookups satisfied from the cache */
+	unsigned int	bs_misses;		/* Lookups which needed a new buffer */
+	unsigned int	bs_evictions;		/* Buffers thrown out of the cache */
+	unsigned int	bs_writebacks;		/* Dirty buffers written on eviction */
+	unsigned int	bs_sync_writes;		/* Device writes issued by the syncer */
+	unsigned int	bs_sync_buffers;	/* Buffers written by the syncer */
+	unsigned int	bs_pages_added;		/* Data pages added to the cache */
+	unsigned int	bs_pages_removed;	/* Data pages given back */
+	unsigned int	bs_rehashes;		/* Hash table resizes */
+	unsigned int	bs_prefetch_reads;	/* Device reads issued by bio_prefetch() */
+	unsigned int	bs_prefetch_buffers;	/* Buffers read by bio_prefetch() */
+	unsigned int	bs_mapped;		/* Buffers referring to device memory */
+};
+
+void bio_get_stats(struct BIO_STATS* stats);
+
 #endif /* __ANANAS_BIO_H__ */
@@ -0,0 +1,97 @@
+#ifndef __ANANAS_BIOQUEUE_H__
+#define __ANANAS_BIOQUEUE_H__
+
+#include <ananas/types.h>
+#include <ananas/bio.h>
+#include <ananas/device.h>
+#include <ananas/dqueue.h>
+#include <ananas/lock.h>
+
+/*
+ * Block devices may have a request queue in front of their driver; buffers
+ * handed to device_bread() and device_bwrite() are turned into requests,
+ * which are passed to the driver in the order chosen by the queue's policy.
+ * Requests for adjacent blocks are merged into a single, larger transfer if
+ * the policy allows this; the driver is handed a buffer which refers to the
+ * data of all merged buffers, so nothing needs to be copied.
+ */
+
+/* Maximum length of a merged request, in bytes */
+#define BIOQ_MAX_LENGTH		(128 * 1024)
+
+/* Maximum number of buffers in a single request */
+#define BIOQ_MAX_BIOS		32
+
+struct BIO_QUEUE;
+
+struct BIO_REQUEST {
+	int			br_flags;
+#define BIO_REQUEST_FLAG_WRITE	0x0001
+	struct BIO_QUEUE*	br_queue;
+	blocknr_t		br_block;		/* First block */
+	size_t			br_length;		/* Total length, in bytes */
+	uint64_t		br_deadline;		/* Tick at which the request must be dispatched */
+	uint64_t		br_submitted;		/* Cycle count when submitted */
+	unsigned int		br_num_bios;
+	unsigned int		br_num_vecs;		/* Pieces of all buffers together */
+	struct BIO*		br_bios[BIOQ_MAX_BIOS];	/* Buffers in ascending block order */
+	struct BIO		br_bio;			/* What is handed to the driver */
+	struct BIO_VEC		br_vec[BIO_MAX_VECS];	/* Pieces of a merged request */
+	struct BIO_COMPLETION	br_completion;
+	DQUEUE_FIELDS_IT(struct BIO_REQUEST, fifo);	/* Arrival order */
+	DQUEUE_FIELDS_IT(struct BIO_REQUEST, sorted);	/* Block order */
+};
+DQUEUE_DEFINE(BIO_REQUEST_FIFO, struct BIO_REQUEST);
+DQUEUE_DEFINE(BIO_REQUEST_SORTED, struct BIO_REQUEST);
+
+/*
+ * A policy decides where requests go and which request is dispatched next;
+ * requests are always on the fifo list, the policy may use the sorted list.
+ */
+struct BIO_QUEUE_POLICY {
+	const char*	qp_name;
+	int		qp_merge;	/* Merge requests for adjacent blocks */
+	void		(*qp_insert)(struct BIO_QUEUE* q, struct BIO_REQUEST* br);
+	struct BIO_REQUEST* (*qp_next)(struct BIO_QUEUE* q);
+};
+
+/* Per-queue statistics, since the queue was created */
+struct BIO_QUEUE_STATS {
+	unsigned int	qs_requests;		/* Requests handed to the driver */
+	unsigned int	qs_bios;		/* Buffers handled */
+	unsigned int	qs_merges;		/* Buffers merged into an existing request */
+	unsigned int	qs_max_depth;		/* Most requests in flight at once */
+	uint64_t	qs_total_latency;	/* Submission to completion, in cycles */
+	uint64_t	qs_max_latency;
+};
+
+struct BIO_QUEUE {
+	device_t			q_device;
+	struct BIO_QUEUE_POLICY*	q_policy;
+	unsigned int			q_max_depth;	/* Requests the driver may have in flight */
+	spinlock_t			q_lock;		/* Protects the fields below; also taken from interrupt context */
+	struct BIO_REQUEST_FIFO		q_fifo;		/* Pending requests, by arrival */
+	struct BIO_REQUEST_SORTED	q_sorted;	/* Pending requests, by block (if used) */
+	struct BIO_REQUEST_FIFO		q_done;		/* Completed requests yet to be finished */
+	unsigned int			q_pending;
+	unsigned int			q_depth;	/* Requests in flight */
+	blocknr_t			q_last_block;	/* Where the last dispatched request ended */
+	struct BIO_QUEUE_STATS		q_stats;
+	DQUEUE_FIELDS(struct BIO_QUEUE);
+};
+DQUEUE_DEFINE(BIO_QUEUE_LIST, struct BIO_QUEUE);
+
+/* Hands requests to the driver in order of arrival, without merging */
+extern struct BIO_QUEUE_POLICY bioq_policy_noop;
+/* Sorts requests by block and merges them, but dispatches any expired request first */
+extern struct BIO_QUEUE_POLICY bioq_policy_deadline;
+
+/* Places a queue in front of a device's driver */
+errorcode_t bioq_attach(device_t dev, struct BIO_QUEUE_POLICY* policy, unsigned int max_depth);
+
+/* Called by device_bread() and device_bwrite() for devices with a queue */
+errorcode_t bioq_submit(struct BIO_QUEUE* q, struct BIO* bio, int write);
+
+void bioq_get_stats(struct BIO_QUEUE* q, struct BIO_QUEUE_STATS* stats);
+
+#endif /* __ANANAS_BIOQUEUE_H__ */
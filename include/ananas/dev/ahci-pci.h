@@ -264,22 +264,36 @@ struct AHCI_PCI_PRDE {
 #define AHCI_PRDE_DW3_DBC(x)		(x)
 } __attribute__((packed));
 
+/* Maximum number of bytes a single PRD entry can describe */
+#define AHCI_PRDE_MAX_BYTES		(4 * 1024 * 1024)
+
+/* Number of PRD entries in every command table */
+#define AHCI_PCI_CT_PRDS		DMA_LOAD_MAX_SEGS
+
 /* Command Table */
 struct AHCI_PCI_CT {
 	uint8_t		ct_cfis[64];
 	uint8_t		ct_acmd[16];
 	uint8_t		ct_rsvd[48];
-	/*
-	 * Note that even though AHCI supports multiple PRD's, we only use a
-	 * single one.
-	 */
-	struct		AHCI_PCI_PRDE ct_prd[1];
+	struct		AHCI_PCI_PRDE ct_prd[AHCI_PCI_CT_PRDS];
 } __attribute__((packed));
 
 struct AHCI_PCI_REQUEST {
 	struct SATA_REQUEST	pr_request;
 	dma_buf_t pr_dmabuf_ct;
 	struct AHCI_PCI_CT*	pr_ct;
+	unsigned int		pr_num_prd;	/* PRD entries in use */
+	uint64_t		pr_issued;	/* Cycle count when issued */
+};
+
+/* Per-port statistics, used to size queue depths */
+struct AHCI_PCI_PORT_STATS {
+	uint32_t ps_commands;		/* Commands completed */
+	uint32_t ps_ncq_commands;	/* ... of which natively queued */
+	uint32_t ps_slot_waits;		/* Times enqueue had to wait for a slot */
+	uint32_t ps_occupancy[33];	/* Slots in use when a command was enqueued */
+	uint64_t ps_total_latency;	/* Issue to completion, in cycles */
+	uint64_t ps_max_latency;
 };
 
 struct AHCI_PCI_PORT {
@@ -295,6 +309,9 @@ struct AHCI_PCI_PORT {
 	uint32_t p_request_in_use;	/* [RW] Current requests in use */
 	uint32_t p_request_valid;	/* [RW] Requests that can be activated */
 	uint32_t p_request_active;	/* [RW] Requests that are activated */
+	uint32_t p_request_ncq;		/* [RW] Requests that are natively queued */
+	semaphore_t p_slots;		/* Counts the command slots not in use */
+	struct AHCI_PCI_PORT_STATS p_stats;	/* [RW] Statistics */
 	struct AHCI_PCI_REQUEST p_request[32];
 };
 
@@ -302,6 +319,7 @@ struct AHCI_PCI_PRIVDATA {
 	addr_t ap_addr;
 	uint32_t ap_pi;
 	unsigned int ap_ncs;
+	int ap_ncq;			/* Native command queuing supported */
 	unsigned int ap_num_ports;
 	struct AHCI_PCI_PORT ap_port[0];
 };
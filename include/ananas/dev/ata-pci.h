@@ -25,7 +25,8 @@ struct ATAPCI_PRDT {
 #define ATA_PRDT_EOT		(1 << 31)		/* End Of Transfer */
 } __attribute__((packed));
 
-#define ATA_PCI_NUMPRDT		8
+/* Enough for a buffer of BIO_MAX_VECS pieces */
+#define ATA_PCI_NUMPRDT		32
 
 struct ATAPCI_PRIVDATA {
 	uint32_t		atapci_io;
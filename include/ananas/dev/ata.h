@@ -30,6 +30,8 @@
 #define ATA_CMD_DMA_READ_EXT		0x25	/* 48 bit DMA */
 #define ATA_CMD_WRITE_SECTORS		0x30	/* 28 bit PIO */
 #define ATA_CMD_DMA_WRITE_EXT		0x35	/* 48 bit DMA */
+#define ATA_CMD_READ_FPDMA_QUEUED	0x60	/* 48 bit NCQ */
+#define ATA_CMD_WRITE_FPDMA_QUEUED	0x61	/* 48 bit NCQ */
 #define ATA_CMD_PACKET			0xa0
 #define ATA_CMD_IDENTIFY_PACKET		0xa1
 #define ATA_CMD_READ_MULTIPLE		0xc4	/* 28 bit DMA */
@@ -104,7 +106,10 @@ struct ATA_IDENTIFY {
 	/*  68 */ uint8_t min_pio_xfer[2];
 	/*  69 */ uint8_t reserved1[12];
 	/*  75 */ uint8_t queue_depth[2];
-	/*  76 */ uint8_t reserved2[8];
+#define ATA_QUEUE_DEPTH(x)	(((x) & 0x1f) + 1)
+	/*  76 */ uint8_t sata_capabilities[2];
+#define ATA_SATACAP_NCQ		(1 <<  8)
+	/*  77 */ uint8_t reserved2[6];
 	/*  80 */ uint8_t major_ata_spec[2];
 #define ATA_SPEC_ATAPI14	(1 << 14)
 #define ATA_SPEC_ATAPI13	(1 << 13)
@@ -40,7 +40,7 @@ struct SATA_REQUEST {
 		struct SATA_FIS_H2D fis_h2d;
 	} sr_fis;
 	unsigned int	sr_fis_length;	/* FIS length, in bytes */
-	uint16_t	sr_count;	/* request length in bytes */
+	uint32_t	sr_count;	/* request length in bytes */
 	void*		sr_buffer;	/* data buffer, if not NULL */
 	struct BIO*	sr_bio;		/* associated I/O buffer, if not NULL */
 	semaphore_t*	sr_semaphore;		/* Semaphore to signal on completion, if any */
@@ -48,6 +48,7 @@ struct SATA_REQUEST {
 #define SATA_REQUEST_FLAG_READ	(1 << 0)	/* Read request */
 #define SATA_REQUEST_FLAG_WRITE	(1 << 1)	/* Write request */
 #define SATA_REQUEST_FLAG_ATAPI	(1 << 2)	/* ATAPI request */
+#define SATA_REQUEST_FLAG_NCQ	(1 << 3)	/* Device can queue this DMA READ/WRITE EXT natively */
 };
 
 /* Signatures per device category */
@@ -56,5 +57,7 @@ struct SATA_REQUEST {
 
 void sata_fis_h2d_make_cmd(struct SATA_FIS_H2D* h2d, uint8_t cmd);
 void sata_fis_h2d_make_cmd_lba48(struct SATA_FIS_H2D* h2d, uint8_t cmd, uint64_t lba, uint32_t count);
+/* Turns a DMA READ/WRITE EXT command into its native queued form, using 'tag' */
+void sata_fis_h2d_make_ncq(struct SATA_FIS_H2D* h2d, unsigned int tag);
 
 #endif /* __ANANAS_SATA_H__ */
@@ -48,6 +48,7 @@ struct RESOURCE {
 };
 
 struct BIO;
+struct BIO_QUEUE;
 struct USB_BUS;
 struct USB_DEVICE;
 struct USB_TRANSFER;
@@ -68,6 +69,8 @@ struct DRIVER {
 	errorcode_t	(*drv_bwrite)(device_t, struct BIO*);
 	errorcode_t	(*drv_read)(device_t, void*, size_t*, off_t);
 	errorcode_t	(*drv_bread)(device_t, struct BIO*);
+	/* for memory-backed block devices: returns where a block lives, or NULL */
+	void*		(*drv_bmap)(device_t, blocknr_t, size_t);
 	errorcode_t	(*drv_stat)(device_t, void*);
 	errorcode_t	(*drv_devctl)(device_t, process_t*, unsigned int, void*, size_t);
 	/* for block devices: enqueue request */
@@ -114,6 +117,9 @@ struct DEVICE {
 	/* Waiters */
 	semaphore_t	waiters;
 
+	/* Request queue in front of the driver, if any */
+	struct BIO_QUEUE* bio_queue;
+
 	/* Queue fields */
 	DQUEUE_FIELDS(struct DEVICE);
 };
@@ -173,6 +179,11 @@ errorcode_t device_write(device_t dev, const char* buf, size_t* len, off_t offse
 errorcode_t device_bwrite(device_t dev, struct BIO* bio);
 errorcode_t device_read(device_t dev, char* buf, size_t* len, off_t offset);
 errorcode_t device_bread(device_t dev, struct BIO* bio);
+/*
+ * Returns a pointer to the data of a block if the device keeps it in memory,
+ * or NULL if it must be read using device_bread().
+ */
+void* device_bmap(device_t dev, blocknr_t block, size_t len);
 
 void* device_alloc_resource(device_t dev, resource_type_t type, size_t len);
 
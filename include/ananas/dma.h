@@ -10,6 +10,9 @@
 #define DMA_SEGS_MAX_ANY ((unsigned int)~0)
 #define DMA_SEGS_MAX_SIZE ((dma_size_t)~0)
 
+/* Maximum number of segments dma_buf_load() can hand to the load function; must be at least BIO_MAX_VECS */
+#define DMA_LOAD_MAX_SEGS 32
+
 /* DMA tag; contains information how a given device needs DMA to work */
 /* DMA buffer: contains a list of segments with data */
 /* DMA buffer segment: contains a page to DMA from/to */
@@ -23,6 +26,7 @@ struct DMA_BUFFER_SEGMENT {
 	struct PAGE* s_page;
 	void* s_virt;
 	dma_addr_t s_phys;
+	dma_size_t s_length;
 };
 
 /*
@@ -65,7 +69,11 @@ dma_buf_seg_t dma_buf_get_segment(dma_buf_t buf, unsigned int n);
 
 typedef errorcode_t (*dma_load_func_t)(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs);
 
-/* Loads a given buffer to DMA-able addresses for the device */
+/*
+ * Loads a given buffer to DMA-able addresses for the device; the load
+ * function is called with the physically contiguous segments making up the
+ * buffer, which honour the restrictions of the buffer's tag.
+ */
 errorcode_t dma_buf_load(dma_buf_t buf, void* data, dma_size_t size, dma_load_func_t load, void* load_arg, int flags);
 
 /* Loads a BIO buffer to DMA-able addresses for the device */
@@ -0,0 +1,26 @@
+#ifndef __ANANAS_EPOCH_H__
+#define __ANANAS_EPOCH_H__
+
+#include <ananas/types.h>
+
+/*
+ * Epochs allow data structures to be read without taking any locks; readers
+ * bracket their accesses with epoch_enter() and epoch_exit(), and writers
+ * which have unlinked an item call epoch_synchronize() before freeing it.
+ * This waits until every reader which may still be looking at the item has
+ * left its section.
+ *
+ * Readers must not sleep or take sleeping locks within a section, and
+ * epoch_synchronize() must never be called from within one.
+ */
+
+/* Enters a read section; the result must be passed to epoch_exit() */
+int epoch_enter();
+
+/* Leaves a read section */
+void epoch_exit(int idx);
+
+/* Waits until all read sections which have been entered so far are left */
+void epoch_synchronize();
+
+#endif /* __ANANAS_EPOCH_H__ */
@@ -107,4 +107,16 @@ void md_restore_ctx(struct CONTEXT* ctx);
 #define md_cpu_relax() \
 	__asm __volatile("hlt")
 
+/* Used in busy-wait loops; hints the CPU that we are spinning */
+#define md_cpu_pause() \
+	__asm __volatile("pause" : : : "memory")
+
+/* Returns the current value of the cycle counter */
+static inline uint64_t md_cpu_cycles()
+{
+	register uint64_t v;
+	__asm __volatile("rdtsc" : "=A" (v));
+	return v;
+}
+
 #endif /* __I386_THREAD_H__ */
@@ -10,6 +10,9 @@
  * weight. They come in a normal and preemptible flavor; the latter will disable
  * interrupts. XXX It's open to debate whether this should always be the case
  *
+ * Spinlocks are fair: they are granted in the order in which they were
+ * requested, so no CPU can be starved by the others.
+ *
  * The definition of spinlock_t is in _types/spinlock.h because it's this avoids
  * a circular depency: the waitqueue used spinlocks, but mutexes use the
  * waitqueues, so they can't be declared in this file...
@@ -18,6 +21,7 @@
 struct SEMAPHORE_WAITER {
 	thread_t*		sw_thread;
 	int			sw_signalled;
+	int			sw_timedout;
 	DQUEUE_FIELDS(struct SEMAPHORE_WAITER);
 };
 DQUEUE_DEFINE(semaphore_wq, struct SEMAPHORE_WAITER);
@@ -32,19 +36,36 @@ typedef struct {
 	struct semaphore_wq	sem_wq;
 } semaphore_t;
 
-#define SPINLOCK_DEFAULT_INIT { { 0 } }
+#define SPINLOCK_DEFAULT_INIT { { 0 }, { 0 } }
+
+/*
+ * Contention statistics for all mutex acquisitions made from a given source
+ * location; these are updated without locking and thus approximate.
+ */
+struct MUTEX_STATS {
+	const char*		ms_fname;
+	int			ms_line;
+	unsigned int		ms_acquisitions;	/* Number of times acquired */
+	unsigned int		ms_spins;	/* Acquired while spinning */
+	unsigned int		ms_sleeps;	/* Had to sleep to acquire */
+	uint64_t		ms_max_hold;	/* Longest hold time, in cycles */
+};
 
 /*
  * Mutexes are sleepable locks that will suspend the current thread when the
  * lock is already being held. They cannot be used from interrupt context; they
- * are implemented as binary semaphores.
+ * are implemented as binary semaphores. If the owner of a contended mutex is
+ * running on another CPU, we spin for a while first as it is likely to
+ * release the mutex soon.
  */
 struct MUTEX {
 	const char*		mtx_name;
-	thread_t*		mtx_owner;
+	thread_t* volatile	mtx_owner;
 	semaphore_t		mtx_sem;
 	const char*		mtx_fname;
 	int			mtx_line;
+	struct MUTEX_STATS*	mtx_stats;	/* Statistics of the current holder */
+	uint64_t		mtx_acquired;	/* Cycle count when acquired */
 };
 
 typedef struct MUTEX mutex_t;
@@ -59,6 +80,9 @@ void spinlock_init(spinlock_t* l);
 register_t spinlock_lock_unpremptible(spinlock_t* l);
 void spinlock_unlock_unpremptible(spinlock_t* l, register_t state);
 
+/* Records contention on a spinlock; only present with the SPINLOCK_STATS option */
+void spinlock_stats_record(spinlock_t* l, uint64_t cycles);
+
 /* Mutexes */
 void mutex_init(mutex_t* mtx, const char* name);
 void mutex_lock_(mutex_t* mtx, const char* file, int line);
@@ -75,6 +99,8 @@ void sem_init(semaphore_t* sem, int count);
 void sem_signal(semaphore_t* sem);
 void sem_wait(semaphore_t* sem);
 int sem_trywait(semaphore_t* sem);
+/* Waits at most 'ms' milliseconds; returns non-zero if the semaphore was acquired */
+int sem_timedwait(semaphore_t* sem, unsigned int ms);
 void sem_wait_and_drain(semaphore_t* sem);
 
 #endif /* __LOCK_H__ */
@@ -81,4 +81,16 @@ void* page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags);
 /* Retrieve the page statistics */
 void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages);
 
+/* Statistics of the per-CPU single page caches */
+struct PAGE_CACHE_STATS {
+	unsigned int pcs_cached;	/* Pages currently in the cache */
+	unsigned int pcs_hits;		/* Allocations served from the cache */
+	unsigned int pcs_misses;	/* Allocations finding the cache empty */
+	unsigned int pcs_refills;	/* Batches taken from the zones */
+	unsigned int pcs_drains;	/* Batches returned to the zones */
+};
+
+/* Retrieve the page cache statistics of a given CPU; returns zero if there are none */
+int page_get_cache_stats(int cpuid, struct PAGE_CACHE_STATS* stats);
+
 #endif /* __ANANAS_PAGE_H__ */
@@ -1,10 +1,14 @@
 #include <ananas/types.h>
 #include <ananas/thread.h>
+#include <ananas/schedule.h>
 #include <machine/pcpu.h>
 
 #ifndef __PCPU_H__
 #define __PCPU_H__
 
+/* Maximum number of CPU's we keep per-CPU information for */
+#define PCPU_MAX_CPUS 32
+
 /* Per-CPU information pointer */
 struct PCPU {
 	MD_PCPU_FIELDS				/* Machine-dependant data */
@@ -12,6 +16,7 @@ struct PCPU {
 	void* curthread;			/* current thread */
 	thread_t* idlethread;			/* idle thread */
 	int nested_irq;				/* number of nested IRQ functions */
+	struct SCHED_RUNQUEUE runqueue;		/* threads runnable on this CPU */
 };
 
 /* Retrieve the size of the machine-dependant structure */
@@ -20,6 +25,12 @@ size_t md_pcpu_get_privdata_length();
 /* Introduce a per-cpu structure */
 void pcpu_init(struct PCPU* pcpu);
 
+/* Retrieve the per-cpu structure of a given CPU, or NULL if there is none */
+struct PCPU* pcpu_get(int cpuid);
+
+/* Retrieve the number of CPU's introduced using pcpu_init() */
+int pcpu_get_num_cpus();
+
 /* Get the current thread */
 #define PCPU_CURTHREAD() PCPU_GET(curthread)
 
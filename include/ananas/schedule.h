@@ -6,11 +6,35 @@
 
 struct SCHED_PRIV {
 	thread_t* sp_thread;	/* Backreference to the thread */
+	int sp_cpu;		/* CPU whose runqueue holds us (or last held us) */
+	int sp_prio;		/* Priority level we are queued at */
+	const void* sp_wchan;	/* Wait channel we are sleeping on, if any */
 	DQUEUE_FIELDS(struct SCHED_PRIV);
 };
 
 DQUEUE_DEFINE(SCHEDULER_QUEUE, struct SCHED_PRIV);
 
+/* Number of priority levels; must match the range of t_priority */
+#define SCHED_NUM_PRIORITIES	256
+#define SCHED_BITMAP_BITS	32
+#define SCHED_BITMAP_WORDS	(SCHED_NUM_PRIORITIES / SCHED_BITMAP_BITS)
+
+/*
+ * Per-CPU runqueue; every CPU schedules only from its own queue and will
+ * steal work from other CPU's once it has nothing left but its idle thread.
+ * There is a FIFO list per priority level; rq_bitmap has a bit set for every
+ * non-empty level and rq_summary has a bit set for every non-zero bitmap word.
+ */
+struct SCHED_RUNQUEUE {
+	spinlock_t		rq_lock;	/* Protects the runqueue */
+	uint32_t		rq_summary;	/* Non-empty rq_bitmap words */
+	uint32_t		rq_bitmap[SCHED_BITMAP_WORDS];	/* Non-empty levels */
+	struct SCHEDULER_QUEUE	rq_queue[SCHED_NUM_PRIORITIES];	/* Runnable threads per level */
+	unsigned int		rq_depth;	/* Number of threads on rq_queue */
+	unsigned int		rq_steals;	/* Threads taken from other CPU's */
+	unsigned int		rq_stolen;	/* Threads taken by other CPU's */
+};
+
 void scheduler_add(thread_t* t);
 void scheduler_remove(thread_t* t);
 
@@ -21,6 +45,20 @@ void scheduler_deactivate();
 int scheduler_activated();
 void scheduler_launch();
 
+/* Runqueue manipulation; callers must hold rq_lock */
+void runqueue_init(struct SCHED_RUNQUEUE* rq);
+void runqueue_add(struct SCHED_RUNQUEUE* rq, struct SCHED_PRIV* sp, int prio);
+void runqueue_remove(struct SCHED_RUNQUEUE* rq, struct SCHED_PRIV* sp);
+
+/* Iterate through the runqueue, most important items first */
+struct SCHED_PRIV* runqueue_first(struct SCHED_RUNQUEUE* rq);
+struct SCHED_PRIV* runqueue_next(struct SCHED_RUNQUEUE* rq, struct SCHED_PRIV* sp);
+
+#define RUNQUEUE_FOREACH(rq, it) \
+	for (struct SCHED_PRIV* (it) = runqueue_first(rq); \
+	     (it) != NULL; \
+	     (it) = runqueue_next((rq), (it)))
+
 /* Initializes the scheduler-specific part for a given thread */
 void scheduler_init_thread(thread_t* t);
 
@@ -30,6 +68,15 @@ void scheduler_add_thread(thread_t* t);
 /* Unregister a thread for scheduling */
 void scheduler_remove_thread(thread_t* t);
 
+/*
+ * Unregister a thread for scheduling until its wait channel is woken up; the
+ * caller is responsible for calling schedule() afterwards.
+ */
+void scheduler_sleep_thread(thread_t* t, const void* wchan);
+
+/* Resumes all threads sleeping on a wait channel; returns the number woken up */
+int scheduler_wakeup(const void* wchan);
+
 /* Exits a thread - removes it from the runqueue in a safe manner */
 void scheduler_exit_thread(thread_t* t);
 
@@ -0,0 +1,76 @@
+#ifndef __ANANAS_SLAB_H__
+#define __ANANAS_SLAB_H__
+
+#include <ananas/types.h>
+#include <ananas/dqueue.h>
+#include <ananas/lock.h>
+#include <ananas/pcpu.h>
+
+/*
+ * Object caches hand out fixed-size objects, which are carved from single
+ * page slabs. Every CPU has a magazine of recently freed objects in front of
+ * the slabs, so that most allocations and frees need no lock at all.
+ *
+ * The constructor is only called once for every object, when the slab it
+ * lives in is created; objects are handed out in the state they were freed
+ * in, so callers must return them to their constructed state before freeing.
+ */
+
+/* Maximum number of objects in a per-CPU magazine */
+#define KMEM_MAGAZINE_SIZE 16
+/* Number of objects moved between a magazine and the slabs at once */
+#define KMEM_MAGAZINE_BATCH 8
+
+struct KMEM_SLAB;
+DQUEUE_DEFINE(KMEM_SLAB_LIST, struct KMEM_SLAB);
+
+typedef void (*kmem_ctor_t)(void* obj);
+
+struct KMEM_MAGAZINE {
+	unsigned int		km_count;			/* Number of cached objects */
+	void*			km_obj[KMEM_MAGAZINE_SIZE];	/* Objects, hottest last */
+	unsigned int		km_hits;			/* Allocations from the magazine */
+	unsigned int		km_misses;			/* Allocations from the slabs */
+};
+
+struct KMEM_CACHE {
+	const char*		kc_name;
+	size_t			kc_size;		/* Object size as requested */
+	kmem_ctor_t		kc_ctor;
+	spinlock_t		kc_lock;		/* Protects the fields below */
+	size_t			kc_objsize;		/* Object size including alignment */
+	unsigned int		kc_objs_per_slab;	/* Zero until the layout is calculated */
+	unsigned int		kc_offset;		/* Offset of the first object in a slab */
+	struct KMEM_SLAB_LIST	kc_partial;		/* Slabs with free and used objects */
+	struct KMEM_SLAB_LIST	kc_full;		/* Slabs without free objects */
+	struct KMEM_SLAB_LIST	kc_empty;		/* Slabs without used objects */
+	unsigned int		kc_num_slabs;
+	unsigned int		kc_num_inuse;		/* Objects not free in a slab */
+	struct KMEM_MAGAZINE	kc_magazine[PCPU_MAX_CPUS];
+	DQUEUE_FIELDS(struct KMEM_CACHE);
+};
+DQUEUE_DEFINE(KMEM_CACHE_LIST, struct KMEM_CACHE);
+
+/* Initializes a statically allocated cache; it is set up on first use */
+#define KMEM_CACHE_INITIALIZER(name, size, ctor) \
+	{ \
+		.kc_name = (name), \
+		.kc_size = (size), \
+		.kc_ctor = (ctor), \
+		.kc_lock = SPINLOCK_DEFAULT_INIT \
+	}
+
+#define KMEM_CACHE_DEFINE(var, name, size, ctor) \
+	struct KMEM_CACHE var = KMEM_CACHE_INITIALIZER(name, size, ctor)
+
+/* Creates a cache of 'size' byte objects; returns NULL if out of memory */
+struct KMEM_CACHE* kmem_cache_create(const char* name, size_t size, kmem_ctor_t ctor);
+/* Destroys a cache obtained by kmem_cache_create(); all objects must be freed */
+void kmem_cache_destroy(struct KMEM_CACHE* kc);
+void* kmem_cache_alloc(struct KMEM_CACHE* kc);
+void kmem_cache_free(struct KMEM_CACHE* kc, void* obj);
+
+/* Hands all free objects held by the current CPU's magazine back to the slabs */
+void kmem_cache_drain(struct KMEM_CACHE* kc);
+
+#endif /* __ANANAS_SLAB_H__ */
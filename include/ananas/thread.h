@@ -43,7 +43,7 @@ struct THREAD {
 #define THREAD_FLAG_ZOMBIE	0x0004	/* Thread has no more resources */
 #define THREAD_FLAG_RESCHEDULE	0x0008	/* Thread desires a reschedule */
 #define THREAD_FLAG_REAPING	0x0010	/* Thread will be reaped (destroyed by idle thread) */
-#define THREAD_FLAG_MALLOC	0x0020	/* Thread is kmalloc()'ed */
+#define THREAD_FLAG_MALLOC	0x0020	/* Thread is from the thread cache */
 #define THREAD_FLAG_KTHREAD	0x8000	/* Kernel thread */
 
 	struct STACKFRAME* t_frame;
@@ -115,6 +115,11 @@ void md_setup_post_exec(thread_t* thread, addr_t exec_addr);
 
 void thread_suspend(thread_t* t);
 void thread_resume(thread_t* t);
+
+/* Sleeps until the given timer tick has been reached */
+void thread_sleep_until(uint64_t deadline);
+/* Sleeps for at least the given number of milliseconds */
+void thread_sleep_ms(unsigned int ms);
 void thread_exit(int exitcode);
 void thread_dump(int num_args, char** arg);
 errorcode_t thread_clone(process_t* proc, thread_t** dest);
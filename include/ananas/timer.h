@@ -1,7 +1,52 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#include <ananas/types.h>
+#include <ananas/dqueue.h>
+
+/* Number of timer ticks per second */
+#define TIMER_HZ 100
+
+typedef void (*timer_func_t)(void*);
+
+/*
+ * A timer invokes a callback function once a given tick has been reached;
+ * callbacks are invoked from interrupt context and thus must not sleep.
+ */
+struct TIMER {
+	uint64_t	tm_expires;	/* Tick at which the timer fires */
+	timer_func_t	tm_func;	/* Callback function */
+	void*		tm_arg;		/* Callback argument */
+	int		tm_flags;
+#define TIMER_FLAG_PENDING	0x0001	/* Timer is on the wheel */
+	int		tm_level;	/* Wheel level we are on */
+	int		tm_slot;	/* Wheel slot we are on */
+	DQUEUE_FIELDS(struct TIMER);
+};
+
+DQUEUE_DEFINE(TIMER_QUEUE, struct TIMER);
+
 /* Returns the number of timer ticks since boot */
 uint64_t timer_get_ticks();
 
+/* Converts milliseconds to ticks, rounding up */
+#define TIMER_MS_TO_TICKS(ms) \
+	(((uint64_t)(ms) * TIMER_HZ + 999) / 1000)
+
+/* Initializes a timer; this must be done before it is used */
+void timer_init(struct TIMER* tm, timer_func_t func, void* arg);
+
+/* Schedules a timer to fire at tick 'expires'; re-schedules it if it was pending */
+void timer_schedule(struct TIMER* tm, uint64_t expires);
+
+/*
+ * Cancels a timer; once this returns, the callback will not be running nor be
+ * invoked. Returns non-zero if the timer was still pending. Must not be called
+ * from interrupt context or from the timer's own callback.
+ */
+int timer_cancel(struct TIMER* tm);
+
+/* Called by the clock interrupt on every tick */
+void timer_tick();
+
 #endif /* __TIMER_H__ */
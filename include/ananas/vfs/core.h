@@ -32,6 +32,12 @@ static inline errorcode_t vfs_bread(struct VFS_MOUNTED_FS* fs, blocknr_t block,
 	return vfs_bget(fs, block, bio, 0);
 }
 
+/*
+ * Starts reading 'num' adjacent blocks for the given filesystem into the
+ * buffer cache, without waiting for them.
+ */
+void vfs_bprefetch(struct VFS_MOUNTED_FS* fs, blocknr_t block, unsigned int num);
+
 errorcode_t vfs_lookup(struct DENTRY* parent, struct DENTRY** destentry, const char* dentry);
 
 /* Higher-level interface */
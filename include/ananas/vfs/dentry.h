@@ -4,40 +4,94 @@
 #include <ananas/types.h>
 #include <ananas/device.h>
 #include <ananas/dqueue.h>
+#include <machine/atomic.h>
 
 struct VFS_MOUNTED_FS;
 
-#define DCACHE_ITEMS_PER_FS	32
 #define DCACHE_MAX_NAME_LEN	255
 
+/*
+ * Number of entries the cache will keep around once they are no longer in
+ * use; entries which are in use are never thrown away, so the cache may grow
+ * beyond this.
+ */
+#define DCACHE_MAX_ENTRIES	4096
+
+/*
+ * Dentries can be looked up without any locks (see dcache_lookup_lockless());
+ * this is why the reference count is atomic and why entries are only freed
+ * once no lockless lookup can be looking at them anymore.
+ */
 struct DENTRY {
-	refcount_t d_refcount;			/* Reference count, >0 */
+	atomic_t d_refcount;			/* Reference count, >0 */
+	struct VFS_MOUNTED_FS* d_fs;		/* Filesystem the entry lives on */
 	struct DENTRY* d_parent;		/* Parent directory entry */
 	struct VFS_INODE* d_inode;		/* Backing entry inode, or NULL */
 	uint32_t d_flags;			/* Item flags */
 #define DENTRY_FLAG_NEGATIVE	0x0001		/* Negative entry; does not exist */
 #define DENTRY_FLAG_PERMANENT	0x0002		/* Entry must not be removed */
 #define DENTRY_FLAG_CACHED	0x0004		/* Entry is in the cache */
+	uint32_t d_hash;			/* Hash of parent and name */
 	char	d_entry[DCACHE_MAX_NAME_LEN];	/* Entry name */
-	DQUEUE_FIELDS(struct DENTRY);
+	DQUEUE_FIELDS_IT(struct DENTRY, bucket);	/* Hash bucket */
+	DQUEUE_FIELDS_IT(struct DENTRY, lru);	/* Most recently used first */
 };
 
-DQUEUE_DEFINE(DENTRY_QUEUE, struct DENTRY);
+DQUEUE_DEFINE(DENTRY_BUCKET, struct DENTRY);
+DQUEUE_DEFINE(DENTRY_LRU, struct DENTRY);
+
+/* Cache statistics, since startup */
+struct DCACHE_STATS {
+	unsigned int	ds_hits;		/* Lookups which found a positive entry */
+	unsigned int	ds_negative_hits;	/* Lookups which found a negative entry */
+	unsigned int	ds_misses;		/* Lookups which had to ask the filesystem */
+	unsigned int	ds_purges;		/* Entries thrown out to make room */
+	unsigned int	ds_rehashes;		/* Hash table resizes */
+};
 
-void dcache_init(struct VFS_MOUNTED_FS* fs);
+errorcode_t dcache_init(struct VFS_MOUNTED_FS* fs);
 void dcache_dump(struct VFS_MOUNTED_FS* fs);
 void dcache_destroy(struct VFS_MOUNTED_FS* fs);
-struct DENTRY* dcache_lookup(struct DENTRY* parent, const char* entry);
+errorcode_t dcache_lookup(struct DENTRY* parent, const char* entry, struct DENTRY** result);
 void dcache_remove_inode(struct VFS_INODE* inode);
 void dcache_set_inode(struct DENTRY* de, struct VFS_INODE* inode);
 
 /* Adds a reference to dentry d */
 void dentry_ref(struct DENTRY* d);
 
+/*
+ * Lockless lookup of an entry; the caller must be within an epoch section and
+ * the result, if any, is only valid until the section is left. Returns NULL if
+ * the entry isn't cached.
+ */
+struct DENTRY* dcache_lookup_lockless(struct DENTRY* parent, const char* entry);
+
+/*
+ * Adds a reference to a dentry found using dcache_lookup_lockless(); returns
+ * zero if this is not possible because the entry is being thrown away.
+ */
+int dentry_ref_lockless(struct DENTRY* d);
+
+/*
+ * Renames must be bracketed by these, so that lockless lookups which may have
+ * seen a mix of the old and new names can detect this and try again.
+ */
+void dcache_rename_begin();
+void dcache_rename_end();
+
+/* Returns the rename sequence to check; odd values mean a rename is in progress */
+unsigned int dcache_rename_seq();
+
 /* Removes a reference from d; cleans up the item when out of references */
 void dentry_deref(struct DENTRY* d);
 
 /* Purges an entry from the cache; this may clean up the item when out of references */
 void dcache_purge_entry(struct DENTRY* d);
 
+void dcache_get_stats(struct DCACHE_STATS* stats);
+void dcache_get_size(unsigned int* num_entries, unsigned int* hash_size);
+
+/* All cached entries, most recently used first; kdb only, as this is not locked */
+extern struct DENTRY_LRU dcache_lru;
+
 #endif /*  __ANANAS_DENTRY_H__ */
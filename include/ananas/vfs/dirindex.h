@@ -0,0 +1,37 @@
+#ifndef __ANANAS_VFS_DIRINDEX_H__
+#define __ANANAS_VFS_DIRINDEX_H__
+
+#include <ananas/types.h>
+#include <ananas/lock.h>
+
+struct DENTRY;
+struct VFS_INODE;
+struct DIRINDEX_ENTRY;
+
+/*
+ * In-memory index of a directory's names, which maps every name to the
+ * entry's FSOP. It is built by reading the entire directory on the first
+ * lookup; from then on, it is kept in sync by the VFS, which is why only
+ * filesystems whose directories solely change by create, unlink and rename
+ * may use vfs_dirindex_lookup().
+ */
+struct VFS_DIRINDEX {
+	mutex_t		di_mutex;		/* Protects the index */
+	unsigned int	di_flags;
+#define DIRINDEX_FLAG_COMPLETE	0x0001		/* All entries are present */
+	unsigned int	di_num_entries;		/* Number of entries */
+	unsigned int	di_hash_size;		/* Number of buckets, always a power of two */
+	struct DIRINDEX_ENTRY** di_bucket;	/* Hash buckets */
+};
+
+/* Looks up an entry using the directory index; can be used as inode lookup operation */
+errorcode_t vfs_dirindex_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry);
+
+/* Updates the index of 'dir', if any, after an entry was added or removed */
+void dirindex_add(struct VFS_INODE* dir, const char* name, const void* fsop);
+void dirindex_remove(struct VFS_INODE* dir, const char* name);
+
+/* Throws away the index of 'dir'; called once the inode is destroyed */
+void dirindex_destroy(struct VFS_INODE* dir);
+
+#endif /* __ANANAS_VFS_DIRINDEX_H__ */
@@ -4,23 +4,43 @@
 #include <ananas/types.h>
 #include <ananas/device.h>
 #include <ananas/dqueue.h>
+#include <ananas/lock.h>
 
 struct VFS_MOUNTED_FS;
 
-#define ICACHE_ITEMS_PER_FS	32
-
 struct ICACHE_ITEM {
-	struct VFS_INODE* inode;		/* Backing inode, or NULL */
-	DQUEUE_FIELDS(struct ICACHE_ITEM);
+	struct VFS_MOUNTED_FS* fs;		/* Filesystem the item belongs to */
+	struct VFS_INODE* inode;		/* Backing inode, or NULL if pending */
+	uint32_t hash;				/* Hash of the filesystem and fsop */
+	int flags;
+#define ICACHE_ITEM_FLAG_DEAD	0x0001		/* Removed; freed by the last waiter */
+	unsigned int waiters;			/* Threads waiting for the pending inode */
+	semaphore_t wait_sem;			/* Signalled once no longer pending */
+	DQUEUE_FIELDS_IT(struct ICACHE_ITEM, bucket);
+	DQUEUE_FIELDS_IT(struct ICACHE_ITEM, lru);
 	char fsop[1];				/* FSOP of the item */
 };
 
-DQUEUE_DEFINE(ICACHE_QUEUE, struct ICACHE_ITEM);
+DQUEUE_DEFINE(ICACHE_BUCKET, struct ICACHE_ITEM);
+DQUEUE_DEFINE(ICACHE_LRU, struct ICACHE_ITEM);
+
+/* Inode cache statistics, since boot */
+struct ICACHE_STATS {
+	unsigned int	is_hits;		/* Inode was cached */
+	unsigned int	is_misses;		/* Inode had to be read */
+	unsigned int	is_waits;		/* Had to wait for a pending inode */
+	unsigned int	is_purges;		/* Unused inodes thrown away */
+};
 
 void icache_init(struct VFS_MOUNTED_FS* fs);
 void icache_dump(struct VFS_MOUNTED_FS* fs);
 void icache_destroy(struct VFS_MOUNTED_FS* fs);
 void icache_remove_inode(struct VFS_INODE* inode);
+void icache_get_stats(struct ICACHE_STATS* stats);
+void icache_get_size(unsigned int* num_entries, unsigned int* max_entries, unsigned int* hash_size);
+
+/* All cached items, most recently used first; kdb only, as this is not locked */
+extern struct ICACHE_LRU icache_lru;
 /*
  * Removes an inode reference; cleans up the inode if the refcount is zero.
  */
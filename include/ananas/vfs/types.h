@@ -3,14 +3,15 @@
 
 #include <ananas/dqueue.h>
 #include <ananas/stat.h> /* for 'struct stat' */
-#include <ananas/vfs/dentry.h> /* for 'struct DENTRY_QUEUE' */
-#include <ananas/vfs/icache.h> /* for 'struct ICACHE_QUEUE' */
+#include <ananas/vfs/dentry.h>
+#include <ananas/vfs/icache.h>
 
 struct DENTRY;
 struct DEVICE;
 struct VFS_MOUNTED_FS;
 struct VFS_INODE_OPS;
 struct VFS_FILESYSTEM_OPS;
+struct VFS_DIRINDEX;
 
 #define INODE_LOCK(i) \
 	mutex_lock(&(i)->i_mutex)
@@ -24,7 +25,7 @@ struct VFS_FILESYSTEM_OPS;
  */
 struct VFS_INODE {
 	mutex_t		i_mutex;		/* Mutex protecting inode */
-	refcount_t	i_refcount;		/* Refcount, must be >=1 */
+	refcount_t	i_refcount;		/* Refcount, must be >=1 (protected by the icache) */
 	unsigned int	i_flags;		/* Inode flags */
 #define INODE_FLAG_DIRTY	(1 << 0)	/* Needs to be written */
 	struct stat 	i_sb;			/* Inode information */
@@ -32,6 +33,7 @@ struct VFS_INODE {
 
 	struct VFS_MOUNTED_FS* i_fs;		/* Filesystem where the inode lives */
 	void*		i_privdata;		/* Filesystem-specific data */
+	struct VFS_DIRINDEX* i_dirindex;	/* Directory name index, if any */
 	uint8_t		i_fsop[1];		/* File system object pointer */
 };
 
@@ -49,6 +51,10 @@ struct VFS_FILE {
 	 */
 	struct DENTRY*		f_dentry;
 	struct DEVICE*		f_device;
+	/* Read-ahead state; see vfs_generic_read() */
+	off_t			f_ra_offset;	/* Offset where the previous read ended */
+	blocknr_t		f_ra_next;	/* First logical block not yet read ahead */
+	unsigned int		f_ra_window;	/* Number of blocks to read ahead, 0 if none */
 };
 
 /*
@@ -86,18 +92,6 @@ struct VFS_MOUNTED_FS {
 	uint8_t		fs_fsop_size;		/* (R) FSOP identifier length */
 	void*		fs_privdata;		/* (R) Private filesystem data */
 
-	/* Inode cache */
-	mutex_t			fs_icache_lock;		/* Protects fields marked with (I) */
-	struct ICACHE_QUEUE	fs_icache_inuse;	/* (I) Currently used inodes */
-	struct ICACHE_QUEUE	fs_icache_free;		/* (I) Available inode list */
-	void*			fs_icache_buffer;	/* (I) Inode cache buffer, for cleanup */
-
-	/* Dentry cache */
-	mutex_t			fs_dcache_lock;		/* Protects fields marked with (D) */
-	struct DENTRY_QUEUE	fs_dcache_inuse;	/* (D) Currently used items */
-	struct DENTRY_QUEUE	fs_dcache_free;		/* (D) Currently used items */
-	void*			fs_dcache_buffer;	/* (D) Dentry cache buffer, for cleanup */
-
 	struct VFS_FILESYSTEM_OPS* fs_fsops;		/* (R) Filesystem operations */
 	struct DENTRY* fs_root_dentry;			/* (R) Filesystem's root dentry */
 };
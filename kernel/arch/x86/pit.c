@@ -5,14 +5,13 @@
 #include <ananas/pcpu.h>
 #include <ananas/irq.h>
 #include <ananas/lib.h>
+#include <ananas/timer.h>
 #include <machine/interrupts.h>
 #include "options.h"
 
 #define IRQ_PIT 0
 #define TIMER_FREQ 1193182
 
-#define HZ 100 /* XXX does not belong here */
-
 extern int md_cpu_clock_mhz;
 static uint64_t tsc_boot_time;
 
@@ -20,6 +19,7 @@ static irqresult_t
 x86_pit_irq()
 {
 	PCPU_SET(tickcount, PCPU_GET(tickcount) + 1);
+	timer_tick();
 	if (!scheduler_activated())
 		return IRQ_RESULT_PROCESSED;
 
@@ -52,7 +52,7 @@ x86_get_ms_since_boot()
 void
 x86_pit_init()
 {
-	uint16_t count = TIMER_FREQ / HZ;
+	uint16_t count = TIMER_FREQ / TIMER_HZ;
 	outb(PIT_MODE_CMD, PIT_CH_CHAN0 | PIT_MODE_3 | PIT_ACCESS_BOTH);
 	outb(PIT_CH0_DATA, (count & 0xff));
 	outb(PIT_CH0_DATA, (count >> 8));
@@ -70,10 +70,10 @@ x86_pit_calc_cpuspeed_mhz()
 	 * Interrupts are there, this means we can use the tick count to
 	 * figure out the CPU speed; we use the following formula:
 	 *
-	 *  current - base     number of ticks to wait 1/HZ sec
+	 *  current - base     number of ticks to wait 1/TIMER_HZ sec
 	 * 
 	 *  So to figure out the number of Hz's the CPU is, we'll have
-	 *  (current-base)*HZ; 
+	 *  (current-base)*TIMER_HZ; 
 	 */
 	uint64_t tsc_base, tsc_current;
 	uint32_t tickcount = PCPU_GET(tickcount);
@@ -84,7 +84,7 @@ x86_pit_calc_cpuspeed_mhz()
 	tsc_current = rdtsc();
 	/* We use the tsc_current value as the boot time */
 	tsc_boot_time = tsc_current;
-	return ((tsc_current - tsc_base) * HZ) / 1000000;
+	return ((tsc_current - tsc_base) * TIMER_HZ) / 1000000;
 }
 
 void
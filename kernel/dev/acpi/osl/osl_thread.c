@@ -1,4 +1,5 @@
 #include <ananas/pcpu.h>
+#include <ananas/thread.h>
 #include <ananas/time.h>
 #include <ananas/lib.h>
 #include "../acpica/acpi.h"
@@ -19,7 +20,7 @@ AcpiOsExecute(ACPI_EXECUTE_TYPE Type, ACPI_OSD_EXEC_CALLBACK Function, void* Con
 void
 AcpiOsSleep(UINT64 Milliseconds)
 {
-	AcpiOsStall(Milliseconds); // for now
+	thread_sleep_ms(Milliseconds);
 }
 
 void
@@ -12,6 +12,7 @@
 #include <ananas/page.h>
 #include <ananas/mm.h>
 #include <ananas/vm.h>
+#include <ananas/thread.h>
 #include <ananas/time.h>
 #include <ananas/trace.h>
 #include <machine/param.h>
@@ -101,9 +102,9 @@ ahcipci_reset_port(device_t dev, struct AHCI_PCI_PORT* p)
 
 	/* Force a hard port reset */
 	AHCI_WRITE_4(AHCI_REG_PxSCTL(n), AHCI_PxSCTL_DET(AHCI_DET_RESET));
-	delay(100);
+	thread_sleep_ms(100);
 	AHCI_WRITE_4(AHCI_REG_PxSCTL(n), AHCI_READ_4(AHCI_REG_PxSCTL(n)) & ~AHCI_PxSCTL_DET(AHCI_DET_RESET));
-	delay(100);
+	thread_sleep_ms(100);
 
 	/* Wait until the port shows some life */
 	int port_delay = 100;
@@ -222,6 +223,7 @@ ahcipci_attach(device_t dev)
 
 	uint32_t cap = AHCI_READ_4(AHCI_REG_CAP);
 	privdata->ap_ncs = AHCI_CAP_NCS(cap) + 1;
+	privdata->ap_ncq = (cap & AHCI_CAP_SNCQ) != 0;
 
 	/* XXX */
 	struct AHCI_PRIVDATA* pd = kmalloc(sizeof(*pd));
@@ -249,7 +251,7 @@ ahcipci_attach(device_t dev)
 
 	/* If we had to reset ports, wait until they are all okay */
 	if (need_wait) {
-		delay(500);
+		thread_sleep_ms(500);
 		int ok = 1;
 
 		/* Check if they are all okay */
@@ -8,6 +8,7 @@
 #include <ananas/error.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <machine/thread.h> /* for md_cpu_cycles() */
 #include <machine/vm.h>
 
 TRACE_SETUP;
@@ -17,6 +18,8 @@ TRACE_SETUP;
 
 extern struct DRIVER drv_sata_disk;
 
+static void ahciport_start_locked(device_t dev, struct AHCI_PCI_PORT* p);
+
 void
 ahcipci_port_irq(device_t dev, struct AHCI_PCI_PORT* p, uint32_t pis)
 {
@@ -24,8 +27,11 @@ ahcipci_port_irq(device_t dev, struct AHCI_PCI_PORT* p, uint32_t pis)
 
 	AHCI_DPRINTF("got irq, pis=%x", pis);
 
+	uint64_t now = md_cpu_cycles();
+	unsigned int num_freed = 0;
 	PORT_LOCK;
 	uint32_t ci = AHCI_READ_4(AHCI_REG_PxCI(p->p_num));
+	uint32_t sact = AHCI_READ_4(AHCI_REG_PxSACT(p->p_num));
 	for (int i = 0; i < privdata->ap_ncs; i++) {
 		if ((p->p_request_valid & (1 << i)) == 0)
 			continue;
@@ -33,6 +39,9 @@ ahcipci_port_irq(device_t dev, struct AHCI_PCI_PORT* p, uint32_t pis)
 		/* It's valid; this could be triggered */
 		if ((ci & AHCI_PxCIT_CI(i)) != 0)
 			continue; /* no status update here */
+		/* Queued commands leave CI once accepted; they are done when they leave SActive */
+		if ((p->p_request_ncq & (1 << i)) != 0 && (sact & AHCI_PxSACT_DS(i)) != 0)
+			continue;
 		if ((p->p_request_active & (1 << i)) == 0) {
 			device_printf(dev, "got trigger for inactive request %d", i);
 			continue;
@@ -52,12 +61,30 @@ ahcipci_port_irq(device_t dev, struct AHCI_PCI_PORT* p, uint32_t pis)
 			bio_set_available(sr->sr_bio);
 		}
 
+		struct AHCI_PCI_PORT_STATS* ps = &p->p_stats;
+		uint64_t latency = now - pr->pr_issued;
+		ps->ps_commands++;
+		if (p->p_request_ncq & (1 << i))
+			ps->ps_ncq_commands++;
+		ps->ps_total_latency += latency;
+		if (latency > ps->ps_max_latency)
+			ps->ps_max_latency = latency;
+
 		/* This request is no longer active nor valid */
 		p->p_request_active &= ~(1 << i);
 		p->p_request_valid &= ~(1 << i);
 		p->p_request_in_use &= ~(1 << i);
+		p->p_request_ncq &= ~(1 << i);
+		num_freed++;
 	}
+
+	/* Issue anything which had to wait for the requests that just completed */
+	ahciport_start_locked(dev, p);
 	PORT_UNLOCK;
+
+	/* Wake up anyone waiting for a slot */
+	while (num_freed-- > 0)
+		sem_signal(&p->p_slots);
 }
 
 static errorcode_t
@@ -82,10 +109,18 @@ ahciport_attach(device_t dev)
 		return ANANAS_ERROR(NO_DEVICE);
 	}
 
+	/*
+	 * Data is transferred using the PRD entries of the command tables, so
+	 * that's how many segments a transfer can have.
+	 */
+	errorcode_t err = dma_tag_create(dev->parent->dma_tag, dev, &dev->dma_tag, 1, 0, DMA_ADDR_MAX_32BIT, AHCI_PCI_CT_PRDS, AHCI_PRDE_MAX_BYTES);
+	ANANAS_ERROR_RETURN(err);
+	sem_init(&p->p_slots, privdata->ap_ncs);
+
 	/* Initialize the DMA buffers for requests */
 	for(unsigned int n = 0; n < 32; n++) {
 		struct AHCI_PCI_REQUEST* pr = &p->p_request[n];
-		errorcode_t err = dma_buf_alloc(dev->parent->dma_tag, sizeof(struct AHCI_PCI_CT), &pr->pr_dmabuf_ct);
+		err = dma_buf_alloc(dev->dma_tag, sizeof(struct AHCI_PCI_CT), &pr->pr_dmabuf_ct);
 		ANANAS_ERROR_RETURN(err);
 		pr->pr_ct = dma_buf_get_segment(pr->pr_dmabuf_ct, 0)->s_virt;
 	}
@@ -118,121 +153,207 @@ ahciport_attach(device_t dev)
 	return ANANAS_ERROR_OK;
 }
 
+static errorcode_t
+ahciport_load_prd(void* ctx, struct DMA_BUFFER_SEGMENT* s, int num_segs)
+{
+	struct AHCI_PCI_REQUEST* pr = ctx;
+	KASSERT(num_segs <= AHCI_PCI_CT_PRDS, "too many segments (%d)", num_segs);
+
+	for (int n = 0; n < num_segs; n++, s++) {
+		struct AHCI_PCI_PRDE* prd = &pr->pr_ct->ct_prd[n];
+		prd->prde_dw0 = AHCI_PRDE_DW0_DBA(s->s_phys & 0xffffffff);
+		prd->prde_dw1 = AHCI_PRDE_DW1_DBAU(s->s_phys >> 32);
+		prd->prde_dw2 = 0;
+		prd->prde_dw3 = AHCI_PRDE_DW3_DBC(s->s_length - 1);
+	}
+	pr->pr_num_prd = num_segs;
+	return ANANAS_ERROR_OK;
+}
+
+/*
+ * Sets up the command table and command list entry of slot 'n'; the command
+ * isn't issued until ahciport_start() is called.
+ */
+static errorcode_t
+ahciport_prepare(device_t dev, struct AHCI_PCI_PORT* p, int n)
+{
+	struct AHCI_PCI_PRIVDATA* privdata = p->p_pd;
+	struct AHCI_PCI_REQUEST* pr = &p->p_request[n];
+	struct SATA_REQUEST* sr = &pr->pr_request;
+
+	/* Construct the command table; the data is described by as many PRD's as needed */
+	struct AHCI_PCI_CT* ct = pr->pr_ct;
+	memset(ct, 0, sizeof(struct AHCI_PCI_CT));
+	errorcode_t err;
+	if (sr->sr_buffer != NULL)
+		err = dma_buf_load(pr->pr_dmabuf_ct, sr->sr_buffer, sr->sr_count, ahciport_load_prd, pr, 0);
+	else
+		err = dma_buf_load_bio(pr->pr_dmabuf_ct, sr->sr_bio, ahciport_load_prd, pr, 0);
+	ANANAS_ERROR_RETURN(err);
+
+	/* XXX handle atapi */
+	memcpy(&ct->ct_cfis[0], &sr->sr_fis.fis_h2d, sizeof(struct SATA_FIS_H2D));
+	if (privdata->ap_ncq && (sr->sr_flags & SATA_REQUEST_FLAG_NCQ)) {
+		/* The slot number doubles as the tag which identifies the command */
+		sata_fis_h2d_make_ncq((struct SATA_FIS_H2D*)&ct->ct_cfis[0], n);
+		PORT_LOCK;
+		p->p_request_ncq |= 1 << n;
+		PORT_UNLOCK;
+	}
+	dma_buf_sync(pr->pr_dmabuf_ct, DMA_SYNC_OUT);
+
+	/* Set up the command list entry and hook it to this table */
+	struct AHCI_PCI_CLE* cle = &p->p_cle[n];
+	uint64_t addr_ct = dma_buf_get_segment(pr->pr_dmabuf_ct, 0)->s_phys;
+	memset(cle, 0, sizeof(struct AHCI_PCI_CLE));
+	cle->cle_dw0 =
+	 AHCI_CLE_DW0_PRDTL(pr->pr_num_prd) |
+	 AHCI_CLE_DW0_PMP(0) |
+	 AHCI_CLE_DW0_CFL(sr->sr_fis_length / 4);
+	if (sr->sr_flags & SATA_REQUEST_FLAG_WRITE)
+		cle->cle_dw0 |= AHCI_CLE_DW0_W;
+	cle->cle_dw1 = 0;
+	cle->cle_dw2 = AHCI_CLE_DW2_CTBA(addr_ct & 0xffffffff);
+	cle->cle_dw3 = AHCI_CLE_DW3_CTBAU(addr_ct >> 32);
+	dma_buf_sync(p->p_dmabuf_cl, DMA_SYNC_OUT);
+	return ANANAS_ERROR_OK;
+}
+
 static void
 ahciport_enqueue(device_t dev, void* item)
 {
 	struct AHCI_PCI_PORT* p = dev->privdata;
 	struct AHCI_PCI_PRIVDATA* privdata = p->p_pd;
 
-	/* Fetch an usable command slot */
-	int n = -1;
-	while (n < 0) {
+	/*
+	 * Wait until a command slot is available; this only happens under load, as
+	 * the request queue in front of us rarely has more requests than slots.
+	 */
+	if (!sem_trywait(&p->p_slots)) {
 		PORT_LOCK;
-		int i = 0;
-		for (/* nothing */; i < privdata->ap_ncs; i++)
-			if ((p->p_request_in_use & (1 << i)) == 0)
-				break;
-		if (i < privdata->ap_ncs) {
-			p->p_request_in_use |= 1 << i;
-			n = i;
-		} 
+		p->p_stats.ps_slot_waits++;
 		PORT_UNLOCK;
+		sem_wait(&p->p_slots);
+	}
 
-		if (n < 0) {
-			/* XXX This is valid, but it'd be odd without any load */
-			device_printf(dev, "ahciport_enqueue(): out of command slots; retrying (%x)", p->p_request_in_use);
-
-			/* XXX We should sleep on some wakeup condition - use a semaphore ? */
-		}
+	/* We own a slot now; find out which one */
+	PORT_LOCK;
+	int n = 0;
+	unsigned int num_in_use = 0;
+	for (int i = privdata->ap_ncs - 1; i >= 0; i--) {
+		if ((p->p_request_in_use & (1 << i)) == 0)
+			n = i;
+		else
+			num_in_use++;
 	}
+	KASSERT((p->p_request_in_use & (1 << n)) == 0, "no free slot even though we waited for one");
+	p->p_request_in_use |= 1 << n;
+	p->p_stats.ps_occupancy[num_in_use]++;
+	PORT_UNLOCK;
 
 	/* Enqueue the item and mark it as valid */
 	memcpy(&p->p_request[n], item, sizeof(struct SATA_REQUEST));
+	errorcode_t err = ahciport_prepare(dev, p, n);
+	if (err != ANANAS_ERROR_OK) {
+		device_printf(dev, "unable to map request (%u bytes), failing it", p->p_request[n].pr_request.sr_count);
+		struct SATA_REQUEST* sr = &p->p_request[n].pr_request;
+		if (sr->sr_bio != NULL)
+			bio_set_error(sr->sr_bio);
+		if (sr->sr_semaphore != NULL)
+			sem_signal(sr->sr_semaphore);
+		PORT_LOCK;
+		p->p_request_in_use &= ~(1 << n);
+		PORT_UNLOCK;
+		sem_signal(&p->p_slots);
+		return;
+	}
+
 	PORT_LOCK;
 	p->p_request_valid |= 1 << n;
 	PORT_UNLOCK;
 }
 
+/* Issues all valid requests which aren't active yet; must be called with the port lock held */
 static void
-ahciport_start(device_t dev)
+ahciport_start_locked(device_t dev, struct AHCI_PCI_PORT* p)
 {
-	struct AHCI_PCI_PORT* p = dev->privdata;
 	struct AHCI_PCI_PRIVDATA* privdata = p->p_pd;
 
-	/*
-	 * Program all valid requests which aren't currently active
-	 *
-	 * XXX Maybe we could do something more sane than keep the lock all this
-	 *     time?
-	 */
-	PORT_LOCK;
-	uint32_t ci = p->p_request_active;
+	uint32_t ci = 0, sact = 0;
 	for (int i = 0; i < privdata->ap_ncs; i++) {
 		if ((p->p_request_valid & (1 << i)) == 0)
 			continue;
 		if ((p->p_request_active & (1 << i)) != 0)
 			continue;
 
-		/* Request is valid but not yet active; program it */
-		struct AHCI_PCI_REQUEST* pr = &p->p_request[i];
-		struct SATA_REQUEST* sr = &pr->pr_request;
-
-		/* XXX use dma for data_ptr */
-		uint64_t data_ptr;
-		if (sr->sr_buffer != NULL)
-			data_ptr = kmem_get_phys(sr->sr_buffer);
-		else
-			data_ptr = kmem_get_phys(BIO_DATA(sr->sr_bio));
-
-		/* Construct the command table; it will always have 1 PRD entry */
-		struct AHCI_PCI_CT* ct = pr->pr_ct;
-		memset(ct, 0, sizeof(struct AHCI_PCI_CT));
-
-		ct->ct_prd[0].prde_dw0 = AHCI_PRDE_DW0_DBA(data_ptr & 0xffffffff);
-		ct->ct_prd[0].prde_dw1 = AHCI_PRDE_DW1_DBAU(data_ptr >> 32);
-		ct->ct_prd[0].prde_dw2 = 0;
-		ct->ct_prd[0].prde_dw3 = AHCI_PRDE_DW3_I | AHCI_PRDE_DW3_DBC(sr->sr_count - 1);
-		ct->ct_prd[0].prde_dw3 = AHCI_PRDE_DW3_DBC(sr->sr_count - 1);
-		/* XXX handle atapi */
-		memcpy(&ct->ct_cfis[0], &sr->sr_fis.fis_h2d, sizeof(struct SATA_FIS_H2D));
-		dma_buf_sync(pr->pr_dmabuf_ct, DMA_SYNC_OUT);
-
-		/* Set up the command list entry and hook it to this table */
-		struct AHCI_PCI_CLE* cle = &p->p_cle[i];
-		uint64_t addr_ct = dma_buf_get_segment(pr->pr_dmabuf_ct, 0)->s_phys;
-		memset(cle, 0, sizeof(struct AHCI_PCI_CLE));
-		cle->cle_dw0 =
-		 AHCI_CLE_DW0_PRDTL(1) |
-		 AHCI_CLE_DW0_PMP(0) |
-		 AHCI_CLE_DW0_CFL(sr->sr_fis_length / 4);
-		if (sr->sr_flags & SATA_REQUEST_FLAG_WRITE)
-			cle->cle_dw0 |= AHCI_CLE_DW0_W;
-		cle->cle_dw1 = 0;
-		cle->cle_dw2 = AHCI_CLE_DW2_CTBA(addr_ct & 0xffffffff);
-		cle->cle_dw3 = AHCI_CLE_DW3_CTBAU(addr_ct >> 32);
-		dma_buf_sync(p->p_dmabuf_cl, DMA_SYNC_OUT);
+		/*
+		 * Queued and non-queued commands must never be outstanding at the same
+		 * time; the request is left for when the others have completed.
+		 */
+		uint32_t active = p->p_request_active | ci;
+		if ((p->p_request_ncq & (1 << i)) != 0) {
+			if ((active & ~p->p_request_ncq) != 0)
+				continue;
+			sact |= AHCI_PxSACT_DS(i);
+		} else if ((active & p->p_request_ncq) != 0)
+			continue;
 
 		/* Command is ready to be transmitted */
-		ci |= 1 << i;
+		ci |= AHCI_PxCIT_CI(i);
+		p->p_request[i].pr_issued = md_cpu_cycles();
 	}
-
-	/* XXXRS Maybe small race here? */
-	if (ci == p->p_request_active) {
-		PORT_UNLOCK;
+	if (ci == 0)
 		return;
-	}
-	p->p_request_active = ci;
-	PORT_UNLOCK;
+	p->p_request_active |= ci;
 
 	AHCI_DPRINTF(">> #%d issuing command\n", p->p_num);
 	DUMP_PORT_STATE(p->p_num);
 
+	/*
+	 * Only write the bits of the new commands; writing a bit of a command which
+	 * completed but has not yet been processed would issue it again. SActive
+	 * must be set before the command is issued.
+	 */
+	if (sact != 0)
+		AHCI_WRITE_4(AHCI_REG_PxSACT(p->p_num), sact);
 	AHCI_WRITE_4(AHCI_REG_PxCI(p->p_num), ci);
 }
 
+static void
+ahciport_start(device_t dev)
+{
+	struct AHCI_PCI_PORT* p = dev->privdata;
+
+	PORT_LOCK;
+	ahciport_start_locked(dev, p);
+	PORT_UNLOCK;
+}
+
+static void
+ahciport_dump(device_t dev)
+{
+	struct AHCI_PCI_PORT* p = dev->privdata;
+	struct AHCI_PCI_PRIVDATA* privdata = p->p_pd;
+	struct AHCI_PCI_PORT_STATS* ps = &p->p_stats;
+
+	kprintf("port #%d: %u slots, in use %x, active %x, queued %x\n",
+	 p->p_num, privdata->ap_ncs, p->p_request_in_use, p->p_request_active, p->p_request_ncq);
+	kprintf("commands: %u completed (%u queued natively), %u waits for a slot\n",
+	 ps->ps_commands, ps->ps_ncq_commands, ps->ps_slot_waits);
+	if (ps->ps_commands > 0)
+		kprintf("latency: %u cycles average, %u max\n",
+		 (uint32_t)(ps->ps_total_latency / ps->ps_commands), (uint32_t)ps->ps_max_latency);
+	kprintf("slots in use on enqueue:");
+	for (unsigned int n = 0; n <= privdata->ap_ncs; n++)
+		if (ps->ps_occupancy[n] > 0)
+			kprintf(" %u:%u", n, ps->ps_occupancy[n]);
+	kprintf("\n");
+}
+
 struct DRIVER drv_ahcipci_port = {
 	.name = "ahci-port",
 	.drv_attach = ahciport_attach,
+	.drv_dump = ahciport_dump,
 	.drv_enqueue = ahciport_enqueue,
 	.drv_start = ahciport_start,
 };
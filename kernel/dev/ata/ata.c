@@ -83,11 +83,13 @@ ata_irq(device_t dev, void* context)
 		 * this before updating the buffer status to prevent races.
 		 */
 		if (item->flags & ATA_ITEM_FLAG_READ) {
-			uint8_t* bio_data = item->bio->data;
-			for(int count = 0; count < item->bio->length / 2; count++) {
-				uint16_t data = inw(priv->io_port + ATA_REG_DATA);
-				*bio_data++ = data & 0xff;
-				*bio_data++ = data >> 8;
+			for (unsigned int n = 0; n < bio_num_vecs(item->bio); n++) {
+				uint8_t* bio_data = bio_vec_data(item->bio, n);
+				for(int count = 0; count < bio_vec_length(item->bio, n) / 2; count++) {
+					uint16_t data = inw(priv->io_port + ATA_REG_DATA);
+					*bio_data++ = data & 0xff;
+					*bio_data++ = data >> 8;
+				}
 			}
 		}
 
@@ -276,11 +278,13 @@ ata_start_pio(device_t dev, struct ATA_REQUEST_ITEM* item)
 			}
 
 			/* XXX We really need outsw() or similar */
-			uint8_t* bio_data = item->bio->data;
-			for(int i = 0; i < item->bio->length; i += 2) {
-				uint16_t v = bio_data[0] | (uint16_t)bio_data[1] << 8;
-				outw(priv->io_port + ATA_REG_DATA, v);
-				bio_data += 2;
+			for (unsigned int n = 0; n < bio_num_vecs(item->bio); n++) {
+				uint8_t* bio_data = bio_vec_data(item->bio, n);
+				for(int i = 0; i < bio_vec_length(item->bio, n); i += 2) {
+					uint16_t v = bio_data[0] | (uint16_t)bio_data[1] << 8;
+					outw(priv->io_port + ATA_REG_DATA, v);
+					bio_data += 2;
+				}
 			}
 		}
 	} else {
@@ -319,13 +323,18 @@ ata_start_dma(device_t dev, struct ATA_REQUEST_ITEM* item)
 
 	struct ATAPCI_PRDT* prdt = &priv->atapci.atapci_prdt[0];
 	KASSERT(((addr_t)prdt & 3) == 0, "prdt not dword-aligned");
+	KASSERT(bio_num_vecs(item->bio) <= ATA_PCI_NUMPRDT, "too many pieces for prdt");
 
 	uint32_t dma_io = priv->atapci.atapci_io;
 	if (dev->unit > 0) dma_io += 8; /* XXX crude */
 
-	/* XXX For now, we assume a single request per go */
-	prdt->prdt_base = (addr_t)KVTOP((addr_t)BIO_DATA(item->bio)); /* XXX 32 bit */
-	prdt->prdt_size = item->bio->length | ATA_PRDT_EOT;
+	/* Every piece gets its own entry; pieces never cross a page, let alone 64KB */
+	unsigned int num_vecs = bio_num_vecs(item->bio);
+	for (unsigned int n = 0; n < num_vecs; n++) {
+		prdt[n].prdt_base = (addr_t)KVTOP((addr_t)bio_vec_data(item->bio, n)); /* XXX 32 bit */
+		prdt[n].prdt_size = bio_vec_length(item->bio, n);
+	}
+	prdt[num_vecs - 1].prdt_size |= ATA_PRDT_EOT;
 
 	/* Program the DMA parts of the PCI bus */
 	outl(dma_io + ATA_PCI_REG_PRI_PRDT, (uint32_t)KVTOP((addr_t)prdt)); /* XXX 32 bit */
@@ -27,7 +27,7 @@ atacd_attach(device_t dev)
 }
 
 static errorcode_t
-atacd_bread(device_t dev, struct BIO* bio)
+atacd_start_read(device_t dev, struct BIO* bio)
 {
 	struct ATACD_PRIVDATA* priv = (struct ATACD_PRIVDATA*)dev->privdata;
 	struct ATA_REQUEST_ITEM item;
@@ -52,6 +52,41 @@ atacd_bread(device_t dev, struct BIO* bio)
 	return ANANAS_ERROR_OK;
 }
 
+static errorcode_t
+atacd_bread(device_t dev, struct BIO* bio)
+{
+	if (bio->num_vecs == 0)
+		return atacd_start_read(dev, bio);
+
+	/*
+	 * XXX Our ATAPI code can only transfer a single sector per request, so we
+	 * read the pieces one by one and wait for every one of them.
+	 */
+	blocknr_t block = bio->io_block;
+	for (unsigned int n = 0; n < bio->num_vecs; n++) {
+		struct BIO piece;
+		memset(&piece, 0, sizeof(piece));
+		sem_init(&piece.sem, 0);
+		DQUEUE_INIT(&piece.completions);
+		piece.flags = BIO_FLAG_PENDING;
+		piece.device = dev;
+		piece.block = block;
+		piece.io_block = block;
+		piece.length = bio->vec[n].bv_length;
+		piece.data = bio->vec[n].bv_data;
+		errorcode_t err = atacd_start_read(dev, &piece);
+		if (err == ANANAS_ERROR_OK)
+			err = bio_wait(&piece);
+		if (err != ANANAS_ERROR_OK) {
+			bio_set_error(bio);
+			return ANANAS_ERROR_OK;
+		}
+		block += bio->vec[n].bv_length / BIO_SECTOR_SIZE;
+	}
+	bio_set_available(bio);
+	return ANANAS_ERROR_OK;
+}
+
 struct DRIVER drv_atacd = {
 	.name					= "atacd",
 	.drv_probe		= NULL,
@@ -3,6 +3,7 @@
 #include <ananas/dev/ata.h>
 #include <ananas/x86/io.h>
 #include <ananas/bio.h>
+#include <ananas/bioqueue.h>
 #include <ananas/lib.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
@@ -45,6 +46,9 @@ atadisk_attach(device_t dev)
 		device_printf(dev, "using DMA transfers");
 	}
 
+	/* The controller handles a single command at a time, so sort and merge in front of it */
+	bioq_attach(dev, &bioq_policy_deadline, 1);
+
 	/*
 	 * Read the first sector and pass it to the MBR code; this is crude
 	 * and does not really belong here.
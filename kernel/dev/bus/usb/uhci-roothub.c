@@ -409,11 +409,7 @@ uroothub_thread(void* ptr)
 	while (1) {
 		uroothub_update_status(p->uhci_roothub);
 
-		/* XXX we need some sensible sleep mechanism */
-		for (int n = 0; n < 100; n++) {
-			delay(10);
-			reschedule();
-		}
+		thread_sleep_ms(1000);
 	}
 }
 
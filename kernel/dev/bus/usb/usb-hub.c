@@ -117,7 +117,7 @@ ushub_reset_port(struct USB_HUB* hub, int n)
 	struct HUB_PORT_STATUS ps;
 	int timeout = 10; /* XXX */
 	while(timeout > 0) {
-		delay(100);
+		thread_sleep_ms(100);
 
 		/* See if the device is correctly reset */
 		size_t len = sizeof(ps);
@@ -275,7 +275,7 @@ usbhub_attach(device_t dev)
 		hub->hub_port[n].p_flags = HUB_PORT_FLAG_UPDATED;
 
 		/* Wait until the power is good */
-		delay(hd.hd_poweron2good * 2 + 10 /* slack */);
+		thread_sleep_ms(hd.hd_poweron2good * 2 + 10 /* slack */);
 	}
 
 	/* Initialization went well; hook up the interrupt pipe so that we may receive updates */
@@ -18,6 +18,8 @@ usbpipe_create_transfer(struct USB_PIPE* pipe, size_t maxlen)
 {
 	struct USB_ENDPOINT* ep = pipe->p_ep;
 	struct USB_TRANSFER* xfer = usbtransfer_alloc(pipe->p_dev, ep->ep_type, ((ep->ep_dir == EP_DIR_IN) ? TRANSFER_FLAG_READ : TRANSFER_FLAG_WRITE) | TRANSFER_FLAG_DATA, ep->ep_address, maxlen);
+	if (xfer == NULL)
+		return NULL;
 	xfer->xfer_length = ep->ep_maxpacketsize;
 	xfer->xfer_callback = usbpipe_callback;
 	xfer->xfer_callback_data = pipe;
@@ -56,6 +58,10 @@ usbpipe_alloc(struct USB_DEVICE* usb_dev, int num, int type, int dir, size_t max
 	p->p_callback = callback;
 	p->p_ep = ep;
 	p->p_xfer = usbpipe_create_transfer(p, maxlen);
+	if (p->p_xfer == NULL) {
+		kfree(p);
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
 
 	/* Hook up the pipe to the device */
 	mutex_lock(&usb_dev->usb_mutex);
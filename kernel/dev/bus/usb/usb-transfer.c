@@ -10,6 +10,7 @@
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
+#include <ananas/slab.h>
 #include <machine/param.h> /* XXX for PAGE_SIZE */
 #include "usb-bus.h"
 #include "usb-device.h"
@@ -23,6 +24,10 @@
 
 TRACE_SETUP;
 
+/* Maximum time we wait for a control transfer to complete, in ms */
+#define USB_CONTROL_XFER_TIMEOUT 5000
+
+static KMEM_CACHE_DEFINE(usbtransfer_cache, "usbtransfer", sizeof(struct USB_TRANSFER), NULL);
 static thread_t usbtransfer_thread;
 static semaphore_t usbtransfer_sem;
 static struct USB_TRANSFER_QUEUE usbtransfer_completedqueue;
@@ -40,6 +45,8 @@ usb_make_control_xfer(struct USB_DEVICE* usb_dev, int req, int recipient, int ty
 	else
 		flags |= TRANSFER_FLAG_READ;
 	struct USB_TRANSFER* xfer = usbtransfer_alloc(usb_dev, TRANSFER_TYPE_CONTROL, flags, 0, (len != NULL) ? *len : 0);
+	if (xfer == NULL)
+		return NULL;
 	xfer->xfer_control_req.req_type = TO_REG32((write ? 0 : USB_CONTROL_REQ_DEV2HOST) | USB_CONTROL_REQ_RECIPIENT(recipient) | USB_CONTROL_REQ_TYPE(type));
 	xfer->xfer_control_req.req_request = TO_REG32(req);
 	xfer->xfer_control_req.req_value = TO_REG32(value);
@@ -53,12 +60,19 @@ errorcode_t
 usb_control_xfer(struct USB_DEVICE* usb_dev, int req, int recipient, int type, int value, int index, void* buf, size_t* len, int write)
 {
 	struct USB_TRANSFER* xfer = usb_make_control_xfer(usb_dev, req, recipient, type, value, index, buf, len, write);
+	if (xfer == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 
 	DPRINTF("usb_control_xfer(): req %d value %x -> xfer=%p\n", req, value, xfer);
 
-	/* Now schedule the transfer and until it's completed XXX Timeout */
+	/* Now schedule the transfer and until it's completed */
 	usbtransfer_schedule(xfer);
-	sem_wait_and_drain(&xfer->xfer_semaphore);
+	if (!sem_timedwait(&xfer->xfer_semaphore, USB_CONTROL_XFER_TIMEOUT)) {
+		/* Freeing the transfer cancels it, so it cannot complete after this */
+		DPRINTF("usb_control_xfer(): xfer %p TIMEOUT\n", xfer);
+		usbtransfer_free(xfer);
+		return ANANAS_ERROR(TIMEOUT);
+	}
 	if (xfer->xfer_flags & TRANSFER_FLAG_ERROR) {
 		DPRINTF("usb_control_xfer(): xfer %p ERROR\n", xfer);
 		usbtransfer_free(xfer);
@@ -98,7 +112,9 @@ usbtransfer_setup(struct USB_TRANSFER* xfer)
 struct USB_TRANSFER*
 usbtransfer_alloc(struct USB_DEVICE* dev, int type, int flags, int endpt, size_t maxlen)
 {
-	struct USB_TRANSFER* usb_xfer = kmalloc(sizeof *usb_xfer);
+	struct USB_TRANSFER* usb_xfer = kmem_cache_alloc(&usbtransfer_cache);
+	if (usb_xfer == NULL)
+		return NULL;
 	DPRINTF("usbtransfer_alloc: xfer=%x type %d\n", usb_xfer, type);
 	memset(usb_xfer, 0, sizeof *usb_xfer);
 	usb_xfer->xfer_device = dev;
@@ -111,7 +127,7 @@ usbtransfer_alloc(struct USB_DEVICE* dev, int type, int flags, int endpt, size_t
 
 	errorcode_t err = usbtransfer_setup(usb_xfer);
 	if (err != ANANAS_ERROR_NONE) {
-		kfree(usb_xfer);
+		kmem_cache_free(&usbtransfer_cache, usb_xfer);
 		return NULL;
 	}
 	return usb_xfer;
@@ -158,7 +174,7 @@ usbtransfer_free_locked(struct USB_TRANSFER* xfer)
 
 	usbtransfer_cancel_locked(xfer);
 	usbtransfer_teardown_locked(xfer);
-	kfree(xfer);
+	kmem_cache_free(&usbtransfer_cache, xfer);
 }
 
 void
@@ -2,6 +2,7 @@
 #include <ananas/error.h>
 #include <ananas/bootinfo.h>
 #include <ananas/bio.h>
+#include <ananas/bioqueue.h>
 #include <ananas/trace.h>
 #include <ananas/device.h>
 #include <ananas/trace.h>
@@ -44,7 +45,9 @@ ramdisk_attach(device_t dev)
 		device_printf(dev, "%u KB",
 		 (addr_t)mod->mod_phys_start_addr, (addr_t)mod->mod_phys_end_addr,
 		 privdata->ram_size / 1024);
-		
+
+		/* Reads complete right away; there is nothing to gain from reordering them */
+		bioq_attach(dev, &bioq_policy_noop, 1);
 		return ANANAS_ERROR_OK;
 	}
 	return ANANAS_ERROR(NO_DEVICE);
@@ -60,17 +63,35 @@ ramdisk_bread(device_t dev, struct BIO* bio)
 	KASSERT((bio->io_block * BIO_SECTOR_SIZE) + bio->length < privdata->ram_size, "attempted to read beyond ramdisk range");
 
 	/* XXX We could really use page-mapped blocks now */
-	memcpy(BIO_DATA(bio), (void*)((addr_t)privdata->ram_buffer + (addr_t)bio->io_block * BIO_SECTOR_SIZE), bio->length);
+	addr_t src = (addr_t)privdata->ram_buffer + (addr_t)bio->io_block * BIO_SECTOR_SIZE;
+	for (unsigned int n = 0; n < bio_num_vecs(bio); n++) {
+		memcpy(bio_vec_data(bio, n), (void*)src, bio_vec_length(bio, n));
+		src += bio_vec_length(bio, n);
+	}
 
 	bio_set_available(bio);
 	return ANANAS_ERROR_OK;
 }
 
+/*
+ * The image is in memory already, so the buffer cache can use it as-is rather
+ * than keeping a copy of every block.
+ */
+static void*
+ramdisk_bmap(device_t dev, blocknr_t block, size_t len)
+{
+	struct RAMDISK_PRIVDATA* privdata = (struct RAMDISK_PRIVDATA*)dev->privdata;
+	if ((block * BIO_SECTOR_SIZE) + len > privdata->ram_size)
+		return NULL;
+	return (void*)((addr_t)privdata->ram_buffer + (addr_t)block * BIO_SECTOR_SIZE);
+}
+
 struct DRIVER drv_ramdisk = {
 	.name					= "ramdisk",
 	.drv_probe		= ramdisk_probe,
 	.drv_attach		= ramdisk_attach,
-	.drv_bread		= ramdisk_bread
+	.drv_bread		= ramdisk_bread,
+	.drv_bmap			= ramdisk_bmap
 };
 
 DRIVER_PROBE(ramdisk)
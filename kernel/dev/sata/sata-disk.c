@@ -2,6 +2,7 @@
 #include <ananas/dev/ata.h>
 #include <ananas/dev/sata.h>
 #include <ananas/bio.h>
+#include <ananas/bioqueue.h>
 #include <ananas/device.h>
 #include <ananas/endian.h>
 #include <ananas/error.h>
@@ -12,11 +13,16 @@
 
 TRACE_SETUP;
 
+/* Maximum number of requests handed to the port at once */
+#define SATADISK_QUEUE_DEPTH 32
+
 struct SATADISK_PRIVDATA {
 	struct ATA_IDENTIFY sd_identify;
 	uint64_t sd_size;	/* in sectors */
 	uint32_t sd_flags;
 #define SATADISK_FLAGS_LBA48 1
+#define SATADISK_FLAGS_NCQ 2
+	unsigned int sd_queue_depth;	/* Commands the device can queue natively */
 };
 
 static errorcode_t
@@ -60,6 +66,19 @@ satadisk_attach(device_t dev)
 		priv->sd_flags |= SATADISK_FLAGS_LBA48;
 	}
 
+	/*
+	 * See if the disk supports native command queuing; the port will only use
+	 * it if the controller supports it as well.
+	 */
+	unsigned int depth = SATADISK_QUEUE_DEPTH;
+	if (ATA_GET_WORD(priv->sd_identify.sata_capabilities) & ATA_SATACAP_NCQ) {
+		priv->sd_flags |= SATADISK_FLAGS_NCQ;
+		priv->sd_queue_depth = ATA_QUEUE_DEPTH(ATA_GET_WORD(priv->sd_identify.queue_depth));
+		/* Tags are command slots, so having no more requests than tags keeps them in range */
+		if (priv->sd_queue_depth < depth)
+			depth = priv->sd_queue_depth;
+	}
+
 	/* Terminate the model name */
 	for(int n = sizeof(priv->sd_identify.model) - 1; n > 0 && priv->sd_identify.model[n] == ' '; n--)
 		priv->sd_identify.model[n] = '\0';
@@ -67,6 +86,11 @@ satadisk_attach(device_t dev)
 	device_printf(dev, "<%s> - %u MB",
 	 priv->sd_identify.model,
  	 priv->sd_size / ((1024UL * 1024UL) / 512UL));
+	if (priv->sd_flags & SATADISK_FLAGS_NCQ)
+		device_printf(dev, "native command queuing, depth %u", priv->sd_queue_depth);
+
+	/* The port can have a command in every slot; let the queue sort and merge in front of it */
+	bioq_attach(dev, &bioq_policy_deadline, depth);
 
 	/*
 	 * Read the first sector and pass it to the MBR code; this is crude
@@ -86,6 +110,7 @@ satadisk_attach(device_t dev)
 static errorcode_t
 satadisk_bread(device_t dev, struct BIO* bio)
 {
+	struct SATADISK_PRIVDATA* priv = dev->privdata;
 	KASSERT(bio != NULL, "invalid buffer");
 	KASSERT(bio->length > 0, "invalid length");
 	KASSERT(bio->length % 512 == 0, "invalid length"); /* XXX */
@@ -98,6 +123,8 @@ satadisk_bread(device_t dev, struct BIO* bio)
 	sr.sr_count = bio->length;
 	sr.sr_bio = bio;
 	sr.sr_flags = SATA_REQUEST_FLAG_READ;
+	if (priv->sd_flags & SATADISK_FLAGS_NCQ)
+		sr.sr_flags |= SATA_REQUEST_FLAG_NCQ;
 	dev->parent->driver->drv_enqueue(dev->parent, &sr);
 	dev->parent->driver->drv_start(dev->parent);
 	return ANANAS_ERROR_OK;
@@ -106,6 +133,7 @@ satadisk_bread(device_t dev, struct BIO* bio)
 static errorcode_t
 satadisk_bwrite(device_t dev, struct BIO* bio)
 {
+	struct SATADISK_PRIVDATA* priv = dev->privdata;
 	struct SATA_REQUEST sr;
 	memset(&sr, 0, sizeof(sr));
 	/* XXX  we shouldn't always use lba-48 */
@@ -114,6 +142,8 @@ satadisk_bwrite(device_t dev, struct BIO* bio)
 	sr.sr_count = bio->length;
 	sr.sr_bio = bio;
 	sr.sr_flags = SATA_REQUEST_FLAG_WRITE;
+	if (priv->sd_flags & SATADISK_FLAGS_NCQ)
+		sr.sr_flags |= SATA_REQUEST_FLAG_NCQ;
 	dev->parent->driver->drv_enqueue(dev->parent, &sr);
 	dev->parent->driver->drv_start(dev->parent);
 	return ANANAS_ERROR_OK;
@@ -1,4 +1,5 @@
 #include <ananas/types.h>
+#include <ananas/dev/ata.h>
 #include <ananas/dev/sata.h>
 #include <ananas/lib.h>
 
@@ -27,4 +28,18 @@ sata_fis_h2d_make_cmd_lba48(struct SATA_FIS_H2D* h2d, uint8_t cmd, uint64_t lba,
 	h2d->h2d_dw2_cyl_hi_exp = (lba >> 40) & 0xff;
 }
 
+void
+sata_fis_h2d_make_ncq(struct SATA_FIS_H2D* h2d, unsigned int tag)
+{
+	KASSERT(h2d->h2d_dw0_cmd == ATA_CMD_DMA_READ_EXT || h2d->h2d_dw0_cmd == ATA_CMD_DMA_WRITE_EXT, "command %x cannot be queued", h2d->h2d_dw0_cmd);
+
+	/* The sector count moves to the feature fields, the tag takes its place */
+	h2d->h2d_dw0_cmd = (h2d->h2d_dw0_cmd == ATA_CMD_DMA_READ_EXT) ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_WRITE_FPDMA_QUEUED;
+	h2d->h2d_dw0_feat = h2d->h2d_dw3_count;
+	h2d->h2d_dw2_feat = h2d->h2d_dw3_count_exp;
+	h2d->h2d_dw3_count = tag << 3;
+	h2d->h2d_dw3_count_exp = 0;
+	h2d->h2d_dw1_dev_head = (1 << 6) /* LBA addr */;
+}
+
 /* vim:set ts=2 sw=2: */
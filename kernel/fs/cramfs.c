@@ -31,6 +31,7 @@
 #include <ananas/bio.h>
 #include <ananas/error.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
@@ -238,7 +239,7 @@ static struct VFS_INODE_OPS cramfs_file_ops = {
 
 static struct VFS_INODE_OPS cramfs_dir_ops = {
 	.readdir = cramfs_readdir,
-	.lookup = vfs_generic_lookup
+	.lookup = vfs_dirindex_lookup
 };
 
 static void
@@ -26,12 +26,14 @@
 #include <ananas/bio.h>
 #include <ananas/error.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
 #include <ananas/lib.h>
 #include <ananas/trace.h>
 #include <ananas/mm.h>
+#include <ananas/slab.h>
 #include <ext2.h>
 
 TRACE_SETUP;
@@ -48,8 +50,11 @@ struct EXT2_FS_PRIVDATA {
 
 struct EXT2_INODE_PRIVDATA {
 	blocknr_t block[EXT2_INODE_BLOCKS];
+	uint32_t flags;
 };
 
+static struct KMEM_CACHE* ext2_inode_cache;
+
 static void
 ext2_conv_superblock(struct EXT2_SUPERBLOCK* sb)
 {
@@ -63,7 +68,11 @@ ext2_alloc_inode(struct VFS_MOUNTED_FS* fs, const void* fsop)
 	struct VFS_INODE* inode = vfs_make_inode(fs, fsop);
 	if (inode == NULL)
 		return NULL;
-	struct EXT2_INODE_PRIVDATA* privdata = kmalloc(sizeof(struct EXT2_INODE_PRIVDATA));
+	struct EXT2_INODE_PRIVDATA* privdata = kmem_cache_alloc(ext2_inode_cache);
+	if (privdata == NULL) {
+		kfree(inode);
+		return NULL;
+	}
 	memset(privdata, 0, sizeof(struct EXT2_INODE_PRIVDATA));
 	inode->i_privdata = privdata;
 	return inode;
@@ -72,7 +81,7 @@ ext2_alloc_inode(struct VFS_MOUNTED_FS* fs, const void* fsop)
 static void
 ext2_destroy_inode(struct VFS_INODE* inode)
 {
-	kfree(inode->i_privdata);
+	kmem_cache_free(ext2_inode_cache, inode->i_privdata);
 	vfs_destroy_inode(inode);
 }
 
@@ -117,10 +126,10 @@ ext2_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out
 	 * double or triply-linked block. From the comments above, we know that:
 	 *
 	 * (a) The first 12 blocks (0 .. 11) can directly be accessed.
-	 * (a) The first indirect block contains blocks 12 .. 12 + block_size / 4.
-	 * (b) The double-indirect block contains blocks 12 + block_size / 4 to
+	 * (b) The first indirect block contains blocks 12 .. 12 + block_size / 4.
+	 * (c) The double-indirect block contains blocks 12 + block_size / 4 to
 	 *     13 + (block_size / 4)^2
-	 * (c) The triple-indirect block contains everything else.
+	 * (d) The triple-indirect block contains everything else.
 	 */
 
 	/* (a) Direct blocks are easy */
@@ -129,20 +138,37 @@ ext2_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out
 		return ANANAS_ERROR_OK;
 	}
 
-	if (block_in < 12 + fs->fs_block_size / 4) {
-		/*
-		 * (b) Need to look up the block the first indirect block, 13.
-		 */
+	/* (b) - (d) Figure out which indirect block to start with and how deep it goes */
+	blocknr_t per_block = fs->fs_block_size / sizeof(uint32_t);
+	blocknr_t span = 1;
+	blocknr_t indirect = 0;
+	block_in -= 12;
+	for (unsigned int level = 0; level < 3; level++) {
+		span *= per_block;
+		if (block_in < span) {
+			indirect = in_privdata->block[12 + level];
+			break;
+		}
+		block_in -= span;
+	}
+	if (indirect == 0 && block_in >= span)
+		return ANANAS_ERROR(BAD_RANGE);
+
+	/*
+	 * Walk down the indirect blocks; every level divides the remaining range by
+	 * the number of pointers per block. Holes are reported as block 0.
+	 */
+	while (span > 1 && indirect != 0) {
+		span /= per_block;
 		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, in_privdata->block[12], &bio);
+		errorcode_t err = vfs_bread(fs, indirect, &bio);
 		ANANAS_ERROR_RETURN(err);
-		*block_out = EXT2_TO_LE32(*(uint32_t*)(BIO_DATA(bio) + (block_in - 12) * sizeof(uint32_t)));
+		indirect = EXT2_TO_LE32(*(uint32_t*)(BIO_DATA(bio) + (block_in / span) * sizeof(uint32_t)));
 		bio_free(bio);
-		return ANANAS_ERROR_OK;
+		block_in %= span;
 	}
-
-	panic("ext2_block_map() needs support for doubly/triple indirect blocks!");
-	return ANANAS_ERROR(BAD_RANGE);
+	*block_out = indirect;
+	return ANANAS_ERROR_OK;
 }
 
 static errorcode_t
@@ -212,6 +238,335 @@ ext2_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
 	return ANANAS_ERROR_OK;
 }
 
+/*
+ * Hash indexed directories; the hash functions are the ones used by Linux,
+ * as we must end up with exactly the same values.
+ */
+#define EXT2_DX_MAX_LEVELS	3
+#define EXT2_DX_BLOCK_MASK	0x0fffffff
+
+/* The original hash; 'is_unsigned' tells whether characters are considered to be unsigned */
+static uint32_t
+ext2_dx_legacy_hash(const char* name, int len, int is_unsigned)
+{
+	uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (int n = 0; n < len; n++) {
+		int c = is_unsigned ? (int)(unsigned char)name[n] : (int)(signed char)name[n];
+		uint32_t hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/* Converts up to 'num' words worth of the name to hash input, padding it using the length */
+static void
+ext2_dx_str2hashbuf(const char* name, int len, uint32_t* buf, int num, int is_unsigned)
+{
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (int n = 0; n < len; n++) {
+		int c = is_unsigned ? (int)(unsigned char)name[n] : (int)(signed char)name[n];
+		val = c + (val << 8);
+		if ((n % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+#define EXT2_ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define EXT2_MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s) \
+	(a += f(b, c, d) + (x), a = EXT2_ROL32(a, s))
+#define EXT2_MD4_K2 013240474631u
+#define EXT2_MD4_K3 015666365641u
+
+/* MD4 with only half the rounds, which is plenty to spread names around */
+static void
+ext2_dx_half_md4(uint32_t* buf, const uint32_t* in)
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0], 3);
+	EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1], 7);
+	EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2], 11);
+	EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3], 19);
+	EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4], 3);
+	EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5], 7);
+	EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6], 11);
+	EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7], 19);
+
+	EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + EXT2_MD4_K2, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + EXT2_MD4_K2, 5);
+	EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + EXT2_MD4_K2, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + EXT2_MD4_K2, 13);
+	EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + EXT2_MD4_K2, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + EXT2_MD4_K2, 5);
+	EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + EXT2_MD4_K2, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + EXT2_MD4_K2, 13);
+
+	EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + EXT2_MD4_K3, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + EXT2_MD4_K3, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + EXT2_MD4_K3, 11);
+	EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + EXT2_MD4_K3, 15);
+	EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + EXT2_MD4_K3, 3);
+	EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + EXT2_MD4_K3, 9);
+	EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + EXT2_MD4_K3, 11);
+	EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + EXT2_MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void
+ext2_dx_tea(uint32_t* buf, const uint32_t* in)
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	for (int n = 0; n < 16; n++) {
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/* Calculates the hash of a name, as stored in the index; bit 0 is always clear */
+static uint32_t
+ext2_dx_hash(const char* name, int len, int version, const uint32_t* seed)
+{
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	if (seed[0] != 0 || seed[1] != 0 || seed[2] != 0 || seed[3] != 0)
+		memcpy(buf, seed, sizeof(buf));
+
+	uint32_t hash, in[8];
+	switch(version) {
+		case EXT2_HASH_HALF_MD4:
+		case EXT2_HASH_HALF_MD4_UNSIGNED:
+			for (/* nothing */; len > 0; len -= 32, name += 32) {
+				ext2_dx_str2hashbuf(name, len, in, 8, version == EXT2_HASH_HALF_MD4_UNSIGNED);
+				ext2_dx_half_md4(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case EXT2_HASH_TEA:
+		case EXT2_HASH_TEA_UNSIGNED:
+			for (/* nothing */; len > 0; len -= 16, name += 16) {
+				ext2_dx_str2hashbuf(name, len, in, 4, version == EXT2_HASH_TEA_UNSIGNED);
+				ext2_dx_tea(buf, in);
+			}
+			hash = buf[0];
+			break;
+		default: /* legacy */
+			hash = ext2_dx_legacy_hash(name, len, version == EXT2_HASH_LEGACY_UNSIGNED);
+			break;
+	}
+
+	/* The topmost value is reserved to mark the end of the directory */
+	hash &= ~1;
+	if (hash == 0xfffffffe)
+		hash = 0xfffffffc;
+	return hash;
+}
+
+/*
+ * Looks for 'name' in a single directory block; returns NO_FILE if it is not
+ * there and BAD_TYPE if the block is damaged.
+ */
+static errorcode_t
+ext2_dx_search_block(struct VFS_INODE* inode, blocknr_t lblock, const char* name, int len, uint32_t* inum)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	blocknr_t block;
+	errorcode_t err = ext2_block_map(inode, lblock, &block, 0);
+	ANANAS_ERROR_RETURN(err);
+	if (block == 0)
+		return ANANAS_ERROR(BAD_TYPE);
+
+	struct BIO* bio;
+	err = vfs_bread(fs, block, &bio);
+	ANANAS_ERROR_RETURN(err);
+
+	err = ANANAS_ERROR(NO_FILE);
+	for (uint32_t offset = 0; offset + sizeof(struct EXT2_DIRENTRY) <= fs->fs_block_size; /* nothing */) {
+		struct EXT2_DIRENTRY* ext2de = (struct EXT2_DIRENTRY*)(void*)(BIO_DATA(bio) + offset);
+		uint16_t rec_len = EXT2_TO_LE16(ext2de->rec_len);
+		if (rec_len < sizeof(struct EXT2_DIRENTRY) || offset + rec_len > fs->fs_block_size) {
+			err = ANANAS_ERROR(BAD_TYPE);
+			break;
+		}
+		if (ext2de->inode != 0 && ext2de->name_len == len && memcmp(ext2de->name, name, len) == 0) {
+			*inum = EXT2_TO_LE32(ext2de->inode);
+			err = ANANAS_ERROR_OK;
+			break;
+		}
+		offset += rec_len;
+	}
+	bio_free(bio);
+	return err;
+}
+
+/* A single level of the index while we walk it */
+struct EXT2_DX_FRAME {
+	struct BIO*		bio;
+	struct EXT2_DX_ENTRY*	entries;
+	unsigned int		count;
+	unsigned int		at;		/* Entry we followed */
+};
+
+/*
+ * Reads index block 'lblock' of 'inode' into 'frame' and selects the entry
+ * to follow for 'hash'; the entries start at 'offset'.
+ */
+static errorcode_t
+ext2_dx_read_node(struct VFS_INODE* inode, blocknr_t lblock, unsigned int offset, uint32_t hash, struct EXT2_DX_FRAME* frame)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	blocknr_t block;
+	errorcode_t err = ext2_block_map(inode, lblock, &block, 0);
+	ANANAS_ERROR_RETURN(err);
+	if (block == 0)
+		return ANANAS_ERROR(BAD_TYPE);
+	err = vfs_bread(fs, block, &frame->bio);
+	ANANAS_ERROR_RETURN(err);
+
+	struct EXT2_DX_COUNTLIMIT* cl = (struct EXT2_DX_COUNTLIMIT*)(void*)(BIO_DATA(frame->bio) + offset);
+	unsigned int limit = EXT2_TO_LE16(cl->limit);
+	frame->entries = (struct EXT2_DX_ENTRY*)(void*)cl;
+	frame->count = EXT2_TO_LE16(cl->count);
+	if (frame->count == 0 || frame->count > limit || offset + limit * sizeof(struct EXT2_DX_ENTRY) > fs->fs_block_size)
+		return ANANAS_ERROR(BAD_TYPE);
+
+	/* Find the last entry whose hash does not exceed ours; the first one has an implied hash of zero */
+	unsigned int lo = 1, hi = frame->count;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (EXT2_TO_LE32(frame->entries[mid].hash) > hash)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	frame->at = lo - 1;
+	return ANANAS_ERROR_OK;
+}
+
+/*
+ * Looks up 'name' using the hash index of directory 'inode'. Returns NO_FILE
+ * if the name does not exist and BAD_TYPE if the index cannot be used, in
+ * which case the caller must look at all entries instead.
+ */
+static errorcode_t
+ext2_dx_lookup(struct VFS_INODE* inode, const char* name, uint32_t* inum)
+{
+	struct EXT2_FS_PRIVDATA* privdata = inode->i_fs->fs_privdata;
+	int len = strlen(name);
+
+	/* '.' and '..' are not part of the index, but they always live in the first block */
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return ext2_dx_search_block(inode, 0, name, len, inum);
+
+	/* Grab the root, which tells us how to hash the name */
+	struct EXT2_DX_FRAME frame[EXT2_DX_MAX_LEVELS];
+	memset(frame, 0, sizeof(frame));
+	blocknr_t block;
+	errorcode_t err = ext2_block_map(inode, 0, &block, 0);
+	ANANAS_ERROR_RETURN(err);
+	err = vfs_bread(inode->i_fs, block, &frame[0].bio);
+	ANANAS_ERROR_RETURN(err);
+	struct EXT2_DX_ROOT_INFO* info = (struct EXT2_DX_ROOT_INFO*)(void*)(BIO_DATA(frame[0].bio) + EXT2_DX_ROOT_INFO_OFFSET);
+	int valid = info->reserved_zero == 0;
+	unsigned int levels = info->indirect_levels;
+	int version = info->hash_version;
+	unsigned int offset = EXT2_DX_ROOT_INFO_OFFSET + info->info_length;
+	bio_free(frame[0].bio);
+	frame[0].bio = NULL;
+	if (!valid || levels >= EXT2_DX_MAX_LEVELS || version > EXT2_HASH_TEA_UNSIGNED)
+		return ANANAS_ERROR(BAD_TYPE);
+	if (version <= EXT2_HASH_TEA && (privdata->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+		version += EXT2_HASH_LEGACY_UNSIGNED;
+	uint32_t seed[4];
+	memcpy(seed, privdata->sb.s_hash_seed, sizeof(seed));
+	uint32_t hash = ext2_dx_hash(name, len, version, seed);
+
+	/* Walk down the tree to the leaf block which should contain the name */
+	err = ext2_dx_read_node(inode, 0, offset, hash, &frame[0]);
+	for (unsigned int n = 1; err == ANANAS_ERROR_OK && n <= levels; n++) {
+		blocknr_t next = EXT2_TO_LE32(frame[n - 1].entries[frame[n - 1].at].block) & EXT2_DX_BLOCK_MASK;
+		err = ext2_dx_read_node(inode, next, EXT2_DX_NODE_ENTRIES_OFFSET, hash, &frame[n]);
+	}
+
+	while (err == ANANAS_ERROR_OK) {
+		struct EXT2_DX_FRAME* leaf = &frame[levels];
+		blocknr_t lblock = EXT2_TO_LE32(leaf->entries[leaf->at].block) & EXT2_DX_BLOCK_MASK;
+		err = ext2_dx_search_block(inode, lblock, name, len, inum);
+		if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_NO_FILE)
+			break;
+
+		/*
+		 * Names with the same hash may continue in the next leaf block; this is
+		 * the case if the next entry's hash is ours with the lowest bit set.
+		 */
+		int n = levels;
+		while (n >= 0 && frame[n].at + 1 >= frame[n].count)
+			n--;
+		if (n < 0)
+			break;
+		frame[n].at++;
+		if (EXT2_TO_LE32(frame[n].entries[frame[n].at].hash) != (hash | 1))
+			break;
+		for (/* nothing */; n < levels && err == ANANAS_ERROR_OK; n++) {
+			bio_free(frame[n + 1].bio);
+			frame[n + 1].bio = NULL;
+			blocknr_t next = EXT2_TO_LE32(frame[n].entries[frame[n].at].block) & EXT2_DX_BLOCK_MASK;
+			err = ext2_dx_read_node(inode, next, EXT2_DX_NODE_ENTRIES_OFFSET, 0, &frame[n + 1]);
+		}
+	}
+
+	for (unsigned int n = 0; n < EXT2_DX_MAX_LEVELS; n++)
+		if (frame[n].bio != NULL)
+			bio_free(frame[n].bio);
+	return err;
+}
+
+static errorcode_t
+ext2_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	struct VFS_INODE* inode = parent->d_inode;
+	struct EXT2_FS_PRIVDATA* privdata = inode->i_fs->fs_privdata;
+	struct EXT2_INODE_PRIVDATA* iprivdata = inode->i_privdata;
+
+	if ((iprivdata->flags & EXT2_INDEX_FL) && (privdata->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		uint32_t inum;
+		errorcode_t err = ext2_dx_lookup(inode, dentry, &inum);
+		if (err == ANANAS_ERROR_OK)
+			return vfs_get_inode(inode->i_fs, &inum, destinode);
+		if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_TYPE)
+			return err;
+		TRACE(VFS, WARN, "unusable directory index in inode %u", (uint32_t)inode->i_sb.st_ino);
+	}
+
+	/* No hash index; look at all entries once and use our own index */
+	return vfs_dirindex_lookup(parent, destinode, dentry);
+}
+
 static struct VFS_INODE_OPS ext2_file_ops = {
 	.read = vfs_generic_read,
 	.block_map = ext2_block_map
@@ -219,7 +574,7 @@ static struct VFS_INODE_OPS ext2_file_ops = {
 
 static struct VFS_INODE_OPS ext2_dir_ops = {
 	.readdir = ext2_readdir,
-	.lookup = vfs_generic_lookup
+	.lookup = ext2_lookup
 };
 
 /*
@@ -275,6 +630,7 @@ ext2_read_inode(struct VFS_INODE* inode, void* fsop)
 	struct EXT2_INODE_PRIVDATA* iprivdata = (struct EXT2_INODE_PRIVDATA*)inode->i_privdata;
 	for (unsigned int i = 0; i < EXT2_INODE_BLOCKS; i++)
 		iprivdata->block[i] = EXT2_TO_LE32(ext2inode->i_block[i]);
+	iprivdata->flags = EXT2_TO_LE32(ext2inode->i_flags);
 
 	/* Fill out the inode operations - this depends on the inode type */
 	uint16_t imode = EXT2_TO_LE16(ext2inode->i_mode);
@@ -389,13 +745,24 @@ static struct VFS_FILESYSTEM fs_ext2 = {
 errorcode_t
 ext2_init()
 {
-	return vfs_register_filesystem(&fs_ext2);
+	ext2_inode_cache = kmem_cache_create("ext2_inode", sizeof(struct EXT2_INODE_PRIVDATA), NULL);
+	if (ext2_inode_cache == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+
+	errorcode_t err = vfs_register_filesystem(&fs_ext2);
+	if (err != ANANAS_ERROR_OK)
+		kmem_cache_destroy(ext2_inode_cache);
+	return err;
 }
 
 static errorcode_t
 ext2_exit()
 {
-	return vfs_unregister_filesystem(&fs_ext2);
+	errorcode_t err = vfs_unregister_filesystem(&fs_ext2);
+	ANANAS_ERROR_RETURN(err);
+
+	kmem_cache_destroy(ext2_inode_cache);
+	return ANANAS_ERROR_OK;
 }
 
 INIT_FUNCTION(ext2_init, SUBSYSTEM_VFS, ORDER_MIDDLE);
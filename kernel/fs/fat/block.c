@@ -6,7 +6,7 @@
 #include <ananas/lock.h>
 #include <ananas/error.h>
 #include <fat.h>
-#include <ananas/schedule.h>
+#include <ananas/mm.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
 #include "fatfs.h"
@@ -14,6 +14,12 @@
 
 TRACE_SETUP;
 
+/* Number of extents an inode starts out with; this doubles as needed */
+#define FAT_NUM_EXTENTS_MIN 4
+
+/* Number of FAT sectors read at once while building the bitmap of clusters in use */
+#define FAT_BITMAP_PREFETCH 64
+
 static inline blocknr_t
 fat_cluster_to_sector(struct VFS_MOUNTED_FS* fs, uint32_t cluster)
 {
@@ -47,134 +53,194 @@ fat_make_cluster_block_offset(struct VFS_MOUNTED_FS* fs, uint32_t cluster, block
 }
 
 /*
- * Used to obtain the clusternum'th cluster of a file starting at
- * first_cluster. Returns BAD_RANGE error if end-of-file was found (but
- * cluster_out will be set to the final cluster found_
+ * Reads the FAT entry of 'cluster' and stores the next cluster in the chain in
+ * 'next', or 0 if this was the final cluster. '*bio' holds the most recently
+ * used FAT block and is reused if possible; the caller must free it.
  */
 static errorcode_t
-fat_get_cluster(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster, uint32_t clusternum, uint32_t* cluster_out)
+fat_read_fat_entry(struct VFS_MOUNTED_FS* fs, uint32_t cluster, struct BIO** bio, uint32_t* next)
 {
 	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
-	uint32_t cur_cluster = first_cluster;
 
-	/*
-	 * First of all, look through our cache. XXX linear search.
-	 *
-	 * We assume the cache items will never be removed while we are working with
-	 * the file because it will remain referenced - we throw away the cache items
-	 * when the inode is freed.
-	 *
-	 * Note that we explicitely _do not_ cache cluster -1; it is used to find the
-	 * final cluster of the FAT chain.
-	 */
-try_cache: ; /* dummy ; to keep gcc happy */
-	int create = 0, found = 0;
-	struct FAT_CLUSTER_CACHEITEM* ci = NULL;
-	struct FAT_CLUSTER_CACHEITEM* ci_closest = NULL;
-	if (clusternum != -1) {
-		spinlock_lock(&fs_privdata->spl_cache);
-		for(int cache_item = 0; cache_item < FAT_NUM_CACHEITEMS; cache_item++) {
-			ci = &fs_privdata->cluster_cache[cache_item];
-			if (ci->f_clusterno == 0) {
-				/* Found empty item - use it (we assume this always occurs at the end of the items) */
-				create++;
-				ci->f_clusterno = first_cluster;
-				ci->f_index = clusternum;
-				ci->f_nextcluster = 0;
-				break;
-			}
-			if (ci->f_clusterno == first_cluster) {
-				if (ci->f_index == clusternum) {
-					/* Got it */
-					found++;
-					break;
-				}
-
-				/*
-				 * Cluster is fine, but index isn't. Attempt to use this item as a base;
-				 * the less items we'll have to walk through, the better.
-				 */
-				if (ci->f_index < clusternum && (ci_closest == NULL || ci->f_index > ci_closest->f_index))
-					ci_closest = ci;
-			}
-		}
-		/*
-		 * If we need to do a lookup, use the closest item as base; we do this
-		 * while holding the lock to ensure the item won't vanish.
-		 */
-		if (create && !found && ci_closest != NULL) {
-			cur_cluster = ci_closest->f_nextcluster;
-			clusternum -= ci_closest->f_index;
+	blocknr_t sector_num;
+	uint32_t offset;
+	fat_make_cluster_block_offset(fs, cluster, &sector_num, &offset);
+	if (*bio == NULL || (*bio)->block != sector_num * (fs->fs_block_size / BIO_SECTOR_SIZE)) {
+		if (*bio != NULL)
+			bio_free(*bio);
+		errorcode_t err = vfs_bread(fs, sector_num, bio);
+		if (err != ANANAS_ERROR_OK) {
+			*bio = NULL;
+			return err;
 		}
-		spinlock_unlock(&fs_privdata->spl_cache);
-
-		if (create == 0 && found == 0) {
-			/*
-			 * Out of cache items; we'll just throw away all cached clusters of this
-			 * item. If this doesn't work, we'll just overwrite the first item XXX
-			 */
-			if (fat_clear_cache(fs, first_cluster))
-				goto try_cache;
-			ci = &fs_privdata->cluster_cache[0];
-			ci->f_clusterno = first_cluster;
-			ci->f_index = clusternum;
-			ci->f_nextcluster = 0;
-			create++;
-			kprintf("fat_get_cluster(): sacrificed first cache block\n");
+	}
+
+	/* Grab the value from the FAT */
+	uint32_t val = 0;
+	switch (fs_privdata->fat_type) {
+		case 16:
+			val = FAT_FROM_LE16((char*)(BIO_DATA(*bio) + offset));
+			if (val >= 0xfff8)
+				val = 0;
+			break;
+		case 32: /* actually FAT-28... */
+			val = FAT_FROM_LE32((char*)(BIO_DATA(*bio) + offset)) & 0xfffffff;
+			if (val >= 0xffffff8)
+				val = 0;
+			break;
+	}
+	/* Free and reserved clusters do not belong in a chain; treat them as the end */
+	if (val < 2)
+		val = 0;
+	*next = val;
+	return ANANAS_ERROR_OK;
+}
+
+/* Adds the next cluster of the chain to the extents; extent map must be locked */
+static errorcode_t
+fat_extent_append_locked(struct FAT_INODE_PRIVDATA* privdata, uint32_t cluster)
+{
+	if (privdata->num_extents > 0) {
+		struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents - 1];
+		if (e->e_cluster + e->e_length == cluster) {
+			/* Consecutive on disk; just make the final extent longer */
+			e->e_length++;
+			privdata->num_mapped++;
+			return ANANAS_ERROR_OK;
 		}
 	}
 
-	/*
-	 * If we are not creating, yet the next cluster value is zero, someone else is
-	 * looking up the item, we need to spin.
-	 */
-	if (ci != NULL && create == 0) {
-		while (ci->f_nextcluster == 0) {
-			kprintf("fat_get_cluster(): pending cluster found, waiting...\n");
-			reschedule();
+	if (privdata->num_extents == privdata->max_extents) {
+		unsigned int new_max = (privdata->max_extents > 0) ? privdata->max_extents * 2 : FAT_NUM_EXTENTS_MIN;
+		struct FAT_EXTENT* new_extent = kmalloc(sizeof(struct FAT_EXTENT) * new_max);
+		if (new_extent == NULL)
+			return ANANAS_ERROR(OUT_OF_MEMORY);
+		if (privdata->extent != NULL) {
+			memcpy(new_extent, privdata->extent, sizeof(struct FAT_EXTENT) * privdata->num_extents);
+			kfree(privdata->extent);
 		}
-		if (ci->f_nextcluster == -1)
-			return ANANAS_ERROR(BAD_RANGE);
-		*cluster_out = ci->f_nextcluster;
-		return ANANAS_ERROR_NONE;
+		privdata->extent = new_extent;
+		privdata->max_extents = new_max;
 	}
 
-	/* Not in the cache; we'll need to traverse the disk */
-	*cluster_out = first_cluster;
-	while (cur_cluster != 0 && clusternum-- > 0) {
-		blocknr_t sector_num;
-		uint32_t offset;
-		fat_make_cluster_block_offset(fs, cur_cluster, &sector_num, &offset);
-		struct BIO* bio;
-		errorcode_t err = vfs_bread(fs, sector_num, &bio);
-		ANANAS_ERROR_RETURN(err);
+	struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents++];
+	e->e_index = privdata->num_mapped;
+	e->e_cluster = cluster;
+	e->e_length = 1;
+	privdata->num_mapped++;
+	return ANANAS_ERROR_OK;
+}
 
-		/* Grab the value from the FAT */
-		switch (fs_privdata->fat_type) {
-			case 16:
-				cur_cluster = FAT_FROM_LE16((char*)(BIO_DATA(bio) + offset));
-				if (cur_cluster >= 0xfff8)
-					cur_cluster = 0;
-				break;
-			case 32: /* actually FAT-28... */
-				cur_cluster = FAT_FROM_LE32((char*)(BIO_DATA(bio) + offset)) & 0xfffffff;
-				if (cur_cluster >= 0xffffff8)
-					cur_cluster = 0;
+/*
+ * Walks the FAT until the extents cover cluster 'clusternum' of the file, or
+ * the end of the chain is reached. Passing -1 as clusternum maps the entire
+ * chain. The extent map is not locked while the FAT is read; if it changed in
+ * the meantime, we just try again.
+ */
+static errorcode_t
+fat_extent_fill(struct VFS_INODE* inode, uint32_t clusternum)
+{
+	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	struct BIO* bio = NULL;
+	errorcode_t err = ANANAS_ERROR_OK;
+
+	mutex_lock(&privdata->extent_mtx);
+	while (!privdata->extent_complete && privdata->num_mapped <= clusternum) {
+		if (privdata->num_mapped == 0) {
+			/* Nothing mapped yet; the first cluster comes from the directory entry */
+			if (privdata->first_cluster == 0)
+				privdata->extent_complete = 1;
+			else
+				err = fat_extent_append_locked(privdata, privdata->first_cluster);
+			if (err != ANANAS_ERROR_OK)
 				break;
+			continue;
 		}
-		bio_free(bio);
-		if (cur_cluster != 0)
-			*cluster_out = cur_cluster;
+
+		struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents - 1];
+		uint32_t cluster = e->e_cluster + e->e_length - 1;
+		uint32_t num_mapped = privdata->num_mapped;
+		mutex_unlock(&privdata->extent_mtx);
+
+		uint32_t next;
+		err = fat_read_fat_entry(fs, cluster, &bio, &next);
+		mutex_lock(&privdata->extent_mtx);
+		if (err != ANANAS_ERROR_OK)
+			break;
+		if (privdata->num_mapped != num_mapped)
+			continue; /* someone else changed the extents */
+		if (next == 0)
+			privdata->extent_complete = 1;
+		else
+			err = fat_extent_append_locked(privdata, next);
+		if (err != ANANAS_ERROR_OK)
+			break;
 	}
-	if (cur_cluster != 0) {
-		if (ci != NULL)
-			ci->f_nextcluster = *cluster_out;
-		return ANANAS_ERROR_OK;
-	} else {
-		if (ci != NULL)
-			ci->f_nextcluster = -1;
+	mutex_unlock(&privdata->extent_mtx);
+	if (bio != NULL)
+		bio_free(bio);
+	return err;
+}
+
+/* Returns the final cluster covered by the extents, or 0 if there is none; extent map must be locked */
+static uint32_t
+fat_extent_last_locked(struct FAT_INODE_PRIVDATA* privdata)
+{
+	if (privdata->num_extents == 0)
+		return 0;
+	struct FAT_EXTENT* e = &privdata->extent[privdata->num_extents - 1];
+	return e->e_cluster + e->e_length - 1;
+}
+
+/*
+ * Throws away the extent map of an inode; it will be rebuilt from the FAT
+ * when needed. Extent map must be locked.
+ */
+static void
+fat_extent_clear_locked(struct FAT_INODE_PRIVDATA* privdata)
+{
+	if (privdata->extent != NULL)
+		kfree(privdata->extent);
+	privdata->extent = NULL;
+	privdata->num_extents = 0;
+	privdata->max_extents = 0;
+	privdata->num_mapped = 0;
+	privdata->extent_complete = 0;
+}
+
+/*
+ * Used to obtain the clusternum'th cluster of a file. Returns BAD_RANGE error
+ * if the chain ends before that.
+ */
+static errorcode_t
+fat_get_cluster(struct VFS_INODE* inode, uint32_t clusternum, uint32_t* cluster_out)
+{
+	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
+
+	errorcode_t err = fat_extent_fill(inode, clusternum);
+	ANANAS_ERROR_RETURN(err);
+
+	mutex_lock(&privdata->extent_mtx);
+	if (clusternum >= privdata->num_mapped) {
+		mutex_unlock(&privdata->extent_mtx);
 		return ANANAS_ERROR(BAD_RANGE);
 	}
+
+	/* The extents have no holes, so there must be one containing our cluster */
+	unsigned int lo = 0, hi = privdata->num_extents - 1;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi + 1) / 2;
+		if (privdata->extent[mid].e_index <= clusternum)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	struct FAT_EXTENT* e = &privdata->extent[lo];
+	KASSERT(clusternum >= e->e_index && clusternum < e->e_index + e->e_length, "extent %u does not contain cluster %u", lo, clusternum);
+	*cluster_out = e->e_cluster + (clusternum - e->e_index);
+	mutex_unlock(&privdata->extent_mtx);
+	return ANANAS_ERROR_OK;
 }
 
 /*
@@ -208,11 +274,14 @@ fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluste
 
 	bio_set_dirty(bio);
 
-	/* Sync all other FAT tables as well */
+	/*
+	 * Sync all other FAT tables as well; as we overwrite the entire sector,
+	 * there is no need to read it first.
+	 */
 	for (int i = 1; i < fs_privdata->num_fats; i++) {
 		sector_num += fs_privdata->num_fat_sectors;
 		struct BIO* bio2;
-		err = vfs_bread(fs, sector_num, &bio2);
+		err = vfs_bget(fs, sector_num, &bio2, BIO_READ_NODATA);
 		if (err != ANANAS_ERROR_NONE) {
 			/* XXX we should free the cluster */
 			bio_free(bio);
@@ -228,61 +297,183 @@ fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluste
 	return ANANAS_ERROR_OK;
 }
 
+static inline int
+fat_bitmap_test(const uint32_t* bitmap, uint32_t cluster)
+{
+	return (bitmap[cluster / 32] & (1U << (cluster % 32))) != 0;
+}
+
+static inline void
+fat_bitmap_set(uint32_t* bitmap, uint32_t cluster)
+{
+	bitmap[cluster / 32] |= 1U << (cluster % 32);
+}
+
+static inline void
+fat_bitmap_clear(uint32_t* bitmap, uint32_t cluster)
+{
+	bitmap[cluster / 32] &= ~(1U << (cluster % 32));
+}
+
 /*
- * Obtains the first available cluster and marks it as being used.
+ * Builds the bitmap of clusters in use by reading the entire FAT; this also
+ * tells us exactly how many clusters are available. Allocation lock must be
+ * held.
  */
 static errorcode_t
-fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t* cluster_out)
+fat_bitmap_build_locked(struct VFS_MOUNTED_FS* fs)
 {
 	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
 
-	/* XXX We do a dumb find-first on the filesystem for now */
-	blocknr_t cur_block = (blocknr_t)-1;
+	/* Clusters 0 and 1 are reserved, and anything beyond the final cluster is never available */
+	uint32_t num_clusters = fs_privdata->total_clusters + 2;
+	uint32_t num_words = (num_clusters + 31) / 32;
+	uint32_t* bitmap = kmalloc(sizeof(uint32_t) * num_words);
+	if (bitmap == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	memset(bitmap, 0, sizeof(uint32_t) * num_words);
+	fat_bitmap_set(bitmap, 0);
+	fat_bitmap_set(bitmap, 1);
+	for (uint32_t cluster = num_clusters; cluster < num_words * 32; cluster++)
+		fat_bitmap_set(bitmap, cluster);
+
+	blocknr_t fat_end = fs_privdata->reserved_sectors + fs_privdata->num_fat_sectors;
+	blocknr_t cur_block = (blocknr_t)-1, prefetch_block = 0;
 	struct BIO* bio = NULL;
-	for (uint32_t clusterno = fs_privdata->next_avail_cluster; clusterno < fs_privdata->total_clusters; clusterno++) {
-		/* Obtain the FAT block, if necessary */
-		uint32_t offset;
+	uint32_t num_avail = 0;
+	for (uint32_t cluster = 2; cluster < num_clusters; cluster++) {
+		/* Obtain the FAT block, if necessary; we read the FAT in large chunks */
 		blocknr_t want_block;
-		fat_make_cluster_block_offset(fs, clusterno, &want_block, &offset);
+		uint32_t offset;
+		fat_make_cluster_block_offset(fs, cluster, &want_block, &offset);
 		if (want_block != cur_block || bio == NULL) {
 			if (bio != NULL) bio_free(bio);
+			if (want_block >= prefetch_block && want_block < fat_end) {
+				unsigned int num = FAT_BITMAP_PREFETCH;
+				if (want_block + num > fat_end)
+					num = fat_end - want_block;
+				vfs_bprefetch(fs, want_block, num);
+				prefetch_block = want_block + num;
+			}
 			errorcode_t err = vfs_bread(fs, want_block, &bio);
-			ANANAS_ERROR_RETURN(err);
+			if (err != ANANAS_ERROR_OK) {
+				kfree(bitmap);
+				return err;
+			}
 			cur_block = want_block;
 		}
 
-		/* Obtain the cluster value */
-		uint32_t val = -1;
+		uint32_t val = 0;
 		switch (fs_privdata->fat_type) {
 			case 16:
 				val = FAT_FROM_LE16((char*)(BIO_DATA(bio) + offset));
-				if (val == 0) { /* available cluster? */
-					/* Yes; claim it */
-					FAT_TO_LE16((char*)(BIO_DATA(bio) + offset), 0xfff8);
-				}
 				break;
 			case 32: /* actually FAT-28... */
 				val = FAT_FROM_LE32((char*)(BIO_DATA(bio) + offset)) & 0xfffffff;
-				if (val == 0) { /* available cluster? */
-					/* Yes; claim it */
-					FAT_TO_LE32((char*)(BIO_DATA(bio) + offset), 0xffffff8);
-				}
 				break;
 		}
-		if (val != 0)
-			continue;
-
-		/* OK; this one is available (and we just claimed it) - flush the FAT entry */
-		bio_set_dirty(bio);
+		if (val == 0)
+			num_avail++;
+		else
+			fat_bitmap_set(bitmap, cluster);
+	}
+	if (bio != NULL)
 		bio_free(bio);
 
-		/* XXX should update second fat */
-		*cluster_out = clusterno;
-		return ANANAS_ERROR_NONE;
+	fs_privdata->free_bitmap = bitmap;
+	fs_privdata->num_avail_clusters = num_avail;
+	if (fs_privdata->next_avail_cluster < 2 || fs_privdata->next_avail_cluster >= num_clusters)
+		fs_privdata->next_avail_cluster = 2;
+	return ANANAS_ERROR_OK;
+}
+
+/* Finds the first available cluster in [first, last); returns non-zero if one was found */
+static int
+fat_bitmap_find(const uint32_t* bitmap, uint32_t first, uint32_t last, uint32_t* cluster_out)
+{
+	uint32_t cluster = first;
+	while (cluster < last) {
+		/* Skip words with all clusters in use; ignore the clusters before the one we want */
+		uint32_t word = bitmap[cluster / 32] | ((1U << (cluster % 32)) - 1);
+		if (word != 0xffffffff) {
+			cluster = (cluster & ~31) + __builtin_ctz(~word);
+			if (cluster >= last)
+				break;
+			*cluster_out = cluster;
+			return 1;
+		}
+		cluster = (cluster & ~31) + 32;
 	}
+	return 0;
+}
 
-	/* Out of available clusters */
-	return ANANAS_ERROR(NO_SPACE);
+/*
+ * Marks 'num' clusters starting at 'first' as available; the FAT must already
+ * have been updated.
+ */
+static void
+fat_release_clusters(struct VFS_MOUNTED_FS* fs, uint32_t first, uint32_t num)
+{
+	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
+
+	mutex_lock(&fs_privdata->alloc_mtx);
+	if (fs_privdata->free_bitmap != NULL) {
+		for (uint32_t n = 0; n < num; n++) {
+			KASSERT(fat_bitmap_test(fs_privdata->free_bitmap, first + n), "releasing available cluster %u", first + n);
+			fat_bitmap_clear(fs_privdata->free_bitmap, first + n);
+		}
+	}
+	if (fs_privdata->num_avail_clusters != (uint32_t)-1)
+		fs_privdata->num_avail_clusters += num;
+	mutex_unlock(&fs_privdata->alloc_mtx);
+}
+
+/*
+ * Obtains an available cluster and marks it as the end of a chain. We try
+ * 'hint' first and the clusters following it; this keeps the clusters of a
+ * file together. If 'hint' is zero, we continue where the last allocation
+ * left off.
+ */
+static errorcode_t
+fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t hint, uint32_t* cluster_out)
+{
+	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
+	uint32_t num_clusters = fs_privdata->total_clusters + 2;
+
+	mutex_lock(&fs_privdata->alloc_mtx);
+	if (fs_privdata->free_bitmap == NULL) {
+		errorcode_t err = fat_bitmap_build_locked(fs);
+		if (err != ANANAS_ERROR_OK) {
+			mutex_unlock(&fs_privdata->alloc_mtx);
+			return err;
+		}
+	}
+
+	if (hint < 2 || hint >= num_clusters)
+		hint = fs_privdata->next_avail_cluster;
+	uint32_t cluster;
+	if (!fat_bitmap_find(fs_privdata->free_bitmap, hint, num_clusters, &cluster) &&
+	    !fat_bitmap_find(fs_privdata->free_bitmap, 2, hint, &cluster)) {
+		/* Out of available clusters */
+		mutex_unlock(&fs_privdata->alloc_mtx);
+		return ANANAS_ERROR(NO_SPACE);
+	}
+	fat_bitmap_set(fs_privdata->free_bitmap, cluster);
+	fs_privdata->num_avail_clusters--;
+	fs_privdata->next_avail_cluster = (cluster + 1 < num_clusters) ? cluster + 1 : 2;
+	mutex_unlock(&fs_privdata->alloc_mtx);
+
+	/*
+	 * Mark the cluster as the end of the chain; this only dirties the FAT
+	 * buffers, which are written back together later on.
+	 */
+	errorcode_t err = fat_set_cluster(fs, cluster, (fs_privdata->fat_type == 16) ? 0xfff8 : 0xffffff8);
+	if (err != ANANAS_ERROR_OK) {
+		fat_release_clusters(fs, cluster, 1);
+		return err;
+	}
+	*cluster_out = cluster;
+	return ANANAS_ERROR_NONE;
 }
 
 /*
@@ -295,55 +486,65 @@ fat_append_cluster(struct VFS_INODE* inode, uint32_t* cluster_out)
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
 	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
 
+	/* We need the last cluster of the file; the extents know it once they are complete */
+	mutex_lock(&privdata->chain_mtx);
+	errorcode_t err = fat_extent_fill(inode, (uint32_t)-1);
+	if (err != ANANAS_ERROR_OK) {
+		mutex_unlock(&privdata->chain_mtx);
+		return err;
+	}
+	mutex_lock(&privdata->extent_mtx);
+	uint32_t last_cluster = fat_extent_last_locked(privdata);
+	mutex_unlock(&privdata->extent_mtx);
+
 	/*
-	 * Figure out the last cluster of the file; we cache this per inode as we don't
-	 * want to clutter the cluster-cache with it (these entries need to be updated
-	 * if we append a cluster)
+	 * Obtain the next cluster - this will also mark it as being in use. We'd
+	 * like it to follow the current final cluster, so that the file stays
+	 * contiguous.
 	 */
-	uint32_t last_cluster = privdata->last_cluster;
-	if (last_cluster == 0) {
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, (uint32_t)-1, &last_cluster);
-		if (ANANAS_ERROR_CODE(err) != ANANAS_ERROR_BAD_RANGE) {
-			KASSERT(err != ANANAS_ERROR_OK, "able to obtain impossible cluster");
+	uint32_t new_cluster = 0;
+	err = fat_claim_avail_cluster(fs, (last_cluster != 0) ? last_cluster + 1 : 0, &new_cluster);
+	if (err != ANANAS_ERROR_OK) {
+		mutex_unlock(&privdata->chain_mtx);
+		return err;
+	}
+
+	/* Append this cluster to the file chain, if there is one */
+	if (last_cluster != 0) {
+		err = fat_set_cluster(fs, last_cluster, new_cluster);
+		if (err != ANANAS_ERROR_OK) {
+			mutex_unlock(&privdata->chain_mtx);
+			fat_set_cluster(fs, new_cluster, 0);
+			fat_release_clusters(fs, new_cluster, 1);
 			return err;
 		}
-		privdata->last_cluster = last_cluster;
 	}
 
-	/* Obtain the next cluster - this will also mark it as being in use */
-	uint32_t new_cluster = 0;
-	errorcode_t err = fat_claim_avail_cluster(fs, &new_cluster);
-	ANANAS_ERROR_RETURN(err);
-
-	/* If the file didn't have any clusters before, it sure does now */
-	if (privdata->first_cluster == 0) {
+	/*
+	 * Keep the extents in sync; a lookup may have raced with us, in which case
+	 * (or if we run out of memory) they will be read from the FAT again.
+	 */
+	mutex_lock(&privdata->extent_mtx);
+	int new_file = privdata->first_cluster == 0;
+	if (new_file)
 		privdata->first_cluster = new_cluster;
-		vfs_set_inode_dirty(inode);
-	} else {
-		/* Append this cluster to the file chain */
-		err = fat_set_cluster(fs, last_cluster, new_cluster);
-		ANANAS_ERROR_RETURN(err); /* XXX leaks clusterno */
-	}
+	if (!privdata->extent_complete || fat_extent_last_locked(privdata) != last_cluster ||
+	    fat_extent_append_locked(privdata, new_cluster) != ANANAS_ERROR_OK)
+		fat_extent_clear_locked(privdata);
+	mutex_unlock(&privdata->extent_mtx);
+	mutex_unlock(&privdata->chain_mtx);
 	*cluster_out = new_cluster;
 
 	/*
-	 * Update the cache; if there is an entry for our inode which is marked as
-	 * nonexistent, we expect it to be the last one and overwrite it.
+	 * If the file didn't have any clusters before, it sure does now; note that
+	 * this writes the inode, so we mustn't hold any of our locks. An unlinked
+	 * file has no directory entry to update, and writing it would free the
+	 * cluster we just handed out.
 	 */
-	spinlock_lock(&fs_privdata->spl_cache);
-	for(int cache_item = 0; cache_item < FAT_NUM_CACHEITEMS; cache_item++) {
-		struct FAT_CLUSTER_CACHEITEM* ci = &fs_privdata->cluster_cache[cache_item];
-		if (ci->f_clusterno == privdata->first_cluster && ci->f_nextcluster == -1) {
-			/* Found empty item - use it (we assume this always occurs at the end of the items) */
-			KASSERT(ci->f_index == (inode->i_sb.st_size + ((fs_privdata->sector_size * fs_privdata->sectors_per_cluster) - 1)) / (fs_privdata->sector_size * fs_privdata->sectors_per_cluster), "empty cache item isn't final item?");
-			ci->f_nextcluster = new_cluster;
-			break;
-		}
-	}
-	spinlock_unlock(&fs_privdata->spl_cache);
+	if (new_file && inode->i_sb.st_nlink > 0)
+		vfs_set_inode_dirty(inode);
 
 	/* Update the block count of the inode */
-	privdata->last_cluster = new_cluster;
 	inode->i_sb.st_blocks += fs_privdata->sectors_per_cluster;
 	return ANANAS_ERROR_OK;
 }
@@ -353,38 +554,43 @@ fat_truncate_clusterchain(struct VFS_INODE* inode)
 {
 	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
 	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
 
 	/*
-	 * We need to free the clusters in reverse order: if we do it sequentially,
-	 * we won't be able to find the next one as we broke the chain...
+	 * Map the entire chain before freeing anything; once we start, the chain
+	 * is broken and we won't be able to find the next cluster anymore. We take
+	 * the extents away from the inode, so that we can free the clusters without
+	 * holding the extent lock.
 	 */
-	unsigned int bytes_per_cluster = fs_privdata->sector_size * fs_privdata->sectors_per_cluster;
-	int num_clusters = (inode->i_sb.st_size + bytes_per_cluster - 1) / bytes_per_cluster;
-
-	errorcode_t err = ANANAS_ERROR_OK;
-	uint32_t cluster = 0;
-	for (int num = num_clusters - 1; num >= 0; num--) {
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, num, &cluster);
-		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE)
-			break; /* end of the run */
-		ANANAS_ERROR_RETURN(err); /* anything else is bad */
-
-		/*
-		 * Throw away this cluster; note that fat_set_cluster() will not update the
-		 * cluster map, which is fine as we'll just flush the cache soon.
-		 */
-		err = fat_set_cluster(fs, cluster, 0);
-		if (err != ANANAS_ERROR_OK)
-			break;
+	mutex_lock(&privdata->chain_mtx);
+	errorcode_t err = fat_extent_fill(inode, (uint32_t)-1);
+	mutex_lock(&privdata->extent_mtx);
+	struct FAT_EXTENT* extent = privdata->extent;
+	unsigned int num_extents = privdata->num_extents;
+	privdata->extent = NULL;
+	fat_extent_clear_locked(privdata);
+	/* The file no longer has a chain; a second truncate must not free it again */
+	privdata->first_cluster = 0;
+	inode->i_sb.st_blocks = 0;
+	mutex_unlock(&privdata->extent_mtx);
+
+	for (unsigned int n = 0; err == ANANAS_ERROR_OK && n < num_extents; n++) {
+		struct FAT_EXTENT* e = &extent[n];
+		uint32_t i;
+		for (i = 0; i < e->e_length; i++) {
+			err = fat_set_cluster(fs, e->e_cluster + i, 0);
+			if (err != ANANAS_ERROR_OK)
+				break;
+		}
+		fat_release_clusters(fs, e->e_cluster, i);
 	}
+	mutex_unlock(&privdata->chain_mtx);
 
 	/*
-	 * Throw away the cluster map of this inode - we clean up everything even in
+	 * Throw away the extents of this inode - we clean up everything even in
 	 * case of an error as it won't hurt to do so (and we expect little failure)
 	 */
-	if (privdata->first_cluster > 0)
-		fat_clear_cache(fs, privdata->first_cluster);
+	if (extent != NULL)
+		kfree(extent);
 	return err;
 }
 
@@ -413,7 +619,7 @@ fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out,
 			return ANANAS_ERROR(BAD_RANGE);
 	} else {
 		uint32_t cluster;
-		errorcode_t err = fat_get_cluster(fs, privdata->first_cluster, block_in / fs_privdata->sectors_per_cluster, &cluster);
+		errorcode_t err = fat_get_cluster(inode, block_in / fs_privdata->sectors_per_cluster, &cluster);
 		if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_BAD_RANGE) {
 			/* end of the chain */
 			if (!create) {
@@ -435,58 +641,26 @@ fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out,
 	return ANANAS_ERROR_OK;
 }
 
-int
-fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster)
+void
+fat_clear_extents(struct VFS_INODE* inode)
 {
-	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
-
-	/*
-	 * Throw away al inode's cluster items; this works by searching for the last
-	 * item in the cluster cache and copying it over our removed blocks - this
-	 * works because the cache isn't sorted.
-	 */
-	spinlock_lock(&fs_privdata->spl_cache);
-	unsigned int last_index = 0;
-	while (last_index < FAT_NUM_CACHEITEMS && fs_privdata->cluster_cache[last_index].f_clusterno != 0)
-		last_index++;
-	/* Cacheitems 0 ... i, for all i < last_index are in use */
-
-	/* Throw away all inode's cluster items in the cache */
-	int num_removed = 0;
-	struct FAT_CLUSTER_CACHEITEM* ci = fs_privdata->cluster_cache;
-	for(unsigned int n = 0; n < FAT_NUM_CACHEITEMS; n++, ci++) {
-		if (ci->f_clusterno != first_cluster)
-			continue;
+	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
 
-		/*
-		 * OK, this is an item we'll have to destroy - copy the last entry over it and remove that one.
-		 * If this is the final entry, we skip the copying.
-			*/
-		KASSERT(last_index >= 0 && last_index <= FAT_NUM_CACHEITEMS, "last index %u invalid", last_index);
-		KASSERT(n <= last_index, "item to remove %u is beyond last index %i", n, last_index);
-		if (n != (last_index - 1)) {
-			/* Need to overwrite this item with the final cache item */
-			memcpy(ci, &fs_privdata->cluster_cache[last_index - 1], sizeof(*ci));
-			memset(&fs_privdata->cluster_cache[last_index - 1], 0, sizeof(*ci));
-			last_index--;
-		} else {
-			memset(ci, 0, sizeof(*ci));
-		}
-		num_removed++;
-	}
-	spinlock_unlock(&fs_privdata->spl_cache);
-	return num_removed;
+	mutex_lock(&privdata->extent_mtx);
+	fat_extent_clear_locked(privdata);
+	mutex_unlock(&privdata->extent_mtx);
 }
 
 void
-fat_dump_cache(struct VFS_MOUNTED_FS* fs)
+fat_dump_extents(struct VFS_INODE* inode)
 {
-	struct FAT_FS_PRIVDATA* fs_privdata = fs->fs_privdata;
-	struct FAT_CLUSTER_CACHEITEM* ci = fs_privdata->cluster_cache;
-	for(unsigned int n = 0; n < FAT_NUM_CACHEITEMS; n++, ci++) {
-		kprintf("ci[%i]: clusterno=%i, index=%i, nextcl=%u\n",
-		 n, ci->f_clusterno, ci->f_index, ci->f_nextcluster);
+	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
+	for(unsigned int n = 0; n < privdata->num_extents; n++) {
+		struct FAT_EXTENT* e = &privdata->extent[n];
+		kprintf("extent[%u]: index=%u, cluster=%u, length=%u\n",
+		 n, e->e_index, e->e_cluster, e->e_length);
 	}
+	kprintf("%u cluster(s) mapped, %s\n", privdata->num_mapped, privdata->extent_complete ? "complete" : "incomplete");
 }
 
 errorcode_t
@@ -6,8 +6,8 @@
 struct VFS_INODE;
 
 errorcode_t fat_block_map(struct VFS_INODE* inode, blocknr_t block_in, blocknr_t* block_out, int create);
-void fat_dump_cache(struct VFS_MOUNTED_FS* fs);
-int fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster);
+void fat_dump_extents(struct VFS_INODE* inode);
+void fat_clear_extents(struct VFS_INODE* inode);
 errorcode_t fat_truncate_clusterchain(struct VFS_INODE* inode);
 errorcode_t fat_update_infosector(struct VFS_MOUNTED_FS* fs);
 
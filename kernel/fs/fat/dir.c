@@ -6,6 +6,7 @@
 #include <ananas/lib.h>
 #include <ananas/vfs/types.h>
 #include <ananas/vfs/core.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
 #include <fat.h>
 #include "block.h"
@@ -556,8 +557,13 @@ fat_rename(struct VFS_INODE* old_dir, struct DENTRY* old_dentry, struct VFS_INOD
 	 * Copy the inode information over; the old inode will soon go XXX we should copy more
 	 */
 	struct VFS_INODE* old_inode = old_dentry->d_inode;
+	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
+	struct FAT_INODE_PRIVDATA* old_privdata = old_inode->i_privdata;
 	inode->i_sb.st_size = old_inode->i_sb.st_size;
-	memcpy(inode->i_privdata, old_inode->i_privdata, sizeof(struct FAT_INODE_PRIVDATA));
+	privdata->root_inode = old_privdata->root_inode;
+	privdata->first_cluster = old_privdata->first_cluster;
+	/* The extents belong to the old inode; ours are rebuilt from the FAT when needed */
+	fat_clear_extents(inode);
 	vfs_set_inode_dirty(inode);
 
 	/*
@@ -571,7 +577,7 @@ fat_rename(struct VFS_INODE* old_dir, struct DENTRY* old_dentry, struct VFS_INOD
 
 struct VFS_INODE_OPS fat_dir_ops = {
 	.readdir = fat_readdir,
-	.lookup = vfs_generic_lookup,
+	.lookup = vfs_dirindex_lookup,
 	.create = fat_create,
 	.unlink = fat_unlink,
 	.rename = fat_rename,
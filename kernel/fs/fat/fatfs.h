@@ -2,6 +2,7 @@
 #define __FATFS_H__
 
 #include <ananas/types.h>
+#include <ananas/lock.h>
 
 /*
  * Used to uniquely identify a FAT16 root inode; it appears on a
@@ -29,13 +30,15 @@
 		((uint8_t*)(x))[3] = ((y) >> 24) & 0xff; \
 	} while(0)
 
-/* Number of cache items per filesystem */
-#define FAT_NUM_CACHEITEMS	1000
-
-struct FAT_CLUSTER_CACHEITEM {
-	uint32_t	f_clusterno;
-	uint32_t	f_index;
-	uint32_t	f_nextcluster;
+/*
+ * A run of clusters of a file which are consecutive on disk; every inode
+ * keeps a list of these, sorted by index, so that mapping a block does not
+ * have to walk the FAT.
+ */
+struct FAT_EXTENT {
+	uint32_t	e_index;		/* Index of the first cluster within the file */
+	uint32_t	e_cluster;		/* First cluster on disk */
+	uint32_t	e_length;		/* Number of clusters */
 };
 
 struct FAT_FS_PRIVDATA {
@@ -49,17 +52,23 @@ struct FAT_FS_PRIVDATA {
 	uint32_t first_rootdir_sector;		/* First sector containing root dir */
 	uint32_t first_data_sector;		/* First sector containing file data */
 	uint32_t total_clusters;		/* Total number of clusters on filesystem */
+	uint32_t infosector_num;		/* Info sector, or 0 if not present */
+	mutex_t  alloc_mtx;			/* Protects the fields below */
 	uint32_t next_avail_cluster;		/* Next available cluster */
 	uint32_t num_avail_clusters;		/* Number of available clusters */
-	uint32_t infosector_num;		/* Info sector, or 0 if not present */
-	spinlock_t spl_cache;
-	struct FAT_CLUSTER_CACHEITEM cluster_cache[FAT_NUM_CACHEITEMS];
+	uint32_t* free_bitmap;			/* Bit per cluster, set if in use; NULL if not yet read */
 };
 
 struct FAT_INODE_PRIVDATA {
 	int      root_inode;
 	uint32_t first_cluster;
-	uint32_t last_cluster;
+	mutex_t  chain_mtx;			/* Serializes changes to the cluster chain */
+	mutex_t  extent_mtx;			/* Protects the extent map and first_cluster */
+	struct FAT_EXTENT* extent;		/* Extents, sorted by index */
+	unsigned int num_extents;		/* Number of extents in use */
+	unsigned int max_extents;		/* Number of extents allocated */
+	uint32_t num_mapped;			/* Number of clusters covered by the extents */
+	int      extent_complete;		/* Extents cover the entire chain */
 };
 
 #endif /* __FATFS_H__ */
@@ -19,22 +19,19 @@ fat_alloc_inode(struct VFS_MOUNTED_FS* fs, const void* fsop)
 	struct VFS_INODE* inode = vfs_make_inode(fs, fsop);
 	if (inode == NULL)
 		return NULL;
-	inode->i_privdata = kmalloc(sizeof(struct FAT_INODE_PRIVDATA));
-	memset(inode->i_privdata, 0, sizeof(struct FAT_INODE_PRIVDATA));
+	struct FAT_INODE_PRIVDATA* privdata = kmalloc(sizeof(struct FAT_INODE_PRIVDATA));
+	memset(privdata, 0, sizeof(struct FAT_INODE_PRIVDATA));
+	mutex_init(&privdata->chain_mtx, "fatchain");
+	mutex_init(&privdata->extent_mtx, "fatextent");
+	inode->i_privdata = privdata;
 	return inode;
 }
 
 void
 fat_destroy_inode(struct VFS_INODE* inode)
 {
-	struct FAT_INODE_PRIVDATA* privdata = inode->i_privdata;
-
-	/*
-	 * If the file has backing storage, we need to throw away all inode's cluster
-	 * items in the cache.
-	 */
-	if (privdata->first_cluster != 0)
-		fat_clear_cache(inode->i_fs, privdata->first_cluster);
+	/* Throw away the inode's extents, if we have any */
+	fat_clear_extents(inode);
 
 	kfree(inode->i_privdata);
 	vfs_destroy_inode(inode);
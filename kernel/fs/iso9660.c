@@ -11,6 +11,7 @@
 #include <ananas/bio.h>
 #include <ananas/error.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
 #include <ananas/init.h>
@@ -288,7 +289,7 @@ iso9660_read(struct VFS_FILE* file, void* buf, size_t* len)
 
 static struct VFS_INODE_OPS iso9660_dir_ops = {
 	.readdir = iso9660_readdir,
-	.lookup = vfs_generic_lookup 
+	.lookup = vfs_dirindex_lookup
 };
 
 static struct VFS_INODE_OPS iso9660_file_ops = {
@@ -4,74 +4,392 @@
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
 #include <ananas/lock.h>
+#include <ananas/kmem.h>
+#include <ananas/page.h>
 #include <ananas/pcpu.h>
 #include <ananas/schedule.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
+#include <ananas/vm.h>
 #include "options.h"
 
 TRACE_SETUP;
 
-DQUEUE_DEFINE_BEGIN(BIO_BUCKET, struct BIO)
-	spinlock_t spl_bucket;
-DQUEUE_DEFINE_END
+/*
+ * The buffer cache keeps recently used blocks in memory. Cached buffers are
+ * located using a hash table on (device, block) which is resized as the
+ * number of buffers changes; buckets are protected by a fixed set of lock
+ * stripes, so lookups of different blocks rarely contend.
+ *
+ * Buffer data is allocated from pages which are added to the cache as
+ * needed; the number of pages the cache may use is derived from the amount of
+ * available memory and re-evaluated regularly. Every page is managed as a
+ * buddy system of sector-sized blocks, with a free list per block size, so
+ * that allocating and freeing data never needs to scan. Once the cache has reached its
+ * size, buffers are evicted using the CLOCK algorithm: a hit merely marks the
+ * buffer as referenced, and the clock hand gives referenced buffers a second
+ * chance before evicting them.
+ *
+ * Dirty buffers are written back by the syncer thread, which keeps them on a
+ * list sorted by device and block so that runs of adjacent blocks can be
+ * written using a single request. Buffers are written once they have been
+ * dirty for a while, or when too much of the cache is dirty.
+ */
+
+/* Number of lock stripes protecting the hash buckets; must be a power of two */
+#define BIO_HASH_LOCKS		64
+
+/* Minimum and maximum number of hash buckets; must be powers of two */
+#define BIO_HASH_MIN		BIO_HASH_LOCKS
+#define BIO_HASH_MAX		65536
+
+/* Average number of buffers per bucket before the hash table is grown */
+#define BIO_HASH_LOAD		2
+
+/* Bounds on the number of data pages in the cache */
+#define BIO_MIN_DATA_PAGES	128
+#define BIO_MAX_DATA_PAGES	65536
+
+/* The cache may use 1 / BIO_MEMORY_FRACTION of available memory */
+#define BIO_MEMORY_FRACTION	8
+
+/* Number of cache misses after which the cache size is re-evaluated */
+#define BIO_RESIZE_INTERVAL	64
+
+/* Maximum number of buffers evicted at once when the cache must shrink */
+#define BIO_SHRINK_MAX		64
+
+#define BIO_SECTORS_PER_PAGE	(PAGE_SIZE / BIO_SECTOR_SIZE)
+
+/* Interval at which the syncer looks for old dirty buffers, in ms */
+#define BIO_SYNCER_INTERVAL	1000
+
+/* Maximum time to wait for buffer data to be freed when out of memory, in ms */
+#define BIO_DATA_WAIT		100
+
+/* Time after which a dirty buffer is written, in seconds */
+#define BIO_DIRTY_AGE		5
+
+/* Percentage of cached buffers which may be dirty before the syncer is kicked */
+#define BIO_DIRTY_RATIO		10
+
+/* Minimum number of dirty buffers before the ratio is considered */
+#define BIO_DIRTY_MIN		32
+
+/* Maximum length of a single request issued by the syncer or bio_prefetch() */
+#define BIO_CLUSTER_MAX		(128 * 1024)
+
+/* Largest data block order; a block of this order spans an entire page */
+#define BIO_DATA_MAX_ORDER	3
+
+DQUEUE_DEFINE(BIO_BUCKET, struct BIO);
 DQUEUE_DEFINE(BIO_CHAIN, struct BIO);
+DQUEUE_DEFINE(BIO_DIRTY_LIST, struct BIO);
 
-static struct BIO_CHAIN bio_freelist;
-static struct BIO_CHAIN bio_usedlist;
-static struct BIO_BUCKET bio_bucket[BIO_BUCKET_SIZE];
-static unsigned int bio_bitmap_size;
-static uint8_t* bio_bitmap = NULL;
-static uint8_t* bio_data = NULL;
+/* A page used to hold buffer data */
+struct BIO_DATA_PAGE {
+	void*		dp_data;
+	struct PAGE*	dp_page;
+	/* For every sector: 1 + order of the free block starting there, or 0 */
+	uint8_t		dp_free[BIO_SECTORS_PER_PAGE];
+};
+
+/* Free data block; this is stored in the free block itself */
+struct BIO_DATA_FREE {
+	struct BIO_DATA_PAGE*	df_page;
+	DQUEUE_FIELDS(struct BIO_DATA_FREE);
+};
+DQUEUE_DEFINE(BIO_DATA_FREE_LIST, struct BIO_DATA_FREE);
+
+/* A read of several adjacent buffers using a single request */
+struct BIO_CLUSTER {
+	struct BIO		cl_bio;
+	unsigned int		cl_num_bios;
+	struct BIO*		cl_bios[BIO_MAX_VECS];
+	struct BIO_VEC		cl_vec[BIO_MAX_VECS];
+	struct BIO_COMPLETION	cl_completion;
+	struct BIO_CLUSTER*	cl_next;	/* on bio_cluster_reap_list */
+};
 
+static KMEM_CACHE_DEFINE(bio_cache, "bio", sizeof(struct BIO), NULL);
+static KMEM_CACHE_DEFINE(bio_cluster_cache, "bio_cluster", sizeof(struct BIO_CLUSTER), NULL);
+
+/* Hash table; protected by all of the lock stripes */
+static struct BIO_BUCKET* bio_hash;
+static unsigned int bio_hash_size;
+static spinlock_t spl_bio_hash[BIO_HASH_LOCKS];
+
+/* Clock ring of cached buffers and the freelist; protected by spl_bio_lists */
+static struct BIO_CHAIN bio_clock;
+static struct BIO_CHAIN bio_freelist;
+static unsigned int bio_num_cached;
+static unsigned int bio_num_buffers;
 static spinlock_t spl_bio_lists;
-static spinlock_t spl_bio_bitmap;
 
+/* Data pages; protected by spl_bio_data */
+static struct BIO_DATA_FREE_LIST bio_data_free_list[BIO_DATA_MAX_ORDER + 1];
+static unsigned int bio_data_num_free[BIO_DATA_MAX_ORDER + 1];
+static unsigned int bio_num_data_pages;
+static unsigned int bio_target_data_pages;
+static unsigned int bio_data_waiters;
+static spinlock_t spl_bio_data;
+static semaphore_t bio_data_sem; /* signalled when data is freed and there are waiters */
+
+/* Dirty buffers, sorted by device and block; protected by spl_bio_dirty */
+static struct BIO_DIRTY_LIST bio_dirty;
+static unsigned int bio_num_dirty;
+static spinlock_t spl_bio_dirty;
+
+/* Syncer thread; mtx_bio_sync serializes writing back dirty buffers */
+static thread_t bio_syncer_thread;
+static semaphore_t bio_syncer_sem;
+static mutex_t mtx_bio_sync;
+static struct BIO_VEC bio_sync_vec[BIO_MAX_VECS]; /* protected by mtx_bio_sync */
+
+/* Protects the completion lists of all buffers; may be taken from interrupt context */
+static spinlock_t spl_bio_completion;
+
+/*
+ * Clusters whose read is done; they complete in interrupt context, where we
+ * cannot free them, so they wait here. Protected by spl_bio_completion.
+ */
+static struct BIO_CLUSTER* bio_cluster_reap_list;
+
+static struct BIO_STATS bio_stats;
+
+static inline uint32_t
+bio_hash_value(device_t dev, blocknr_t block)
+{
+	uint32_t h = (uint32_t)block ^ (uint32_t)(block >> 32) ^ (uint32_t)((addr_t)dev >> 4);
+	return h * 0x9e3779b1;
+}
+
+static inline spinlock_t*
+bio_hash_lock(device_t dev, blocknr_t block)
+{
+	return &spl_bio_hash[(bio_hash_value(dev, block) >> 16) & (BIO_HASH_LOCKS - 1)];
+}
+
+/* Returns the bucket of a block; must be called with the block's stripe locked */
+static inline struct BIO_BUCKET*
+bio_hash_bucket(device_t dev, blocknr_t block)
+{
+	uint32_t h = bio_hash_value(dev, block) >> 16;
+	/* Bucket n is always protected by stripe n % BIO_HASH_LOCKS */
+	return &bio_hash[h & (bio_hash_size - 1)];
+}
+
+/* Locks every stripe, which gives exclusive access to the hash table */
+static void
+bio_hash_lock_all()
+{
+	for (unsigned int n = 0; n < BIO_HASH_LOCKS; n++)
+		spinlock_lock(&spl_bio_hash[n]);
+}
+
+static void
+bio_hash_unlock_all()
+{
+	for (int n = BIO_HASH_LOCKS - 1; n >= 0; n--)
+		spinlock_unlock(&spl_bio_hash[n]);
+}
+
+/* Resizes the hash table to the size appropriate for the number of cached buffers */
+static void
+bio_hash_resize()
+{
+	unsigned int size = BIO_HASH_MIN;
+	while (size < BIO_HASH_MAX && size * BIO_HASH_LOAD < bio_num_cached)
+		size *= 2;
+	if (size == bio_hash_size)
+		return;
+
+	/* Allocate the new table without any locks held; if we can't, the old one will do */
+	struct BIO_BUCKET* new_hash = kmalloc(sizeof(struct BIO_BUCKET) * size);
+	if (new_hash == NULL)
+		return;
+	for (unsigned int n = 0; n < size; n++)
+		DQUEUE_INIT(&new_hash[n]);
+
+	bio_hash_lock_all();
+	struct BIO_BUCKET* old_hash = bio_hash;
+	unsigned int old_size = bio_hash_size;
+	bio_hash = new_hash;
+	bio_hash_size = size;
+	for (unsigned int n = 0; n < old_size; n++) {
+		while (!DQUEUE_EMPTY(&old_hash[n])) {
+			struct BIO* bio = DQUEUE_HEAD(&old_hash[n]);
+			DQUEUE_POP_HEAD_IP(&old_hash[n], bucket);
+			DQUEUE_ADD_TAIL_IP(bio_hash_bucket(bio->device, bio->block), bucket, bio);
+		}
+	}
+	bio_stats.bs_rehashes++;
+	bio_hash_unlock_all();
+
+	kfree(old_hash);
+}
+
+/* Returns the smallest block order which can hold 'len' bytes */
+static inline unsigned int
+bio_data_order(size_t len)
+{
+	unsigned int order = 0;
+	while ((BIO_SECTOR_SIZE << order) < len)
+		order++;
+	return order;
+}
+
+/* Places a block on the free lists; must be called with spl_bio_data held */
+static inline void
+bio_data_push(struct BIO_DATA_PAGE* dp, unsigned int sector, unsigned int order)
+{
+	struct BIO_DATA_FREE* df = (struct BIO_DATA_FREE*)((char*)dp->dp_data + sector * BIO_SECTOR_SIZE);
+	df->df_page = dp;
+	dp->dp_free[sector] = order + 1;
+	DQUEUE_ADD_TAIL(&bio_data_free_list[order], df);
+	bio_data_num_free[order]++;
+}
+
+/* Removes a block from the free lists; must be called with spl_bio_data held */
+static inline void
+bio_data_unlink(struct BIO_DATA_FREE* df, unsigned int sector, unsigned int order)
+{
+	df->df_page->dp_free[sector] = 0;
+	DQUEUE_REMOVE(&bio_data_free_list[order], df);
+	bio_data_num_free[order]--;
+}
+
+/* Adds a fresh page to the data pool */
 static errorcode_t
-bio_init()
+bio_data_grow()
 {
-	/*
-	 * Allocate the BIO data buffers. Note that we allocate a BIO_SECTOR_SIZE - 1
-	 * more than needed if necessary - this is because we want to keep the data
-	 * bitmap at the beginning to prevent it from being messed with by faulty
-	 * drivers; and this will ensure it to be adequately aligned as a nice bonus.
-	 */
-	bio_bitmap_size = ((BIO_DATA_SIZE / BIO_SECTOR_SIZE) + 7) / 8; /* in bytes */
-	int bio_bitmap_slack = 0;
-	if ((bio_bitmap_size & (BIO_SECTOR_SIZE - 1)) > 0)
-		bio_bitmap_slack = BIO_SECTOR_SIZE - (bio_bitmap_size % BIO_SECTOR_SIZE);
-	bio_bitmap = kmalloc(BIO_DATA_SIZE + bio_bitmap_size + bio_bitmap_slack);
-	bio_data = bio_bitmap + bio_bitmap_size + bio_bitmap_slack;
+	struct BIO_DATA_PAGE* dp = kmalloc(sizeof(*dp));
+	if (dp == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	dp->dp_data = page_alloc_single_mapped(&dp->dp_page, VM_FLAG_READ | VM_FLAG_WRITE);
+	if (dp->dp_data == NULL) {
+		if (dp->dp_page != NULL)
+			page_free(dp->dp_page);
+		kfree(dp);
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	memset(dp->dp_free, 0, sizeof(dp->dp_free));
+
+	spinlock_lock(&spl_bio_data);
+	bio_data_push(dp, 0, BIO_DATA_MAX_ORDER);
+	bio_num_data_pages++;
+	bio_stats.bs_pages_added++;
+	spinlock_unlock(&spl_bio_data);
+	return ANANAS_ERROR_OK;
+}
+
+static void
+bio_data_release(struct BIO_DATA_PAGE* dp)
+{
+	kmem_unmap(dp->dp_data, PAGE_SIZE);
+	page_free(dp->dp_page);
+	kfree(dp);
+}
+
+/*
+ * Attempts to allocate 'len' bytes of buffer data; returns zero if there is
+ * no space available.
+ */
+static int
+bio_data_alloc(struct BIO* bio, size_t len)
+{
+	unsigned int order = bio_data_order(len);
 
-	/* Clear the BIO bucket chain */
-	for (unsigned int i = 0; i < BIO_BUCKET_SIZE; i++) {
-		DQUEUE_INIT(&bio_bucket[i]);
-		spinlock_init(&bio_bucket[i].spl_bucket);
+	/* Take the smallest free block that fits */
+	spinlock_lock(&spl_bio_data);
+	unsigned int block_order = order;
+	while (block_order <= BIO_DATA_MAX_ORDER && DQUEUE_EMPTY(&bio_data_free_list[block_order]))
+		block_order++;
+	if (block_order > BIO_DATA_MAX_ORDER) {
+		spinlock_unlock(&spl_bio_data);
+		return 0;
 	}
+	struct BIO_DATA_FREE* df = DQUEUE_HEAD(&bio_data_free_list[block_order]);
+	struct BIO_DATA_PAGE* dp = df->df_page;
+	unsigned int sector = ((char*)df - (char*)dp->dp_data) / BIO_SECTOR_SIZE;
+	bio_data_unlink(df, sector, block_order);
 
-	/* Initialize bio buffers and hook them up to the freelist */
-	struct BIO* bios = kmalloc(sizeof(struct BIO) * BIO_NUM_BUFFERS);
-	DQUEUE_INIT(&bio_freelist);
-	for (unsigned int i = 0; i < BIO_NUM_BUFFERS; i++, bios++) {
-		sem_init(&bios->sem, 1);
-		DQUEUE_ADD_TAIL_IP(&bio_freelist, chain, bios);
+	/* Split it until it has the size we need; the upper halves become free */
+	while (block_order > order) {
+		block_order--;
+		bio_data_push(dp, sector + (1 << block_order), block_order);
 	}
+	spinlock_unlock(&spl_bio_data);
 
-	/*
-	 * Construct the BIO bitmap; we need to mark all items as clear except those
-	 * in the slack section, they cannot be used.
-	 */
-	memset(bio_bitmap, 0, bio_bitmap_size);
-	if (((BIO_DATA_SIZE / BIO_SECTOR_SIZE) & 7) != 0) {
-		/*
-	 	 * This means the bitmap size is not a multiple of a byte; we need to set
-		 * the trailing bits to prevent buffers from being allocated that do not
-		 * exist.
-	 	 */
-		for (int n = (BIO_DATA_SIZE / BIO_SECTOR_SIZE) & 7; n < 8; n++)
-			bio_bitmap[bio_bitmap_size] |= (1 << n);
+	bio->data = df;
+	bio->data_page = dp;
+	return 1;
+}
+
+static void
+bio_data_free(struct BIO* bio)
+{
+	struct BIO_DATA_PAGE* dp = bio->data_page;
+	unsigned int sector = ((char*)bio->data - (char*)dp->dp_data) / BIO_SECTOR_SIZE;
+	unsigned int order = bio_data_order(bio->length);
+
+	spinlock_lock(&spl_bio_data);
+	KASSERT(dp->dp_free[sector] == 0, "freeing unallocated bio data %p", bio->data);
+
+	/* Merge the block with its buddy for as long as the buddy is free */
+	while (order < BIO_DATA_MAX_ORDER) {
+		unsigned int buddy = sector ^ (1 << order);
+		if (dp->dp_free[buddy] != order + 1)
+			break;
+		bio_data_unlink((struct BIO_DATA_FREE*)((char*)dp->dp_data + buddy * BIO_SECTOR_SIZE), buddy, order);
+		sector &= ~(1 << order);
+		order++;
+	}
+
+	if (order < BIO_DATA_MAX_ORDER || bio_num_data_pages <= bio_target_data_pages || bio_data_waiters > 0) {
+		bio_data_push(dp, sector, order);
+		int wakeup = bio_data_waiters > 0;
+		spinlock_unlock(&spl_bio_data);
+		if (wakeup)
+			sem_signal(&bio_data_sem);
+		return;
 	}
+
+	/* Page is unused and we are over our target; give it back */
+	bio_num_data_pages--;
+	bio_stats.bs_pages_removed++;
+	spinlock_unlock(&spl_bio_data);
+	bio_data_release(dp);
+}
+
+static errorcode_t
+bio_init()
+{
+	bio_hash_size = BIO_HASH_MIN;
+	bio_hash = kmalloc(sizeof(struct BIO_BUCKET) * bio_hash_size);
+	if (bio_hash == NULL)
+		panic("cannot allocate buffer cache hash table");
+	for (unsigned int n = 0; n < bio_hash_size; n++)
+		DQUEUE_INIT(&bio_hash[n]);
+	for (unsigned int n = 0; n < BIO_HASH_LOCKS; n++)
+		spinlock_init(&spl_bio_hash[n]);
+
+	DQUEUE_INIT(&bio_clock);
+	DQUEUE_INIT(&bio_freelist);
+	KASSERT((BIO_SECTOR_SIZE << BIO_DATA_MAX_ORDER) == PAGE_SIZE, "data block orders do not match page size");
+	for (unsigned int n = 0; n <= BIO_DATA_MAX_ORDER; n++)
+		DQUEUE_INIT(&bio_data_free_list[n]);
+	bio_target_data_pages = BIO_MIN_DATA_PAGES;
 	spinlock_init(&spl_bio_lists);
-	spinlock_init(&spl_bio_bitmap);
+	spinlock_init(&spl_bio_data);
+	spinlock_init(&spl_bio_completion);
+	DQUEUE_INIT(&bio_dirty);
+	spinlock_init(&spl_bio_dirty);
+	sem_init(&bio_syncer_sem, 0);
+	sem_init(&bio_data_sem, 0);
+	mutex_init(&mtx_bio_sync, "biosync");
 	return ANANAS_ERROR_OK;
 }
 
@@ -96,7 +414,8 @@ bio_waitdirty(struct BIO* bio)
 }
 
 /*
- * Called to queue a bio to storage; called with list lock held.
+ * Called to queue a bio to storage and wait for it to be written; called
+ * without any locks held.
  */
 static void
 bio_flush(struct BIO* bio)
@@ -107,6 +426,15 @@ bio_flush(struct BIO* bio)
 	if ((bio->flags & BIO_FLAG_DIRTY) == 0)
 		return;
 
+	/* We'll write it now, so the syncer needn't bother */
+	spinlock_lock(&spl_bio_dirty);
+	if (bio->dirty_queued) {
+		DQUEUE_REMOVE_IP(&bio_dirty, dirty, bio);
+		bio->dirty_queued = 0;
+		bio_num_dirty--;
+	}
+	spinlock_unlock(&spl_bio_dirty);
+
 	TRACE(BIO, INFO, "bio %p (lba %u) is dirty, flushing", bio, (uint32_t)bio->io_block);
 
 	errorcode_t err = device_bwrite(bio->device, bio);
@@ -123,172 +451,321 @@ bio_flush(struct BIO* bio)
 	}
 }
 
+/* Hands a buffer which is no longer in the cache back to the freelist */
 static void
-bio_cleanup()
+bio_release(struct BIO* bio)
 {
-	TRACE(BIO, FUNC, "called");
-
+	if (bio->data_page != NULL)
+		bio_data_free(bio);
+	bio->data = NULL;
+	bio->data_page = NULL;
 	spinlock_lock(&spl_bio_lists);
-	KASSERT(!DQUEUE_EMPTY(&bio_usedlist), "usedlist is empty");
+	DQUEUE_ADD_TAIL_IP(&bio_freelist, chain, bio);
+	spinlock_unlock(&spl_bio_lists);
+}
 
-	/* Grab the final entry and remove it from the list */
-	struct BIO* bio = DQUEUE_TAIL(&bio_usedlist);
-	DQUEUE_POP_TAIL_IP(&bio_usedlist, chain);
+/* Returns non-zero if 'a' must be written before 'b' */
+static inline int
+bio_dirty_before(struct BIO* a, struct BIO* b)
+{
+	if (a->device != b->device)
+		return (addr_t)a->device < (addr_t)b->device;
+	return a->block < b->block;
+}
 
-	bio_flush(bio);
+/* Returns non-zero if too many buffers are dirty; must be called with spl_bio_dirty held */
+static inline int
+bio_dirty_exceeded()
+{
+	return bio_num_dirty >= BIO_DIRTY_MIN && bio_num_dirty * 100 > bio_num_cached * BIO_DIRTY_RATIO;
+}
 
-	/* Add it to the freelist */
-	DQUEUE_ADD_TAIL_IP(&bio_freelist, chain, bio);
+/*
+ * Evicts a buffer from the cache using the CLOCK algorithm. Returns zero if
+ * there was nothing we could evict, i.e. all buffers are busy.
+ */
+static int
+bio_evict()
+{
+	TRACE(BIO, FUNC, "called");
 
-	KASSERT(bio->data != NULL, "to-remove bio %p has no data (fl %x, block %x, len %x)",
-	 bio, bio->flags, (int)bio->block, bio->length);
-	/*
-	 * OK, now we need to nuke the data bio points to; this must be done within
-	 * the lists spinlock because it must not be allocated by someone else.
-	 */
-	spinlock_lock(&spl_bio_bitmap);
-	unsigned int bio_data_block = (bio->data - (void*)bio_data) / BIO_SECTOR_SIZE;
-	for (unsigned int n = bio_data_block; n < bio_data_block + (bio->length / BIO_SECTOR_SIZE); n++) {
-		KASSERT((bio_bitmap[n / 8] & (1 << (n % 8))) != 0, "data block %u not assigned", n);
-		bio_bitmap[n / 8] &= ~(1 << (n % 8));
-	}
-	/* Finally, remove the block from the bucket chain */
-	unsigned int bucket_num = bio->block % BIO_BUCKET_SIZE;
-	spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-	KASSERT(!DQUEUE_EMPTY(&bio_bucket[bucket_num]), "bio bucket %u is empty", bucket_num);
-	DQUEUE_REMOVE_IP(&bio_bucket[bucket_num], bucket, bio);
+	/* Advance the clock hand until we find a buffer which was not recently used */
+	spinlock_lock(&spl_bio_lists);
+	struct BIO* bio = NULL;
+	struct BIO* dirty_bio = NULL;
+	for (unsigned int n = 0; n < 2 * bio_num_cached && !DQUEUE_EMPTY(&bio_clock); n++) {
+		struct BIO* b = DQUEUE_HEAD(&bio_clock);
+		DQUEUE_POP_HEAD_IP(&bio_clock, chain);
+		DQUEUE_ADD_TAIL_IP(&bio_clock, chain, b);
+		if (b->referenced) {
+			b->referenced = 0;
+			continue;
+		}
+		if (b->flags & BIO_FLAG_PENDING)
+			continue; /* I/O in progress */
+		if (b->flags & BIO_FLAG_DIRTY) {
+			/* Writing takes time; only evict dirty buffers as a last resort */
+			if (dirty_bio == NULL)
+				dirty_bio = b;
+			continue;
+		}
+		bio = b;
+		break;
+	}
+	if (bio == NULL)
+		bio = dirty_bio;
+	if (bio == NULL) {
+		spinlock_unlock(&spl_bio_lists);
+		return 0;
+	}
+	device_t dev = bio->device;
+	blocknr_t block = bio->block;
+	spinlock_unlock(&spl_bio_lists);
+
+	/* Writing the buffer back sleeps, so we must do this without any locks held */
+	if (BIO_IS_DIRTY(bio)) {
+		sem_signal(&bio_syncer_sem); /* there is more where this came from */
+		bio_flush(bio);
+		bio_stats.bs_writebacks++;
+	}
 
 	/*
-	 * Clear the bio info; it's available again for use (but set it as pending as
-	 * the data it's not yet available)
+	 * Now remove the buffer from the cache; we have to check whether it is
+	 * still a candidate as it may have been used or evicted in the meantime.
 	 */
+	spinlock_t* spl_hash = bio_hash_lock(dev, block);
+	spinlock_lock(spl_hash);
+	spinlock_lock(&spl_bio_lists);
+	if (bio->device != dev || bio->block != block || bio->referenced ||
+	    (bio->flags & (BIO_FLAG_PENDING | BIO_FLAG_DIRTY)) != 0) {
+		spinlock_unlock(&spl_bio_lists);
+		spinlock_unlock(spl_hash);
+		return 1; /* try again */
+	}
+	DQUEUE_REMOVE_IP(bio_hash_bucket(dev, block), bucket, bio);
+	DQUEUE_REMOVE_IP(&bio_clock, chain, bio);
+	bio_num_cached--;
+	bio->device = NULL;
 	bio->flags = BIO_FLAG_PENDING;
-	bio->data = NULL;
-	spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-	spinlock_unlock(&spl_bio_bitmap);
+	bio_stats.bs_evictions++;
 	spinlock_unlock(&spl_bio_lists);
+	spinlock_unlock(spl_hash);
+
+	KASSERT(bio->data != NULL, "to-remove bio %p has no data (fl %x, block %x, len %x)",
+	 bio, bio->flags, (int)bio->block, bio->length);
+	bio_release(bio);
+	return 1;
 }
 
 /*
- * Return a given bio buffer. This will use any cached item if possible, or
- * allocate a new one as required.
+ * Re-evaluates how much memory the cache may use, and shrinks it if it has
+ * become too large.
  */
-static struct BIO*
-bio_get_buffer(device_t dev, blocknr_t block, size_t len)
+static void
+bio_resize()
 {
-	TRACE(BIO, FUNC, "dev=%p, block=%u, len=%u", dev, (int)block, len);
-	KASSERT((len % BIO_SECTOR_SIZE) == 0, "length %u not a multiple of bio sector size", len);
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
 
-	/* First of all, lock the corresponding queue */
-	unsigned int bucket_num = block % BIO_BUCKET_SIZE;
-bio_restart:
-	spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
+	spinlock_lock(&spl_bio_data);
+	unsigned int target = (avail_pages + bio_num_data_pages) / BIO_MEMORY_FRACTION;
+	if (target < BIO_MIN_DATA_PAGES)
+		target = BIO_MIN_DATA_PAGES;
+	if (target > BIO_MAX_DATA_PAGES)
+		target = BIO_MAX_DATA_PAGES;
+	bio_target_data_pages = target;
+	int excess = bio_num_data_pages > target;
+	spinlock_unlock(&spl_bio_data);
 
-	/* See if we can find the block in the bucket queue; if so, we can just return it */
-	DQUEUE_FOREACH_IP(&bio_bucket[bucket_num], bucket, bio, struct BIO) {
-		if (bio->device != dev || bio->block != block)
-			continue;
+	/* Evicting buffers frees pages once they are unused */
+	for (unsigned int n = 0; excess && n < BIO_SHRINK_MAX; n++) {
+		if (!bio_evict())
+			break;
+		excess = bio_num_data_pages > bio_target_data_pages;
+	}
 
-		/*
-	 	 * This is the block we need; we must move it in front of the used queue to
-		 * prevent it from being nuked.
-		 */
-		spinlock_lock(&spl_bio_lists);
-		KASSERT(!DQUEUE_EMPTY(&bio_usedlist), "usedlist is empty");
-		/* Remove ourselves from the chain... */
-		DQUEUE_REMOVE_IP(&bio_usedlist, chain, bio);
-		/* ...and prepend us at the beginning */
-		DQUEUE_ADD_HEAD_IP(&bio_usedlist, chain, bio);
-		spinlock_unlock(&spl_bio_lists);
+	bio_hash_resize();
+}
 
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		KASSERT(bio->length == len, "bio item found with length %u, requested length %u", bio->length, len); /* XXX should avoid... somehow */
+/*
+ * Waits a while for buffers or their data to be released; we kick the syncer
+ * as dirty buffers can only go once written.
+ */
+static void
+bio_wait_for_release()
+{
+	spinlock_lock(&spl_bio_data);
+	bio_data_waiters++;
+	spinlock_unlock(&spl_bio_data);
+	sem_signal(&bio_syncer_sem);
+	sem_timedwait(&bio_data_sem, BIO_DATA_WAIT);
+	spinlock_lock(&spl_bio_data);
+	bio_data_waiters--;
+	spinlock_unlock(&spl_bio_data);
+}
 
-		/*
-		 * We have already found the I/O buffer in the cache; however, if two
-		 * threads request the same block at roughly the same time, one will
-		 * be stuck waiting for it to be read and the other will end up here.
-		 *
-		 * To prevent this, we'll have to wait until the BIO buffer is no
-		 * longer pending, as this ensures it will have been read.
-		 *
-		 * XXX What about the NODATA flag?
-		 */
-		bio_waitcomplete(bio);
-		TRACE(BIO, INFO, "returning cached bio=%p", bio);
-		return bio;
-	}
-	
-	/* Grab a bio from the head of the freelist */
+/* Grabs a bio from the head of the freelist, or makes a new one; returns NULL if out of memory */
+static struct BIO*
+bio_alloc_buffer()
+{
 	spinlock_lock(&spl_bio_lists);
 	struct BIO* bio = NULL;
 	if (!DQUEUE_EMPTY(&bio_freelist)) {
 		bio = DQUEUE_HEAD(&bio_freelist);
 		DQUEUE_POP_HEAD_IP(&bio_freelist, chain);
 	}
+	spinlock_unlock(&spl_bio_lists);
+	if (bio != NULL)
+		return bio;
 
-	if (bio == NULL) {
-		/* No bio's available; clean up some */
-		spinlock_unlock(&spl_bio_lists);
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		bio_cleanup();
-		goto bio_restart;
+	/*
+	 * Buffers are never handed back to the object cache as consumers may
+	 * still look at buffers which have been evicted.
+	 */
+	bio = kmem_cache_alloc(&bio_cache);
+	if (bio == NULL)
+		return NULL;
+	memset(bio, 0, sizeof(*bio));
+	sem_init(&bio->sem, 1);
+	DQUEUE_INIT(&bio->completions);
+	spinlock_lock(&spl_bio_lists);
+	bio_num_buffers++;
+	spinlock_unlock(&spl_bio_lists);
+	return bio;
+}
+
+/*
+ * Obtains an unused buffer with 'len' bytes of data; if 'data' is not NULL,
+ * the buffer uses it rather than data of its own.
+ */
+static struct BIO*
+bio_alloc(size_t len, void* data)
+{
+	/* Without memory for a new buffer, we must reuse one we evict */
+	struct BIO* bio;
+	while ((bio = bio_alloc_buffer()) == NULL) {
+		if (!bio_evict())
+			bio_wait_for_release();
 	}
 
-	/* And add it to the used list */
-	DQUEUE_ADD_HEAD_IP(&bio_usedlist, chain, bio);
-	spinlock_unlock(&spl_bio_lists);
+	if (data != NULL) {
+		bio->data = data;
+		bio->data_page = NULL;
+		return bio;
+	}
 
-	/* Find available data blocks in the bio data pool */
-bio_restartdata:
-	spinlock_lock(&spl_bio_bitmap);
-	unsigned int chain_length = 0, cur_data_block = 0;
-	unsigned int num_blocks = len / BIO_SECTOR_SIZE;
-	for (; cur_data_block < bio_bitmap_size * 8; cur_data_block++) {
-		if(bio_bitmap[cur_data_block / 8] & (1 << (cur_data_block % 8))) {
-			/* Data block isn't available - try again */
-			chain_length = 0;
+	/*
+	 * Find space for the data; grow the cache if we may, otherwise make room.
+	 * If there is no memory to grow and every buffer is busy, we have to wait
+	 * for pending I/O to complete so that a buffer can be evicted.
+	 */
+	while (!bio_data_alloc(bio, len)) {
+		if (bio_num_data_pages < bio_target_data_pages && bio_data_grow() == ANANAS_ERROR_OK)
 			continue;
-		}
-
-		if (chain_length == num_blocks)
-			break;
-		chain_length++;
+		if (bio_evict() || bio_data_grow() == ANANAS_ERROR_OK)
+			continue;
+		bio_wait_for_release();
 	}
-	if (chain_length != num_blocks) {
-		/* No bio data available; clean up some */
-		spinlock_unlock(&spl_bio_bitmap);
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-		bio_cleanup();
-		spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-		goto bio_restartdata;
+	return bio;
+}
+
+/*
+ * Looks up a block in the cache; returns the buffer if found. Must be called
+ * with the block's hash stripe locked.
+ */
+static struct BIO*
+bio_lookup(device_t dev, blocknr_t block)
+{
+	struct BIO_BUCKET* bucket = bio_hash_bucket(dev, block);
+	if (DQUEUE_EMPTY(bucket))
+		return NULL;
+	DQUEUE_FOREACH_IP(bucket, bucket, bio, struct BIO) {
+		if (bio->device == dev && bio->block == block)
+			return bio;
 	}
-	/* Walk back the number of blocks we need to allocate, we know they are free */
-	cur_data_block -= chain_length;
+	return NULL;
+}
 
-	/* Mark the blocks as in use */
-	for (unsigned int n = cur_data_block; n <  cur_data_block + num_blocks; n++) {
-		bio_bitmap[n / 8] |= (1 << (n % 8));
+/*
+ * Return a given bio buffer. This will use any cached item if possible, or
+ * allocate a new one as required; 'created' is set if the buffer is new, in
+ * which case the caller must schedule the read. Cached buffers may still be
+ * pending.
+ */
+static struct BIO*
+bio_get_buffer(device_t dev, blocknr_t block, size_t len, int* created)
+{
+	TRACE(BIO, FUNC, "dev=%p, block=%u, len=%u", dev, (int)block, len);
+	KASSERT((len % BIO_SECTOR_SIZE) == 0, "length %u not a multiple of bio sector size", len);
+	KASSERT(len <= PAGE_SIZE, "length %u exceeds page size", len);
+
+	spinlock_t* spl_hash = bio_hash_lock(dev, block);
+	spinlock_lock(spl_hash);
+	struct BIO* bio = bio_lookup(dev, block);
+	if (bio != NULL) {
+		/* No need to move anything; the clock hand will see the buffer was used */
+		bio->referenced = 1;
+		spinlock_unlock(spl_hash);
+		bio_stats.bs_hits++;
+		KASSERT(bio->length == len, "bio item found with length %u, requested length %u", bio->length, len); /* XXX should avoid... somehow */
+		*created = 0;
+		TRACE(BIO, INFO, "returning cached bio=%p", bio);
+		return bio;
 	}
-	spinlock_unlock(&spl_bio_bitmap);
+	spinlock_unlock(spl_hash);
 
-	/* Hook the request to the corresponding bucket */
-	DQUEUE_ADD_HEAD_IP(&bio_bucket[bucket_num], bucket, bio);
-	spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
+	/*
+	 * Not cached; get a new buffer. This may evict other buffers, so we must
+	 * not hold the hash lock while doing so. If the device keeps the block in
+	 * memory, the buffer refers to it and there is nothing to read.
+	 */
+	unsigned int misses = ++bio_stats.bs_misses;
+	if ((misses % BIO_RESIZE_INTERVAL) == 0)
+		bio_resize();
+	void* mapped = device_bmap(dev, block, len);
+	struct BIO* new_bio = bio_alloc(len, mapped);
 
 	/*
 	 * Throw away any flags the buffer has (as this is a new request, we can't
 	 * anything more sensible yet) - note that we need to set the pending flag
 	 * because the data isn't ready yet.
 	 */
-	bio->flags = BIO_FLAG_PENDING;
-	bio->device = dev;
-	bio->block = block;
-	bio->io_block = block;
-	bio->length = len;
-	bio->data = bio_data + (cur_data_block * BIO_SECTOR_SIZE);
-	TRACE(BIO, INFO, "returning new bio=%p", bio);
-	return bio;
+	new_bio->flags = (mapped != NULL) ? BIO_FLAG_MAPPED : BIO_FLAG_PENDING;
+	new_bio->block = block;
+	new_bio->io_block = block;
+	new_bio->length = len;
+	new_bio->referenced = 0;
+
+	/* Someone may have added the block while we weren't looking */
+	spinlock_lock(spl_hash);
+	bio = bio_lookup(dev, block);
+	if (bio != NULL) {
+		bio->referenced = 1;
+		spinlock_unlock(spl_hash);
+		bio_release(new_bio);
+		*created = 0;
+		return bio;
+	}
+	new_bio->device = dev;
+	DQUEUE_ADD_HEAD_IP(bio_hash_bucket(dev, block), bucket, new_bio);
+	spinlock_lock(&spl_bio_lists);
+	DQUEUE_ADD_TAIL_IP(&bio_clock, chain, new_bio);
+	bio_num_cached++;
+	int need_rehash = bio_num_cached > bio_hash_size * BIO_HASH_LOAD && bio_hash_size < BIO_HASH_MAX;
+	spinlock_unlock(&spl_bio_lists);
+	spinlock_unlock(spl_hash);
+
+	if (need_rehash)
+		bio_hash_resize();
+
+	if (mapped != NULL) {
+		bio_stats.bs_mapped++;
+		*created = 0;
+		return new_bio;
+	}
+	*created = 1;
+	TRACE(BIO, INFO, "returning new bio=%p", new_bio);
+	return new_bio;
 }
 
 /*
@@ -300,10 +777,43 @@ bio_free(struct BIO* bio)
 	TRACE(BIO, FUNC, "bio=%p", bio);
 }
 
+void
+bio_add_completion(struct BIO* bio, struct BIO_COMPLETION* bc)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_bio_completion);
+	if (bio->flags & BIO_FLAG_PENDING) {
+		DQUEUE_ADD_TAIL(&bio->completions, bc);
+		spinlock_unlock_unpremptible(&spl_bio_completion, state);
+		return;
+	}
+	spinlock_unlock_unpremptible(&spl_bio_completion, state);
+	bc->bc_func(bio, bc->bc_arg);
+}
+
+/* Marks a buffer as no longer pending and invokes all its completions */
+static void
+bio_complete(struct BIO* bio, uint32_t flags)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_bio_completion);
+	bio->flags = (bio->flags & ~BIO_FLAG_PENDING) | flags;
+	struct BIO_COMPLETION* bc = DQUEUE_HEAD(&bio->completions);
+	DQUEUE_INIT(&bio->completions);
+	spinlock_unlock_unpremptible(&spl_bio_completion, state);
+	sem_signal(&bio->sem);
+
+	while (bc != NULL) {
+		/* The callback may re-use the completion, so fetch the next one first */
+		struct BIO_COMPLETION* next = DQUEUE_NEXT(bc);
+		bc->bc_func(bio, bc->bc_arg);
+		bc = next;
+	}
+}
+
 struct BIO*
-bio_get(device_t dev, blocknr_t block, size_t len, int flags)
+bio_submit(device_t dev, blocknr_t block, size_t len, int flags, struct BIO_COMPLETION* bc)
 {
-	struct BIO* bio = bio_get_buffer(dev, block, len);
+	int created;
+	struct BIO* bio = bio_get_buffer(dev, block, len, &created);
 	if (flags & BIO_READ_NODATA) {
 		/*
 		 * The requester doesn't want the actual data; this means we needn't
@@ -312,15 +822,22 @@ bio_get(device_t dev, blocknr_t block, size_t len, int flags)
 		 * being pending - caller is likely to destroy any data in it
 		 * either way.
 		 */
-		bio->flags &= ~BIO_FLAG_PENDING;
+		if (created)
+			bio_complete(bio, 0);
+		if (bc != NULL)
+			bio_add_completion(bio, bc);
 		return bio;
 	}
 
+	/* Register our completion before kicking the device so we cannot miss it */
+	if (bc != NULL)
+		bio_add_completion(bio, bc);
+
 	/*
-	 * If we have a block that is not pending, we can just return it. Note that
-	 * dirty blocks are never pending.
+	 * If someone else created the buffer, the read has already been scheduled
+	 * (or is done); otherwise, it is up to us.
 	 */
-	if ((bio->flags & BIO_FLAG_PENDING) == 0) {
+	if (!created) {
 		TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> cached block %p", dev, (int)block, len, bio);
 		return bio;
 	}
@@ -328,99 +845,451 @@ bio_get(device_t dev, blocknr_t block, size_t len, int flags)
 	/* kick the device; we want it to read */
 	errorcode_t err = device_bread(dev, bio);
 	if (err != ANANAS_ERROR_NONE) {
-		kprintf("bio_read(): device_read() failed, %i\n", err);
+		kprintf("bio_submit(): device_read() failed, %i\n", err);
 		bio_set_error(bio);
-		return bio;
 	}
+	return bio;
+}
+
+errorcode_t
+bio_wait(struct BIO* bio)
+{
+	bio_waitcomplete(bio);
+	if (BIO_IS_ERROR(bio))
+		return ANANAS_ERROR(IO);
+	return ANANAS_ERROR_OK;
+}
+
+errorcode_t
+bio_wait_many(struct BIO** bio, unsigned int num)
+{
+	/* As all requests are in flight, the order in which we wait does not matter */
+	errorcode_t err = ANANAS_ERROR_OK;
+	for (unsigned int n = 0; n < num; n++) {
+		errorcode_t e = bio_wait(bio[n]);
+		if (e != ANANAS_ERROR_OK)
+			err = e;
+	}
+	return err;
+}
+
+struct BIO*
+bio_get(device_t dev, blocknr_t block, size_t len, int flags)
+{
+	struct BIO* bio = bio_submit(dev, block, len, flags, NULL);
 
-	/* ... and wait until we have something to report... */
+	/*
+	 * Wait until the buffer is no longer pending; if two threads request the
+	 * same block at roughly the same time, this ensures the second one will
+	 * not use the buffer before it has been read. Note that dirty blocks are
+	 * never pending.
+	 */
 	bio_waitcomplete(bio);
-	TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> new block %p", dev, (int)block, len, bio);
+	TRACE(BIO, INFO, "dev=%p, block=%u, len=%u ==> block %p", dev, (int)block, len, bio);
 	return bio;
 }
 
+/* Invoked once a cluster read is done; hands the outcome to the buffers it covers */
+static void
+bio_cluster_done(struct BIO* bio, void* arg)
+{
+	struct BIO_CLUSTER* cl = arg;
+	int error = BIO_IS_ERROR(&cl->cl_bio);
+	for (unsigned int n = 0; n < cl->cl_num_bios; n++) {
+		if (error)
+			bio_set_error(cl->cl_bios[n]);
+		else
+			bio_set_available(cl->cl_bios[n]);
+	}
+
+	register_t state = spinlock_lock_unpremptible(&spl_bio_completion);
+	cl->cl_next = bio_cluster_reap_list;
+	bio_cluster_reap_list = cl;
+	spinlock_unlock_unpremptible(&spl_bio_completion, state);
+}
+
+/* Frees all clusters whose read is done; must be called from thread context */
+static void
+bio_cluster_reap()
+{
+	register_t state = spinlock_lock_unpremptible(&spl_bio_completion);
+	struct BIO_CLUSTER* cl = bio_cluster_reap_list;
+	bio_cluster_reap_list = NULL;
+	spinlock_unlock_unpremptible(&spl_bio_completion, state);
+
+	while (cl != NULL) {
+		struct BIO_CLUSTER* next = cl->cl_next;
+		kmem_cache_free(&bio_cluster_cache, cl);
+		cl = next;
+	}
+}
+
+/* Reads a single new buffer on its own */
+static void
+bio_read_single(struct BIO* bio)
+{
+	errorcode_t err = device_bread(bio->device, bio);
+	if (err != ANANAS_ERROR_NONE) {
+		kprintf("bio_read_single(): device_read() failed, %i\n", err);
+		bio_set_error(bio);
+	}
+}
+
+/* Reads the buffers gathered in a cluster, which must all be adjacent and new */
+static void
+bio_read_cluster(struct BIO_CLUSTER* cl)
+{
+	struct BIO* first = cl->cl_bios[0];
+	errorcode_t err;
+	bio_stats.bs_prefetch_reads++;
+	bio_stats.bs_prefetch_buffers += cl->cl_num_bios;
+	if (cl->cl_num_bios == 1) {
+		/* Nothing to merge; just read the buffer itself */
+		kmem_cache_free(&bio_cluster_cache, cl);
+		bio_read_single(first);
+		return;
+	}
+
+	struct BIO* bio = &cl->cl_bio;
+	memset(bio, 0, sizeof(*bio));
+	sem_init(&bio->sem, 0);
+	DQUEUE_INIT(&bio->completions);
+	bio->flags = BIO_FLAG_PENDING;
+	bio->device = first->device;
+	bio->block = first->block;
+	bio->io_block = first->block;
+	bio->num_vecs = cl->cl_num_bios;
+	bio->vec = cl->cl_vec;
+	for (unsigned int n = 0; n < cl->cl_num_bios; n++) {
+		cl->cl_vec[n].bv_data = BIO_DATA(cl->cl_bios[n]);
+		cl->cl_vec[n].bv_length = cl->cl_bios[n]->length;
+		bio->length += cl->cl_bios[n]->length;
+	}
+	cl->cl_completion.bc_func = bio_cluster_done;
+	cl->cl_completion.bc_arg = cl;
+	bio_add_completion(bio, &cl->cl_completion);
+
+	err = device_bread(bio->device, bio);
+	if (err != ANANAS_ERROR_NONE) {
+		kprintf("bio_read_cluster(): device_read() failed, %i\n", err);
+		bio_set_error(bio);
+	}
+}
+
+void
+bio_prefetch(device_t dev, blocknr_t block, size_t len, unsigned int num)
+{
+	/*
+	 * New buffers are pending until we read them, so nothing else will; we
+	 * gather runs of them and read every run at once. Anything cached (or
+	 * already being read) ends the run.
+	 */
+	bio_cluster_reap();
+	struct BIO_CLUSTER* cl = NULL;
+	for (unsigned int n = 0; n < num; n++, block += len / BIO_SECTOR_SIZE) {
+		int created;
+		struct BIO* bio = bio_get_buffer(dev, block, len, &created);
+		if (!created) {
+			if (cl != NULL)
+				bio_read_cluster(cl);
+			cl = NULL;
+			continue;
+		}
+
+		if (cl == NULL) {
+			cl = kmem_cache_alloc(&bio_cluster_cache);
+			if (cl == NULL) {
+				/* No memory to merge anything; the buffer is pending, so it must be read */
+				bio_read_single(bio);
+				continue;
+			}
+			cl->cl_num_bios = 0;
+		}
+		cl->cl_bios[cl->cl_num_bios++] = bio;
+		if (cl->cl_num_bios == BIO_MAX_VECS || (cl->cl_num_bios + 1) * len > BIO_CLUSTER_MAX) {
+			bio_read_cluster(cl);
+			cl = NULL;
+		}
+	}
+	if (cl != NULL)
+		bio_read_cluster(cl);
+}
+
 void
 bio_set_error(struct BIO* bio)
 {
 	TRACE(BIO, FUNC, "bio=%p", bio);
-	bio->flags = (bio->flags & ~BIO_FLAG_PENDING) | BIO_FLAG_ERROR;
-	sem_signal(&bio->sem);
+	bio_complete(bio, BIO_FLAG_ERROR);
 }
 
 void
 bio_set_available(struct BIO* bio)
 {
 	TRACE(BIO, FUNC, "bio=%p", bio);
-	bio->flags &= ~BIO_FLAG_PENDING;
-	sem_signal(&bio->sem);
+	bio_complete(bio, 0);
 }
 
 void
 bio_set_dirty(struct BIO* bio)
 {
 	TRACE(BIO, FUNC, "bio=%p", bio);
+	/* Changes to the device's own memory need not be written anywhere */
+	if (BIO_IS_MAPPED(bio))
+		return;
 	bio->flags |= BIO_FLAG_DIRTY;
-	bio_flush(bio); /* XXX debug aid so that the image can be inspected */
+
+	spinlock_lock(&spl_bio_dirty);
+	if (!bio->dirty_queued) {
+		/* Insert in order; scan from the tail as writes tend to be sequential */
+		struct BIO* pos = DQUEUE_EMPTY(&bio_dirty) ? NULL : DQUEUE_TAIL(&bio_dirty);
+		while (pos != NULL && !bio_dirty_before(pos, bio))
+			pos = DQUEUE_PREV_IP(pos, dirty);
+		if (pos == NULL) {
+			DQUEUE_ADD_HEAD_IP(&bio_dirty, dirty, bio);
+		} else if (DQUEUE_NEXT_IP(pos, dirty) == NULL) {
+			DQUEUE_ADD_TAIL_IP(&bio_dirty, dirty, bio);
+		} else {
+			DQUEUE_INSERT_BEFORE_IP(&bio_dirty, dirty, DQUEUE_NEXT_IP(pos, dirty), bio);
+		}
+		bio->dirty_queued = 1;
+		bio->dirty_since = timer_get_ticks();
+		bio_num_dirty++;
+	}
+	int kick = bio_dirty_exceeded();
+	spinlock_unlock(&spl_bio_dirty);
+
+	if (kick)
+		sem_signal(&bio_syncer_sem);
 }
 
-#ifdef OPTION_KDB
-KDB_COMMAND(bio, NULL, "Display I/O buffers")
+/*
+ * Writes a run of adjacent dirty buffers, which have been removed from the
+ * dirty list, using a single request. Called with mtx_bio_sync held.
+ */
+static void
+bio_write_cluster(struct BIO** bios, unsigned int num)
 {
-	kprintf("bio dump\n");
+	struct BIO* first = bios[0];
+	errorcode_t err;
+	if (num == 1) {
+		/* Nothing to merge; just write the buffer itself */
+		err = device_bwrite(first->device, first);
+		if (err == ANANAS_ERROR_NONE)
+			bio_waitdirty(first);
+	} else {
+		/*
+		 * Construct a buffer covering the entire run, which refers to the data
+		 * of the buffers themselves; it is not part of the cache, so nothing but
+		 * us will ever see it.
+		 */
+		struct BIO cluster;
+		memset(&cluster, 0, sizeof(cluster));
+		sem_init(&cluster.sem, 1);
+		DQUEUE_INIT(&cluster.completions);
+		cluster.flags = BIO_FLAG_DIRTY;
+		cluster.device = first->device;
+		cluster.block = first->block;
+		cluster.io_block = first->block;
+		cluster.num_vecs = num;
+		cluster.vec = bio_sync_vec;
+		for (unsigned int n = 0; n < num; n++) {
+			bio_sync_vec[n].bv_data = BIO_DATA(bios[n]);
+			bio_sync_vec[n].bv_length = bios[n]->length;
+			cluster.length += bios[n]->length;
+		}
 
-	unsigned int freelist_avail = 0, usedlist_used = 0;
-	spinlock_lock(&spl_bio_lists);
-	if(!DQUEUE_EMPTY(&bio_freelist))
-		DQUEUE_FOREACH_IP(&bio_freelist, chain, bio, struct BIO) {
-			freelist_avail++;
+		err = device_bwrite(cluster.device, &cluster);
+		if (err == ANANAS_ERROR_NONE) {
+			bio_waitdirty(&cluster);
+			if (BIO_IS_ERROR(&cluster))
+				err = ANANAS_ERROR(IO);
 		}
-	if(!DQUEUE_EMPTY(&bio_usedlist))
-		DQUEUE_FOREACH_IP(&bio_usedlist, chain, bio, struct BIO) {
-			usedlist_used++;
+	}
+	bio_stats.bs_sync_writes++;
+	bio_stats.bs_sync_buffers += num;
+
+	/*
+	 * The buffers are clean unless they were dirtied again while we were
+	 * writing them; in that case, they are back on the dirty list.
+	 */
+	for (unsigned int n = 0; n < num; n++) {
+		struct BIO* bio = bios[n];
+		spinlock_lock(&spl_bio_dirty);
+		if (err != ANANAS_ERROR_NONE) {
+			kprintf("bio_write_cluster(): device_write() failed, %i\n", err);
+			bio->flags |= BIO_FLAG_ERROR;
 		}
-	spinlock_unlock(&spl_bio_lists);
-	kprintf("lists: %u bio's used, %u bio's free, %u total\n", usedlist_used, freelist_avail, BIO_NUM_BUFFERS);
-	KASSERT(freelist_avail + usedlist_used == BIO_NUM_BUFFERS, "chain length does not add up");
-
-	kprintf("buckets:");
-	for (unsigned int bucket_num = 0; bucket_num < BIO_BUCKET_SIZE; bucket_num++) {
-		kprintf("%u =>", bucket_num);
-		spinlock_lock(&bio_bucket[bucket_num].spl_bucket);
-		if(!DQUEUE_EMPTY(&bio_bucket[bucket_num])) {
-			DQUEUE_FOREACH_IP(&bio_bucket[bucket_num], bucket, bio, struct BIO) {
-				kprintf(" 0x%p (%u)", bio, bio->block);
-			}
-		} else {
-			kprintf(" (empty)");
+		if (bio->dirty_queued)
+			bio->flags |= BIO_FLAG_DIRTY;
+		else
+			bio->flags &= ~BIO_FLAG_DIRTY;
+		spinlock_unlock(&spl_bio_dirty);
+		sem_signal(&bio->sem);
+	}
+}
+
+/*
+ * Writes dirty buffers of device 'dev', or of all devices if NULL. If 'all' is
+ * set, every dirty buffer is written; otherwise, only runs containing a buffer
+ * which has been dirty for long enough are written.
+ */
+static void
+bio_sync_buffers(device_t dev, int all)
+{
+	struct BIO* bios[BIO_MAX_VECS];
+	uint64_t now = timer_get_ticks();
+	uint64_t expired = (now > BIO_DIRTY_AGE * TIMER_HZ) ? now - BIO_DIRTY_AGE * TIMER_HZ : 0;
+
+	mutex_lock(&mtx_bio_sync);
+	/* Runs we decide to skip stay on the list, so remember where we were */
+	device_t next_dev = NULL;
+	blocknr_t next_block = 0;
+	while (1) {
+		spinlock_lock(&spl_bio_dirty);
+		struct BIO* bio = DQUEUE_EMPTY(&bio_dirty) ? NULL : DQUEUE_HEAD(&bio_dirty);
+		while (bio != NULL && ((addr_t)bio->device < (addr_t)next_dev ||
+		       (bio->device == next_dev && bio->block < next_block) ||
+		       (dev != NULL && bio->device != dev)))
+			bio = DQUEUE_NEXT_IP(bio, dirty);
+		if (bio == NULL) {
+			spinlock_unlock(&spl_bio_dirty);
+			break;
 		}
-		kprintf("\n");
-		spinlock_unlock(&bio_bucket[bucket_num].spl_bucket);
-	}
-
-	unsigned int databuf_avail = 0;
-	kprintf("data buffers:");
-	spinlock_lock(&spl_bio_bitmap);
-	int current = -1;
-	for (unsigned int i = 0; i < bio_bitmap_size * 8; i++) {
-		if((bio_bitmap[i / 8] & (1 << (i % 8))) != 0) {
-			/* This entry is used; need to show it */
-			if (current == -1)
-				kprintf(" %u", i);
-			current = i;
+
+		/* Gather the run of adjacent buffers starting here */
+		unsigned int num = 0, old = 0;
+		size_t len = 0;
+		struct BIO* cur = bio;
+		do {
+			if (cur->dirty_since <= expired)
+				old++;
+			len += cur->length;
+			bios[num++] = cur;
+			struct BIO* next = DQUEUE_NEXT_IP(cur, dirty);
+			if (next == NULL || next->device != cur->device ||
+			    next->block != cur->block + cur->length / BIO_SECTOR_SIZE ||
+			    num == BIO_MAX_VECS || len + next->length > BIO_CLUSTER_MAX)
+				break;
+			cur = next;
+		} while (1);
+		next_dev = cur->device;
+		next_block = cur->block + 1;
+
+		if (!all && !old && !bio_dirty_exceeded()) {
+			spinlock_unlock(&spl_bio_dirty);
 			continue;
 		}
-		if (current != -1) {
-			kprintf("-%u", i);
-			current = -1;
+
+		/*
+		 * Take the run off the dirty list; it'll be put back by bio_set_dirty()
+		 * if it is modified while we write it.
+		 */
+		for (unsigned int n = 0; n < num; n++) {
+			DQUEUE_REMOVE_IP(&bio_dirty, dirty, bios[n]);
+			bios[n]->dirty_queued = 0;
+			bios[n]->flags |= BIO_FLAG_DIRTY;
 		}
-		databuf_avail++;
+		bio_num_dirty -= num;
+		spinlock_unlock(&spl_bio_dirty);
+
+		bio_write_cluster(bios, num);
+	}
+	mutex_unlock(&mtx_bio_sync);
+}
+
+void
+bio_sync(device_t dev)
+{
+	bio_sync_buffers(dev, 1);
+}
+
+static void
+bio_syncer(void* arg)
+{
+	while(1) {
+		/* Wake up regularly to write old buffers, or when kicked */
+		sem_timedwait(&bio_syncer_sem, BIO_SYNCER_INTERVAL);
+		bio_sync_buffers(NULL, 0);
+		bio_cluster_reap();
 	}
-	if (current != -1)
-		kprintf("-%u\n", bio_bitmap_size * 8);
-	spinlock_unlock(&spl_bio_bitmap);
-	kprintf(" %u available (%u total)\n", databuf_avail, BIO_DATA_SIZE / BIO_SECTOR_SIZE);
+}
 
-	KASSERT(databuf_avail <= (BIO_DATA_SIZE / BIO_SECTOR_SIZE), "more bio data available than total");
+static errorcode_t
+bio_start_syncer()
+{
+	kthread_init(&bio_syncer_thread, "syncer", &bio_syncer, NULL);
+	thread_resume(&bio_syncer_thread);
+	return ANANAS_ERROR_OK;
+}
+
+INIT_FUNCTION(bio_start_syncer, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+void
+bio_get_stats(struct BIO_STATS* stats)
+{
+	memcpy(stats, &bio_stats, sizeof(*stats));
+}
+
+void
+bio_dump()
+{
+	spinlock_lock(&spl_bio_lists);
+	unsigned int num_cached = bio_num_cached, num_buffers = bio_num_buffers;
+	unsigned int num_free = 0, num_dirty = 0, num_pending = 0;
+	if (!DQUEUE_EMPTY(&bio_freelist))
+		DQUEUE_FOREACH_IP(&bio_freelist, chain, bio, struct BIO) {
+			num_free++;
+		}
+	if (!DQUEUE_EMPTY(&bio_clock))
+		DQUEUE_FOREACH_IP(&bio_clock, chain, bio, struct BIO) {
+			if (bio->flags & BIO_FLAG_DIRTY)
+				num_dirty++;
+			if (bio->flags & BIO_FLAG_PENDING)
+				num_pending++;
+		}
+	spinlock_unlock(&spl_bio_lists);
+	kprintf("buffers: %u cached (%u dirty, %u pending), %u free, %u total\n",
+	 num_cached, num_dirty, num_pending, num_free, num_buffers);
+	kprintf("syncer: %u buffers queued, %u written using %u requests\n",
+	 bio_num_dirty, bio_stats.bs_sync_buffers, bio_stats.bs_sync_writes);
+	kprintf("prefetch: %u buffers read using %u requests\n",
+	 bio_stats.bs_prefetch_buffers, bio_stats.bs_prefetch_reads);
+	kprintf("mapped: %u buffers referred to device memory\n", bio_stats.bs_mapped);
+	KASSERT(num_cached + num_free <= num_buffers, "chain length does not add up");
+
+	/*
+	 * Fragmentation is the fraction of free space which cannot be used for a
+	 * full page buffer; it is zero if all free space is in entire pages.
+	 */
+	spinlock_lock(&spl_bio_data);
+	unsigned int num_pages = bio_num_data_pages, target_pages = bio_target_data_pages;
+	unsigned int free_blocks[BIO_DATA_MAX_ORDER + 1];
+	unsigned int sectors_free = 0;
+	for (unsigned int n = 0; n <= BIO_DATA_MAX_ORDER; n++) {
+		free_blocks[n] = bio_data_num_free[n];
+		sectors_free += free_blocks[n] << n;
+	}
+	spinlock_unlock(&spl_bio_data);
+	unsigned int frag = 0;
+	if (sectors_free > 0)
+		frag = 100 - ((free_blocks[BIO_DATA_MAX_ORDER] << BIO_DATA_MAX_ORDER) * 100) / sectors_free;
+	kprintf("data: %u pages (target %u), %u of %u sectors free, fragmentation %u percent\n",
+	 num_pages, target_pages, sectors_free, num_pages * BIO_SECTORS_PER_PAGE, frag);
+	kprintf("free blocks:");
+	for (unsigned int n = 0; n <= BIO_DATA_MAX_ORDER; n++)
+		kprintf(" %u x %u", free_blocks[n], BIO_SECTOR_SIZE << n);
+	kprintf("\n");
+
+	kprintf("hash: %u buckets, %u rehashes\n", bio_hash_size, bio_stats.bs_rehashes);
+	kprintf("lookups: %u hits, %u misses\n", bio_stats.bs_hits, bio_stats.bs_misses);
+	kprintf("evictions: %u (%u written back), pages: %u added, %u removed\n",
+	 bio_stats.bs_evictions, bio_stats.bs_writebacks, bio_stats.bs_pages_added, bio_stats.bs_pages_removed);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(bio, NULL, "Display I/O buffers")
+{
+	bio_dump();
 }
 #endif /* KDB */
 
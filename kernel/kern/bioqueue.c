@@ -0,0 +1,433 @@
+#include <ananas/bio.h>
+#include <ananas/bioqueue.h>
+#include <ananas/device.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/slab.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <ananas/trace.h>
+#include <machine/thread.h> /* for md_cpu_cycles() */
+#include "options.h"
+
+TRACE_SETUP;
+
+/* How long a request may wait before the deadline policy dispatches it regardless of order */
+#define BIOQ_READ_DEADLINE	50	/* ms */
+#define BIOQ_WRITE_DEADLINE	500	/* ms */
+
+static KMEM_CACHE_DEFINE(bioq_request_cache, "bioq_request", sizeof(struct BIO_REQUEST), NULL);
+
+static spinlock_t spl_bioq_list = SPINLOCK_DEFAULT_INIT;
+static struct BIO_QUEUE_LIST bioq_list;
+
+/*
+ * The dispatcher thread finishes requests the driver has completed and hands
+ * pending requests to the driver once it has room. Until it runs, requests
+ * bypass the queues: devices are attached (and their partition tables read)
+ * before there is a scheduler.
+ */
+static thread_t bioq_thread;
+static semaphore_t bioq_sem;
+static int bioq_running = 0;
+
+static inline int
+bioq_is_write(struct BIO_REQUEST* br)
+{
+	return (br->br_flags & BIO_REQUEST_FLAG_WRITE) != 0;
+}
+
+static inline blocknr_t
+bioq_end_block(struct BIO_REQUEST* br)
+{
+	return br->br_block + br->br_length / BIO_SECTOR_SIZE;
+}
+
+/*
+ * Noop policy: requests are dispatched in order of arrival.
+ */
+static void
+bioq_noop_insert(struct BIO_QUEUE* q, struct BIO_REQUEST* br)
+{
+}
+
+static struct BIO_REQUEST*
+bioq_noop_next(struct BIO_QUEUE* q)
+{
+	return DQUEUE_HEAD(&q->q_fifo);
+}
+
+struct BIO_QUEUE_POLICY bioq_policy_noop = {
+	.qp_name = "noop",
+	.qp_merge = 0,
+	.qp_insert = bioq_noop_insert,
+	.qp_next = bioq_noop_next
+};
+
+/*
+ * Deadline policy: requests are kept sorted by block and dispatched in a
+ * single sweep upwards from where the previous request ended, wrapping around
+ * at the end. If the oldest request has waited past its deadline, it goes
+ * first so that a steady stream of nearby requests cannot starve it.
+ */
+static void
+bioq_deadline_insert(struct BIO_QUEUE* q, struct BIO_REQUEST* br)
+{
+	/* Scan from the tail; requests tend to arrive in ascending order */
+	struct BIO_REQUEST* pos = DQUEUE_EMPTY(&q->q_sorted) ? NULL : DQUEUE_TAIL(&q->q_sorted);
+	while (pos != NULL && pos->br_block > br->br_block)
+		pos = DQUEUE_PREV_IP(pos, sorted);
+	if (pos == NULL) {
+		DQUEUE_ADD_HEAD_IP(&q->q_sorted, sorted, br);
+	} else if (DQUEUE_NEXT_IP(pos, sorted) == NULL) {
+		DQUEUE_ADD_TAIL_IP(&q->q_sorted, sorted, br);
+	} else {
+		DQUEUE_INSERT_BEFORE_IP(&q->q_sorted, sorted, DQUEUE_NEXT_IP(pos, sorted), br);
+	}
+}
+
+static struct BIO_REQUEST*
+bioq_deadline_next(struct BIO_QUEUE* q)
+{
+	struct BIO_REQUEST* br = DQUEUE_HEAD(&q->q_fifo);
+	if (br->br_deadline > timer_get_ticks()) {
+		/* Nothing expired; continue the sweep */
+		br = DQUEUE_HEAD(&q->q_sorted);
+		DQUEUE_FOREACH_IP(&q->q_sorted, sorted, r, struct BIO_REQUEST) {
+			if (r->br_block >= q->q_last_block) {
+				br = r;
+				break;
+			}
+		}
+	}
+	DQUEUE_REMOVE_IP(&q->q_sorted, sorted, br);
+	return br;
+}
+
+struct BIO_QUEUE_POLICY bioq_policy_deadline = {
+	.qp_name = "deadline",
+	.qp_merge = 1,
+	.qp_insert = bioq_deadline_insert,
+	.qp_next = bioq_deadline_next
+};
+
+/*
+ * Attempts to add a buffer to a pending request in the same direction which
+ * ends right before it or starts right after it; must be called with the
+ * queue lock held. Returns non-zero on success.
+ */
+static int
+bioq_merge_locked(struct BIO_QUEUE* q, struct BIO* bio, int flags)
+{
+	blocknr_t bio_end = bio->io_block + bio->length / BIO_SECTOR_SIZE;
+	if (DQUEUE_EMPTY(&q->q_fifo))
+		return 0;
+
+	/*
+	 * Anything pending which overlaps the buffer must be dispatched before it;
+	 * merging could change that, so the buffer gets a request of its own.
+	 */
+	DQUEUE_FOREACH_IP(&q->q_fifo, fifo, br, struct BIO_REQUEST) {
+		if (br->br_block < bio_end && bioq_end_block(br) > bio->io_block)
+			return 0;
+	}
+
+	DQUEUE_FOREACH_IP(&q->q_fifo, fifo, br, struct BIO_REQUEST) {
+		if (br->br_flags != flags)
+			continue;
+		if (br->br_num_bios == BIOQ_MAX_BIOS || br->br_length + bio->length > BIOQ_MAX_LENGTH ||
+		    br->br_num_vecs + bio_num_vecs(bio) > BIO_MAX_VECS)
+			continue;
+
+		if (bioq_end_block(br) == bio->io_block) {
+			/* Back merge; the request's position in the sorted list is unchanged */
+			br->br_bios[br->br_num_bios++] = bio;
+			br->br_num_vecs += bio_num_vecs(bio);
+			br->br_length += bio->length;
+			return 1;
+		}
+		if (bio_end == br->br_block) {
+			/*
+			 * Front merge; a pending request between the buffer and this one would
+			 * have to start within the buffer, which we ruled out above, so the
+			 * request can stay where it is in the sorted list.
+			 */
+			memmove(&br->br_bios[1], &br->br_bios[0], br->br_num_bios * sizeof(struct BIO*));
+			br->br_bios[0] = bio;
+			br->br_num_bios++;
+			br->br_num_vecs += bio_num_vecs(bio);
+			br->br_block = bio->io_block;
+			br->br_length += bio->length;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Invoked by the buffer layer, usually from interrupt context, once the driver is done */
+static void
+bioq_request_done(struct BIO* bio, void* arg)
+{
+	struct BIO_REQUEST* br = arg;
+	struct BIO_QUEUE* q = br->br_queue;
+
+	register_t state = spinlock_lock_unpremptible(&q->q_lock);
+	q->q_depth--;
+	DQUEUE_ADD_TAIL_IP(&q->q_done, fifo, br);
+	spinlock_unlock_unpremptible(&q->q_lock, state);
+
+	sem_signal(&bioq_sem);
+}
+
+/* Builds the driver's buffer for a request and hands it over */
+static void
+bioq_start_request(struct BIO_QUEUE* q, struct BIO_REQUEST* br)
+{
+	struct BIO* bio = &br->br_bio;
+	memset(bio, 0, sizeof(*bio));
+	sem_init(&bio->sem, 0);
+	DQUEUE_INIT(&bio->completions);
+	bio->flags = BIO_FLAG_PENDING | (bioq_is_write(br) ? BIO_FLAG_DIRTY : 0);
+	bio->device = q->q_device;
+	bio->block = br->br_block;
+	bio->io_block = br->br_block;
+	bio->length = br->br_length;
+
+	if (br->br_num_bios == 1) {
+		bio->data = br->br_bios[0]->data;
+		bio->num_vecs = br->br_bios[0]->num_vecs;
+		bio->vec = br->br_bios[0]->vec;
+	} else {
+		/* Refer to the pieces of all buffers, in order */
+		bio->num_vecs = 0;
+		bio->vec = br->br_vec;
+		for (unsigned int n = 0; n < br->br_num_bios; n++) {
+			struct BIO* b = br->br_bios[n];
+			for (unsigned int v = 0; v < bio_num_vecs(b); v++) {
+				br->br_vec[bio->num_vecs].bv_data = bio_vec_data(b, v);
+				br->br_vec[bio->num_vecs].bv_length = bio_vec_length(b, v);
+				bio->num_vecs++;
+			}
+		}
+	}
+
+	br->br_completion.bc_func = bioq_request_done;
+	br->br_completion.bc_arg = br;
+	bio_add_completion(bio, &br->br_completion);
+
+	driver_t drv = q->q_device->driver;
+	errorcode_t err = bioq_is_write(br) ? drv->drv_bwrite(q->q_device, bio) : drv->drv_bread(q->q_device, bio);
+	if (err != ANANAS_ERROR_OK)
+		bio_set_error(bio);
+}
+
+/* Hands pending requests to the driver until it is at its maximum depth */
+static void
+bioq_dispatch(struct BIO_QUEUE* q)
+{
+	while (1) {
+		register_t state = spinlock_lock_unpremptible(&q->q_lock);
+		if (q->q_pending == 0 || q->q_depth >= q->q_max_depth) {
+			spinlock_unlock_unpremptible(&q->q_lock, state);
+			return;
+		}
+		struct BIO_REQUEST* br = q->q_policy->qp_next(q);
+		DQUEUE_REMOVE_IP(&q->q_fifo, fifo, br);
+		q->q_pending--;
+		q->q_depth++;
+		q->q_last_block = bioq_end_block(br);
+		q->q_stats.qs_requests++;
+		q->q_stats.qs_bios += br->br_num_bios;
+		if (q->q_depth > q->q_stats.qs_max_depth)
+			q->q_stats.qs_max_depth = q->q_depth;
+		spinlock_unlock_unpremptible(&q->q_lock, state);
+
+		TRACE(BIO, INFO, "dev=%p, block=%u, len=%u, bios=%u", q->q_device, (uint32_t)br->br_block, br->br_length, br->br_num_bios);
+		bioq_start_request(q, br);
+	}
+}
+
+/* Completes the buffers of all requests the driver is done with */
+static void
+bioq_finish(struct BIO_QUEUE* q)
+{
+	while (1) {
+		register_t state = spinlock_lock_unpremptible(&q->q_lock);
+		if (DQUEUE_EMPTY(&q->q_done)) {
+			spinlock_unlock_unpremptible(&q->q_lock, state);
+			return;
+		}
+		struct BIO_REQUEST* br = DQUEUE_HEAD(&q->q_done);
+		DQUEUE_POP_HEAD_IP(&q->q_done, fifo);
+		spinlock_unlock_unpremptible(&q->q_lock, state);
+
+		uint64_t latency = md_cpu_cycles() - br->br_submitted;
+		int error = BIO_IS_ERROR(&br->br_bio);
+		for (unsigned int n = 0; n < br->br_num_bios; n++) {
+			struct BIO* bio = br->br_bios[n];
+			if (error) {
+				bio_set_error(bio);
+				continue;
+			}
+			/* This is what the driver does to the buffers it writes */
+			if (bioq_is_write(br))
+				bio->flags &= ~BIO_FLAG_DIRTY;
+			bio_set_available(bio);
+		}
+		kmem_cache_free(&bioq_request_cache, br);
+
+		state = spinlock_lock_unpremptible(&q->q_lock);
+		q->q_stats.qs_total_latency += latency;
+		if (latency > q->q_stats.qs_max_latency)
+			q->q_stats.qs_max_latency = latency;
+		spinlock_unlock_unpremptible(&q->q_lock, state);
+	}
+}
+
+errorcode_t
+bioq_submit(struct BIO_QUEUE* q, struct BIO* bio, int write)
+{
+	if (!bioq_running) {
+		driver_t drv = q->q_device->driver;
+		return write ? drv->drv_bwrite(q->q_device, bio) : drv->drv_bread(q->q_device, bio);
+	}
+
+	/*
+	 * Allocate up front; this cannot be done with the queue lock held. If there
+	 * is no memory, the buffer can still be merged into an existing request.
+	 */
+	int flags = write ? BIO_REQUEST_FLAG_WRITE : 0;
+	struct BIO_REQUEST* br = kmem_cache_alloc(&bioq_request_cache);
+	if (br == NULL) {
+		register_t state = spinlock_lock_unpremptible(&q->q_lock);
+		int merged = q->q_policy->qp_merge && bioq_merge_locked(q, bio, flags);
+		if (merged)
+			q->q_stats.qs_merges++;
+		spinlock_unlock_unpremptible(&q->q_lock, state);
+		return merged ? ANANAS_ERROR_OK : ANANAS_ERROR(OUT_OF_MEMORY);
+	}
+	br->br_flags = flags;
+	br->br_queue = q;
+	br->br_block = bio->io_block;
+	br->br_length = bio->length;
+	br->br_deadline = timer_get_ticks() + TIMER_MS_TO_TICKS(write ? BIOQ_WRITE_DEADLINE : BIOQ_READ_DEADLINE);
+	br->br_submitted = md_cpu_cycles();
+	br->br_num_bios = 1;
+	br->br_num_vecs = bio_num_vecs(bio);
+	br->br_bios[0] = bio;
+
+	register_t state = spinlock_lock_unpremptible(&q->q_lock);
+	if (q->q_policy->qp_merge && bioq_merge_locked(q, bio, br->br_flags)) {
+		q->q_stats.qs_merges++;
+		spinlock_unlock_unpremptible(&q->q_lock, state);
+		kmem_cache_free(&bioq_request_cache, br);
+		return ANANAS_ERROR_OK;
+	}
+	q->q_policy->qp_insert(q, br);
+	DQUEUE_ADD_TAIL_IP(&q->q_fifo, fifo, br);
+	q->q_pending++;
+	/*
+	 * An idle device gets the request right away; otherwise it is left to the
+	 * dispatcher, so that requests arriving in the meantime can be merged.
+	 */
+	int idle = q->q_depth == 0;
+	spinlock_unlock_unpremptible(&q->q_lock, state);
+
+	if (idle) {
+		bioq_dispatch(q);
+		/* Synchronous drivers are done by now; spare them the trip to the dispatcher */
+		bioq_finish(q);
+	} else
+		sem_signal(&bioq_sem);
+	return ANANAS_ERROR_OK;
+}
+
+static void
+bioq_dispatcher(void* arg)
+{
+	while(1) {
+		sem_wait(&bioq_sem);
+
+		/* Queues are never removed, so only walking the list needs the lock */
+		spinlock_lock(&spl_bioq_list);
+		struct BIO_QUEUE* q = DQUEUE_HEAD(&bioq_list);
+		spinlock_unlock(&spl_bioq_list);
+		while (q != NULL) {
+			bioq_finish(q);
+			bioq_dispatch(q);
+
+			spinlock_lock(&spl_bioq_list);
+			q = DQUEUE_NEXT(q);
+			spinlock_unlock(&spl_bioq_list);
+		}
+	}
+}
+
+errorcode_t
+bioq_attach(device_t dev, struct BIO_QUEUE_POLICY* policy, unsigned int max_depth)
+{
+	KASSERT(dev->bio_queue == NULL, "device already has a queue");
+	KASSERT(max_depth > 0, "invalid queue depth");
+
+	struct BIO_QUEUE* q = kmalloc(sizeof(struct BIO_QUEUE));
+	memset(q, 0, sizeof(*q));
+	q->q_device = dev;
+	q->q_policy = policy;
+	q->q_max_depth = max_depth;
+	spinlock_init(&q->q_lock);
+	DQUEUE_INIT(&q->q_fifo);
+	DQUEUE_INIT(&q->q_sorted);
+	DQUEUE_INIT(&q->q_done);
+
+	spinlock_lock(&spl_bioq_list);
+	DQUEUE_ADD_TAIL(&bioq_list, q);
+	spinlock_unlock(&spl_bioq_list);
+
+	dev->bio_queue = q;
+	return ANANAS_ERROR_OK;
+}
+
+void
+bioq_get_stats(struct BIO_QUEUE* q, struct BIO_QUEUE_STATS* stats)
+{
+	register_t state = spinlock_lock_unpremptible(&q->q_lock);
+	memcpy(stats, &q->q_stats, sizeof(*stats));
+	spinlock_unlock_unpremptible(&q->q_lock, state);
+}
+
+static errorcode_t
+bioq_start_dispatcher()
+{
+	sem_init(&bioq_sem, 0);
+	kthread_init(&bioq_thread, "bioq", &bioq_dispatcher, NULL);
+	thread_resume(&bioq_thread);
+	bioq_running = 1;
+	return ANANAS_ERROR_OK;
+}
+
+INIT_FUNCTION(bioq_start_dispatcher, SUBSYSTEM_SCHEDULER, ORDER_MIDDLE);
+
+#ifdef OPTION_KDB
+KDB_COMMAND(bioq, NULL, "Display block request queues")
+{
+	if (DQUEUE_EMPTY(&bioq_list))
+		return;
+	DQUEUE_FOREACH(&bioq_list, q, struct BIO_QUEUE) {
+		struct BIO_QUEUE_STATS* qs = &q->q_stats;
+		kprintf("%s%u: policy %s, %u pending, %u of %u in flight (max %u)\n",
+		 q->q_device->name, q->q_device->unit, q->q_policy->qp_name,
+		 q->q_pending, q->q_depth, q->q_max_depth, qs->qs_max_depth);
+		kprintf("  %u requests for %u buffers, %u merged\n",
+		 qs->qs_requests, qs->qs_bios, qs->qs_merges);
+		if (qs->qs_requests > 0)
+			kprintf("  latency: %u cycles average, %u max\n",
+			 (uint32_t)(qs->qs_total_latency / qs->qs_requests), (uint32_t)qs->qs_max_latency);
+	}
+}
+#endif /* KDB */
+
+/* vim:set ts=2 sw=2: */
@@ -1,3 +1,4 @@
+#include <ananas/bioqueue.h>
 #include <ananas/console.h>
 #include <ananas/device.h>
 #include <ananas/error.h>
@@ -325,6 +326,10 @@ device_bwrite(device_t dev, struct BIO* bio)
 {
 	KASSERT(dev->driver != NULL, "device_bwrite() without a driver");
 	KASSERT(dev->driver->drv_bwrite != NULL, "device_bwrite() without drv_bwrite");
+#ifdef OPTION_BIO
+	if (dev->bio_queue != NULL)
+		return bioq_submit(dev->bio_queue, bio, 1);
+#endif
 
 	return dev->driver->drv_bwrite(dev, bio);
 }
@@ -343,10 +348,22 @@ device_bread(device_t dev, struct BIO* bio)
 {
 	KASSERT(dev->driver != NULL, "device_bread() without a driver");
 	KASSERT(dev->driver->drv_bread != NULL, "device_bread() without drv_bread");
+#ifdef OPTION_BIO
+	if (dev->bio_queue != NULL)
+		return bioq_submit(dev->bio_queue, bio, 0);
+#endif
 
 	return dev->driver->drv_bread(dev, bio);
 }
 
+void*
+device_bmap(device_t dev, blocknr_t block, size_t len)
+{
+	if (dev->driver == NULL || dev->driver->drv_bmap == NULL)
+		return NULL;
+	return dev->driver->drv_bmap(dev, block, len);
+}
+
 void
 device_printf(device_t dev, const char* fmt, ...)
 {
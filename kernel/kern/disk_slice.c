@@ -33,10 +33,18 @@ slice_bwrite(device_t dev, struct BIO* bio)
 	return device_bwrite(dev->parent, bio);
 }
 
+static void*
+slice_bmap(device_t dev, blocknr_t block, size_t len)
+{
+	struct SLICE_PRIVATE* privdata = (struct SLICE_PRIVATE*)dev->privdata;
+	return device_bmap(dev->parent, block + privdata->first_block, len);
+}
+
 struct DRIVER drv_slice = {
 	.name	= "slice",
 	.drv_bread = slice_bread,
-	.drv_bwrite = slice_bwrite
+	.drv_bwrite = slice_bwrite,
+	.drv_bmap = slice_bmap
 };
 
 struct DEVICE*
@@ -566,6 +566,15 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 
 #define fprintf(f, fmt, ...) kprintf(fmt, ## __VA_ARGS__)
 # define malloc_getpagesize PAGE_SIZE
+
+/*
+ * We cannot give memory back yet (see ananas_free_memory()), so never try to
+ * trim or release segments, and don't use separate mappings for large chunks
+ * as these would have to be released when freed.
+ */
+#define DEFAULT_TRIM_THRESHOLD MAX_SIZE_T
+#define DEFAULT_MMAP_THRESHOLD MAX_SIZE_T
+#define MAX_RELEASE_CHECK_RATE MAX_SIZE_T
 #endif /* __Ananas__ */
 
 #ifndef WIN32
@@ -135,6 +135,7 @@ dma_buf_alloc(dma_tag_t tag, dma_size_t size, dma_buf_t* buf)
 			break;
 		}
 		s->s_phys = page_get_paddr(s->s_page);
+		s->s_length = seg_size;
 	}
 
 	if (err == ANANAS_ERROR_NONE)
@@ -189,31 +190,74 @@ dma_buf_sync(dma_buf_t buf, DMA_SYNC_TYPE type)
 {
 }
 
-errorcode_t
-dma_buf_load(dma_buf_t buf, void* data, dma_size_t size, dma_load_func_t load, void* load_arg, int flags)
+/*
+ * Appends the segments covering [data, data + size) to 'seg'; pages which are
+ * adjacent in virtual memory need not be in physical memory, so every page may
+ * start a new segment.
+ */
+static errorcode_t
+dma_buf_add_segs(dma_tag_t tag, struct DMA_BUFFER_SEGMENT* seg, unsigned int* num_segs, unsigned int max_segs, void* data, dma_size_t size)
 {
-	dma_tag_t tag = buf->db_tag;
+	addr_t virt = (addr_t)data;
+	while (size > 0) {
+		dma_size_t chunk = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+		if (chunk > size)
+			chunk = size;
+		addr_t phys = kmem_get_phys((void*)virt);
+		if (phys < tag->t_min_addr || phys + chunk - 1 > tag->t_max_addr || (phys & tag->t_alignment) != 0)
+			return ANANAS_ERROR(BAD_ADDRESS); /* XXX we could bounce these */
+
+		struct DMA_BUFFER_SEGMENT* s = (*num_segs > 0) ? &seg[*num_segs - 1] : NULL;
+		if (s != NULL && s->s_phys + s->s_length == phys && s->s_length + chunk <= tag->t_max_seg_size) {
+			/* Physically contiguous with the previous page; extend the segment */
+			s->s_length += chunk;
+		} else {
+			if (*num_segs == max_segs)
+				return ANANAS_ERROR(BAD_LENGTH);
+			s = &seg[(*num_segs)++];
+			s->s_page = NULL;
+			s->s_virt = (void*)virt;
+			s->s_phys = phys;
+			s->s_length = chunk;
+		}
+		virt += chunk;
+		size -= chunk;
+	}
+	return ANANAS_ERROR_OK;
+}
 
-	addr_t phys = kmem_get_phys(data);
-	if (phys >= tag->t_min_addr && phys + size <= tag->t_max_addr &&
-	    size < tag->t_max_seg_size &&
-	    (phys & tag->t_alignment) == 0) {
-		/* This is excellent; the device can accept this buffer as-is */
-		struct DMA_BUFFER_SEGMENT bs;
-		bs.s_page = NULL;
-		bs.s_phys = phys;
-		load(load_arg, &bs, 1);
+static unsigned int
+dma_buf_max_segs(dma_buf_t buf)
+{
+	unsigned int max_segs = buf->db_tag->t_max_segs;
+	if (max_segs > DMA_LOAD_MAX_SEGS)
+		max_segs = DMA_LOAD_MAX_SEGS;
+	return max_segs;
+}
 
-		return ANANAS_ERROR_NONE;
-	}
+errorcode_t
+dma_buf_load(dma_buf_t buf, void* data, dma_size_t size, dma_load_func_t load, void* load_arg, int flags)
+{
+	struct DMA_BUFFER_SEGMENT seg[DMA_LOAD_MAX_SEGS];
+	unsigned int num_segs = 0;
+	errorcode_t err = dma_buf_add_segs(buf->db_tag, seg, &num_segs, dma_buf_max_segs(buf), data, size);
+	ANANAS_ERROR_RETURN(err);
 
-	panic("dma_buf_load(): phys %p rejected, FIXME", phys);
+	return load(load_arg, seg, num_segs);
 }
 
 errorcode_t
 dma_buf_load_bio(dma_buf_t buf, struct BIO* bio, dma_load_func_t load, void* load_arg, int flags)
 {
-	return dma_buf_load(buf, BIO_DATA(bio), bio->length, load, load_arg, flags);
+	/* Pieces of the buffer which happen to be physically adjacent share a segment */
+	struct DMA_BUFFER_SEGMENT seg[DMA_LOAD_MAX_SEGS];
+	unsigned int num_segs = 0;
+	for (unsigned int n = 0; n < bio_num_vecs(bio); n++) {
+		errorcode_t err = dma_buf_add_segs(buf->db_tag, seg, &num_segs, dma_buf_max_segs(buf), bio_vec_data(bio, n), bio_vec_length(bio, n));
+		ANANAS_ERROR_RETURN(err);
+	}
+
+	return load(load_arg, seg, num_segs);
 }
 
 /* vim:set ts=2 sw=2: */
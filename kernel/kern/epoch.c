@@ -0,0 +1,61 @@
+/*
+ * Epoch-based reclamation: lockless readers merely count themselves in one
+ * of two reader counters, selected by the current epoch. A writer wanting
+ * to free something flips the epoch, so that new readers use the other
+ * counter, and waits until the old counter drains.
+ *
+ * A reader may have picked the old counter just before the flip yet only
+ * increment it afterwards; it would then be missed by the next flip, so
+ * epoch_synchronize() flips twice and waits for both counters.
+ */
+#include <ananas/types.h>
+#include <ananas/epoch.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
+#include <ananas/lock.h>
+#include <ananas/schedule.h>
+#include <machine/atomic.h>
+
+static atomic_t epoch_current;
+static atomic_t epoch_readers[2];
+static mutex_t mtx_epoch;
+
+int
+epoch_enter()
+{
+	int idx = atomic_read(&epoch_current) & 1;
+	atomic_add(&epoch_readers[idx], 1); /* acts as a full barrier */
+	return idx;
+}
+
+void
+epoch_exit(int idx)
+{
+	atomic_add(&epoch_readers[idx], -1);
+}
+
+void
+epoch_synchronize()
+{
+	mutex_lock(&mtx_epoch);
+	for (int n = 0; n < 2; n++) {
+		int idx = atomic_add(&epoch_current, 1) & 1;
+		while (atomic_read(&epoch_readers[idx]) != 0)
+			reschedule();
+	}
+	mutex_unlock(&mtx_epoch);
+}
+
+static errorcode_t
+epoch_init()
+{
+	atomic_set(&epoch_current, 0);
+	atomic_set(&epoch_readers[0], 0);
+	atomic_set(&epoch_readers[1], 0);
+	mutex_init(&mtx_epoch, "epoch");
+	return ANANAS_ERROR_OK;
+}
+
+INIT_FUNCTION(epoch_init, SUBSYSTEM_THREAD, ORDER_FIRST);
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,94 @@
+#include <ananas/types.h>
+#include <ananas/lock.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/pcpu.h>
+#include <ananas/symbols.h>
+#include <ananas/thread.h>
+#include <machine/interrupts.h>
+#include "options.h"
+
+/*
+ * Spinlock statistics: for every lock on which we had to wait, we keep a
+ * histogram of the number of cycles spent waiting, one bucket per power of
+ * two. Locks are identified by their address.
+ */
+#define SPINLOCK_STATS_SIZE 256
+#define SPINLOCK_STATS_BUCKETS 32
+
+struct SPINLOCK_STATS {
+	spinlock_t*	ss_lock;
+	unsigned int	ss_contended;
+	uint64_t	ss_cycles;
+	unsigned int	ss_hist[SPINLOCK_STATS_BUCKETS];
+};
+
+/* We can't use a spinlock to protect spinlock statistics, so roll our own */
+static atomic_t spinlock_stats_busy;
+static struct SPINLOCK_STATS spinlock_stats[SPINLOCK_STATS_SIZE];
+static unsigned int spinlock_stats_dropped = 0;
+
+static struct SPINLOCK_STATS*
+spinlock_stats_lookup(spinlock_t* s)
+{
+	unsigned int hash = ((addr_t)s >> 3) & (SPINLOCK_STATS_SIZE - 1);
+	for (unsigned int n = 0; n < SPINLOCK_STATS_SIZE; n++) {
+		struct SPINLOCK_STATS* ss = &spinlock_stats[(hash + n) & (SPINLOCK_STATS_SIZE - 1)];
+		if (ss->ss_lock == NULL) {
+			/* Unused; claim it unless someone beat us to it */
+			register_t state = md_interrupts_save_and_disable();
+			while (atomic_xchg(&spinlock_stats_busy, 1) != 0)
+				md_cpu_pause();
+			if (ss->ss_lock == NULL)
+				ss->ss_lock = s;
+			atomic_set(&spinlock_stats_busy, 0);
+			md_interrupts_restore(state);
+		}
+		if (ss->ss_lock == s)
+			return ss;
+	}
+	return NULL;
+}
+
+void
+spinlock_stats_record(spinlock_t* s, uint64_t cycles)
+{
+	struct SPINLOCK_STATS* ss = spinlock_stats_lookup(s);
+	if (ss == NULL) {
+		spinlock_stats_dropped++;
+		return;
+	}
+
+	unsigned int bucket = (cycles > 0) ? 63 - __builtin_clzll(cycles) : 0;
+	if (bucket >= SPINLOCK_STATS_BUCKETS)
+		bucket = SPINLOCK_STATS_BUCKETS - 1;
+	ss->ss_contended++;
+	ss->ss_cycles += cycles;
+	ss->ss_hist[bucket]++;
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(spinlocks, NULL, "Display spinlock contention histograms")
+{
+	for (unsigned int n = 0; n < SPINLOCK_STATS_SIZE; n++) {
+		struct SPINLOCK_STATS* ss = &spinlock_stats[n];
+		if (ss->ss_lock == NULL || ss->ss_contended == 0)
+			continue;
+		struct SYMBOL sym;
+		if (symbol_resolve_addr((addr_t)ss->ss_lock, &sym))
+			kprintf("%s+0x%x", sym.s_name, (uint32_t)((addr_t)ss->ss_lock - sym.s_addr));
+		else
+			kprintf("%p", ss->ss_lock);
+		kprintf(": contended %u, %u cycles total\n", ss->ss_contended, (uint32_t)ss->ss_cycles);
+		for (unsigned int b = 0; b < SPINLOCK_STATS_BUCKETS; b++) {
+			if (ss->ss_hist[b] == 0)
+				continue;
+			kprintf("  < 2^%u cycles: %u\n", b + 1, ss->ss_hist[b]);
+		}
+	}
+	if (spinlock_stats_dropped > 0)
+		kprintf("(%u contended acquisitions not recorded)\n", spinlock_stats_dropped);
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
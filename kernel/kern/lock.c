@@ -4,7 +4,28 @@
 #include <ananas/lib.h>
 #include <ananas/pcpu.h>
 #include <ananas/schedule.h>
+#include <ananas/symbols.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
 #include <machine/interrupts.h>
+#include "options.h"
+
+/* Waits until our ticket is being served; must be called with our ticket */
+static inline void
+spinlock_wait(spinlock_t* s, int ticket)
+{
+	if (atomic_read(&s->sl_owner) == ticket)
+		return;
+
+#ifdef OPTION_SPINLOCK_STATS
+	uint64_t start = md_cpu_cycles();
+#endif
+	while (atomic_read(&s->sl_owner) != ticket)
+		md_cpu_pause();
+#ifdef OPTION_SPINLOCK_STATS
+	spinlock_stats_record(s, md_cpu_cycles() - start);
+#endif
+}
 
 void
 spinlock_lock(spinlock_t* s)
@@ -12,41 +33,36 @@ spinlock_lock(spinlock_t* s)
 	if (scheduler_activated())
 		KASSERT(md_interrupts_save(), "interrups must be enabled");
 
-	for(;;) {
-		while(atomic_read(&s->sl_var) != 0)
-			/* spin */ ;
-		if (atomic_xchg(&s->sl_var, 1) == 0)
-			break;
-	}
+	spinlock_wait(s, atomic_add(&s->sl_next, 1));
 }
 
 void
 spinlock_unlock(spinlock_t* s)
 {
-	if (atomic_xchg(&s->sl_var, 0) == 0)
+	int owner = atomic_read(&s->sl_owner);
+	if (atomic_read(&s->sl_next) == owner)
 		panic("spinlock %p was not locked", s);
+	/* Only the lock holder modifies sl_owner, so no need for atomic operations */
+	atomic_set(&s->sl_owner, owner + 1);
 }
 
 void
 spinlock_init(spinlock_t* s)
 {
-	atomic_set(&s->sl_var, 0);
+	atomic_set(&s->sl_next, 0);
+	atomic_set(&s->sl_owner, 0);
 }
 
 register_t
 spinlock_lock_unpremptible(spinlock_t* s)
 {
-	register_t state = md_interrupts_save();
-
-	for(;;) {
-		while(atomic_read(&s->sl_var) != 0)
-			/* spin */ ;
-		md_interrupts_disable();
-		if (atomic_xchg(&s->sl_var, 1) == 0)
-			break;
-		/* Lock failed; restore interrupts and try again */
-		md_interrupts_restore(state);
-	}
+	/*
+	 * Once we have a ticket, we must wait for our turn without interrupts as
+	 * an interrupt handler grabbing the same lock would deadlock; we take the
+	 * ticket right away, so that we are served in the order we arrived.
+	 */
+	register_t state = md_interrupts_save_and_disable();
+	spinlock_wait(s, atomic_add(&s->sl_next, 1));
 	return state;
 }
 
@@ -57,6 +73,41 @@ spinlock_unlock_unpremptible(spinlock_t* s, register_t state)
 	md_interrupts_restore(state);
 }
 
+/* Number of times we check a running owner before giving up and sleeping */
+#define MUTEX_SPIN_MAX 1000
+
+/* Number of distinct locations for which we keep statistics; must be a power of two */
+#define MUTEX_STATS_SIZE 256
+
+static spinlock_t spl_mutex_stats = SPINLOCK_DEFAULT_INIT;
+static struct MUTEX_STATS mutex_stats[MUTEX_STATS_SIZE];
+static struct MUTEX_STATS mutex_stats_overflow = { "(other)", 0 };
+
+/*
+ * Looks up the statistics entry for a given source location, creating it if
+ * needed. Entries are never removed, so lookups need not take the lock.
+ */
+static struct MUTEX_STATS*
+mutex_stats_lookup(const char* fname, int line)
+{
+	unsigned int hash = ((addr_t)fname ^ (line * 31)) & (MUTEX_STATS_SIZE - 1);
+	for (unsigned int n = 0; n < MUTEX_STATS_SIZE; n++) {
+		struct MUTEX_STATS* ms = &mutex_stats[(hash + n) & (MUTEX_STATS_SIZE - 1)];
+		if (ms->ms_fname == NULL) {
+			/* Unused; claim it unless someone beat us to it */
+			register_t state = spinlock_lock_unpremptible(&spl_mutex_stats);
+			if (ms->ms_fname == NULL) {
+				ms->ms_line = line;
+				ms->ms_fname = fname;
+			}
+			spinlock_unlock_unpremptible(&spl_mutex_stats, state);
+		}
+		if (ms->ms_fname == fname && ms->ms_line == line)
+			return ms;
+	}
+	return &mutex_stats_overflow;
+}
+
 void
 mutex_init(mutex_t* mtx, const char* name)
 {
@@ -64,18 +115,68 @@ mutex_init(mutex_t* mtx, const char* name)
 	mtx->mtx_owner = NULL;
 	mtx->mtx_fname = NULL;
 	mtx->mtx_line = 0;
+	mtx->mtx_stats = NULL;
+	mtx->mtx_acquired = 0;
 	sem_init(&mtx->mtx_sem, 1);
 }
 
-void
-mutex_lock_(mutex_t* mtx, const char* fname, int line)
+/*
+ * Spins as long as the owner of the mutex is running on another CPU, in the
+ * hope that it will let go of the mutex soon; there is no point in this if
+ * the owner is not running as it will need us to go away first. Returns
+ * non-zero if the mutex was acquired.
+ */
+static int
+mutex_spin(mutex_t* mtx)
 {
-	sem_wait(&mtx->mtx_sem);
+	thread_t* curthread = PCPU_GET(curthread);
+	for (int n = 0; n < MUTEX_SPIN_MAX; n++) {
+		thread_t* owner = mtx->mtx_owner;
+		if (owner == NULL) {
+			/* Likely just released; try once more, as we would otherwise sleep on a free mutex */
+			return sem_trywait(&mtx->mtx_sem);
+		}
+		if (owner == curthread || !THREAD_IS_ACTIVE(owner))
+			break;
+		md_cpu_pause();
+		if (mtx->mtx_sem.sem_count > 0 && sem_trywait(&mtx->mtx_sem))
+			return 1;
+	}
+	return 0;
+}
 
-	/* We got the mutex */
+static inline void
+mutex_set_owner(mutex_t* mtx, const char* fname, int line, struct MUTEX_STATS* ms)
+{
 	mtx->mtx_owner = PCPU_GET(curthread);
 	mtx->mtx_fname = fname;
 	mtx->mtx_line = line;
+	mtx->mtx_stats = ms;
+	mtx->mtx_acquired = md_cpu_cycles();
+}
+
+void
+mutex_lock_(mutex_t* mtx, const char* fname, int line)
+{
+	struct MUTEX_STATS* ms = mutex_stats_lookup(fname, line);
+	ms->ms_acquisitions++;
+
+	if (!sem_trywait(&mtx->mtx_sem)) {
+		if (mutex_spin(mtx)) {
+			ms->ms_spins++;
+		} else {
+			/*
+			 * We have to sleep; note that mutex_unlock() hands the mutex directly
+			 * to the first waiter, so only a single thread is woken up and no one
+			 * can take the mutex away from it.
+			 */
+			ms->ms_sleeps++;
+			sem_wait(&mtx->mtx_sem);
+		}
+	}
+
+	/* We got the mutex */
+	mutex_set_owner(mtx, fname, line, ms);
 }
 
 int
@@ -85,9 +186,9 @@ mutex_trylock_(mutex_t* mtx, const char* fname, int line)
 		return 0;
 
 	/* We got the mutex */
-	mtx->mtx_owner = PCPU_GET(curthread);
-	mtx->mtx_fname = fname;
-	mtx->mtx_line = line;
+	struct MUTEX_STATS* ms = mutex_stats_lookup(fname, line);
+	ms->ms_acquisitions++;
+	mutex_set_owner(mtx, fname, line, ms);
 	return 1;
 }
 
@@ -95,9 +196,14 @@ void
 mutex_unlock(mutex_t* mtx)
 {
 	KASSERT(mtx->mtx_owner == PCPU_GET(curthread), "unlocking mutex %p which isn't owned", mtx);
+	struct MUTEX_STATS* ms = mtx->mtx_stats;
+	uint64_t held = md_cpu_cycles() - mtx->mtx_acquired;
+	if (ms != NULL && held > ms->ms_max_hold)
+		ms->ms_max_hold = held;
 	mtx->mtx_owner = NULL;
 	mtx->mtx_fname = NULL;
 	mtx->mtx_line = 0;
+	mtx->mtx_stats = NULL;
 	sem_signal(&mtx->mtx_sem);
 }
 
@@ -170,15 +276,43 @@ sem_signal(semaphore_t* sem)
 	spinlock_unlock_unpremptible(&sem->sem_lock, state);
 }	
 
-/* Waits for a semaphore to be signalled, but holds it locked */
+struct SEMAPHORE_TIMEOUT {
+	struct TIMER			st_timer;
+	semaphore_t*			st_sem;
+	struct SEMAPHORE_WAITER*	st_waiter;
+};
+
+/* Called from the timer interrupt once a timed wait has expired */
 static void
-sem_wait_and_lock(semaphore_t* sem, register_t* state)
+sem_timeout(void* arg)
+{
+	struct SEMAPHORE_TIMEOUT* st = arg;
+	semaphore_t* sem = st->st_sem;
+	struct SEMAPHORE_WAITER* sw = st->st_waiter;
+
+	register_t state = spinlock_lock_unpremptible(&sem->sem_lock);
+	if (!sw->sw_signalled) {
+		/* Not signalled yet; give up on the semaphore and wake the waiter up */
+		DQUEUE_REMOVE(&sem->sem_wq, sw);
+		sw->sw_timedout = 1;
+		thread_resume(sw->sw_thread);
+	}
+	spinlock_unlock_unpremptible(&sem->sem_lock, state);
+}
+
+/*
+ * Waits for a semaphore to be signalled, but holds it locked; if 'deadline'
+ * is not zero, the wait is aborted once that timer tick has been reached.
+ * Returns non-zero if the semaphore was acquired.
+ */
+static int
+sem_wait_and_lock(semaphore_t* sem, register_t* state, uint64_t deadline)
 {
 	/* Happy flow first: if there are units left, we are done */
 	*state = spinlock_lock_unpremptible(&sem->sem_lock);
 	if (sem->sem_count > 0) {
 		sem->sem_count--;
-		return;
+		return 1;
 	}
 
 	/*
@@ -191,14 +325,35 @@ sem_wait_and_lock(semaphore_t* sem, register_t* state)
 	struct SEMAPHORE_WAITER sw;
 	sw.sw_thread = curthread;
 	sw.sw_signalled = 0;
+	sw.sw_timedout = 0;
 	DQUEUE_ADD_TAIL(&sem->sem_wq, &sw);
+
+	struct SEMAPHORE_TIMEOUT st;
+	if (deadline != 0) {
+		st.st_sem = sem;
+		st.st_waiter = &sw;
+		timer_init(&st.st_timer, sem_timeout, &st);
+		timer_schedule(&st.st_timer, deadline);
+	}
+
 	do {
 		thread_suspend(curthread);
 		/* Let go of the lock, but keep interrupts disabled */
 		spinlock_unlock(&sem->sem_lock);
 		schedule();
 		spinlock_lock_unpremptible(&sem->sem_lock);
-	} while (sw.sw_signalled == 0);
+	} while (sw.sw_signalled == 0 && sw.sw_timedout == 0);
+
+	if (deadline != 0) {
+		/*
+		 * Ensure the timer is gone before our stack is; this waits for the
+		 * callback to complete, so we must let go of the lock while doing so.
+		 */
+		spinlock_unlock(&sem->sem_lock);
+		timer_cancel(&st.st_timer);
+		spinlock_lock_unpremptible(&sem->sem_lock);
+	}
+	return sw.sw_signalled;
 }
 
 void
@@ -207,17 +362,29 @@ sem_wait(semaphore_t* sem)
 	KASSERT(PCPU_GET(nested_irq) == 0, "sem_wait() in irq");
 
 	register_t state;
-	sem_wait_and_lock(sem, &state);
+	sem_wait_and_lock(sem, &state, 0);
 	spinlock_unlock_unpremptible(&sem->sem_lock, state);
 }
 
+int
+sem_timedwait(semaphore_t* sem, unsigned int ms)
+{
+	KASSERT(PCPU_GET(nested_irq) == 0, "sem_timedwait() in irq");
+
+	/* The current tick is already partially over, so add an extra one */
+	register_t state;
+	int result = sem_wait_and_lock(sem, &state, timer_get_ticks() + TIMER_MS_TO_TICKS(ms) + 1);
+	spinlock_unlock_unpremptible(&sem->sem_lock, state);
+	return result;
+}
+
 void
 sem_wait_and_drain(semaphore_t* sem)
 {
 	KASSERT(PCPU_GET(nested_irq) == 0, "sem_wait_and_drain() in irq");
 
 	register_t state;
-	sem_wait_and_lock(sem, &state);
+	sem_wait_and_lock(sem, &state, 0);
 	sem->sem_count = 0; /* drain all remaining units */
 	spinlock_unlock_unpremptible(&sem->sem_lock, state);
 }
@@ -237,4 +404,18 @@ sem_trywait(semaphore_t* sem)
 	return result;
 }
 
+#ifdef OPTION_KDB
+KDB_COMMAND(mutexes, NULL, "Display mutex contention statistics")
+{
+	for (unsigned int n = 0; n <= MUTEX_STATS_SIZE; n++) {
+		struct MUTEX_STATS* ms = (n < MUTEX_STATS_SIZE) ? &mutex_stats[n] : &mutex_stats_overflow;
+		if (ms->ms_fname == NULL || ms->ms_acquisitions == 0)
+			continue;
+		kprintf("%s:%d: acquired %u, spun %u, slept %u, max hold %u cycles\n",
+		 ms->ms_fname, ms->ms_line, ms->ms_acquisitions, ms->ms_spins, ms->ms_sleeps,
+		 (uint32_t)ms->ms_max_hold);
+	}
+}
+#endif /* OPTION_KDB */
+
 /* vim:set ts=2 sw=2: */
@@ -1,13 +1,57 @@
+/*
+ * Kernel memory allocator.
+ *
+ * Small allocations are served from a set of power-of-two sized object
+ * caches; these have per-CPU magazines, so most allocations and frees only
+ * touch the current CPU's data and take no lock at all. Larger allocations
+ * are rare and go to dlmalloc, which is protected by a single mutex.
+ *
+ * Every allocation is preceded by a header which records where it came from,
+ * so that kfree() knows where to return it to.
+ */
 #include <ananas/types.h>
 #include <machine/param.h>
 #include <machine/vm.h>
 #include <ananas/lock.h>
 #include <ananas/mm.h>
+#include <ananas/slab.h>
 #include <ananas/vm.h>
 #include <ananas/lib.h>
 
+/*
+ * Smallest and largest size class, including the header, as power of two;
+ * larger classes would waste too much of their single page slabs.
+ */
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_NUM_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+/* Class used for allocations which do not fit in any size class */
+#define KMALLOC_CLASS_LARGE 0xffff
+
+#define KMALLOC_MAGIC 0xbeef
+
+/*
+ * Header placed in front of every allocation; this is 16 bytes so that the
+ * alignment dlmalloc and the caches provide is retained.
+ */
+struct KMALLOC_HEADER {
+	uint16_t	kh_magic;
+	uint16_t	kh_class;
+	uint32_t	kh_pad[3];
+};
+
 static mutex_t mtx_mm;
 
+static struct KMEM_CACHE kmalloc_cache[KMALLOC_NUM_CLASSES] = {
+	KMEM_CACHE_INITIALIZER("kmalloc-32", 32, NULL),
+	KMEM_CACHE_INITIALIZER("kmalloc-64", 64, NULL),
+	KMEM_CACHE_INITIALIZER("kmalloc-128", 128, NULL),
+	KMEM_CACHE_INITIALIZER("kmalloc-256", 256, NULL),
+	KMEM_CACHE_INITIALIZER("kmalloc-512", 512, NULL),
+	KMEM_CACHE_INITIALIZER("kmalloc-1024", 1024, NULL),
+};
+
 void* dlmalloc(size_t);
 void dlfree(void*);
 
@@ -17,21 +61,55 @@ mm_init()
 	mutex_init(&mtx_mm, "mm");
 }
 
+static inline unsigned int
+kmalloc_size_class(size_t len)
+{
+	unsigned int class = 0;
+	while ((1 << (KMALLOC_MIN_SHIFT + class)) < len)
+		class++;
+	return class;
+}
 
 void*
 kmalloc(size_t len)
 {
-	mutex_lock(&mtx_mm);
-	void* ptr = dlmalloc(len);
-	mutex_unlock(&mtx_mm);
-	return ptr;
+	struct KMALLOC_HEADER* kh;
+	len += sizeof(struct KMALLOC_HEADER);
+	if (len <= (1 << KMALLOC_MAX_SHIFT)) {
+		unsigned int class = kmalloc_size_class(len);
+		kh = kmem_cache_alloc(&kmalloc_cache[class]);
+		if (kh == NULL)
+			return NULL;
+		kh->kh_class = class;
+	} else {
+		mutex_lock(&mtx_mm);
+		kh = dlmalloc(len);
+		mutex_unlock(&mtx_mm);
+		if (kh == NULL)
+			return NULL;
+		kh->kh_class = KMALLOC_CLASS_LARGE;
+	}
+	kh->kh_magic = KMALLOC_MAGIC;
+	return kh + 1;
 }
 
 void
 kfree(void* addr)
 {
+	if (addr == NULL)
+		return;
+
+	struct KMALLOC_HEADER* kh = (struct KMALLOC_HEADER*)addr - 1;
+	KASSERT(kh->kh_magic == KMALLOC_MAGIC, "freeing %p which was not allocated by kmalloc()", addr);
+	kh->kh_magic = 0;
+	if (kh->kh_class != KMALLOC_CLASS_LARGE) {
+		KASSERT(kh->kh_class < KMALLOC_NUM_CLASSES, "invalid size class %u for %p", kh->kh_class, addr);
+		kmem_cache_free(&kmalloc_cache[kh->kh_class], kh);
+		return;
+	}
+
 	mutex_lock(&mtx_mm);
-	dlfree(addr);
+	dlfree(kh);
 	mutex_unlock(&mtx_mm);
 }
 
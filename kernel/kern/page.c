@@ -1,8 +1,22 @@
+/*
+ * Pages are allocated from zones using a buddy allocator; every zone has its
+ * own lock.
+ *
+ * Because most allocations are single pages, every CPU keeps a cache of
+ * order-0 pages in front of the zones; single page allocations and frees
+ * normally only touch this cache, which is refilled from and drained to the
+ * zones PAGE_CACHE_BATCH pages at a time. Recently freed (hot) pages are
+ * placed at the head of the cache and handed out first, whereas draining
+ * takes the coldest pages from the tail. A CPU's cache is only accessed by
+ * that CPU with interrupts disabled, so it needs no lock.
+ */
 #include <ananas/page.h>
 #include <machine/param.h>
+#include <machine/interrupts.h>
 #include <ananas/init.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
+#include <ananas/pcpu.h>
 #include <ananas/vm.h>
 #include <ananas/kmem.h>
 #include <ananas/dqueue.h>
@@ -16,7 +30,18 @@
 # define DPRINTF(...)
 #endif
 
+/* Maximum number of pages in a per-CPU cache */
+#define PAGE_CACHE_MAX 64
+/* Number of pages moved between a per-CPU cache and the zones at once */
+#define PAGE_CACHE_BATCH 16
+
+struct PAGE_CACHE {
+	struct page_list pc_pages;		/* Cached pages, hottest first */
+	struct PAGE_CACHE_STATS pc_stats;
+};
+
 static struct zone_list zones;
+static struct PAGE_CACHE page_cache[PCPU_MAX_CPUS];
 
 static inline int
 get_bit(const char* map, int bit)
@@ -52,14 +77,12 @@ bytes2order(size_t length)
 	return order;
 }
 
-void
-page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
+static void
+page_free_index_locked(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 {
 	struct PAGE* p = &z->z_base[index];
 	DPRINTF("page_free_index(): order=%u index=%u -> p=%p\n", order, index, p);
 
-	spinlock_lock(&z->z_lock);
-
 	/* Clear the current index; it is available */
 	clear_bit(z->z_bitmap, index);
 	z->z_avail_pages += 1 << order;
@@ -92,33 +115,28 @@ page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 		DQUEUE_ADD_TAIL(&z->z_free[order], &z->z_base[index]);
 		z->z_base[index].p_order = order;
 	}
-
-	spinlock_unlock(&z->z_lock);
 }
 
 void
-page_free(struct PAGE* p)
+page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index)
 {
-	struct PAGE_ZONE* z = p->p_zone;
-	page_free_index(z, p->p_order, p - z->z_base);
+	spinlock_lock(&z->z_lock);
+	page_free_index_locked(z, order, index);
+	spinlock_unlock(&z->z_lock);
 }
 
-struct PAGE*
-page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
+static struct PAGE*
+page_alloc_zone_locked(struct PAGE_ZONE* z, unsigned int order)
 {
 	DPRINTF("page_alloc_zone(): z=%p, order=%u\n", z, order);
 
-	spinlock_lock(&z->z_lock);
-
 	/* First step is to figure out the initial order we need to use */
 	unsigned int alloc_order = order;
 	while (alloc_order < PAGE_NUM_ORDERS && DQUEUE_EMPTY(&z->z_free[alloc_order]))
 		alloc_order++; /* nothing free here */
 	DPRINTF("page_alloc_zone(): z=%p, order=%u -> alloc_order=%u\n", z, order, alloc_order);
-	if (alloc_order == PAGE_NUM_ORDERS) {
-		spinlock_unlock(&z->z_lock);
+	if (alloc_order == PAGE_NUM_ORDERS)
 		return NULL;
-	}
 
 	/* Now we need to keep splitting each block from alloc_order .. order */
 	for (unsigned int n = alloc_order; n >= order; n--) {
@@ -142,7 +160,6 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 			set_bit(z->z_bitmap, index);
 			DPRINTF("page_alloc_zone(): got page=%p, index %u\n", p, index);
 			z->z_avail_pages -= 1 << order;
-			spinlock_unlock(&z->z_lock);
 			return p;
 		}
 
@@ -161,6 +178,182 @@ page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
 	return NULL;
 }
 
+struct PAGE*
+page_alloc_zone(struct PAGE_ZONE* z, unsigned int order)
+{
+	spinlock_lock(&z->z_lock);
+	struct PAGE* p = page_alloc_zone_locked(z, order);
+	spinlock_unlock(&z->z_lock);
+	return p;
+}
+
+/*
+ * Returns the page cache of the current CPU, or NULL if there is none; this
+ * is the case early in the boot process, before the per-CPU data is set up.
+ * Interrupts must be disabled.
+ */
+static inline struct PAGE_CACHE*
+page_cache_get()
+{
+	int cpuid = PCPU_GET(cpuid);
+	if (pcpu_get(cpuid) == NULL)
+		return NULL;
+	return &page_cache[cpuid];
+}
+
+/* Allocates up to 'count' single pages from the zones and places them on 'list' */
+static unsigned int
+page_cache_fill(struct page_list* list, unsigned int count)
+{
+	unsigned int n = 0;
+	DQUEUE_FOREACH(&zones, z, struct PAGE_ZONE) {
+		spinlock_lock(&z->z_lock);
+		for (/* nothing */; n < count; n++) {
+			struct PAGE* p = page_alloc_zone_locked(z, 0);
+			if (p == NULL)
+				break;
+			DQUEUE_ADD_TAIL(list, p);
+		}
+		spinlock_unlock(&z->z_lock);
+		if (n == count)
+			break;
+	}
+	return n;
+}
+
+/* Returns all pages on 'list' to their zones */
+static void
+page_cache_release(struct page_list* list)
+{
+	struct PAGE_ZONE* z = NULL;
+	while (!DQUEUE_EMPTY(list)) {
+		struct PAGE* p = DQUEUE_HEAD(list);
+		DQUEUE_POP_HEAD(list);
+		/* Pages will mostly be from the same zone, so try to keep the lock */
+		if (p->p_zone != z) {
+			if (z != NULL)
+				spinlock_unlock(&z->z_lock);
+			z = p->p_zone;
+			spinlock_lock(&z->z_lock);
+		}
+		page_free_index_locked(z, 0, p - z->z_base);
+	}
+	if (z != NULL)
+		spinlock_unlock(&z->z_lock);
+}
+
+/* Allocates a single page from the current CPU's cache, refilling it if needed */
+static struct PAGE*
+page_cache_alloc()
+{
+	register_t state = md_interrupts_save_and_disable();
+	struct PAGE_CACHE* pc = page_cache_get();
+	if (pc == NULL) {
+		md_interrupts_restore(state);
+		return NULL;
+	}
+
+	if (DQUEUE_EMPTY(&pc->pc_pages)) {
+		/*
+		 * Cache is empty; refill it. We must not keep interrupts disabled while
+		 * doing so, so we may end up on another CPU - this is harmless.
+		 */
+		pc->pc_stats.pcs_misses++;
+		md_interrupts_restore(state);
+
+		struct page_list list;
+		DQUEUE_INIT(&list);
+		if (page_cache_fill(&list, PAGE_CACHE_BATCH) == 0)
+			return NULL;
+
+		state = md_interrupts_save_and_disable();
+		pc = page_cache_get();
+		pc->pc_stats.pcs_refills++;
+		while (!DQUEUE_EMPTY(&list)) {
+			struct PAGE* p = DQUEUE_HEAD(&list);
+			DQUEUE_POP_HEAD(&list);
+			DQUEUE_ADD_TAIL(&pc->pc_pages, p);
+			pc->pc_stats.pcs_cached++;
+		}
+	} else {
+		pc->pc_stats.pcs_hits++;
+	}
+
+	struct PAGE* p = DQUEUE_HEAD(&pc->pc_pages);
+	DQUEUE_POP_HEAD(&pc->pc_pages);
+	pc->pc_stats.pcs_cached--;
+	md_interrupts_restore(state);
+	return p;
+}
+
+/* Frees a single page to the current CPU's cache; returns zero if there is no cache */
+static int
+page_cache_free(struct PAGE* p)
+{
+	register_t state = md_interrupts_save_and_disable();
+	struct PAGE_CACHE* pc = page_cache_get();
+	if (pc == NULL) {
+		md_interrupts_restore(state);
+		return 0;
+	}
+
+	/* The page was just used, so it's likely to be hot */
+	DQUEUE_ADD_HEAD(&pc->pc_pages, p);
+	pc->pc_stats.pcs_cached++;
+	if (pc->pc_stats.pcs_cached <= PAGE_CACHE_MAX) {
+		md_interrupts_restore(state);
+		return 1;
+	}
+
+	/* Cache is full; hand the coldest pages back to the zones */
+	struct page_list list;
+	DQUEUE_INIT(&list);
+	for (unsigned int n = 0; n < PAGE_CACHE_BATCH; n++) {
+		struct PAGE* cold = DQUEUE_TAIL(&pc->pc_pages);
+		DQUEUE_POP_TAIL(&pc->pc_pages);
+		DQUEUE_ADD_TAIL(&list, cold);
+	}
+	pc->pc_stats.pcs_cached -= PAGE_CACHE_BATCH;
+	pc->pc_stats.pcs_drains++;
+	md_interrupts_restore(state);
+
+	page_cache_release(&list);
+	return 1;
+}
+
+/* Returns all pages in the current CPU's cache to the zones */
+static void
+page_cache_drain()
+{
+	struct page_list list;
+	DQUEUE_INIT(&list);
+
+	register_t state = md_interrupts_save_and_disable();
+	struct PAGE_CACHE* pc = page_cache_get();
+	if (pc != NULL && !DQUEUE_EMPTY(&pc->pc_pages)) {
+		while (!DQUEUE_EMPTY(&pc->pc_pages)) {
+			struct PAGE* p = DQUEUE_HEAD(&pc->pc_pages);
+			DQUEUE_POP_HEAD(&pc->pc_pages);
+			DQUEUE_ADD_TAIL(&list, p);
+		}
+		pc->pc_stats.pcs_cached = 0;
+		pc->pc_stats.pcs_drains++;
+	}
+	md_interrupts_restore(state);
+
+	page_cache_release(&list);
+}
+
+void
+page_free(struct PAGE* p)
+{
+	if (p->p_order == 0 && page_cache_free(p))
+		return;
+
+	struct PAGE_ZONE* z = p->p_zone;
+	page_free_index(z, p->p_order, p - z->z_base);
+}
+
 void
 page_zone_add(addr_t base, size_t length)
 {
@@ -200,11 +393,25 @@ page_zone_add(addr_t base, size_t length)
 	}
 
 	/*
-	 * Now, free all chunks of memory. This is slow, we could do better but for
-	 * now it'll help guarantee that the implementation is correct.
+	 * Now, free all chunks of memory. Rather than freeing every page and having
+	 * the buddies merged, we directly create the blocks the merging would have
+	 * resulted in: the largest order blocks that are aligned and fit in the
+	 * zone. Only the first page of a free block needs to be marked available
+	 * in the bitmap, but merging clears all of them so we do so as well.
 	 */
-	for (int n = 0; n < z->z_num_pages; n++)
-		page_free_index(z, 0, n);
+	memset(z->z_bitmap, 0, z->z_num_pages / 8);
+	for (unsigned int n = z->z_num_pages & ~7; n < z->z_num_pages; n++)
+		clear_bit(z->z_bitmap, n);
+	unsigned int index = 0;
+	while (index < z->z_num_pages) {
+		unsigned int order = PAGE_NUM_ORDERS - 1;
+		while ((index & ((1 << order) - 1)) != 0 || index + (1 << order) > z->z_num_pages)
+			order--;
+		z->z_base[index].p_order = order;
+		DQUEUE_ADD_TAIL(&z->z_free[order], &z->z_base[index]);
+		z->z_avail_pages += 1 << order;
+		index += 1 << order;
+	}
 
 	/* Add the zone to the list XXX there should be some lock on zones */
 	DQUEUE_ADD_TAIL(&zones, z);
@@ -226,6 +433,23 @@ page_alloc_order(int order)
 	KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
 	KASSERT(!DQUEUE_EMPTY(&zones), "no zones");
 
+	if (order == 0) {
+		struct PAGE* page = page_cache_alloc();
+		if (page != NULL)
+			return page;
+	}
+
+	DQUEUE_FOREACH(&zones, z, struct PAGE_ZONE) {
+		struct PAGE* page = page_alloc_zone(z, order);
+		if (page != NULL)
+			return page;
+	}
+
+	/*
+	 * Nothing available; our cache may be holding pages we could merge, so
+	 * hand them back and try once more before giving up.
+	 */
+	page_cache_drain();
 	DQUEUE_FOREACH(&zones, z, struct PAGE_ZONE) {
 		struct PAGE* page = page_alloc_zone(z, order);
 		if (page != NULL)
@@ -269,6 +493,21 @@ page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
 		*avail_pages += z->z_avail_pages;
 		spinlock_unlock(&z->z_lock);
 	}
+
+	/* Pages in the per-CPU caches are available as well */
+	for (int cpuid = 0; cpuid < pcpu_get_num_cpus(); cpuid++)
+		*avail_pages += page_cache[cpuid].pc_stats.pcs_cached;
+}
+
+int
+page_get_cache_stats(int cpuid, struct PAGE_CACHE_STATS* stats)
+{
+	if (pcpu_get(cpuid) == NULL)
+		return 0;
+
+	/* No locking; the statistics are just a snapshot */
+	memcpy(stats, &page_cache[cpuid].pc_stats, sizeof(*stats));
+	return 1;
 }
 
 #ifdef OPTION_KDB
@@ -304,6 +543,17 @@ KDB_COMMAND(pages, NULL, "Display page zones")
 	DQUEUE_FOREACH(&zones, z, struct PAGE_ZONE) {
 		page_dump(z);
 	}
+
+	for (int cpuid = 0; cpuid < pcpu_get_num_cpus(); cpuid++) {
+		struct PAGE_CACHE_STATS pcs;
+		if (!page_get_cache_stats(cpuid, &pcs))
+			continue;
+		unsigned int total = pcs.pcs_hits + pcs.pcs_misses;
+		kprintf("cpu %u page cache: cached %u, hits %u, misses %u (%u percent hit), refills %u, drains %u\n",
+		 cpuid, pcs.pcs_cached, pcs.pcs_hits, pcs.pcs_misses,
+		 (total > 0) ? (pcs.pcs_hits * 100) / total : 0,
+		 pcs.pcs_refills, pcs.pcs_drains);
+	}
 }
 #endif
 
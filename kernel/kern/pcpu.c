@@ -3,11 +3,21 @@
 #include <ananas/lib.h>
 #include <ananas/pcpu.h>
 #include <ananas/thread.h>
+#include <ananas/schedule.h>
 #include <machine/param.h> /* for PAGE_SIZE */
 
+static struct PCPU* pcpu_list[PCPU_MAX_CPUS];
+static int pcpu_num_cpus = 0;
+
 void
 pcpu_init(struct PCPU* pcpu)
 {
+	KASSERT(pcpu->cpuid < PCPU_MAX_CPUS, "cpu %u exceeds maximum of %u cpus", pcpu->cpuid, PCPU_MAX_CPUS);
+	pcpu_list[pcpu->cpuid] = pcpu;
+	if (pcpu_num_cpus <= pcpu->cpuid)
+		pcpu_num_cpus = pcpu->cpuid + 1;
+	runqueue_init(&pcpu->runqueue);
+
 	pcpu->idlethread = kmalloc(sizeof(struct THREAD));
 	KASSERT(pcpu->idlethread != NULL, "out of memory for idle thread");
 
@@ -25,4 +35,18 @@ pcpu_init(struct PCPU* pcpu)
 	pcpu->idlethread->t_priority = THREAD_PRIORITY_IDLE;
 }
 
+struct PCPU*
+pcpu_get(int cpuid)
+{
+	if (cpuid < 0 || cpuid >= pcpu_num_cpus)
+		return NULL;
+	return pcpu_list[cpuid];
+}
+
+int
+pcpu_get_num_cpus()
+{
+	return pcpu_num_cpus;
+}
+
 /* vim:set ts=2 sw=2: */
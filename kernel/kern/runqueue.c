@@ -0,0 +1,105 @@
+/*
+ * Runqueues hold the threads that are ready to run on a given CPU. Every
+ * priority level has its own FIFO list, and a two-level bitmap tracks which
+ * lists are non-empty; this makes adding, removing and finding the most
+ * important thread O(1) while maintaining round-robin order within each
+ * priority level.
+ *
+ * This code does not do any locking by itself; the scheduler is expected to
+ * hold rq_lock as needed.
+ */
+#include <ananas/types.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/schedule.h>
+
+void
+runqueue_init(struct SCHED_RUNQUEUE* rq)
+{
+	spinlock_init(&rq->rq_lock);
+	rq->rq_summary = 0;
+	for (unsigned int n = 0; n < SCHED_BITMAP_WORDS; n++)
+		rq->rq_bitmap[n] = 0;
+	for (unsigned int n = 0; n < SCHED_NUM_PRIORITIES; n++)
+		DQUEUE_INIT(&rq->rq_queue[n]);
+	rq->rq_depth = 0;
+	rq->rq_steals = 0;
+	rq->rq_stolen = 0;
+}
+
+void
+runqueue_add(struct SCHED_RUNQUEUE* rq, struct SCHED_PRIV* sp, int prio)
+{
+	KASSERT(prio >= 0 && prio < SCHED_NUM_PRIORITIES, "invalid priority %d", prio);
+
+	sp->sp_prio = prio;
+	DQUEUE_ADD_TAIL(&rq->rq_queue[prio], sp);
+	rq->rq_bitmap[prio / SCHED_BITMAP_BITS] |= 1U << (prio % SCHED_BITMAP_BITS);
+	rq->rq_summary |= 1U << (prio / SCHED_BITMAP_BITS);
+	rq->rq_depth++;
+}
+
+void
+runqueue_remove(struct SCHED_RUNQUEUE* rq, struct SCHED_PRIV* sp)
+{
+	int prio = sp->sp_prio;
+	KASSERT(rq->rq_depth > 0, "removing item from empty runqueue");
+
+	struct SCHEDULER_QUEUE* q = &rq->rq_queue[prio];
+	DQUEUE_REMOVE(q, sp);
+	if (DQUEUE_EMPTY(q)) {
+		/* Level is now empty; update the bitmaps to match */
+		rq->rq_bitmap[prio / SCHED_BITMAP_BITS] &= ~(1U << (prio % SCHED_BITMAP_BITS));
+		if (rq->rq_bitmap[prio / SCHED_BITMAP_BITS] == 0)
+			rq->rq_summary &= ~(1U << (prio / SCHED_BITMAP_BITS));
+	}
+	rq->rq_depth--;
+}
+
+/* Locates the first non-empty priority level >= prio, or -1 if there is none */
+static int
+runqueue_find_level(struct SCHED_RUNQUEUE* rq, int prio)
+{
+	if (prio >= SCHED_NUM_PRIORITIES)
+		return -1;
+
+	/* First try the remaining levels in the word prio is in */
+	unsigned int word = prio / SCHED_BITMAP_BITS;
+	uint32_t bits = rq->rq_bitmap[word] & (~0U << (prio % SCHED_BITMAP_BITS));
+	if (bits != 0)
+		return word * SCHED_BITMAP_BITS + __builtin_ctz(bits);
+
+	/* Nothing there; use the summary to find the next non-empty word */
+	if (word + 1 >= SCHED_BITMAP_WORDS)
+		return -1;
+	uint32_t summary = rq->rq_summary & (~0U << (word + 1));
+	if (summary == 0)
+		return -1;
+	word = __builtin_ctz(summary);
+	return word * SCHED_BITMAP_BITS + __builtin_ctz(rq->rq_bitmap[word]);
+}
+
+struct SCHED_PRIV*
+runqueue_first(struct SCHED_RUNQUEUE* rq)
+{
+	if (rq->rq_summary == 0)
+		return NULL;
+	int prio = runqueue_find_level(rq, 0);
+	KASSERT(prio >= 0, "summary set but no levels found");
+	return DQUEUE_HEAD(&rq->rq_queue[prio]);
+}
+
+struct SCHED_PRIV*
+runqueue_next(struct SCHED_RUNQUEUE* rq, struct SCHED_PRIV* sp)
+{
+	if (DQUEUE_NEXT(sp) != NULL)
+		return DQUEUE_NEXT(sp);
+
+	/* End of this level; continue with the next, less important, level */
+	int prio = runqueue_find_level(rq, sp->sp_prio + 1);
+	if (prio < 0)
+		return NULL;
+	return DQUEUE_HEAD(&rq->rq_queue[prio]);
+}
+
+/* vim:set ts=2 sw=2: */
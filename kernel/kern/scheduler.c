@@ -1,17 +1,29 @@
 /*
- * This contains the scheduler; it has two queues: a runqueue (containing all
- * threads that can run) and a sleepqueue (threads which cannot run). The
- * current thread is never on either of these queues; the reason is that the
- * administration of threads is distinct from the scheduler, and having the
- * scheduler re-add a thread that has expired its timeslice back to the
- * runqueue avoids nasty races (as well as being much easier to follow)
+ * This contains the scheduler; every CPU has its own runqueue (containing all
+ * threads that can run on that CPU) and there is a sleepqueue (threads
+ * which cannot run). The thread a CPU is currently executing stays on its
+ * runqueue; the scheduler re-adds a thread that has expired its timeslice to
+ * the back of the runqueue, which avoids nasty races (as well as being much
+ * easier to follow)
+ *
+ * A CPU only ever picks threads from its own runqueue; once it has nothing
+ * but its idle thread left, it will try to steal a thread from the other
+ * CPU's. Threads bound to a specific CPU are always placed on that CPU's
+ * runqueue and will never be stolen.
+ *
+ * The sleepqueue is hashed by wait channel, which is just an address the
+ * sleeping thread is waiting on; every bucket has its own lock, so that
+ * unrelated sleepers and wakers do not contend with each other. Threads that
+ * are suspended without a wait channel end up in the bucket of NULL.
+ *
+ * Locking order is: sleepqueue bucket lock, runqueue locks (in ascending CPU
+ * order). A thread's sp_cpu field is only changed with its runqueue lock held
+ * and its sp_wchan field only with its sleepqueue bucket lock held.
  */
 #include <machine/thread.h>
 #include <machine/interrupts.h>
 #include <ananas/error.h>
 #include <ananas/kdb.h>
-#include <ananas/pcpu.h>
-#include <ananas/pcpu.h>
 #include <ananas/lock.h>
 #include <ananas/lib.h>
 #include <ananas/init.h>
@@ -33,9 +45,22 @@
 
 static int scheduler_active = 0;
 
-static spinlock_t spl_scheduler = SPINLOCK_DEFAULT_INIT;
-static struct SCHEDULER_QUEUE sched_runqueue;
-static struct SCHEDULER_QUEUE sched_sleepqueue;
+#define SCHED_SLEEPQUEUE_BUCKETS 64
+
+static struct SCHED_SLEEPQUEUE {
+	spinlock_t sq_lock;
+	struct SCHEDULER_QUEUE sq_queue;
+} sched_sleepqueue[SCHED_SLEEPQUEUE_BUCKETS];
+
+static inline struct SCHED_SLEEPQUEUE*
+scheduler_get_sleepqueue(const void* wchan)
+{
+	addr_t a = (addr_t)wchan;
+	/* Wait channels tend to be aligned addresses; fold the upper bits in */
+	a ^= a >> 6;
+	a ^= a >> 12;
+	return &sched_sleepqueue[a % SCHED_SLEEPQUEUE_BUCKETS];
+}
 
 #ifdef DEBUG_SCHEDULER
 static int
@@ -48,94 +73,202 @@ scheduler_is_on_queue(struct SCHEDULER_QUEUE* q, thread_t* t)
 	}
 	return n;
 }
+
+static int
+scheduler_is_on_runqueue(struct SCHED_RUNQUEUE* rq, thread_t* t)
+{
+	int n = 0;
+	RUNQUEUE_FOREACH(rq, s) {
+		if (s->sp_thread == t)
+			n++;
+	}
+	return n;
+}
 #define SCHED_ASSERT(x,...) KASSERT((x), __VA_ARGS__)
 #else
 #define SCHED_ASSERT(x,...)
 #endif
 
+static inline struct SCHED_RUNQUEUE*
+scheduler_get_runqueue(int cpuid)
+{
+	struct PCPU* pcpu = pcpu_get(cpuid);
+	KASSERT(pcpu != NULL, "no per-cpu data for cpu %d", cpuid);
+	return &pcpu->runqueue;
+}
+
+/*
+ * Locks the runqueue the thread is on; because the thread may be stolen by
+ * another CPU while we wait for the lock, we have to verify that it is still
+ * there once we have it. Interrupts must be disabled.
+ */
+static struct SCHED_RUNQUEUE*
+scheduler_lock_thread_runqueue(thread_t* t)
+{
+	for(;;) {
+		int cpuid = t->t_sched_priv.sp_cpu;
+		struct SCHED_RUNQUEUE* rq = scheduler_get_runqueue(cpuid);
+		spinlock_lock_unpremptible(&rq->rq_lock);
+		if (t->t_sched_priv.sp_cpu == cpuid)
+			return rq;
+		spinlock_unlock(&rq->rq_lock);
+	}
+}
+
 void
 scheduler_init_thread(thread_t* t)
 {
 	/* Hook up our private scheduling entity */
 	t->t_sched_priv.sp_thread = t;
+	t->t_sched_priv.sp_cpu = -1;
 
 	/* Mark the thread as suspened - the scheduler is responsible for this */
 	t->t_flags |= THREAD_FLAG_SUSPENDED;
 
 	/* Hook the thread to our sleepqueue */
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
-	KASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 0, "new thread is already on runq?");
-	KASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "new thread is already on sleepq?");
-	DQUEUE_ADD_TAIL(&sched_sleepqueue, &t->t_sched_priv);
-	spinlock_unlock_unpremptible(&spl_scheduler, state);
+	t->t_sched_priv.sp_wchan = NULL;
+	struct SCHED_SLEEPQUEUE* sq = scheduler_get_sleepqueue(NULL);
+	register_t state = spinlock_lock_unpremptible(&sq->sq_lock);
+	KASSERT(scheduler_is_on_queue(&sq->sq_queue, t) == 0, "new thread is already on sleepq?");
+	DQUEUE_ADD_TAIL(&sq->sq_queue, &t->t_sched_priv);
+	spinlock_unlock_unpremptible(&sq->sq_lock, state);
 }
 
 static void
-scheduler_add_thread_locked(thread_t* t)
+scheduler_add_thread_locked(struct SCHED_RUNQUEUE* rq, thread_t* t)
 {
-	KASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 0, "adding thread on runq?");
-	KASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "adding thread on sleepq?");
+	SCHED_ASSERT(scheduler_is_on_runqueue(rq, t) == 0, "adding thread on runq?");
 
 	/*
-	 * Add it to the runqueue - note that we must preserve order here
-	 * because the threads must be sorted in order of priority
-	 * XXX Note that this is O(n) - we can do better
+	 * Add it to the back of the list for its priority level; this gives us
+	 * round-robin scheduling within each level.
 	 */
-	int inserted = 0;
-	if (!DQUEUE_EMPTY(&sched_runqueue)) {
-		DQUEUE_FOREACH(&sched_runqueue, s, struct SCHED_PRIV) {
-			KASSERT(s->sp_thread != t, "thread %p already in runqueue", t);
-			if (s->sp_thread->t_priority <= t->t_priority)
-				continue;
+	runqueue_add(rq, &t->t_sched_priv, t->t_priority);
+}
 
-			/* Found a thread with a lower priority; we can insert it here */
-			DQUEUE_INSERT_BEFORE(&sched_runqueue, s, &t->t_sched_priv);
-			inserted++;
-			break;
-		}
-	}
-	if (!inserted)
-		DQUEUE_ADD_TAIL(&sched_runqueue, &t->t_sched_priv);
+static void
+scheduler_remove_thread_locked(struct SCHED_RUNQUEUE* rq, thread_t* t)
+{
+	runqueue_remove(rq, &t->t_sched_priv);
 }
 
-void
-scheduler_add_thread(thread_t* t)
+/*
+ * Determines on which CPU a thread that becomes runnable is to be placed:
+ * pinned threads always go to their own CPU, others go to the CPU they last
+ * ran on (as their cache may still be warm) or the current CPU otherwise.
+ */
+static int
+scheduler_select_cpu(thread_t* t)
 {
-	SCHED_KPRINTF("%s: t=%p\n", __func__, t);
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
+	if (t->t_affinity != THREAD_AFFINITY_ANY)
+		return t->t_affinity;
+	if (t->t_sched_priv.sp_cpu >= 0)
+		return t->t_sched_priv.sp_cpu;
+	return PCPU_GET(cpuid);
+}
+
+/*
+ * Moves a suspended thread from the sleepqueue to a runqueue; the caller must
+ * hold the lock of the sleepqueue bucket the thread is on.
+ */
+static void
+scheduler_wakeup_thread_locked(struct SCHED_SLEEPQUEUE* sq, thread_t* t)
+{
+	int cpuid = scheduler_select_cpu(t);
+	struct SCHED_RUNQUEUE* rq = scheduler_get_runqueue(cpuid);
+	spinlock_lock_unpremptible(&rq->rq_lock);
 	KASSERT(THREAD_IS_SUSPENDED(t), "adding non-suspended thread %p", t);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 0, "adding thread %p already on runqueue", t);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 1, "adding thread %p not on sleepqueue", t);
+	SCHED_ASSERT(scheduler_is_on_runqueue(rq, t) == 0, "adding thread %p already on runqueue", t);
+	SCHED_ASSERT(scheduler_is_on_queue(&sq->sq_queue, t) == 1, "adding thread %p not on sleepqueue", t);
 	/* Remove the thread from the sleepqueue ... */
-	DQUEUE_REMOVE(&sched_sleepqueue, &t->t_sched_priv);
+	DQUEUE_REMOVE(&sq->sq_queue, &t->t_sched_priv);
+	t->t_sched_priv.sp_wchan = NULL;
 	/* ... and add it to the runqueue ... */
-	scheduler_add_thread_locked(t);
+	scheduler_add_thread_locked(rq, t);
+	t->t_sched_priv.sp_cpu = cpuid;
 	/*
 	 * ... and finally, update the flags: we must do this in the scheduler lock because
 	 *     no one else is allowed to touch the thread while we're moving it
 	 */
 	t->t_flags &= ~THREAD_FLAG_SUSPENDED;
-	spinlock_unlock_unpremptible(&spl_scheduler, state);
+	spinlock_unlock(&rq->rq_lock);
+}
+
+/*
+ * Locks the sleepqueue bucket the thread is on; like with the runqueue, the
+ * thread may move while we are waiting, so verify once we have the lock.
+ * Interrupts must be disabled.
+ */
+static struct SCHED_SLEEPQUEUE*
+scheduler_lock_thread_sleepqueue(thread_t* t)
+{
+	for(;;) {
+		const void* wchan = t->t_sched_priv.sp_wchan;
+		struct SCHED_SLEEPQUEUE* sq = scheduler_get_sleepqueue(wchan);
+		spinlock_lock_unpremptible(&sq->sq_lock);
+		if (t->t_sched_priv.sp_wchan == wchan)
+			return sq;
+		spinlock_unlock(&sq->sq_lock);
+	}
 }
 
 void
-scheduler_remove_thread(thread_t* t)
+scheduler_add_thread(thread_t* t)
 {
 	SCHED_KPRINTF("%s: t=%p\n", __func__, t);
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
+	register_t state = md_interrupts_save_and_disable();
+	struct SCHED_SLEEPQUEUE* sq = scheduler_lock_thread_sleepqueue(t);
+	scheduler_wakeup_thread_locked(sq, t);
+	spinlock_unlock_unpremptible(&sq->sq_lock, state);
+}
+
+void
+scheduler_sleep_thread(thread_t* t, const void* wchan)
+{
+	SCHED_KPRINTF("%s: t=%p wchan=%p\n", __func__, t, wchan);
+	register_t state = md_interrupts_save_and_disable();
+	struct SCHED_SLEEPQUEUE* sq = scheduler_get_sleepqueue(wchan);
+	spinlock_lock_unpremptible(&sq->sq_lock);
+	struct SCHED_RUNQUEUE* rq = scheduler_lock_thread_runqueue(t);
 	KASSERT(!THREAD_IS_SUSPENDED(t), "removing suspended thread %p", t);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "removing thread already on sleepqueue");
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 1, "removing thread not on runqueue");
+	SCHED_ASSERT(scheduler_is_on_queue(&sq->sq_queue, t) == 0, "removing thread already on sleepqueue");
+	SCHED_ASSERT(scheduler_is_on_runqueue(rq, t) == 1, "removing thread not on runqueue");
 	/* Remove the thread from the runqueue ... */
-	DQUEUE_REMOVE(&sched_runqueue, &t->t_sched_priv);
+	scheduler_remove_thread_locked(rq, t);
 	/* ... add it to the sleepqueue ... */
-	DQUEUE_ADD_TAIL(&sched_sleepqueue, &t->t_sched_priv);
+	t->t_sched_priv.sp_wchan = wchan;
+	DQUEUE_ADD_TAIL(&sq->sq_queue, &t->t_sched_priv);
 	/*
 	 * ... and finally, update the flags: we must do this in the scheduler lock because
 	 *     no one else is allowed to touch the thread while we're moving it
 	 */
 	t->t_flags |= THREAD_FLAG_SUSPENDED;
-	spinlock_unlock_unpremptible(&spl_scheduler, state);
+	spinlock_unlock(&rq->rq_lock);
+	spinlock_unlock_unpremptible(&sq->sq_lock, state);
+}
+
+void
+scheduler_remove_thread(thread_t* t)
+{
+	scheduler_sleep_thread(t, NULL);
+}
+
+int
+scheduler_wakeup(const void* wchan)
+{
+	KASSERT(wchan != NULL, "waking up NULL wait channel");
+	register_t state = md_interrupts_save_and_disable();
+	struct SCHED_SLEEPQUEUE* sq = scheduler_get_sleepqueue(wchan);
+	spinlock_lock_unpremptible(&sq->sq_lock);
+	int n = 0;
+	DQUEUE_FOREACH_SAFE(&sq->sq_queue, sp, struct SCHED_PRIV) {
+		if (sp->sp_wchan != wchan)
+			continue;
+		scheduler_wakeup_thread_locked(sq, sp->sp_thread);
+		n++;
+	}
+	spinlock_unlock_unpremptible(&sq->sq_lock, state);
+	return n;
 }
 
 void
@@ -146,11 +279,11 @@ scheduler_exit_thread(thread_t* t)
 	 * remove the thread from the schedulers runqueue, and it will not be re-added again.
 	 * Thus, if a context switch would occur, the final exiting code will not be run.
 	 */
-	spinlock_lock_unpremptible(&spl_scheduler);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, t) == 1, "exiting thread already not on sleepqueue");
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, t) == 0, "exiting thread on runqueue");
+	md_interrupts_disable();
+	struct SCHED_RUNQUEUE* rq = scheduler_lock_thread_runqueue(t);
+	SCHED_ASSERT(scheduler_is_on_runqueue(rq, t) == 1, "exiting thread not on runqueue");
 	/* Thread seems sane; remove it from the runqueue */
-	DQUEUE_REMOVE(&sched_runqueue, &t->t_sched_priv);
+	scheduler_remove_thread_locked(rq, t);
 	/*
 	 * Turn the thread into a zombie; we'll soon be letting go of the scheduler lock, but all
 	 * resources are gone and the thread can be destroyed from now on - interrupts are disabled,
@@ -159,8 +292,8 @@ scheduler_exit_thread(thread_t* t)
 	 * about the thread at all.
 	 */
 	t->t_flags |= THREAD_FLAG_ZOMBIE;
-	/* Let go of the scheduler lock but leave interrupts disabled */
-	spinlock_unlock(&spl_scheduler);
+	/* Let go of the runqueue lock but leave interrupts disabled */
+	spinlock_unlock(&rq->rq_lock);
 
 	/* Force a reschedule - won't return */
 	schedule();
@@ -174,6 +307,81 @@ scheduler_release(thread_t* old)
 	old->t_flags &= ~THREAD_FLAG_ACTIVE;
 }
 
+/* Picks the most important thread on the runqueue which we can run */
+static struct SCHED_PRIV*
+scheduler_pick_locked(struct SCHED_RUNQUEUE* rq, int cpuid, thread_t* curthread)
+{
+	RUNQUEUE_FOREACH(rq, sp) {
+		/* Skip the thread if we can't schedule it here */
+		if (sp->sp_thread->t_affinity != THREAD_AFFINITY_ANY &&
+			  sp->sp_thread->t_affinity != cpuid)
+			continue;
+		/* Skip threads that are still being switched away from elsewhere */
+		if (THREAD_IS_ACTIVE(sp->sp_thread) && sp->sp_thread != curthread)
+			continue;
+		return sp;
+	}
+	return NULL;
+}
+
+/*
+ * Attempts to steal a single thread from another CPU and place it on the
+ * runqueue of the given CPU. Neighbouring CPU's are tried first. Interrupts
+ * must be disabled and no runqueue locks may be held. Returns non-zero if a
+ * thread was stolen.
+ */
+static int
+scheduler_steal(int cpuid)
+{
+	int num_cpus = pcpu_get_num_cpus();
+	struct SCHED_RUNQUEUE* rq = scheduler_get_runqueue(cpuid);
+	for (int n = 1; n < num_cpus; n++) {
+		int victim_cpuid = (cpuid + n) % num_cpus;
+		struct PCPU* victim_pcpu = pcpu_get(victim_cpuid);
+		if (victim_pcpu == NULL)
+			continue;
+		struct SCHED_RUNQUEUE* victim_rq = &victim_pcpu->runqueue;
+
+		/* Unlocked peek; a victim with just its own idle thread has nothing to give */
+		if (victim_rq->rq_depth <= 1)
+			continue;
+
+		/* Lock both runqueues in CPU order to avoid deadlocks */
+		if (cpuid < victim_cpuid) {
+			spinlock_lock_unpremptible(&rq->rq_lock);
+			spinlock_lock_unpremptible(&victim_rq->rq_lock);
+		} else {
+			spinlock_lock_unpremptible(&victim_rq->rq_lock);
+			spinlock_lock_unpremptible(&rq->rq_lock);
+		}
+
+		struct SCHED_PRIV* stolen = NULL;
+		RUNQUEUE_FOREACH(victim_rq, sp) {
+			thread_t* t = sp->sp_thread;
+			/* Only threads not bound to a CPU and not running anywhere can move */
+			if (t->t_affinity != THREAD_AFFINITY_ANY || THREAD_IS_ACTIVE(t))
+				continue;
+			stolen = sp;
+			break;
+		}
+		if (stolen != NULL) {
+			thread_t* t = stolen->sp_thread;
+			SCHED_KPRINTF("%s[%d]: stealing t=%p from cpu %d\n", __func__, cpuid, t, victim_cpuid);
+			scheduler_remove_thread_locked(victim_rq, t);
+			scheduler_add_thread_locked(rq, t);
+			stolen->sp_cpu = cpuid;
+			victim_rq->rq_stolen++;
+			rq->rq_steals++;
+		}
+
+		spinlock_unlock(&victim_rq->rq_lock);
+		spinlock_unlock(&rq->rq_lock);
+		if (stolen != NULL)
+			return 1;
+	}
+	return 0;
+}
+
 void
 schedule()
 {
@@ -183,39 +391,16 @@ schedule()
 	SCHED_KPRINTF("schedule(): cpu=%u curthread=%p\n", cpuid, curthread);
 
 	/*
-	 * Grab the scheduler lock and disable interrupts; note that they need not be
+	 * Grab our runqueue lock and disable interrupts; note that they need not be
 	 * enabled - this happens in interrupt context, which needs to clean up
 	 * before another interrupt can be handled.
 	 */
-	register_t state = spinlock_lock_unpremptible(&spl_scheduler);
+	struct SCHED_RUNQUEUE* rq = scheduler_get_runqueue(cpuid);
+	register_t state = spinlock_lock_unpremptible(&rq->rq_lock);
 
 	/* Cancel any rescheduling as we are about to schedule here */
 	curthread->t_flags &= ~THREAD_FLAG_RESCHEDULE;
 
-	/* Pick the next thread to schedule */
-	KASSERT(!DQUEUE_EMPTY(&sched_runqueue), "runqueue cannot be empty");
-	struct SCHED_PRIV* next_sched = NULL;
-	DQUEUE_FOREACH(&sched_runqueue, sp, struct SCHED_PRIV) {
-		/* Skip the thread if we can't schedule it here */
-		if (sp->sp_thread->t_affinity != THREAD_AFFINITY_ANY &&
-			  sp->sp_thread->t_affinity != cpuid)
-			continue;
-		if (THREAD_IS_ACTIVE(sp->sp_thread) && sp->sp_thread != curthread)
-			continue;
-		next_sched = sp;
-		break;
-	}
-	KASSERT(next_sched != NULL, "nothing on the runqueue for cpu %u", cpuid);
-
-	/* Sanity checks */
-	thread_t* newthread = next_sched->sp_thread;
-	KASSERT(!THREAD_IS_SUSPENDED(newthread), "activating suspended thread %p", newthread);
-	KASSERT(newthread == curthread || !THREAD_IS_ACTIVE(newthread), "activating active thread %p", newthread);
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_runqueue, newthread) == 1, "scheduling thread not on runqueue (?)");
-	SCHED_ASSERT(scheduler_is_on_queue(&sched_sleepqueue, newthread) == 0, "scheduling thread on sleepqueue");
-
-	SCHED_KPRINTF("%s[%d]: newthread=%p curthread=%p\n", __func__, cpuid, newthread, curthread);
-
 	/*
 	 * If the current thread is not suspended, this means it got interrupted
 	 * involuntary and must be placed back on the running queue; otherwise it
@@ -223,15 +408,41 @@ schedule()
 	 * in order to obtain round-robin scheduling within each priority level.
 	 *
 	 * We must also take care not to re-add zombie threads; these must not be
-	 * re-added to either scheduler queue.
+	 * re-added to either scheduler queue. Finally, a thread that has just
+	 * been resumed may be placed on another CPU's runqueue while we are still
+	 * running it; that CPU will pick it up once we switch away from it.
 	 */
-	if (!THREAD_IS_SUSPENDED(curthread) && !THREAD_IS_ZOMBIE(curthread)) {
-		SCHED_KPRINTF("%s[%d]: removing t=%p from runqueue\n", __func__, cpuid, curthread);
-		DQUEUE_REMOVE(&sched_runqueue, &curthread->t_sched_priv);
+	if (!THREAD_IS_SUSPENDED(curthread) && !THREAD_IS_ZOMBIE(curthread) &&
+	    curthread->t_sched_priv.sp_cpu == cpuid) {
 		SCHED_KPRINTF("%s[%d]: re-adding t=%p\n", __func__, cpuid, curthread);
-		scheduler_add_thread_locked(curthread);
+		scheduler_remove_thread_locked(rq, curthread);
+		scheduler_add_thread_locked(rq, curthread);
 	}
 
+	/* Pick the next thread to schedule */
+	KASSERT(rq->rq_depth > 0, "runqueue of cpu %u cannot be empty", cpuid);
+	struct SCHED_PRIV* next_sched = scheduler_pick_locked(rq, cpuid, curthread);
+	if (next_sched == NULL || next_sched->sp_thread == PCPU_GET(idlethread)) {
+		/*
+		 * Nothing but the idle thread left for us; see if another CPU has
+		 * work to spare. We must let go of our lock to prevent deadlocks.
+		 */
+		spinlock_unlock(&rq->rq_lock);
+		scheduler_steal(cpuid);
+		spinlock_lock_unpremptible(&rq->rq_lock);
+		/* Our runqueue may have changed while it was unlocked; pick again */
+		next_sched = scheduler_pick_locked(rq, cpuid, curthread);
+	}
+	KASSERT(next_sched != NULL, "nothing on the runqueue for cpu %u", cpuid);
+
+	/* Sanity checks */
+	thread_t* newthread = next_sched->sp_thread;
+	KASSERT(!THREAD_IS_SUSPENDED(newthread), "activating suspended thread %p", newthread);
+	KASSERT(newthread == curthread || !THREAD_IS_ACTIVE(newthread), "activating active thread %p", newthread);
+	SCHED_ASSERT(scheduler_is_on_runqueue(rq, newthread) == 1, "scheduling thread not on runqueue (?)");
+
+	SCHED_KPRINTF("%s[%d]: newthread=%p curthread=%p\n", __func__, cpuid, newthread, curthread);
+
 	/*
 	 * Schedule our new thread; by marking it as active, it will not be picked up by another
 	 * CPU.
@@ -239,8 +450,8 @@ schedule()
 	newthread->t_flags |= THREAD_FLAG_ACTIVE;
 	PCPU_SET(curthread, newthread);
 
-	/* Now unlock the scheduler lock but do _not_ enable interrupts */
-	spinlock_unlock(&spl_scheduler);
+	/* Now unlock the runqueue lock but do _not_ enable interrupts */
+	spinlock_unlock(&rq->rq_lock);
 
 	if (curthread != newthread) {
 		thread_t* prev = md_thread_switch(newthread, curthread);
@@ -292,22 +503,36 @@ scheduler_activated()
 #ifdef OPTION_KDB
 KDB_COMMAND(scheduler, NULL, "Display scheduler status")
 {
-	kprintf("runqueue\n");
-	if (!DQUEUE_EMPTY(&sched_runqueue)) {
-		DQUEUE_FOREACH(&sched_runqueue, s, struct SCHED_PRIV) {
-			kprintf("  thread %p\n", s->sp_thread);
+	int num_cpus = pcpu_get_num_cpus();
+	for (int cpuid = 0; cpuid < num_cpus; cpuid++) {
+		struct PCPU* pcpu = pcpu_get(cpuid);
+		if (pcpu == NULL)
+			continue;
+		struct SCHED_RUNQUEUE* rq = &pcpu->runqueue;
+		kprintf("cpu %u runqueue: depth %u, stole %u, stolen %u\n",
+		 cpuid, rq->rq_depth, rq->rq_steals, rq->rq_stolen);
+		if (rq->rq_depth > 0) {
+			RUNQUEUE_FOREACH(rq, s) {
+				kprintf("  thread %p prio %d%s\n", s->sp_thread, s->sp_prio,
+				 THREAD_IS_ACTIVE(s->sp_thread) ? " (active)" : "");
+			}
+		} else {
+			kprintf("(empty)\n");
 		}
-	} else {
-		kprintf("(empty)\n");
 	}
 	kprintf("sleepqueue\n");
-	if (!DQUEUE_EMPTY(&sched_sleepqueue)) {
-		DQUEUE_FOREACH(&sched_sleepqueue, s, struct SCHED_PRIV) {
-			kprintf("  thread %p\n", s->sp_thread);
+	int num_sleepers = 0;
+	for (int n = 0; n < SCHED_SLEEPQUEUE_BUCKETS; n++) {
+		struct SCHED_SLEEPQUEUE* sq = &sched_sleepqueue[n];
+		if (DQUEUE_EMPTY(&sq->sq_queue))
+			continue;
+		DQUEUE_FOREACH(&sq->sq_queue, s, struct SCHED_PRIV) {
+			kprintf("  thread %p wchan %p (bucket %u)\n", s->sp_thread, s->sp_wchan, n);
+			num_sleepers++;
 		}
-	} else {
-		kprintf("(empty)\n");
 	}
+	if (num_sleepers == 0)
+		kprintf("(empty)\n");
 }
 #endif /* OPTION_KDB */
 
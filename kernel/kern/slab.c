@@ -0,0 +1,416 @@
+/*
+ * Object caches (slabs) for fixed-size kernel objects.
+ *
+ * Every cache carves its objects from single pages obtained from the page
+ * allocator; such a page is called a slab. A slab starts with a KMEM_SLAB
+ * header, followed by a stack of free object indices and finally the objects
+ * themselves. As slabs are page-aligned, the slab an object belongs to can be
+ * found by rounding the object's address down to a page boundary.
+ *
+ * Free objects are tracked outside of the objects, so their contents are
+ * never touched by the cache; this allows the constructor to run only once,
+ * when the slab is created.
+ *
+ * Slabs live on one of three lists depending on how many objects are in use
+ * (partial, full and empty) and are protected by the cache lock. To avoid
+ * taking this lock for most allocations, every CPU has a magazine of free
+ * objects which is only accessed by that CPU with interrupts disabled. Empty
+ * magazines are refilled from the slabs and full ones are drained to them,
+ * KMEM_MAGAZINE_BATCH objects at a time.
+ */
+#include <ananas/types.h>
+#include <machine/param.h>
+#include <machine/interrupts.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/pcpu.h>
+#include <ananas/kmem.h>
+#include <ananas/slab.h>
+#include <ananas/vm.h>
+#include "options.h"
+
+/*
+ * Alignment of every object; this matches what kmalloc() provides and is
+ * needed for structures containing FPU state, such as threads.
+ */
+#define KMEM_OBJ_ALIGN 16
+
+struct KMEM_SLAB {
+	struct KMEM_CACHE*	ks_cache;
+	struct PAGE*		ks_page;
+	unsigned int		ks_num_free;		/* Number of entries in ks_free */
+	DQUEUE_FIELDS(struct KMEM_SLAB);
+	uint16_t		ks_free[];		/* Indices of free objects */
+};
+
+static spinlock_t spl_caches = SPINLOCK_DEFAULT_INIT;
+static struct KMEM_CACHE_LIST caches;
+
+static inline struct KMEM_SLAB*
+kmem_slab_from_obj(void* obj)
+{
+	return (struct KMEM_SLAB*)((addr_t)obj & ~(PAGE_SIZE - 1));
+}
+
+static inline void*
+kmem_slab_obj(struct KMEM_CACHE* kc, struct KMEM_SLAB* ks, unsigned int index)
+{
+	return (char*)ks + kc->kc_offset + index * kc->kc_objsize;
+}
+
+/* Calculates how objects are placed in a slab; must be called with the cache lock held */
+static void
+kmem_cache_setup_locked(struct KMEM_CACHE* kc)
+{
+	size_t objsize = (kc->kc_size + KMEM_OBJ_ALIGN - 1) & ~(KMEM_OBJ_ALIGN - 1);
+
+	/* Every object needs space for itself and its entry in the free index stack */
+	unsigned int n = (PAGE_SIZE - sizeof(struct KMEM_SLAB)) / (objsize + sizeof(uint16_t));
+	size_t offset;
+	for (/* nothing */; n > 0; n--) {
+		offset = sizeof(struct KMEM_SLAB) + n * sizeof(uint16_t);
+		offset = (offset + KMEM_OBJ_ALIGN - 1) & ~(KMEM_OBJ_ALIGN - 1);
+		if (offset + n * objsize <= PAGE_SIZE)
+			break;
+	}
+	KASSERT(n > 0, "cache '%s': object size %u does not fit in a slab", kc->kc_name, kc->kc_size);
+
+	kc->kc_objsize = objsize;
+	kc->kc_offset = offset;
+	kc->kc_objs_per_slab = n;
+	DQUEUE_INIT(&kc->kc_partial);
+	DQUEUE_INIT(&kc->kc_full);
+	DQUEUE_INIT(&kc->kc_empty);
+	kc->kc_num_slabs = 0;
+	kc->kc_num_inuse = 0;
+
+	spinlock_lock(&spl_caches);
+	DQUEUE_ADD_TAIL(&caches, kc);
+	spinlock_unlock(&spl_caches);
+}
+
+/* Allocates and constructs a new slab; called without the cache lock held */
+static struct KMEM_SLAB*
+kmem_slab_create(struct KMEM_CACHE* kc)
+{
+	struct PAGE* p;
+	struct KMEM_SLAB* ks = page_alloc_single_mapped(&p, VM_FLAG_READ | VM_FLAG_WRITE);
+	if (ks == NULL)
+		return NULL;
+	KASSERT(((addr_t)ks & (PAGE_SIZE - 1)) == 0, "slab %p not page-aligned", ks);
+
+	ks->ks_cache = kc;
+	ks->ks_page = p;
+	ks->ks_num_free = kc->kc_objs_per_slab;
+	/* Hand out the objects in order; the stack is popped from the end */
+	for (unsigned int n = 0; n < kc->kc_objs_per_slab; n++)
+		ks->ks_free[n] = kc->kc_objs_per_slab - n - 1;
+	if (kc->kc_ctor != NULL)
+		for (unsigned int n = 0; n < kc->kc_objs_per_slab; n++)
+			kc->kc_ctor(kmem_slab_obj(kc, ks, n));
+	return ks;
+}
+
+static void
+kmem_slab_destroy(struct KMEM_SLAB* ks)
+{
+	struct PAGE* p = ks->ks_page;
+	kmem_unmap(ks, PAGE_SIZE);
+	page_free(p);
+}
+
+/*
+ * Fetches up to 'count' objects from the slabs and stores them in 'obj';
+ * returns the number of objects obtained. Must be called with the cache lock
+ * held, which may be dropped to create a new slab.
+ */
+static unsigned int
+kmem_cache_get_locked(struct KMEM_CACHE* kc, void** obj, unsigned int count)
+{
+	unsigned int n = 0;
+	while (n < count) {
+		struct KMEM_SLAB* ks;
+		if (!DQUEUE_EMPTY(&kc->kc_partial)) {
+			ks = DQUEUE_HEAD(&kc->kc_partial);
+		} else if (!DQUEUE_EMPTY(&kc->kc_empty)) {
+			ks = DQUEUE_HEAD(&kc->kc_empty);
+			DQUEUE_POP_HEAD(&kc->kc_empty);
+			DQUEUE_ADD_HEAD(&kc->kc_partial, ks);
+		} else if (n > 0) {
+			/* Don't grow the cache if we can already satisfy our caller */
+			break;
+		} else {
+			spinlock_unlock(&kc->kc_lock);
+			ks = kmem_slab_create(kc);
+			spinlock_lock(&kc->kc_lock);
+			if (ks == NULL)
+				break;
+			kc->kc_num_slabs++;
+			DQUEUE_ADD_HEAD(&kc->kc_partial, ks);
+		}
+
+		while (n < count && ks->ks_num_free > 0) {
+			unsigned int index = ks->ks_free[--ks->ks_num_free];
+			obj[n++] = kmem_slab_obj(kc, ks, index);
+			kc->kc_num_inuse++;
+		}
+		if (ks->ks_num_free == 0) {
+			DQUEUE_REMOVE(&kc->kc_partial, ks);
+			DQUEUE_ADD_TAIL(&kc->kc_full, ks);
+		}
+	}
+	return n;
+}
+
+/*
+ * Returns 'count' objects to their slabs. We keep at most a single empty slab
+ * around; any others are placed on 'release' so the caller can destroy them
+ * once the cache lock is dropped.
+ */
+static void
+kmem_cache_put_locked(struct KMEM_CACHE* kc, void** obj, unsigned int count, struct KMEM_SLAB_LIST* release)
+{
+	for (unsigned int n = 0; n < count; n++) {
+		struct KMEM_SLAB* ks = kmem_slab_from_obj(obj[n]);
+		KASSERT(ks->ks_cache == kc, "object %p freed to cache '%s' but belongs to %p", obj[n], kc->kc_name, ks->ks_cache);
+		KASSERT(ks->ks_num_free < kc->kc_objs_per_slab, "object %p freed to empty slab", obj[n]);
+
+		unsigned int index = ((char*)obj[n] - (char*)ks - kc->kc_offset) / kc->kc_objsize;
+		if (ks->ks_num_free++ == 0) {
+			DQUEUE_REMOVE(&kc->kc_full, ks);
+			DQUEUE_ADD_HEAD(&kc->kc_partial, ks);
+		}
+		ks->ks_free[ks->ks_num_free - 1] = index;
+		kc->kc_num_inuse--;
+
+		if (ks->ks_num_free < kc->kc_objs_per_slab)
+			continue;
+
+		DQUEUE_REMOVE(&kc->kc_partial, ks);
+		if (DQUEUE_EMPTY(&kc->kc_empty)) {
+			DQUEUE_ADD_TAIL(&kc->kc_empty, ks);
+		} else {
+			DQUEUE_ADD_TAIL(release, ks);
+			kc->kc_num_slabs--;
+		}
+	}
+}
+
+static void
+kmem_cache_release(struct KMEM_SLAB_LIST* release)
+{
+	while (!DQUEUE_EMPTY(release)) {
+		struct KMEM_SLAB* ks = DQUEUE_HEAD(release);
+		DQUEUE_POP_HEAD(release);
+		kmem_slab_destroy(ks);
+	}
+}
+
+/*
+ * Returns the current CPU's magazine, or NULL if there is none; this is the
+ * case early in the boot process, before the per-CPU data is set up.
+ * Interrupts must be disabled.
+ */
+static inline struct KMEM_MAGAZINE*
+kmem_magazine_get(struct KMEM_CACHE* kc)
+{
+	int cpuid = PCPU_GET(cpuid);
+	if (pcpu_get(cpuid) == NULL)
+		return NULL;
+	return &kc->kc_magazine[cpuid];
+}
+
+struct KMEM_CACHE*
+kmem_cache_create(const char* name, size_t size, kmem_ctor_t ctor)
+{
+	struct KMEM_CACHE* kc = kmalloc(sizeof(*kc));
+	if (kc == NULL)
+		return NULL;
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	spinlock_init(&kc->kc_lock);
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct KMEM_CACHE* kc)
+{
+	/*
+	 * Nothing may use the cache anymore, so we can just as well throw away the
+	 * magazines of all CPU's.
+	 */
+	struct KMEM_SLAB_LIST release;
+	DQUEUE_INIT(&release);
+	spinlock_lock(&kc->kc_lock);
+	if (kc->kc_objs_per_slab > 0) {
+		for (unsigned int cpuid = 0; cpuid < PCPU_MAX_CPUS; cpuid++) {
+			struct KMEM_MAGAZINE* km = &kc->kc_magazine[cpuid];
+			kmem_cache_put_locked(kc, km->km_obj, km->km_count, &release);
+			km->km_count = 0;
+		}
+		KASSERT(kc->kc_num_inuse == 0, "destroying cache '%s' with %u objects in use", kc->kc_name, kc->kc_num_inuse);
+		while (!DQUEUE_EMPTY(&kc->kc_empty)) {
+			struct KMEM_SLAB* ks = DQUEUE_HEAD(&kc->kc_empty);
+			DQUEUE_POP_HEAD(&kc->kc_empty);
+			DQUEUE_ADD_TAIL(&release, ks);
+		}
+
+		spinlock_lock(&spl_caches);
+		DQUEUE_REMOVE(&caches, kc);
+		spinlock_unlock(&spl_caches);
+	}
+	spinlock_unlock(&kc->kc_lock);
+
+	kmem_cache_release(&release);
+	kfree(kc);
+}
+
+void*
+kmem_cache_alloc(struct KMEM_CACHE* kc)
+{
+	/* Until the first CPU is introduced, we cannot even look for a magazine */
+	register_t state;
+	struct KMEM_MAGAZINE* km = NULL;
+	if (pcpu_get_num_cpus() > 0) {
+		state = md_interrupts_save_and_disable();
+		km = kmem_magazine_get(kc);
+		if (km != NULL && km->km_count > 0) {
+			void* obj = km->km_obj[--km->km_count];
+			km->km_hits++;
+			md_interrupts_restore(state);
+			return obj;
+		}
+		if (km != NULL)
+			km->km_misses++;
+		md_interrupts_restore(state);
+	}
+
+	/*
+	 * Magazine is empty (or we have none); take a batch of objects from the
+	 * slabs. We must not keep interrupts disabled while doing so, so we may end
+	 * up on another CPU - this is harmless.
+	 */
+	void* obj[KMEM_MAGAZINE_BATCH];
+	unsigned int count = (km != NULL) ? KMEM_MAGAZINE_BATCH : 1;
+	spinlock_lock(&kc->kc_lock);
+	if (kc->kc_objs_per_slab == 0)
+		kmem_cache_setup_locked(kc);
+	count = kmem_cache_get_locked(kc, obj, count);
+	spinlock_unlock(&kc->kc_lock);
+	if (count == 0)
+		return NULL;
+
+	/* Store the remaining objects in the magazine, as long as they fit */
+	unsigned int n = 1;
+	if (km != NULL) {
+		state = md_interrupts_save_and_disable();
+		km = kmem_magazine_get(kc);
+		for (/* nothing */; km != NULL && n < count && km->km_count < KMEM_MAGAZINE_SIZE; n++)
+			km->km_obj[km->km_count++] = obj[n];
+		md_interrupts_restore(state);
+	}
+	if (n < count) {
+		struct KMEM_SLAB_LIST release;
+		DQUEUE_INIT(&release);
+		spinlock_lock(&kc->kc_lock);
+		kmem_cache_put_locked(kc, &obj[n], count - n, &release);
+		spinlock_unlock(&kc->kc_lock);
+		kmem_cache_release(&release);
+	}
+	return obj[0];
+}
+
+void
+kmem_cache_free(struct KMEM_CACHE* kc, void* obj)
+{
+	void* batch[KMEM_MAGAZINE_BATCH];
+	unsigned int count = 0;
+	if (pcpu_get_num_cpus() > 0) {
+		register_t state = md_interrupts_save_and_disable();
+		struct KMEM_MAGAZINE* km = kmem_magazine_get(kc);
+		if (km != NULL) {
+			if (km->km_count == KMEM_MAGAZINE_SIZE) {
+				/* Magazine is full; hand the coldest objects back to the slabs */
+				count = KMEM_MAGAZINE_BATCH;
+				memcpy(batch, &km->km_obj[0], sizeof(void*) * count);
+				memmove(&km->km_obj[0], &km->km_obj[count], sizeof(void*) * (KMEM_MAGAZINE_SIZE - count));
+				km->km_count -= count;
+			}
+			km->km_obj[km->km_count++] = obj;
+			md_interrupts_restore(state);
+			if (count == 0)
+				return;
+			obj = NULL;
+		} else {
+			md_interrupts_restore(state);
+		}
+	}
+
+	if (obj != NULL)
+		batch[count++] = obj;
+
+	struct KMEM_SLAB_LIST release;
+	DQUEUE_INIT(&release);
+	spinlock_lock(&kc->kc_lock);
+	kmem_cache_put_locked(kc, batch, count, &release);
+	spinlock_unlock(&kc->kc_lock);
+	kmem_cache_release(&release);
+}
+
+void
+kmem_cache_drain(struct KMEM_CACHE* kc)
+{
+	if (pcpu_get_num_cpus() == 0)
+		return;
+
+	void* obj[KMEM_MAGAZINE_SIZE];
+	unsigned int count = 0;
+	register_t state = md_interrupts_save_and_disable();
+	struct KMEM_MAGAZINE* km = kmem_magazine_get(kc);
+	if (km != NULL) {
+		count = km->km_count;
+		memcpy(obj, km->km_obj, sizeof(void*) * count);
+		km->km_count = 0;
+	}
+	md_interrupts_restore(state);
+	if (count == 0)
+		return;
+
+	struct KMEM_SLAB_LIST release;
+	DQUEUE_INIT(&release);
+	spinlock_lock(&kc->kc_lock);
+	kmem_cache_put_locked(kc, obj, count, &release);
+	spinlock_unlock(&kc->kc_lock);
+	kmem_cache_release(&release);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(caches, NULL, "Display object caches")
+{
+	/* No locking; the statistics are just a snapshot */
+	if (DQUEUE_EMPTY(&caches))
+		return;
+	DQUEUE_FOREACH(&caches, kc, struct KMEM_CACHE) {
+		unsigned int hits = 0, misses = 0, cached = 0;
+		for (int cpuid = 0; cpuid < pcpu_get_num_cpus(); cpuid++) {
+			struct KMEM_MAGAZINE* km = &kc->kc_magazine[cpuid];
+			hits += km->km_hits;
+			misses += km->km_misses;
+			cached += km->km_count;
+		}
+		unsigned int total = hits + misses;
+		kprintf("%s: size %u, %u per slab, %u slabs, %u in use, %u in magazines, %u hits, %u misses (%u percent hit)\n",
+		 kc->kc_name, kc->kc_size, kc->kc_objs_per_slab, kc->kc_num_slabs,
+		 kc->kc_num_inuse - cached, cached, hits, misses,
+		 (total > 0) ? (hits * 100) / total : 0);
+	}
+}
+#endif
+
+/* vim:set ts=2 sw=2: */
@@ -16,6 +16,7 @@
  * All transitions are managed by scheduler.c.
  */
 #include <ananas/types.h>
+#include <machine/interrupts.h>
 #include <machine/param.h>
 #include <ananas/console.h>
 #include <ananas/device.h>
@@ -28,6 +29,9 @@
 #include <ananas/procinfo.h>
 #include <ananas/reaper.h>
 #include <ananas/schedule.h>
+#include <ananas/slab.h>
+#include <ananas/time.h>
+#include <ananas/timer.h>
 #include <ananas/trace.h>
 #include <ananas/thread.h>
 #include <ananas/vm.h>
@@ -39,13 +43,16 @@
 TRACE_SETUP;
 
 static spinlock_t spl_threadqueue = SPINLOCK_DEFAULT_INIT;
+static KMEM_CACHE_DEFINE(thread_cache, "thread", sizeof(struct THREAD), NULL);
 static struct THREAD_QUEUE thread_queue;
 
 errorcode_t
 thread_alloc(process_t* p, thread_t** dest, const char* name, int flags)
 {
 	/* First off, allocate the thread itself */
-	thread_t* t = kmalloc(sizeof(struct THREAD));
+	thread_t* t = kmem_cache_alloc(&thread_cache);
+	if (t == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	memset(t, 0, sizeof(struct THREAD));
 	process_ref(p);
 	t->t_process = p;
@@ -150,7 +157,7 @@ thread_destroy(thread_t* t)
 	}
 
 	if (t->t_flags & THREAD_FLAG_MALLOC)
-		kfree(t);
+		kmem_cache_free(&thread_cache, t);
 	else
 		memset(t, 0, sizeof(*t));
 }
@@ -238,7 +245,56 @@ thread_resume(thread_t* t)
 	}
 	scheduler_add_thread(t);
 }
-	
+
+static void
+thread_sleep_wakeup(void* arg)
+{
+	thread_resume((thread_t*)arg);
+}
+
+void
+thread_sleep_until(uint64_t deadline)
+{
+	thread_t* curthread = PCPU_GET(curthread);
+	TRACE(THREAD, FUNC, "t=%p, deadline=%u", curthread, (uint32_t)deadline);
+	KASSERT(curthread != PCPU_GET(idlethread), "sleeping idle thread");
+
+	/*
+	 * The timer resumes us once it fires. We have to suspend ourselves before
+	 * the timer is armed, as it may otherwise fire while we are still running
+	 * and we would never be resumed.
+	 */
+	struct TIMER tm;
+	timer_init(&tm, thread_sleep_wakeup, curthread);
+	while (timer_get_ticks() < deadline) {
+		register_t state = md_interrupts_save_and_disable();
+		thread_suspend(curthread);
+		timer_schedule(&tm, deadline);
+		schedule();
+		md_interrupts_restore(state);
+	}
+	timer_cancel(&tm);
+}
+
+void
+thread_sleep_ms(unsigned int ms)
+{
+	/*
+	 * If we cannot sleep, just spin; this happens early in the boot process,
+	 * before the scheduler is running, or from interrupt context.
+	 */
+	if (!scheduler_activated() || PCPU_GET(nested_irq) > 0) {
+		delay(ms);
+		return;
+	}
+
+	/*
+	 * The current tick is already partially over, so we need an extra one to
+	 * ensure we will sleep at least as long as requested.
+	 */
+	thread_sleep_until(timer_get_ticks() + TIMER_MS_TO_TICKS(ms) + 1);
+}
+
 void
 thread_exit(int exitcode)
 {
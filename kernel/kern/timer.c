@@ -0,0 +1,287 @@
+/*
+ * Timers are kept in a hierarchical timing wheel; there are
+ * TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots each. Level 0 contains
+ * timers expiring within TIMER_WHEEL_SLOTS ticks, one slot per tick; every
+ * higher level covers TIMER_WHEEL_SLOTS times the range of the level below
+ * it. Whenever level 0 wraps, the current slot of the next level is cascaded
+ * down, which means adding and removing timers is O(1).
+ *
+ * We keep track of the earliest tick at which there may be work to do; all
+ * ticks before it are skipped by the clock interrupt without even looking at
+ * the wheel, so an idle system does not spend any time here.
+ */
+#include <ananas/types.h>
+#include <ananas/init.h>
+#include <ananas/kdb.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/timer.h>
+#include <machine/interrupts.h>
+#include "options.h"
+
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+/* Maximum number of ticks the wheel can hold; longer timers are re-cascaded */
+#define TIMER_WHEEL_RANGE	(1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static spinlock_t spl_timer = SPINLOCK_DEFAULT_INIT;
+static volatile uint64_t timer_ticks = 0;		/* Ticks since boot */
+static uint64_t timer_wheel_time = 0;			/* Last tick processed by the wheel */
+static volatile uint64_t timer_next_expiry = UINT64_MAX; /* Nothing happens before this tick */
+static volatile unsigned int timer_num_pending = 0;
+static struct TIMER* volatile timer_running = NULL;	/* Timer whose callback is running */
+/* Note that all-zeroes is a valid, empty, wheel */
+static struct TIMER_QUEUE timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t timer_wheel_map[TIMER_WHEEL_LEVELS];	/* Non-empty slots per level */
+
+/* Statistics */
+static unsigned int timer_stat_fired = 0;
+static unsigned int timer_stat_processed = 0;
+static unsigned int timer_stat_skipped = 0;
+
+uint64_t
+timer_get_ticks()
+{
+	/* Reading a 64-bit value need not be atomic; retry if we raced with the tick */
+	uint64_t ticks;
+	do {
+		ticks = timer_ticks;
+	} while (ticks != timer_ticks);
+	return ticks;
+}
+
+void
+timer_init(struct TIMER* tm, timer_func_t func, void* arg)
+{
+	tm->tm_expires = 0;
+	tm->tm_func = func;
+	tm->tm_arg = arg;
+	tm->tm_flags = 0;
+}
+
+/*
+ * Places a timer on the wheel; timers expiring before 'earliest' are treated
+ * as if they expire at 'earliest'. This is normally the next tick, except
+ * when cascading as the current slot is yet to be processed then.
+ */
+static void
+timer_place_locked(struct TIMER* tm, uint64_t earliest)
+{
+	uint64_t expires = tm->tm_expires;
+	if (expires < earliest)
+		expires = earliest;
+	/* Timers beyond the wheel's range are parked in the final level's last slot */
+	if (expires - timer_wheel_time >= TIMER_WHEEL_RANGE)
+		expires = timer_wheel_time + TIMER_WHEEL_RANGE - 1;
+
+	uint64_t delta = expires - timer_wheel_time;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	tm->tm_level = level;
+	tm->tm_slot = slot;
+	DQUEUE_ADD_TAIL(&timer_wheel[level][slot], tm);
+	timer_wheel_map[level] |= 1ULL << slot;
+
+	/* Ensure the clock interrupt doesn't skip the tick at which this requires work */
+	uint64_t next = expires;
+	if (level > 0)
+		next = (timer_wheel_time | TIMER_WHEEL_MASK) + 1; /* next cascade */
+	if (next < timer_next_expiry)
+		timer_next_expiry = next;
+}
+
+static void
+timer_unplace_locked(struct TIMER* tm)
+{
+	struct TIMER_QUEUE* q = &timer_wheel[tm->tm_level][tm->tm_slot];
+	DQUEUE_REMOVE(q, tm);
+	if (DQUEUE_EMPTY(q))
+		timer_wheel_map[tm->tm_level] &= ~(1ULL << tm->tm_slot);
+}
+
+/*
+ * Calculates the first tick at which there may be work to do: either a level
+ * 0 timer expiring, or a higher level that needs to be cascaded down.
+ */
+static void
+timer_update_next_expiry_locked()
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t map = timer_wheel_map[0];
+	if (map != 0) {
+		/* Rotate the map so that bit 0 is the slot of the next tick */
+		unsigned int shift = (timer_wheel_time + 1) & TIMER_WHEEL_MASK;
+		if (shift != 0)
+			map = (map >> shift) | (map << (TIMER_WHEEL_SLOTS - shift));
+		next = timer_wheel_time + 1 + __builtin_ctzll(map);
+	}
+	for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		if (timer_wheel_map[level] == 0)
+			continue;
+		uint64_t cascade = (timer_wheel_time | TIMER_WHEEL_MASK) + 1;
+		if (cascade < next)
+			next = cascade;
+		break;
+	}
+	timer_next_expiry = next;
+}
+
+static void
+timer_cascade_locked(int level, int slot)
+{
+	struct TIMER_QUEUE* q = &timer_wheel[level][slot];
+	while (!DQUEUE_EMPTY(q)) {
+		struct TIMER* tm = DQUEUE_HEAD(q);
+		DQUEUE_POP_HEAD(q);
+		timer_place_locked(tm, timer_wheel_time);
+	}
+	timer_wheel_map[level] &= ~(1ULL << slot);
+}
+
+/*
+ * Processes all ticks up to 'now'; may drop the lock to invoke callbacks, in
+ * which case 'state' is updated to the state of the lock as it is re-taken.
+ */
+static void
+timer_run_locked(uint64_t now, register_t* state)
+{
+	while (timer_wheel_time < now) {
+		/* Nothing can happen before timer_next_expiry, so skip straight to it */
+		if (timer_next_expiry > now) {
+			timer_wheel_time = now;
+			break;
+		}
+		if (timer_next_expiry > timer_wheel_time + 1)
+			timer_wheel_time = timer_next_expiry - 1;
+		uint64_t t = ++timer_wheel_time;
+		timer_stat_processed++;
+
+		/* If a level wrapped, cascade the next level's current slot down */
+		for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if ((t & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+				break;
+			timer_cascade_locked(level, (t >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+		}
+
+		/* Fire everything in the current slot */
+		struct TIMER_QUEUE* q = &timer_wheel[0][t & TIMER_WHEEL_MASK];
+		while (!DQUEUE_EMPTY(q)) {
+			struct TIMER* tm = DQUEUE_HEAD(q);
+			timer_unplace_locked(tm);
+			if (tm->tm_expires > t) {
+				/* Parked timer which is still too far away; put it back */
+				timer_place_locked(tm, t + 1);
+				continue;
+			}
+
+			/*
+			 * Invoke the callback without holding the lock, so that it can
+			 * re-schedule timers; we mustn't touch the timer afterwards as its
+			 * owner is free to get rid of it once timer_running is cleared.
+			 */
+			tm->tm_flags &= ~TIMER_FLAG_PENDING;
+			timer_num_pending--;
+			timer_stat_fired++;
+			timer_func_t func = tm->tm_func;
+			void* arg = tm->tm_arg;
+			timer_running = tm;
+			spinlock_unlock_unpremptible(&spl_timer, *state);
+			func(arg);
+			*state = spinlock_lock_unpremptible(&spl_timer);
+			timer_running = NULL;
+		}
+
+		timer_update_next_expiry_locked();
+	}
+}
+
+void
+timer_schedule(struct TIMER* tm, uint64_t expires)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_timer);
+	if (tm->tm_flags & TIMER_FLAG_PENDING) {
+		timer_unplace_locked(tm);
+		timer_num_pending--;
+	}
+
+	/*
+	 * If nothing was to happen until now, we can safely advance the wheel as
+	 * nothing would have changed; this keeps the timer in the lowest level
+	 * possible.
+	 */
+	uint64_t now = timer_get_ticks();
+	if (timer_wheel_time < now && now < timer_next_expiry)
+		timer_wheel_time = now;
+
+	tm->tm_expires = expires;
+	tm->tm_flags |= TIMER_FLAG_PENDING;
+	timer_place_locked(tm, timer_wheel_time + 1);
+	timer_num_pending++;
+	spinlock_unlock_unpremptible(&spl_timer, state);
+}
+
+int
+timer_cancel(struct TIMER* tm)
+{
+	register_t state = spinlock_lock_unpremptible(&spl_timer);
+	int was_pending = (tm->tm_flags & TIMER_FLAG_PENDING) != 0;
+	if (was_pending) {
+		timer_unplace_locked(tm);
+		tm->tm_flags &= ~TIMER_FLAG_PENDING;
+		timer_num_pending--;
+	} else {
+		/* Wait until the callback is done if it is running right now */
+		while (timer_running == tm) {
+			spinlock_unlock_unpremptible(&spl_timer, state);
+			state = spinlock_lock_unpremptible(&spl_timer);
+		}
+	}
+	spinlock_unlock_unpremptible(&spl_timer, state);
+	return was_pending;
+}
+
+void
+timer_tick()
+{
+	uint64_t now = timer_ticks + 1;
+	timer_ticks = now;
+
+	/* Fast path: if there is nothing due, don't bother looking at the wheel */
+	if (timer_num_pending == 0 || now < timer_next_expiry) {
+		timer_stat_skipped++;
+		return;
+	}
+
+	register_t state = spinlock_lock_unpremptible(&spl_timer);
+	timer_run_locked(now, &state);
+	spinlock_unlock_unpremptible(&spl_timer, state);
+}
+
+#ifdef OPTION_KDB
+KDB_COMMAND(timers, NULL, "Display timer status")
+{
+	kprintf("ticks %u, next expiry %u, wheel time %u\n",
+	 (uint32_t)timer_ticks, (timer_next_expiry != UINT64_MAX) ? (uint32_t)timer_next_expiry : 0, (uint32_t)timer_wheel_time);
+	kprintf("pending %u, fired %u, ticks processed %u, ticks skipped %u\n",
+	 timer_num_pending, timer_stat_fired, timer_stat_processed, timer_stat_skipped);
+	for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (timer_wheel_map[level] == 0)
+			continue;
+		for (unsigned int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			if (DQUEUE_EMPTY(&timer_wheel[level][slot]))
+				continue;
+			DQUEUE_FOREACH(&timer_wheel[level][slot], tm, struct TIMER) {
+				kprintf("  level %u slot %u: timer %p expires %u func %p\n",
+				 level, slot, tm, (uint32_t)tm->tm_expires, tm->tm_func);
+			}
+		}
+	}
+}
+#endif /* OPTION_KDB */
+
+/* vim:set ts=2 sw=2: */
@@ -29,6 +29,12 @@ vfs_bget(struct VFS_MOUNTED_FS* fs, blocknr_t block, struct BIO** bio, int flags
 	return ANANAS_ERROR_OK;
 }
 
+void
+vfs_bprefetch(struct VFS_MOUNTED_FS* fs, blocknr_t block, unsigned int num)
+{
+	bio_prefetch(fs->fs_device, block * (fs->fs_block_size / BIO_SECTOR_SIZE), fs->fs_block_size, num);
+}
+
 size_t
 vfs_filldirent(void** dirents, size_t* size, const void* fsop, int fsoplen, const char* name, int namelen)
 {
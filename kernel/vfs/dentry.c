@@ -1,63 +1,184 @@
 /*
- * Ananas dentry cache (heavily based on icache.c)
+ * Ananas dentry cache
  *
  * A 'dentry' is a directory entry, and can be seen as the function f:
- * directory_inode x entry_name -> inode. These are cached on a per-filesystem
- * basis (to simplify the implementation due to the variable-length FSOP's)
+ * directory_inode x entry_name -> inode. All filesystems share a single
+ * cache, which is a hash table keyed by the parent dentry and the entry
+ * name; entries are also kept on a least-recently-used list, from which
+ * unused entries are thrown away once the cache is full.
+ *
+ * Names which are known not to exist are cached as negative entries, so that
+ * looking them up again does not have to bother the filesystem.
+ *
+ * Path walks first try to find the entries without taking any locks, using
+ * dcache_lookup_lockless(). To make this safe, the hash table is only changed
+ * in ways a concurrent walker can cope with, and entries which are thrown away
+ * are retired rather than freed: they are freed in batches, once an epoch has
+ * passed and no walker can be looking at them anymore.
  *
  * Note that this code depends heavily on the fact that an inode will never be
  * in memory multiple times; this implies that the inode pointer can be used
  * to unique identify a given inode.
- * 
+ *
  */
 #include <ananas/types.h>
+#include <ananas/epoch.h>
+#include <ananas/error.h>
+#include <ananas/init.h>
 #include <ananas/vfs/core.h>
 #include <ananas/vfs/dentry.h>
 #include <ananas/mm.h>
 #include <ananas/lock.h>
 #include <ananas/schedule.h>
+#include <ananas/slab.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
 
 TRACE_SETUP;
 
-#define DCACHE_LOCK(fs) \
-	mutex_lock(&(fs)->fs_dcache_lock)
-#define DCACHE_UNLOCK(fs) \
-	mutex_unlock(&(fs)->fs_dcache_lock)
+/* Hash table size limits, in buckets; must be powers of two */
+#define DCACHE_HASH_MIN		64
+#define DCACHE_HASH_MAX		16384
 
-static void dentry_deref2(struct DENTRY* de, struct VFS_MOUNTED_FS* fs_locked);
+/* Average number of entries per bucket before the table is grown */
+#define DCACHE_HASH_LOAD	2
 
-void
-dcache_init(struct VFS_MOUNTED_FS* fs)
+/* Maximum number of entries thrown out at once when the cache is full */
+#define DCACHE_PURGE_BATCH	32
+
+/* Number of retired entries to collect before waiting for an epoch to free them */
+#define DCACHE_RETIRE_BATCH	32
+
+#define DCACHE_LOCK() \
+	mutex_lock(&mtx_dcache)
+#define DCACHE_UNLOCK() \
+	mutex_unlock(&mtx_dcache)
+
+static KMEM_CACHE_DEFINE(dcache_cache, "dentry", sizeof(struct DENTRY), NULL);
+
+/* The hash table; it is replaced as a whole when it grows */
+struct DCACHE_TABLE {
+	unsigned int		dt_size;	/* Number of buckets */
+	struct DENTRY_BUCKET	dt_bucket[1];
+};
+
+/* Protects everything below; reference counts are atomic */
+static mutex_t mtx_dcache;
+static struct DCACHE_TABLE* volatile dcache_table;
+struct DENTRY_LRU dcache_lru;
+static unsigned int dcache_num_entries;
+static struct DCACHE_STATS dcache_stats;
+static struct DENTRY_LRU dcache_retired;	/* Thrown away, but not yet freed */
+static unsigned int dcache_num_retired;
+
+/* Serializes renames; the sequence is odd while a rename is in progress */
+static mutex_t mtx_rename;
+static atomic_t dcache_seq;
+
+static void dentry_deref_locked(struct DENTRY* d);
+static void dentry_destroy_locked(struct DENTRY* d);
+static void dcache_reclaim();
+
+static struct DCACHE_TABLE*
+dcache_alloc_table(unsigned int size)
 {
-	mutex_init(&fs->fs_dcache_lock, "dcache");
-	DQUEUE_INIT(&fs->fs_dcache_inuse);
-	DQUEUE_INIT(&fs->fs_dcache_free);
+	struct DCACHE_TABLE* table = kmalloc(sizeof(struct DCACHE_TABLE) + sizeof(struct DENTRY_BUCKET) * (size - 1));
+	if (table == NULL)
+		return NULL;
+	table->dt_size = size;
+	for (unsigned int n = 0; n < size; n++)
+		DQUEUE_INIT(&table->dt_bucket[n]);
+	return table;
+}
 
-	/*
-	 * Make an empty cache; we allocate one big pool and set up pointers to the
-	 * items as necessary.
-	 */
-	fs->fs_dcache_buffer = kmalloc(DCACHE_ITEMS_PER_FS * sizeof(struct DENTRY));
-	memset(fs->fs_dcache_buffer, 0, DCACHE_ITEMS_PER_FS * sizeof(struct DENTRY));
-	addr_t dcache_ptr = (addr_t)fs->fs_dcache_buffer;
-	for (int i = 0; i < DCACHE_ITEMS_PER_FS; i++) {
-		DQUEUE_ADD_TAIL(&fs->fs_dcache_free, (struct DENTRY*)dcache_ptr);
-		dcache_ptr += sizeof(struct DENTRY);
+static errorcode_t
+dcache_setup()
+{
+	mutex_init(&mtx_dcache, "dcache");
+	mutex_init(&mtx_rename, "rename");
+	atomic_set(&dcache_seq, 0);
+	dcache_table = dcache_alloc_table(DCACHE_HASH_MIN);
+	if (dcache_table == NULL)
+		panic("cannot allocate dentry cache hash table");
+	DQUEUE_INIT(&dcache_lru);
+	DQUEUE_INIT(&dcache_retired);
+	return ANANAS_ERROR_OK;
+}
+
+INIT_FUNCTION(dcache_setup, SUBSYSTEM_VFS, ORDER_MIDDLE);
+
+static uint32_t
+dcache_hash_value(struct DENTRY* parent, const char* entry)
+{
+	/* FNV-1a over the name, seeded using the parent */
+	uint32_t hash = 2166136261u ^ (uint32_t)((addr_t)parent >> 4);
+	for (const char* p = entry; *p != '\0'; p++) {
+		hash ^= (uint8_t)*p;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline struct DENTRY_BUCKET*
+dcache_bucket(struct DCACHE_TABLE* table, uint32_t hash)
+{
+	return &table->dt_bucket[hash & (table->dt_size - 1)];
+}
+
+/*
+ * Doubles the number of hash buckets; dcache lock must be held. Lockless
+ * lookups which run into an entry being moved may miss, but they will simply
+ * retry using the locked path. If there is no memory for a larger table, we
+ * just keep the current one.
+ *
+ * Returns the old table, or NULL if nothing was replaced. Lockless lookups may
+ * still be using it, so the caller must drop the lock and wait for an epoch
+ * before freeing it; there is no need to hold up all other lookups meanwhile.
+ */
+static struct DCACHE_TABLE*
+dcache_hash_resize_locked()
+{
+	struct DCACHE_TABLE* old_table = dcache_table;
+	struct DCACHE_TABLE* new_table = dcache_alloc_table(old_table->dt_size * 2);
+	if (new_table == NULL)
+		return NULL;
+	for (unsigned int n = 0; n < old_table->dt_size; n++) {
+		struct DENTRY_BUCKET* old_bucket = &old_table->dt_bucket[n];
+		while (!DQUEUE_EMPTY(old_bucket)) {
+			struct DENTRY* d = DQUEUE_HEAD(old_bucket);
+			DQUEUE_POP_HEAD_IP(old_bucket, bucket);
+			DQUEUE_ADD_TAIL_IP(dcache_bucket(new_table, d->d_hash), bucket, d);
+		}
 	}
+	atomic_compiler_barrier();
+	dcache_table = new_table;
+	dcache_stats.ds_rehashes++;
+	return old_table;
+}
 
+errorcode_t
+dcache_init(struct VFS_MOUNTED_FS* fs)
+{
 	/*
 	 * Create the root dentry for the new filesystem; this prevents us from
 	 * having to jump through hoops to find it. vfs_mount() will update the
-	 * dentry as needed.
+	 * dentry as needed. It has no parent, so it never needs to be looked up.
 	 */
-	fs->fs_root_dentry = DQUEUE_HEAD(&fs->fs_dcache_free);
-	DQUEUE_POP_HEAD(&fs->fs_dcache_free);
-	fs->fs_root_dentry->d_refcount = 1; /* filesystem itself */
-	fs->fs_root_dentry->d_inode = NULL; /* supplied by the file system */
-	fs->fs_root_dentry->d_flags = DENTRY_FLAG_PERMANENT | DENTRY_FLAG_CACHED;
-	DQUEUE_ADD_HEAD(&fs->fs_dcache_inuse, fs->fs_root_dentry);
+	struct DENTRY* d = kmem_cache_alloc(&dcache_cache);
+	if (d == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	memset(d, 0, sizeof(*d));
+	atomic_set(&d->d_refcount, 1); /* filesystem itself */
+	d->d_fs = fs;
+	d->d_inode = NULL; /* supplied by the file system */
+	d->d_flags = DENTRY_FLAG_PERMANENT | DENTRY_FLAG_CACHED;
+
+	DCACHE_LOCK();
+	DQUEUE_ADD_HEAD_IP(&dcache_lru, lru, d);
+	dcache_num_entries++;
+	DCACHE_UNLOCK();
+	fs->fs_root_dentry = d;
+	return ANANAS_ERROR_OK;
 }
 
 void
@@ -66,115 +187,96 @@ dcache_dump(struct VFS_MOUNTED_FS* fs)
 	/* XXX Don't lock; this is for debugging purposes only */
 	int n = 0;
 	kprintf("dcache_dump(): fs=%p\n", fs);
-	DQUEUE_FOREACH(&fs->fs_dcache_inuse, d, struct DENTRY) {
-		kprintf("dcache_entry=%p, parent=%p, inode=%p, reverse name=%s[%d]",
-		 d, d->d_parent, d->d_inode, d->d_entry, d->d_refcount);
-		for (struct DENTRY* curde = d->d_parent; curde != NULL; curde = curde->d_parent)
-			kprintf(",%s[%d]", curde->d_entry, curde->d_refcount);
-		kprintf("',flags=0x%x, refcount=%d\n",
-		 d->d_flags, d->d_refcount);
-		n++;
-	}
+	if (!DQUEUE_EMPTY(&dcache_lru))
+		DQUEUE_FOREACH_IP(&dcache_lru, lru, d, struct DENTRY) {
+			if (d->d_fs != fs)
+				continue;
+			kprintf("dcache_entry=%p, parent=%p, inode=%p, reverse name=%s[%d]",
+			 d, d->d_parent, d->d_inode, d->d_entry, atomic_read(&d->d_refcount));
+			for (struct DENTRY* curde = d->d_parent; curde != NULL; curde = curde->d_parent)
+				kprintf(",%s[%d]", curde->d_entry, atomic_read(&curde->d_refcount));
+			kprintf("',flags=0x%x, refcount=%d\n",
+			 d->d_flags, atomic_read(&d->d_refcount));
+			n++;
+		}
 	kprintf("dcache_dump(): %u entries\n", n);
 }
 
 void
 dcache_destroy(struct VFS_MOUNTED_FS* fs)
-{	
+{
 	panic("dcache_destroy");
-#if 0
-	DCACHE_LOCK(fs);
-	DQUEUE_FOREACH(&fs->fs_dcache_inuse, d, struct DENTRY) {
-		if (d->d_entry_inode != NULL)
-			vfs_deref_inode(d->d_entry_inode);
-	}
-	kfree(fs->fs_dcache_buffer);
-	fs->fs_dcache_buffer = NULL;
-	DCACHE_UNLOCK(fs);
-#endif
 }
 
-/* This purges an entry from the cache but *does not* alter the refcount */
+/* Removes an entry from the cache but *does not* alter the refcount; dcache lock must be held */
 static void
-dcache_purge_entry2(struct DENTRY* d, struct VFS_MOUNTED_FS* fs_locked)
+dcache_remove_locked(struct DENTRY* d)
 {
-	TRACE(VFS, FUNC, "purging d=%p [%s] flags=%d refs=%d", d, d->d_entry, d->d_flags, d->d_refcount);
+	TRACE(VFS, FUNC, "purging d=%p [%s] flags=%d refs=%d", d, d->d_entry, d->d_flags, atomic_read(&d->d_refcount));
 	KASSERT(d->d_flags & DENTRY_FLAG_CACHED, "dentry not cached");
 
-	struct VFS_MOUNTED_FS* fs = NULL;
-	if (d->d_inode != NULL)
-		fs = d->d_inode->i_fs;
-	else if (d->d_parent != NULL && d->d_parent->d_inode != NULL)
-		fs = d->d_parent->d_inode->i_fs;
-	KASSERT(fs != NULL, "purging entry without backing inode?");
-
-	if (fs != fs_locked) DCACHE_LOCK(fs);
+	/*
+	 * Note that removing the entry from its bucket leaves its own links
+	 * intact, so a lockless lookup currently at this entry can carry on.
+	 */
 	d->d_flags &= ~DENTRY_FLAG_CACHED;
-
-	/* Free our dentry itself - if it is no longer cached */
-	DQUEUE_REMOVE(&fs->fs_dcache_inuse, d);
-	DQUEUE_ADD_TAIL(&fs->fs_dcache_free, d);
-
-	if (fs != fs_locked) DCACHE_UNLOCK(fs);
+	if (d->d_parent != NULL)
+		DQUEUE_REMOVE_IP(dcache_bucket(dcache_table, d->d_hash), bucket, d);
+	DQUEUE_REMOVE_IP(&dcache_lru, lru, d);
+	dcache_num_entries--;
 }
 
 /*
- * Purges old dcache entries from fs; dcache lock must be held!
+ * Throws away the least recently used entries which are only referenced by
+ * the cache itself; dcache lock must be held.
  */
 static void
-dcache_purge_old_entries(struct VFS_MOUNTED_FS* fs)
+dcache_purge_old_entries_locked()
 {
-	/*
-	 * Our dcache is ordered from old-to-new, so we'll start at the back and
-	 * starting purging things - we'll only purge things that are in the cache.
-	 */
-	int num_removed = 0;
-	if (!DQUEUE_EMPTY(&fs->fs_dcache_inuse))
-		DQUEUE_FOREACH_REVERSE_SAFE(&fs->fs_dcache_inuse, d, struct DENTRY) {
-			if ((d->d_flags & DENTRY_FLAG_CACHED) == 0) 
-				continue;
-			if (d->d_refcount > 1)
-				continue;
-
+	unsigned int num_removed = 0;
+	struct DENTRY* d = DQUEUE_EMPTY(&dcache_lru) ? NULL : DQUEUE_TAIL(&dcache_lru);
+	while (d != NULL && num_removed < DCACHE_PURGE_BATCH) {
+		/*
+		 * Removing the entry only affects its parent, which is referenced by the
+		 * cache and thus stays, so we can safely continue from here.
+		 */
+		struct DENTRY* prev = DQUEUE_PREV_IP(d, lru);
+		if ((d->d_flags & DENTRY_FLAG_PERMANENT) == 0 && atomic_cmpxchg(&d->d_refcount, 1, 0) == 1) {
 			/*
-		 	 * This entry has a single ref, and the holder is the cache - it is safe to
-			 * dereference it.
+			 * The cache held the only reference, and we took it before any lockless
+			 * lookup could add one; the entry is ours to throw away.
 			 */
-			dentry_deref2(d, fs);
+			dentry_destroy_locked(d);
 			num_removed++;
 		}
-
-	KASSERT(num_removed > 0, "no entries removed");
+		d = prev;
+	}
+	dcache_stats.ds_purges += num_removed;
 }
 
 /*
  *
- * Attempts to look up a given entry for a parent dentry. Returns a referenced
- * dentry entry on success.
+ * Attempts to look up a given entry for a parent dentry. Stores a referenced
+ * dentry entry in 'result' on success.
  *
- * The only way for this function to return NULL is that the lookup is
- * currently pending; this means the attempt to is be retried.
+ * If the lookup is currently pending, 'result' is set to NULL; this means the
+ * attempt to is be retried. An error is only returned if no new entry could
+ * be allocated.
  *
  * Note that this function must be called with a referenced dentry to ensure it
  * will not go away. This ref is not touched by this function.
  */
-struct DENTRY*
-dcache_lookup(struct DENTRY* parent, const char* entry)
+errorcode_t
+dcache_lookup(struct DENTRY* parent, const char* entry, struct DENTRY** result)
 {
-	struct VFS_MOUNTED_FS* fs = parent->d_inode->i_fs;
-	KASSERT(fs->fs_dcache_buffer != NULL, "dcache pool not initialized");
-	
 	TRACE(VFS, FUNC, "parent=%p, entry='%s'", parent, entry);
+	uint32_t hash = dcache_hash_value(parent, entry);
 
-	DCACHE_LOCK(fs);
-
-	/*
-	 * XXX This is just a simple linear search which attempts to avoid
-	 * overhead by moving recent entries to the start
-	 */
-	if (!DQUEUE_EMPTY(&fs->fs_dcache_inuse)) {
-		DQUEUE_FOREACH(&fs->fs_dcache_inuse, d, struct DENTRY) {
-			if (d->d_parent != parent || strcmp(d->d_entry, entry) != 0)
+	DCACHE_LOCK();
+	struct DENTRY_BUCKET* bucket = dcache_bucket(dcache_table, hash);
+	if (!DQUEUE_EMPTY(bucket)) {
+		DQUEUE_FOREACH_IP(bucket, bucket, d, struct DENTRY) {
+			if (d->d_hash != hash || d->d_parent != parent || strcmp(d->d_entry, entry) != 0)
 				continue;
 
 			/*
@@ -183,83 +285,100 @@ dcache_lookup(struct DENTRY* parent, const char* entry)
 			 * up.
 			 */
 			if (d->d_inode == NULL && (d->d_flags & DENTRY_FLAG_NEGATIVE) == 0) {
-				DCACHE_UNLOCK(fs);
-				return NULL;
+				DCACHE_UNLOCK();
+				*result = NULL;
+				return ANANAS_ERROR_OK;
 			}
 
 			/* Add an extra ref to the dentry; we'll be giving it to the caller */
-			dentry_ref(d);
+			int refs = atomic_add(&d->d_refcount, 1);
+			KASSERT(refs > 0, "invalid refcount %d", refs);
 
 			/*
-			 * Push the the item to the head of the cache; we expect the caller to
+			 * Push the the item to the head of the LRU list; we expect the caller to
 			 * free it once done, which will decrease the refcount to 1, which is OK
 			 * as only the cache owns it in such a case.
 		 	 */
-			DQUEUE_REMOVE(&fs->fs_dcache_inuse, d);
-			DQUEUE_ADD_HEAD(&fs->fs_dcache_inuse, d);
-			DCACHE_UNLOCK(fs);
+			DQUEUE_REMOVE_IP(&dcache_lru, lru, d);
+			DQUEUE_ADD_HEAD_IP(&dcache_lru, lru, d);
+			if (d->d_flags & DENTRY_FLAG_NEGATIVE)
+				dcache_stats.ds_negative_hits++;
+			else
+				dcache_stats.ds_hits++;
+			DCACHE_UNLOCK();
 			TRACE(VFS, INFO, "cache hit: parent=%p, entry='%s' => d=%p, d.inode=%p", parent, entry, d, d->d_inode);
-			return d;
+			*result = d;
+			return ANANAS_ERROR_OK;
 		}
 	}
 
-	/* Item was not found; try to get one from the freelist */
-	struct DENTRY* d = NULL;
-	while(d == NULL) {
-		if (!DQUEUE_EMPTY(&fs->fs_dcache_free)) {
-			/* Got one! */
-			d = DQUEUE_HEAD(&fs->fs_dcache_free);
-			DQUEUE_POP_HEAD(&fs->fs_dcache_free);
-		} else {
-			/* We are out of dcache entries; we should remove some of the older entries */
-			dcache_purge_old_entries(fs);
-			/* XXX we should be able to cope with the next condition, somehow */
-			KASSERT(!DQUEUE_EMPTY(&fs->fs_dcache_free), "dcache still full after purge!");
-		}
+	/* Item was not found; make room if we have to */
+	dcache_stats.ds_misses++;
+	if (dcache_num_entries >= DCACHE_MAX_ENTRIES)
+		dcache_purge_old_entries_locked();
+
+	struct DENTRY* d = kmem_cache_alloc(&dcache_cache);
+	if (d == NULL) {
+		DCACHE_UNLOCK();
+		dcache_reclaim();
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	}
 
 	/* Add an explicit ref to the parent dentry; it will be referenced by our new dentry */
-	dentry_ref(parent);
+	int parent_refs = atomic_add(&parent->d_refcount, 1);
+	KASSERT(parent_refs > 0, "invalid refcount %d", parent_refs);
 
 	/* Initialize the item */
 	memset(d, 0, sizeof *d);
-	d->d_refcount = 2; /* the caller + the cache */
+	atomic_set(&d->d_refcount, 2); /* the caller + the cache */
+	d->d_fs = parent->d_inode->i_fs;
 	d->d_parent = parent;
 	d->d_inode = NULL;
 	d->d_flags = DENTRY_FLAG_CACHED;
+	d->d_hash = hash;
 	strcpy(d->d_entry, entry);
-	DQUEUE_ADD_HEAD(&fs->fs_dcache_inuse, d);
-	DCACHE_UNLOCK(fs);
+
+	/* Lockless lookups may be walking the bucket; the entry must be complete before it can be seen */
+	d->bucket_next = DQUEUE_HEAD(bucket);
+	atomic_compiler_barrier();
+	DQUEUE_ADD_HEAD_IP(bucket, bucket, d);
+	DQUEUE_ADD_HEAD_IP(&dcache_lru, lru, d);
+	dcache_num_entries++;
+	struct DCACHE_TABLE* old_table = NULL;
+	if (dcache_num_entries > dcache_table->dt_size * DCACHE_HASH_LOAD && dcache_table->dt_size < DCACHE_HASH_MAX)
+		old_table = dcache_hash_resize_locked();
+	DCACHE_UNLOCK();
 	TRACE(VFS, INFO, "cache miss: parent=%p, entry='%s' => d=%p", parent, entry, d);
-	return d;
+
+	if (old_table != NULL) {
+		/* Lockless lookups may still be using the old table */
+		epoch_synchronize();
+		kfree(old_table);
+	}
+
+	/* We may have purged entries to make room */
+	dcache_reclaim();
+	*result = d;
+	return ANANAS_ERROR_OK;
+}
+
+struct DENTRY*
+dcache_lookup_lockless(struct DENTRY* parent, const char* entry)
+{
+	uint32_t hash = dcache_hash_value(parent, entry);
+	struct DCACHE_TABLE* table = dcache_table;
+	struct DENTRY_BUCKET* bucket = dcache_bucket(table, hash);
+	for (struct DENTRY* d = DQUEUE_HEAD(bucket); d != NULL; d = DQUEUE_NEXT_IP(d, bucket)) {
+		if (d->d_hash == hash && d->d_parent == parent && strcmp(d->d_entry, entry) == 0)
+			return d;
+	}
+	return NULL;
 }
 
 void
 dcache_remove_inode(struct VFS_INODE* inode)
 {
-#if 0
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-
-	DCACHE_LOCK(fs);
-	if (!DQUEUE_EMPTY(&fs->fs_dcache_inuse)) {
-		DQUEUE_FOREACH_SAFE(&fs->fs_dcache_inuse, d, struct DENTRY) {
-			/* Never touch pending entries; the lookup code deals with them */
-			if (d->d_inode == NULL)
-				continue;
-			/* Free the inode */
-			vfs_deref_inode(d->d_dir_inode);
-			if (d->d_entry_inode != NULL)
-				vfs_deref_inode(d->d_entry_inode);
-
-			/* Remove from in-use and add to free list */
-			DQUEUE_REMOVE(&fs->fs_dcache_inuse, d);
-			DQUEUE_ADD_TAIL(&fs->fs_dcache_free, d);
-			TRACE(VFS, INFO, "freed cache item: d=%p, entry='%s', dir_inode=%p, entry_inode=%p",
-			 d, d->d_entry, d->d_dir_inode, d->d_entry_inode);
-		}
-	}
-	DCACHE_UNLOCK(fs);
-#endif
+	/* XXX Entries keep their inode referenced; they are purged by age only */
 }
 
 void
@@ -271,59 +390,163 @@ dcache_set_inode(struct DENTRY* de, struct VFS_INODE* inode)
 #endif
 	KASSERT(inode != NULL, "no inode given");
 
-	/* If we already have an inode, deref it; we don't care about it anymore */
-	if (de->d_inode != NULL)
-		vfs_deref_inode(de->d_inode);
-
 	/* Increase the refcount - the cache will have a ref to the inode now */
+	struct VFS_INODE* old_inode = de->d_inode;
 	vfs_ref_inode(inode);
 	de->d_inode = inode;
 	de->d_flags &= ~DENTRY_FLAG_NEGATIVE;
+
+	/*
+	 * If we already had an inode, deref it; we don't care about it anymore. But
+	 * lockless lookups may, so we must wait for them first.
+	 */
+	if (old_inode != NULL) {
+		epoch_synchronize();
+		vfs_deref_inode(old_inode);
+	}
 }
 
 void
 dentry_ref(struct DENTRY* d)
 {
-	KASSERT(d->d_refcount > 0, "invalid refcount %d", d->d_refcount);
-	d->d_refcount++;
+	int refs = atomic_add(&d->d_refcount, 1);
+	KASSERT(refs > 0, "invalid refcount %d", refs);
+}
+
+int
+dentry_ref_lockless(struct DENTRY* d)
+{
+	/* Only add a reference if there still is one; otherwise, the entry is on its way out */
+	int refs = atomic_read(&d->d_refcount);
+	while (refs > 0) {
+		int prev = atomic_cmpxchg(&d->d_refcount, refs, refs + 1);
+		if (prev == refs)
+			return 1;
+		refs = prev;
+	}
+	return 0;
+}
+
+/*
+ * Throws away an entry which has lost its final reference; dcache lock must
+ * be held. The entry is retired, so it will not be freed until lockless
+ * lookups are done with it; this is also why it keeps its inode until then.
+ */
+static void
+dentry_destroy_locked(struct DENTRY* d)
+{
+	/* If it's still in the cache, get rid of it */
+	if (d->d_flags & DENTRY_FLAG_CACHED)
+		dcache_remove_locked(d);
+
+	/* Free our reference to the parent */
+	if (d->d_parent != NULL)
+		dentry_deref_locked(d->d_parent);
+
+	DQUEUE_ADD_TAIL_IP(&dcache_retired, lru, d);
+	dcache_num_retired++;
 }
 
 static void
-dentry_deref2(struct DENTRY* d, struct VFS_MOUNTED_FS* fs_locked)
+dentry_deref_locked(struct DENTRY* d)
 {
-	KASSERT(d->d_refcount > 0, "invalid refcount %d", d->d_refcount);
-	--d->d_refcount;
+	int refs = atomic_add(&d->d_refcount, -1);
+	KASSERT(refs > 0, "invalid refcount %d", refs);
 
 	/* If we still have references left, we are done */
-	if (d->d_refcount > 0)
+	if (refs > 1)
 		return;
 
-	/* We are about to destroy the item; if it's still in the cache, get rid of it */
-	if (d->d_flags & DENTRY_FLAG_CACHED)
-		dcache_purge_entry2(d, fs_locked);
+	dentry_destroy_locked(d);
+}
 
-	/* If we have a backing inode, release it */
-	if (d->d_inode != NULL)
-		vfs_deref_inode(d->d_inode);
+/*
+ * Frees retired entries once enough of them have been collected; we must
+ * wait until no lockless lookup can be looking at them anymore. The dcache
+ * lock must not be held.
+ */
+static void
+dcache_reclaim()
+{
+	if (dcache_num_retired < DCACHE_RETIRE_BATCH)
+		return;
 
-	/* Free our reference to the parent */
-	if (d->d_parent != NULL)
-		dentry_deref2(d->d_parent, fs_locked);
+	DCACHE_LOCK();
+	struct DENTRY_LRU retired = dcache_retired;
+	DQUEUE_INIT(&dcache_retired);
+	dcache_num_retired = 0;
+	DCACHE_UNLOCK();
+	if (DQUEUE_EMPTY(&retired))
+		return;
+
+	epoch_synchronize();
+	while (!DQUEUE_EMPTY(&retired)) {
+		struct DENTRY* d = DQUEUE_HEAD(&retired);
+		DQUEUE_POP_HEAD_IP(&retired, lru);
+
+		/* If we have a backing inode, release it */
+		if (d->d_inode != NULL)
+			vfs_deref_inode(d->d_inode);
+		kmem_cache_free(&dcache_cache, d);
+	}
 }
 
 void
-dentry_deref(struct DENTRY* de)
+dentry_deref(struct DENTRY* d)
 {
-	dentry_deref2(de, NULL);
+	DCACHE_LOCK();
+	dentry_deref_locked(d);
+	DCACHE_UNLOCK();
+	dcache_reclaim();
 }
 
 void
 dcache_purge_entry(struct DENTRY* d)
 {
-	dcache_purge_entry2(d, NULL);
+	DCACHE_LOCK();
+	dcache_remove_locked(d);
 
 	/* And throw away the cache's reference */
-	dentry_deref(d);
+	dentry_deref_locked(d);
+	DCACHE_UNLOCK();
+	dcache_reclaim();
+}
+
+void
+dcache_rename_begin()
+{
+	mutex_lock(&mtx_rename);
+	atomic_add(&dcache_seq, 1);
+}
+
+void
+dcache_rename_end()
+{
+	atomic_add(&dcache_seq, 1);
+	mutex_unlock(&mtx_rename);
+}
+
+unsigned int
+dcache_rename_seq()
+{
+	return atomic_read(&dcache_seq);
+}
+
+void
+dcache_get_stats(struct DCACHE_STATS* stats)
+{
+	DCACHE_LOCK();
+	memcpy(stats, &dcache_stats, sizeof(*stats));
+	DCACHE_UNLOCK();
+}
+
+void
+dcache_get_size(unsigned int* num_entries, unsigned int* hash_size)
+{
+	DCACHE_LOCK();
+	*num_entries = dcache_num_entries;
+	*hash_size = dcache_table->dt_size;
+	DCACHE_UNLOCK();
 }
 
 /* vim:set ts=2 sw=2: */
@@ -0,0 +1,294 @@
+/*
+ * Ananas directory index
+ *
+ * Looking up a name by reading the directory takes time proportional to the
+ * directory size, which hurts for every name that isn't in the dentry cache.
+ * Instead, the first lookup reads the directory once and stores all names in
+ * a hash table attached to the directory inode; later lookups only consult
+ * this table, which also tells us when a name does not exist.
+ *
+ * The VFS updates the index whenever it creates, unlinks or renames an
+ * entry; the index is thrown away along with the inode.
+ */
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/lib.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/trace.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
+#include <ananas/vfs/generic.h>
+
+TRACE_SETUP;
+
+/* Hash table size limits, in buckets; must be powers of two */
+#define DIRINDEX_HASH_MIN	16
+#define DIRINDEX_HASH_MAX	16384
+
+/* Average number of entries per bucket before the table is grown */
+#define DIRINDEX_HASH_LOAD	2
+
+struct DIRINDEX_ENTRY {
+	struct DIRINDEX_ENTRY*	e_next;		/* Next entry in bucket */
+	uint32_t		e_hash;		/* Hash of the name */
+	uint8_t			e_name_len;	/* Length of the name */
+	uint8_t			e_data[1];	/* FSOP, followed by the name */
+};
+
+#define DIRINDEX_ENTRY_NAME(fs, e) \
+	((const char*)&(e)->e_data[(fs)->fs_fsop_size])
+
+static uint32_t
+dirindex_hash_value(const char* name, int len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	for (int n = 0; n < len; n++) {
+		hash ^= (uint8_t)name[n];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct DIRINDEX_ENTRY**
+dirindex_alloc_buckets(unsigned int hash_size)
+{
+	struct DIRINDEX_ENTRY** bucket = kmalloc(sizeof(struct DIRINDEX_ENTRY*) * hash_size);
+	if (bucket != NULL)
+		memset(bucket, 0, sizeof(struct DIRINDEX_ENTRY*) * hash_size);
+	return bucket;
+}
+
+/* Doubles the number of buckets, if possible; index must be locked */
+static void
+dirindex_grow_locked(struct VFS_DIRINDEX* di)
+{
+	unsigned int new_size = di->di_hash_size * 2;
+	struct DIRINDEX_ENTRY** new_bucket = dirindex_alloc_buckets(new_size);
+	if (new_bucket == NULL)
+		return; /* just keep using the longer chains */
+
+	for (unsigned int n = 0; n < di->di_hash_size; n++) {
+		struct DIRINDEX_ENTRY* e = di->di_bucket[n];
+		while (e != NULL) {
+			struct DIRINDEX_ENTRY* next = e->e_next;
+			struct DIRINDEX_ENTRY** b = &new_bucket[e->e_hash & (new_size - 1)];
+			e->e_next = *b;
+			*b = e;
+			e = next;
+		}
+	}
+	kfree(di->di_bucket);
+	di->di_bucket = new_bucket;
+	di->di_hash_size = new_size;
+}
+
+/*
+ * Locates the entry for 'name' in the index; returns a pointer to the link
+ * pointing to it, so that the caller can remove it. If the entry does not
+ * exist, the link will point to NULL. Index must be locked.
+ */
+static struct DIRINDEX_ENTRY**
+dirindex_find_locked(struct VFS_MOUNTED_FS* fs, struct VFS_DIRINDEX* di, const char* name, int len, uint32_t hash)
+{
+	struct DIRINDEX_ENTRY** link = &di->di_bucket[hash & (di->di_hash_size - 1)];
+	for (/* nothing */; *link != NULL; link = &(*link)->e_next) {
+		struct DIRINDEX_ENTRY* e = *link;
+		if (e->e_hash == hash && e->e_name_len == len && memcmp(DIRINDEX_ENTRY_NAME(fs, e), name, len) == 0)
+			break;
+	}
+	return link;
+}
+
+/* Adds or updates the entry for 'name'; index must be locked */
+static errorcode_t
+dirindex_insert_locked(struct VFS_MOUNTED_FS* fs, struct VFS_DIRINDEX* di, const char* name, int len, const void* fsop)
+{
+	uint32_t hash = dirindex_hash_value(name, len);
+	struct DIRINDEX_ENTRY** link = dirindex_find_locked(fs, di, name, len, hash);
+	if (*link != NULL) {
+		/* Entry is already present; this happens if a new entry raced with the initial read */
+		memcpy((*link)->e_data, fsop, fs->fs_fsop_size);
+		return ANANAS_ERROR_OK;
+	}
+
+	struct DIRINDEX_ENTRY* e = kmalloc(sizeof(struct DIRINDEX_ENTRY) + fs->fs_fsop_size + len);
+	if (e == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
+	e->e_hash = hash;
+	e->e_name_len = len;
+	memcpy(e->e_data, fsop, fs->fs_fsop_size);
+	memcpy(&e->e_data[fs->fs_fsop_size], name, len);
+	e->e_next = *link;
+	*link = e;
+
+	di->di_num_entries++;
+	if (di->di_num_entries > di->di_hash_size * DIRINDEX_HASH_LOAD && di->di_hash_size < DIRINDEX_HASH_MAX)
+		dirindex_grow_locked(di);
+	return ANANAS_ERROR_OK;
+}
+
+/* Throws away all entries; index must be locked */
+static void
+dirindex_clear_locked(struct VFS_DIRINDEX* di)
+{
+	for (unsigned int n = 0; n < di->di_hash_size; n++) {
+		while (di->di_bucket[n] != NULL) {
+			struct DIRINDEX_ENTRY* e = di->di_bucket[n];
+			di->di_bucket[n] = e->e_next;
+			kfree(e);
+		}
+	}
+	di->di_num_entries = 0;
+	di->di_flags &= ~DIRINDEX_FLAG_COMPLETE;
+}
+
+/*
+ * Fills the index by reading the entire directory; index must be locked.
+ * Creations and removals wait for the index lock, so they cannot slip by
+ * while we are reading.
+ */
+static errorcode_t
+dirindex_build_locked(struct VFS_DIRINDEX* di, struct DENTRY* parent)
+{
+	struct VFS_MOUNTED_FS* fs = parent->d_inode->i_fs;
+	char buf[1024];
+
+	struct VFS_FILE dirf;
+	memset(&dirf, 0, sizeof(dirf));
+	dirf.f_offset = 0;
+	dirf.f_dentry = parent;
+	while (1) {
+		size_t buf_len = sizeof(buf);
+		errorcode_t err = vfs_read(&dirf, buf, &buf_len);
+		if (err == ANANAS_ERROR_OK && buf_len == 0)
+			break;
+
+		char* cur_ptr = buf;
+		while (err == ANANAS_ERROR_OK && buf_len > 0) {
+			struct VFS_DIRENT* de = (struct VFS_DIRENT*)cur_ptr;
+			buf_len -= DE_LENGTH(de); cur_ptr += DE_LENGTH(de);
+			err = dirindex_insert_locked(fs, di, DE_NAME(de), de->de_name_length, DE_FSOP(de));
+		}
+		if (err != ANANAS_ERROR_OK) {
+			/* Leave the index empty; the next lookup will try again */
+			dirindex_clear_locked(di);
+			return err;
+		}
+	}
+
+	TRACE(VFS, INFO, "indexed directory inode %p: %u entries", parent->d_inode, di->di_num_entries);
+	di->di_flags |= DIRINDEX_FLAG_COMPLETE;
+	return ANANAS_ERROR_OK;
+}
+
+/*
+ * Returns the index of directory 'dir'; if there is none yet, it will be
+ * created if 'create' is set and NULL is returned otherwise.
+ */
+static struct VFS_DIRINDEX*
+dirindex_get(struct VFS_INODE* dir, int create)
+{
+	INODE_LOCK(dir);
+	struct VFS_DIRINDEX* di = dir->i_dirindex;
+	if (di == NULL && create) {
+		di = kmalloc(sizeof(*di));
+		if (di != NULL) {
+			memset(di, 0, sizeof(*di));
+			mutex_init(&di->di_mutex, "dirindex");
+			di->di_hash_size = DIRINDEX_HASH_MIN;
+			di->di_bucket = dirindex_alloc_buckets(di->di_hash_size);
+			if (di->di_bucket == NULL) {
+				kfree(di);
+				di = NULL;
+			}
+		}
+		dir->i_dirindex = di;
+	}
+	INODE_UNLOCK(dir);
+	return di;
+}
+
+errorcode_t
+vfs_dirindex_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	KASSERT(parent != NULL, "lookup with no parent?");
+	struct VFS_INODE* dir = parent->d_inode;
+	struct VFS_MOUNTED_FS* fs = dir->i_fs;
+	KASSERT(S_ISDIR(dir->i_sb.st_mode), "supplied inode is not a directory");
+
+	struct VFS_DIRINDEX* di = dirindex_get(dir, 1);
+	if (di == NULL)
+		return vfs_generic_lookup(parent, destinode, dentry); /* out of memory; do it the slow way */
+
+	/* The index only protects the FSOP; we must not hold it while reading the inode */
+	uint8_t fsop[256];
+	int len = strlen(dentry);
+	uint32_t hash = dirindex_hash_value(dentry, len);
+	mutex_lock(&di->di_mutex);
+	if ((di->di_flags & DIRINDEX_FLAG_COMPLETE) == 0) {
+		errorcode_t err = dirindex_build_locked(di, parent);
+		if (err != ANANAS_ERROR_OK) {
+			mutex_unlock(&di->di_mutex);
+			return err;
+		}
+	}
+	struct DIRINDEX_ENTRY* e = *dirindex_find_locked(fs, di, dentry, len, hash);
+	if (e != NULL)
+		memcpy(fsop, e->e_data, fs->fs_fsop_size);
+	mutex_unlock(&di->di_mutex);
+
+	if (e == NULL)
+		return ANANAS_ERROR(NO_FILE);
+	return vfs_get_inode(fs, fsop, destinode);
+}
+
+void
+dirindex_add(struct VFS_INODE* dir, const char* name, const void* fsop)
+{
+	struct VFS_DIRINDEX* di = dirindex_get(dir, 0);
+	if (di == NULL)
+		return; /* not indexed; the index will be read from disk when needed */
+
+	mutex_lock(&di->di_mutex);
+	if (di->di_flags & DIRINDEX_FLAG_COMPLETE) {
+		if (dirindex_insert_locked(dir->i_fs, di, name, strlen(name), fsop) != ANANAS_ERROR_OK)
+			dirindex_clear_locked(di); /* can't add it; have to re-read the directory */
+	}
+	mutex_unlock(&di->di_mutex);
+}
+
+void
+dirindex_remove(struct VFS_INODE* dir, const char* name)
+{
+	struct VFS_DIRINDEX* di = dirindex_get(dir, 0);
+	if (di == NULL)
+		return;
+
+	mutex_lock(&di->di_mutex);
+	int len = strlen(name);
+	struct DIRINDEX_ENTRY** link = dirindex_find_locked(dir->i_fs, di, name, len, dirindex_hash_value(name, len));
+	struct DIRINDEX_ENTRY* e = *link;
+	if (e != NULL) {
+		*link = e->e_next;
+		di->di_num_entries--;
+		kfree(e);
+	}
+	mutex_unlock(&di->di_mutex);
+}
+
+void
+dirindex_destroy(struct VFS_INODE* dir)
+{
+	/* The inode is going away, so nothing can be using the index anymore */
+	struct VFS_DIRINDEX* di = dir->i_dirindex;
+	if (di == NULL)
+		return;
+	dirindex_clear_locked(di);
+	kfree(di->di_bucket);
+	kfree(di);
+	dir->i_dirindex = NULL;
+}
+
+/* vim:set ts=2 sw=2: */
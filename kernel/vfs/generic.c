@@ -11,6 +11,10 @@ TRACE_SETUP;
 
 #define VFS_DEBUG_LOOKUP 0
 
+/* Initial and maximum number of blocks to read ahead on sequential access */
+#define VFS_READAHEAD_MIN 4
+#define VFS_READAHEAD_MAX 32
+
 errorcode_t
 vfs_generic_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
 {
@@ -22,8 +26,9 @@ vfs_generic_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const ch
 #endif
 
 	/*
-	 * XXX This is a very naive implementation which does not use the
-	 * possible directory index.
+	 * This reads the entire directory for every lookup; filesystems whose
+	 * directories only change through the VFS should use vfs_dirindex_lookup()
+	 * instead.
 	 */
 	struct VFS_INODE* parent_inode = parent->d_inode;
 	KASSERT(S_ISDIR(parent_inode->i_sb.st_mode), "supplied inode is not a directory");
@@ -59,6 +64,46 @@ vfs_generic_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const ch
 	}
 }
 
+/*
+ * Submits reads for the logical blocks of a file up to 'last', starting at
+ * the first block not yet read ahead; the blocks end up in the buffer cache,
+ * so that later reads of them need not wait for the disk. Blocks which are
+ * adjacent on disk are read together.
+ */
+static void
+vfs_readahead(struct VFS_FILE* file, blocknr_t first, blocknr_t last)
+{
+	struct VFS_INODE* inode = file->f_dentry->d_inode;
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+
+	/* Never read beyond the end of the file */
+	if (inode->i_sb.st_size == 0)
+		return;
+	blocknr_t eof_block = (inode->i_sb.st_size - 1) / (blocknr_t)fs->fs_block_size;
+	if (last > eof_block)
+		last = eof_block;
+
+	if (file->f_ra_next < first)
+		file->f_ra_next = first;
+	blocknr_t run_block = 0;
+	unsigned int run_length = 0;
+	for (/* nothing */; file->f_ra_next <= last; file->f_ra_next++) {
+		blocknr_t block;
+		if (inode->i_iops->block_map(inode, file->f_ra_next, &block, 0) != ANANAS_ERROR_OK)
+			break; /* the read itself will report this */
+		if (run_length > 0 && block == run_block + run_length) {
+			run_length++;
+			continue;
+		}
+		if (run_length > 0)
+			vfs_bprefetch(fs, run_block, run_length);
+		run_block = block;
+		run_length = 1;
+	}
+	if (run_length > 0)
+		vfs_bprefetch(fs, run_block, run_length);
+}
+
 errorcode_t
 vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
 {
@@ -75,11 +120,54 @@ vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
 		left = inode->i_sb.st_size - file->f_offset;
 	}
 
+	/*
+	 * If this read continues where the previous one ended, the file is likely
+	 * being streamed; read ahead, and read further ahead the longer this goes
+	 * on. Any other access pattern stops the read-ahead.
+	 */
+	int streaming = file->f_offset == file->f_ra_offset;
+	if (streaming && left > 0) {
+		if (file->f_ra_window == 0)
+			file->f_ra_window = VFS_READAHEAD_MIN;
+		else if (file->f_ra_window < VFS_READAHEAD_MAX)
+			file->f_ra_window *= 2;
+	} else {
+		file->f_ra_window = 0;
+		file->f_ra_next = 0;
+	}
+
+	/*
+	 * A read spanning multiple blocks is read ahead by at least its own length,
+	 * so that blocks which are adjacent on disk are read as a single request.
+	 * Unless the file is being streamed, we won't read beyond its end.
+	 */
+	blocknr_t last_block = 0;
+	if (left > 0) {
+		last_block = (file->f_offset + left - 1) / (blocknr_t)fs->fs_block_size;
+		blocknr_t num_blocks = last_block - file->f_offset / (blocknr_t)fs->fs_block_size + 1;
+		if (num_blocks > 1 && file->f_ra_window < num_blocks)
+			file->f_ra_window = (num_blocks < VFS_READAHEAD_MAX) ? num_blocks : VFS_READAHEAD_MAX;
+	}
+
 	blocknr_t cur_block = 0;
 	while(left > 0) {
+		blocknr_t logical_block = file->f_offset / (blocknr_t)fs->fs_block_size;
+
+		/*
+		 * Keep the read-ahead window filled; we top it up once half of it has
+		 * been consumed so that the requests are submitted in batches. The window
+		 * starts at the current block, so it covers the rest of this read too.
+		 */
+		if (file->f_ra_window > 0 && logical_block + file->f_ra_window / 2 >= file->f_ra_next) {
+			blocknr_t ra_last = logical_block + file->f_ra_window - 1;
+			if (!streaming && ra_last > last_block)
+				ra_last = last_block;
+			vfs_readahead(file, logical_block, ra_last);
+		}
+
 		/* Figure out which block to use next */
 		blocknr_t want_block;
-		errorcode_t err = inode->i_iops->block_map(inode, (file->f_offset / (blocknr_t)fs->fs_block_size), &want_block, 0);
+		errorcode_t err = inode->i_iops->block_map(inode, logical_block, &want_block, 0);
 		ANANAS_ERROR_RETURN(err);
 
 		/* Grab the next block if necessary */
@@ -104,6 +192,7 @@ vfs_generic_read(struct VFS_FILE* file, void* buf, size_t* len)
 		file->f_offset += chunk_len;
 	}
 	if (bio != NULL) bio_free(bio);
+	file->f_ra_offset = file->f_offset;
 	*len = read;
 	return ANANAS_ERROR_OK;
 }
@@ -1,33 +1,71 @@
 /*
  * Ananas inode cache
  *
- * Inode caching is done on a per-filesystem basis, and currently using a
- * simple linear list. It should be unified to a single tree for all
- * filesystems one day, but this is complicated because FSOP's are
- * variable length.
+ * All filesystems share a single inode cache, which is a hash table keyed by
+ * the filesystem and the FSOP bytes; this ensures an inode will only be in
+ * memory once. The number of items is determined by the amount of memory at
+ * boot; once it is reached, inodes which are only referenced by the cache are
+ * thrown away, least recently used first.
+ *
+ * While an inode is being read, its item is pending; anyone looking up the
+ * same inode sleeps until the read is done. Inode reference counts are
+ * protected by the cache lock so that an inode cannot lose its final
+ * reference while it is being looked up.
  */
 #include <ananas/types.h>
 #include <ananas/error.h>
+#include <ananas/init.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/icache.h>
 #include <ananas/mm.h>
 #include <ananas/lock.h>
+#include <ananas/page.h>
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/lib.h>
+#include <machine/param.h> /* for PAGE_SIZE */
 
 TRACE_SETUP;
 
-#define ICACHE_LOCK(fs) \
-	mutex_lock(&(fs)->fs_icache_lock)
-#define ICACHE_UNLOCK(fs) \
-	mutex_unlock(&(fs)->fs_icache_lock)
+/* The inodes may use up to 1 / ICACHE_MEMORY_FRACTION of available memory... */
+#define ICACHE_MEMORY_FRACTION	32
+
+/* ... where we assume this is what an inode and its filesystem data costs, in bytes */
+#define ICACHE_INODE_SIZE	512
+
+/* Minimum number of items before unused inodes are purged */
+#define ICACHE_MIN_ENTRIES	256
+
+/* Hash table size limits, in buckets; must be powers of two */
+#define ICACHE_HASH_MIN		64
+#define ICACHE_HASH_MAX		65536
+
+/* Average number of items per bucket once the cache is full */
+#define ICACHE_HASH_LOAD	2
+
+/* Maximum number of inodes thrown out at once when the cache is full */
+#define ICACHE_PURGE_BATCH	32
+
+#define ICACHE_LOCK() \
+	mutex_lock(&mtx_icache)
+#define ICACHE_UNLOCK() \
+	mutex_unlock(&mtx_icache)
 
 #define INODE_ASSERT_SANE(i) \
 	KASSERT((i)->i_refcount > 0, "referencing inode with no refs");
 
 #undef ICACHE_DEBUG
 
+/* Protects everything below, as well as the reference counts of all inodes */
+static mutex_t mtx_icache;
+static struct ICACHE_BUCKET* icache_hash;
+static unsigned int icache_hash_size;
+struct ICACHE_LRU icache_lru;
+static unsigned int icache_num_entries;
+static unsigned int icache_max_entries;
+static struct ICACHE_STATS icache_stats;
+
 static char*
 fsop_to_string(struct VFS_MOUNTED_FS* fs, void* fsop)
 {
@@ -43,34 +81,82 @@ fsop_to_string(struct VFS_MOUNTED_FS* fs, void* fsop)
 	return out;
 }
 
-static int
-fsop_compare(struct VFS_MOUNTED_FS* fs, const void* fsop1, const void* fsop2)
+static errorcode_t
+icache_setup()
 {
-	const uint8_t* f1 = fsop1;
-	const uint8_t* f2 = fsop2;
-
-	/* XXX this is just a dumb big-endian compare for now */
-	for (int i = fs->fs_fsop_size - 1; i >= 0; i--) {
-		if (f1[i] < f2[i])
-			return -1;
-		else if (f1[i] > f2[i])
-			return 1;
-		/* else equal; continue */
+	mutex_init(&mtx_icache, "icache");
+
+	/* Size the cache using the memory we have */
+	unsigned int total_pages, avail_pages;
+	page_get_stats(&total_pages, &avail_pages);
+	icache_max_entries = (avail_pages / ICACHE_MEMORY_FRACTION) * (PAGE_SIZE / ICACHE_INODE_SIZE);
+	if (icache_max_entries < ICACHE_MIN_ENTRIES)
+		icache_max_entries = ICACHE_MIN_ENTRIES;
+	icache_hash_size = ICACHE_HASH_MIN;
+	while (icache_hash_size * ICACHE_HASH_LOAD < icache_max_entries && icache_hash_size < ICACHE_HASH_MAX)
+		icache_hash_size *= 2;
+
+	icache_hash = kmalloc(sizeof(struct ICACHE_BUCKET) * icache_hash_size);
+	for (unsigned int n = 0; n < icache_hash_size; n++)
+		DQUEUE_INIT(&icache_hash[n]);
+	DQUEUE_INIT(&icache_lru);
+	return ANANAS_ERROR_OK;
+}
+
+INIT_FUNCTION(icache_setup, SUBSYSTEM_VFS, ORDER_MIDDLE);
+
+static uint32_t
+icache_hash_value(struct VFS_MOUNTED_FS* fs, const void* fsop)
+{
+	/* FNV-1a over the fsop, seeded using the filesystem */
+	const uint8_t* p = fsop;
+	uint32_t hash = 2166136261u ^ (uint32_t)((addr_t)fs >> 4);
+	for (int i = 0; i < fs->fs_fsop_size; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
 	}
-	return 0;
+	return hash;
+}
+
+static inline struct ICACHE_BUCKET*
+icache_bucket(uint32_t hash)
+{
+	return &icache_hash[hash & (icache_hash_size - 1)];
+}
+
+/* Finds the item of a given fsop, or NULL; icache lock must be held */
+static struct ICACHE_ITEM*
+icache_find_locked(struct VFS_MOUNTED_FS* fs, const void* fsop, uint32_t hash)
+{
+	struct ICACHE_BUCKET* bucket = icache_bucket(hash);
+	if (!DQUEUE_EMPTY(bucket))
+		DQUEUE_FOREACH_IP(bucket, bucket, ii, struct ICACHE_ITEM) {
+			if (ii->hash == hash && ii->fs == fs && memcmp(ii->fsop, fsop, fs->fs_fsop_size) == 0)
+				return ii;
+		}
+	return NULL;
+}
+
+/* Finds the item of a given inode, or NULL if it isn't cached; icache lock must be held */
+static struct ICACHE_ITEM*
+icache_find_inode_locked(struct VFS_INODE* inode)
+{
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	struct ICACHE_ITEM* ii = icache_find_locked(fs, inode->i_fsop, icache_hash_value(fs, inode->i_fsop));
+	return (ii != NULL && ii->inode == inode) ? ii : NULL;
 }
 
 #ifdef ICACHE_DEBUG
 static void
-icache_sanity_check(struct VFS_MOUNTED_FS* fs)
+icache_sanity_check()
 {
-	DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-		DQUEUE_FOREACH(&fs->fs_icache_inuse, jj, struct ICACHE_ITEM) {
+	DQUEUE_FOREACH_IP(&icache_lru, lru, ii, struct ICACHE_ITEM) {
+		DQUEUE_FOREACH_IP(&icache_lru, lru, jj, struct ICACHE_ITEM) {
 			if (ii == jj)
 				continue;
 
-			KASSERT(fsop_compare(fs, ii->fsop, jj->fsop) != 0, "duplicate fsop in cache");
-			KASSERT(ii->inode != jj->inode, "duplicate inode in cache");
+			KASSERT(ii->fs != jj->fs || memcmp(ii->fsop, jj->fsop, ii->fs->fs_fsop_size) != 0, "duplicate fsop in cache");
+			KASSERT(ii->inode == NULL || ii->inode != jj->inode, "duplicate inode in cache");
 		}
 	}
 }
@@ -79,47 +165,36 @@ icache_sanity_check(struct VFS_MOUNTED_FS* fs)
 void
 icache_ensure_inode_gone(struct VFS_INODE* inode)
 {
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-		KASSERT(ii->inode != inode, "removing inode %p still in cache", inode);
-	}
+	ICACHE_LOCK();
+	KASSERT(icache_find_inode_locked(inode) == NULL, "removing inode %p still in cache", inode);
+	ICACHE_UNLOCK();
 }
 
 void
 icache_init(struct VFS_MOUNTED_FS* fs)
 {
+	/* Nothing to set up; we just need to know how large the fsop's are */
 	KASSERT(fs->fs_fsop_size > 0, "fsop size not initialized");
-	mutex_init(&fs->fs_icache_lock, "icache");
-	DQUEUE_INIT(&fs->fs_icache_inuse);
-	DQUEUE_INIT(&fs->fs_icache_free);
-
-	/*
-	 * Construct an empty cache; we do a single allocation and add the items one
-	 * by one to the free list.
-	 */
-	fs->fs_icache_buffer = kmalloc(ICACHE_ITEMS_PER_FS * (sizeof(struct ICACHE_ITEM) + fs->fs_fsop_size));
-	memset(fs->fs_icache_buffer, 0, ICACHE_ITEMS_PER_FS * (sizeof(struct ICACHE_ITEM) + fs->fs_fsop_size));
-	addr_t icache_ptr = (addr_t)fs->fs_icache_buffer;
-	for (int i = 0; i < ICACHE_ITEMS_PER_FS; i++) {
-		DQUEUE_ADD_TAIL(&fs->fs_icache_free, (struct ICACHE_ITEM*)icache_ptr);
-		icache_ptr += sizeof(struct ICACHE_ITEM) + fs->fs_fsop_size;
-	}
 }
 
 void
 icache_dump(struct VFS_MOUNTED_FS* fs)
 {
+	/* XXX Don't lock; this is for debugging purposes only */
 	kprintf("icache_dump(): fs=%p\n", fs);
 	int n = 0;
-	DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-		kprintf("icache_entry=%p, inode=%p, fsop=",ii, ii->inode);
-		for (int i = 0; i < fs->fs_fsop_size; i++)
-			kprintf("%x ", (unsigned char)ii->fsop[i]);
-		kprintf("\n");
-		if (ii->inode != NULL)
-			vfs_dump_inode(ii->inode);
-		n++;
-	}               
+	if (!DQUEUE_EMPTY(&icache_lru))
+		DQUEUE_FOREACH_IP(&icache_lru, lru, ii, struct ICACHE_ITEM) {
+			if (ii->fs != fs)
+				continue;
+			kprintf("icache_entry=%p, inode=%p, fsop=",ii, ii->inode);
+			for (int i = 0; i < fs->fs_fsop_size; i++)
+				kprintf("%x ", (unsigned char)ii->fsop[i]);
+			kprintf("\n");
+			if (ii->inode != NULL)
+				vfs_dump_inode(ii->inode);
+			n++;
+		}
 	kprintf("icache_dump(): %u entries\n", n);
 }
 
@@ -127,23 +202,57 @@ void
 icache_destroy(struct VFS_MOUNTED_FS* fs)
 {	
 	panic("icache_destroy");
-#if 0
-	ICACHE_LOCK(fs);
-	DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-		if (ii->inode != NULL)
-			vfs_deref_inode(ii->inode);
-	}
-	kfree(fs->fs_icache_buffer);
-	fs->fs_icache_buffer = NULL;
-	ICACHE_UNLOCK(fs);
-#endif
 }
 
-/* Do not hold the icache lock when calling this function */
+/*
+ * Removes an item from the cache. It is freed unless threads are still
+ * waiting for it, in which case the last of them will take care of it; icache
+ * lock must be held.
+ */
+static void
+icache_remove_item_locked(struct ICACHE_ITEM* ii)
+{
+	DQUEUE_REMOVE_IP(icache_bucket(ii->hash), bucket, ii);
+	DQUEUE_REMOVE_IP(&icache_lru, lru, ii);
+	icache_num_entries--;
+
+	if (ii->waiters > 0)
+		ii->flags |= ICACHE_ITEM_FLAG_DEAD;
+	else
+		kfree(ii);
+}
+
+/* Wakes up everyone waiting for a pending item; icache lock must be held */
 static void
-inode_deref_locked(struct VFS_INODE* inode)
+icache_wakeup_waiters_locked(struct ICACHE_ITEM* ii)
+{
+	for (unsigned int n = 0; n < ii->waiters; n++)
+		sem_signal(&ii->wait_sem);
+}
+
+/* Destroys an inode which has lost its final reference; icache lock must not be held */
+static void
+icache_destroy_inode(struct VFS_INODE* inode)
+{
+	KASSERT(inode->i_refcount == 0, "destroying inode %p with refs", inode);
+
+	/* Throw away the filesystem-specific inode parts, if any; these expect a locked inode */
+	struct VFS_MOUNTED_FS* fs = inode->i_fs;
+	INODE_LOCK(inode);
+	if (fs->fs_fsops->destroy_inode != NULL) {
+		fs->fs_fsops->destroy_inode(inode);
+	} else {
+		vfs_destroy_inode(inode);
+	}
+}
+
+void
+vfs_deref_inode(struct VFS_INODE* inode)
 {
 	TRACE(VFS, FUNC, "inode=%p,cur refcount=%u", inode, inode->i_refcount);
+
+	ICACHE_LOCK();
+	INODE_ASSERT_SANE(inode);
 	if (--inode->i_refcount > 0) {
 		/*
 		 * Refcount isn't zero - this means we shouldn't throw the item away. However,
@@ -151,7 +260,7 @@ inode_deref_locked(struct VFS_INODE* inode)
 		 * point, we should remove it from the cache.
 		 */
 		if (inode->i_sb.st_nlink != 0 || inode->i_refcount != 1) {
-			INODE_UNLOCK(inode);
+			ICACHE_UNLOCK();
 			return;
 		}
 
@@ -161,38 +270,16 @@ inode_deref_locked(struct VFS_INODE* inode)
 
 	/*
 	 * The inode is truly gone; this means we have to remove it from our cache as
-	 * well. We do this right before destroying it because we use the cache to
-	 * ensure we will never have multiple copies of the same inode.
+	 * well. We do this before destroying it because we use the cache to ensure we
+	 * will never have multiple copies of the same inode. Inodes which never made
+	 * it to the cache (because they could not be read) need not be removed.
 	 */
-	struct VFS_MOUNTED_FS* fs = inode->i_fs;
-	int removed = 0;
-	ICACHE_LOCK(fs);
-	DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-		if (ii->inode != inode)
-			continue;
-		DQUEUE_REMOVE(&fs->fs_icache_inuse, ii);
-		DQUEUE_ADD_TAIL(&fs->fs_icache_free, ii);
-		removed++;
-		break;
-	}
-	ICACHE_UNLOCK(fs);
-	KASSERT(removed == 1, "inode %p not in cache?", inode);
+	struct ICACHE_ITEM* ii = icache_find_inode_locked(inode);
+	if (ii != NULL)
+		icache_remove_item_locked(ii);
+	ICACHE_UNLOCK();
 
-	/* Throw away the filesystem-specific inode parts, if any */
-	if (fs->fs_fsops->destroy_inode != NULL) {
-		fs->fs_fsops->destroy_inode(inode);
-	} else {
-		vfs_destroy_inode(inode);
-	}
-}
-
-void
-vfs_deref_inode(struct VFS_INODE* inode)
-{
-	INODE_ASSERT_SANE(inode);
-	INODE_LOCK(inode);
-	inode_deref_locked(inode);
-	/* INODE_UNLOCK(inode); - no need, inode_deref_locked() handles this if needed */
+	icache_destroy_inode(inode);
 }
 
 void
@@ -200,145 +287,43 @@ vfs_ref_inode(struct VFS_INODE* inode)
 {
 	KASSERT(inode != NULL, "reffing a null inode");
 	TRACE(VFS, FUNC, "inode=%p,cur refcount=%u", inode, inode->i_refcount);
-	INODE_ASSERT_SANE(inode);
 
-	INODE_LOCK(inode);
+	ICACHE_LOCK();
 	KASSERT(inode->i_refcount > 0, "referencing a dead inode");
 	inode->i_refcount++;
-	INODE_UNLOCK(inode);
-}
-
-/* Removes old entries from the cache - icache must be locked */
-static void
-icache_purge_old_entries(struct VFS_MOUNTED_FS* fs)
-{
-	DQUEUE_FOREACH_REVERSE_SAFE(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-		/*
-		 * Skip any pending items - we are not responsible for their cleanup (and
-		 * to do so would be to introduce a race in vfs_read_inode() !
-		 */
-		if (ii->inode == NULL)
-			continue;
-
-		/*
-		 * Purge the dentry for the given inode; this should free the refs up and
-		 * allow us to throw the inode away.
-		 */
-		dcache_remove_inode(ii->inode);
-
-		/*
-		 * Lock the item; if the refcount is one, it means the cache is the
-		 * sole owner and we can just grab the inode.
-		 */
-		INODE_LOCK(ii->inode);
-		KASSERT(ii->inode->i_refcount > 0, "cached inode %p has no refs! (refcount is %u)", ii->inode, ii->inode->i_refcount);
-		if (ii->inode->i_refcount > 1) {
-			/* Not just in the cache, this one */
-			INODE_UNLOCK(ii->inode);
-			continue;
-		}
-		TRACE(VFS, INFO, "removing only-cache item, ii=%p, inode=%p", ii, ii->inode);
-
-		/* Remove the inode; this will be the final reference, so the cache item will be removed */
-		ICACHE_UNLOCK(fs);
-		inode_deref_locked(ii->inode);
-		ICACHE_LOCK(fs);
-	}
+	ICACHE_UNLOCK();
 }
 
 /*
- * Searches find an inode in the cache; adds a pending entry if it's not found.
- * Will return the cache item; the inode is NULL if a pending item was added,
- * the result is NULL if a pending inode is already in the cache.
- * 
+ * Removes old entries from the cache - icache must be locked. The inodes are
+ * not destroyed, as that may take a while; instead, they are stored in
+ * 'purged' (which must hold ICACHE_PURGE_BATCH entries) and the amount is
+ * returned. These must be destroyed using icache_destroy_inode().
  */
-static struct ICACHE_ITEM*
-icache_lookup(struct VFS_MOUNTED_FS* fs, void* fsop)
+static unsigned int
+icache_purge_old_entries_locked(struct VFS_INODE** purged)
 {
-	KASSERT(fs->fs_icache_buffer != NULL, "icache pool not initialized");
+	unsigned int num_purged = 0;
+	struct ICACHE_ITEM* ii = DQUEUE_EMPTY(&icache_lru) ? NULL : DQUEUE_TAIL(&icache_lru);
+	while (ii != NULL && num_purged < ICACHE_PURGE_BATCH) {
+		struct ICACHE_ITEM* prev = DQUEUE_PREV_IP(ii, lru);
 
-	ICACHE_LOCK(fs);
-
-	/*
-	 * XXX This is just a simple linear search which attempts to avoid
-	 * overhead by moving recent entries to the start
-	 */
-	if (!DQUEUE_EMPTY(&fs->fs_icache_inuse)) {
-		DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-			if (fsop_compare(fs, fsop, ii->fsop) != 0)
-				continue;
-
-			/*
-			 * It's quite possible that this inode is still pending; if that
-		 	 * is the case, our caller should sleep and wait for the other
-			 * caller to finish up.
-			 */
-			if (ii->inode == NULL) {
-				ICACHE_UNLOCK(fs);
-				kprintf("icache_lookup(): pending item, waiting\n");
-				panic("musn't happen");
-				return NULL;
-			}
-
-			/* Now, we must increase the inode's lock count. We know the inode was
-			 * in the cache, so it's refcount must be at least one (it could not be
-			 * removed in between as we hold the cache lock). We increment the
-			 * refcount a second time, as it's now being given to the calling thread.
-			 *
-			 * Note that we cannot safely do this if we are dropping the icache lock,
-			 * because this creates a race: the item may be removed while we are
-			 * waiting for the inode lock.
-			 */
-			vfs_ref_inode(ii->inode);
-
-			/*
-			 * Push the the item to the head of the cache; we expect the caller to
-			 * free it once done, which will decrease the refcount to 1, which is OK
-			 * as only the cache owns it in such a case.
-		 	 */
-			DQUEUE_REMOVE(&fs->fs_icache_inuse, ii);
-			DQUEUE_ADD_HEAD(&fs->fs_icache_inuse, ii);
-			ICACHE_UNLOCK(fs);
-			TRACE(VFS, INFO, "cache hit: fs=%p,fsop=% => ii=%p, inode=%p", fs, fsop_to_string(fs, fsop), ii, ii->inode);
-			return ii;
-		}
-	}
-
-	/* Item was not found; try to get one from the freelist */
-	struct ICACHE_ITEM* ii = NULL;
-	while(ii == NULL) {
-		if (!DQUEUE_EMPTY(&fs->fs_icache_free)) {
-			/* Got one! */
-			ii = DQUEUE_HEAD(&fs->fs_icache_free);
-			DQUEUE_POP_HEAD(&fs->fs_icache_free);
-		} else {
-			/* Freelist is empty; we need to sacrifice an item from the cache */
-			icache_purge_old_entries(fs);
-			/* XXX next condition is too harsh */
-			if (!DQUEUE_EMPTY(&fs->fs_icache_free))
-				kprintf("icache still full after purge??\n");
+		/*
+		 * Skip any pending items - we are not responsible for their cleanup (and
+		 * to do so would be to introduce a race in vfs_get_inode() !) Inodes
+		 * with a refcount above one are not just in the cache, so they stay.
+		 */
+		struct VFS_INODE* inode = ii->inode;
+		if (inode != NULL && inode->i_refcount == 1) {
+			TRACE(VFS, INFO, "removing only-cache item, ii=%p, inode=%p", ii, inode);
+			inode->i_refcount = 0;
+			purged[num_purged++] = inode;
+			icache_remove_item_locked(ii);
 		}
+		ii = prev;
 	}
-
-	/* Initialize the item and place it at the head; it's most recently used after all */
-	TRACE(VFS, INFO, "cache miss: fs=%p, fsop=%s => ii=%p", fs, fsop_to_string(fs, fsop), ii);
-	ii->inode = NULL;
-	memcpy(ii->fsop, fsop, fs->fs_fsop_size);
-	DQUEUE_ADD_HEAD(&fs->fs_icache_inuse, ii);
-	ICACHE_UNLOCK(fs);
-	return ii;
-}
-
-static void
-icache_remove_pending(struct VFS_MOUNTED_FS* fs, struct ICACHE_ITEM* ii)
-{
-	panic("musn't happen");
-	KASSERT(ii->inode == NULL, "removing an item that is not pending");
-
-	ICACHE_LOCK(fs);
-	DQUEUE_REMOVE(&fs->fs_icache_inuse, ii);
-	DQUEUE_ADD_TAIL(&fs->fs_icache_free, ii);
-	ICACHE_UNLOCK(fs);
+	icache_stats.is_purges += num_purged;
+	return num_purged;
 }
 
 static struct VFS_INODE*
@@ -361,59 +346,111 @@ vfs_alloc_inode(struct VFS_MOUNTED_FS* fs, const void* fsop)
 errorcode_t
 vfs_get_inode(struct VFS_MOUNTED_FS* fs, void* fsop, struct VFS_INODE** destinode)
 {
-	struct ICACHE_ITEM* ii = NULL;
-
 	TRACE(VFS, FUNC, "fs=%p, fsop=%s", fs, fsop_to_string(fs, fsop));
+	uint32_t hash = icache_hash_value(fs, fsop);
+
+	ICACHE_LOCK();
+	struct ICACHE_ITEM* ii;
+	while ((ii = icache_find_locked(fs, fsop, hash)) != NULL) {
+		struct VFS_INODE* inode = ii->inode;
+		if (inode != NULL) {
+			/*
+			 * Already have the inode cached; it's refcount must be at least one as
+			 * the cache holds a reference. We increment it a second time, as it's
+			 * now being given to the calling thread.
+			 */
+			INODE_ASSERT_SANE(inode);
+			inode->i_refcount++;
+
+			/*
+			 * Push the the item to the head of the cache; we expect the caller to
+			 * free it once done, which will decrease the refcount to 1, which is OK
+			 * as only the cache owns it in such a case.
+		 	 */
+			DQUEUE_REMOVE_IP(&icache_lru, lru, ii);
+			DQUEUE_ADD_HEAD_IP(&icache_lru, lru, ii);
+			icache_stats.is_hits++;
+			ICACHE_UNLOCK();
+			TRACE(VFS, INFO, "cache hit: fs=%p, fsop=%s => ii=%p,inode=%p", fs, fsop_to_string(fs, fsop), ii, inode);
+			*destinode = inode;
+			return ANANAS_ERROR_OK;
+		}
+
+		/*
+		 * The inode is pending; someone else is reading it, so sleep until they
+		 * are done and try again - if the read failed, the item will be gone.
+		 */
+		TRACE(VFS, INFO, "fsop is already pending, waiting...");
+		icache_stats.is_waits++;
+		ii->waiters++;
+		ICACHE_UNLOCK();
+		sem_wait(&ii->wait_sem);
+		ICACHE_LOCK();
+		if (--ii->waiters == 0 && (ii->flags & ICACHE_ITEM_FLAG_DEAD))
+			kfree(ii);
+	}
 
 	/*
-	 * Wait until we obtain a cache spot - this waits for pending inodes to be
-	 * finished up. By ensuring we fill the cache we ensure the inode can only
-	 * exist a single time.
+	 * Item was not found; make room if we have to and add a pending item. By
+	 * ensuring we fill the cache we ensure the inode can only exist a single
+	 * time; anyone else looking for it will wait until we are done.
 	 */
-	while(1) {
-		ii = icache_lookup(fs, fsop);
-		if (ii != NULL)
-			break;
-		TRACE(VFS, WARN, "fsop is already pending, waiting...");
-		/* XXX There should be a wakeup signal of some kind */
-		reschedule();
-	}
+	struct VFS_INODE* purged[ICACHE_PURGE_BATCH];
+	unsigned int num_purged = 0;
+	icache_stats.is_misses++;
+	if (icache_num_entries >= icache_max_entries)
+		num_purged = icache_purge_old_entries_locked(purged);
+
+	ii = kmalloc(sizeof(struct ICACHE_ITEM) + fs->fs_fsop_size);
+	memset(ii, 0, sizeof(*ii));
+	ii->fs = fs;
+	ii->inode = NULL;
+	ii->hash = hash;
+	sem_init(&ii->wait_sem, 0);
+	memcpy(ii->fsop, fsop, fs->fs_fsop_size);
+	DQUEUE_ADD_HEAD_IP(icache_bucket(hash), bucket, ii);
+	DQUEUE_ADD_HEAD_IP(&icache_lru, lru, ii);
+	icache_num_entries++;
+	ICACHE_UNLOCK();
 
-	if (ii->inode != NULL) {
-		/* Already have the inode cached -> return it (refcount will already be incremented) */
-		*destinode = ii->inode;
-		TRACE(VFS, INFO, "cache hit: fs=%p, fsop=%s => ii=%p,inode=%p", fs, fsop_to_string(fs, fsop), ii, ii->inode);
-		return ANANAS_ERROR_OK;
-	}
+	/* Now that nothing is locked, get rid of anything we purged */
+	for (unsigned int n = 0; n < num_purged; n++)
+		icache_destroy_inode(purged[n]);
 
 	/*
-	 * Must read the inode; if this fails, we have to ask the cache to remove the
-	 * pending item. Because multiple callers for the same FSOP will not reach
-	 * this point (they keep rescheduling, waiting for us to deal with it)
+	 * Must read the inode; if this fails, we have to remove the pending item
+	 * and wake up anyone who is waiting for it, so that they can try for
+	 * themselves.
 	 */
 	struct VFS_INODE* inode = vfs_alloc_inode(fs, fsop);
-	if (inode == NULL) {
-		icache_remove_pending(fs, ii);
-		return ANANAS_ERROR(OUT_OF_HANDLES);
+	errorcode_t result = ANANAS_ERROR(OUT_OF_HANDLES);
+	if (inode != NULL) {
+		result = fs->fs_fsops->read_inode(inode, fsop);
+		if (result != ANANAS_ERROR_NONE)
+			vfs_deref_inode(inode); /* throws it away */
 	}
-
-	errorcode_t result = fs->fs_fsops->read_inode(inode, fsop);
 	if (result != ANANAS_ERROR_NONE) {
-		vfs_deref_inode(inode); /* throws it away */
+		ICACHE_LOCK();
+		icache_wakeup_waiters_locked(ii);
+		icache_remove_item_locked(ii);
+		ICACHE_UNLOCK();
 		return result;
 	}
 
 	/*
-	 * First of all, increment the inode's refcount so that it will not go away while in the cache;
-	 * the caller has one ref, and the cache has the second.
+	 * Hook the inode up to the item and increment the inode's refcount so that
+	 * it will not go away while in the cache; the caller has one ref, and the
+	 * cache has the second.
 	 */
-	KASSERT(inode != NULL, "wtf");
-	vfs_ref_inode(inode);
+	ICACHE_LOCK();
+	inode->i_refcount++;
+	KASSERT(inode->i_refcount == 2, "fresh inode refcount incorrect");
 	ii->inode = inode;
-	KASSERT(ii->inode->i_refcount == 2, "fresh inode refcount incorrect");
+	icache_wakeup_waiters_locked(ii);
 #ifdef ICACHE_DEBUG
-	icache_sanity_check(fs);
+	icache_sanity_check();
 #endif
+	ICACHE_UNLOCK();
 	TRACE(VFS, INFO, "cache miss: fs=%p, fsop=%s => ii=%p,inode=%p", fs, fsop_to_string(fs, fsop), ii, inode);
 	*destinode = inode;
 	return ANANAS_ERROR_OK;
@@ -454,8 +491,27 @@ void
 vfs_destroy_inode(struct VFS_INODE* inode)
 {
 	KASSERT(inode->i_refcount == 0, "destroying inode which still has refs");
+	dirindex_destroy(inode);
 	kfree(inode);
 	TRACE(VFS, INFO, "destroyed inode=%p", inode);
 }
 
+void
+icache_get_stats(struct ICACHE_STATS* stats)
+{
+	ICACHE_LOCK();
+	memcpy(stats, &icache_stats, sizeof(*stats));
+	ICACHE_UNLOCK();
+}
+
+void
+icache_get_size(unsigned int* num_entries, unsigned int* max_entries, unsigned int* hash_size)
+{
+	ICACHE_LOCK();
+	*num_entries = icache_num_entries;
+	*max_entries = icache_max_entries;
+	*hash_size = icache_hash_size;
+	ICACHE_UNLOCK();
+}
+
 /* vim:set ts=2 sw=2: */
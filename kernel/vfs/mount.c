@@ -1,6 +1,7 @@
 #include <ananas/types.h>
 #include <ananas/bio.h>
 #include <ananas/device.h>
+#include <ananas/epoch.h>
 #include <ananas/error.h>
 #include <ananas/kdb.h>
 #include <ananas/lib.h>
@@ -79,7 +80,11 @@ vfs_mount(const char* from, const char* to, const char* type, void* options)
 		return ANANAS_ERROR(OUT_OF_HANDLES);
 	fs->fs_device = dev;
 	fs->fs_fsops = fsops;
-	dcache_init(fs);
+	err = dcache_init(fs);
+	if (err != ANANAS_ERROR_NONE) {
+		memset(fs, 0, sizeof(*fs));
+		return err;
+	}
 
 	struct VFS_INODE* root_inode = NULL;
 	err = fs->fs_fsops->mount(fs, &root_inode);
@@ -116,12 +121,16 @@ vfs_mount(const char* from, const char* to, const char* type, void* options)
 	struct DENTRY* dentry_root;
 	if (vfs_lookup(NULL, &dentry_root, to) == ANANAS_ERROR_OK &&
 	    dentry_root != fs->fs_root_dentry) {
-		if (dentry_root->d_inode != NULL)
-			vfs_deref_inode(dentry_root->d_inode);
+		struct VFS_INODE* old_inode = dentry_root->d_inode;
 		vfs_ref_inode(root_inode);
 		dentry_root->d_inode = root_inode;
 		/* Ensure our entry will never be purged from the cache */
 		dentry_root->d_flags |= DENTRY_FLAG_PERMANENT;
+		/* Lockless lookups may still be looking at the old inode */
+		if (old_inode != NULL) {
+			epoch_synchronize();
+			vfs_deref_inode(old_inode);
+		}
 	}
 	
 	return ANANAS_ERROR_OK;
@@ -139,6 +148,8 @@ vfs_unmount(const char* path)
 			/* Got it; disown it immediately. XXX What about pending inodes etc? */
 			fs->fs_mountpoint = NULL;
 			spinlock_unlock(&spl_mountedfs);
+			/* Ensure everything we wrote ends up on the device */
+			bio_sync(fs->fs_device);
 			/* XXX Ask filesystem politely to unmount */
 			fs->fs_flags = 0; /* Available */
 			return ANANAS_ERROR_OK;
@@ -1,12 +1,14 @@
 #include <ananas/types.h>
 #include <ananas/bio.h>
 #include <ananas/device.h>
+#include <ananas/epoch.h>
 #include <ananas/error.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
 #include <ananas/schedule.h>
 #include <ananas/trace.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
 #include <ananas/vfs/generic.h>
 #include <ananas/vfs/mount.h>
 
@@ -14,6 +16,9 @@ TRACE_SETUP;
 
 #define VFS_DEBUG_LOOKUP 0
 
+/* If non-zero, lookups first try to walk the dentry cache without locking */
+int vfs_lookup_lockless = 1;
+
 static void
 vfs_make_file(struct VFS_FILE* file, struct DENTRY* dentry)
 {
@@ -114,6 +119,87 @@ vfs_seek(struct VFS_FILE* file, off_t offset)
 	return ANANAS_ERROR_OK;
 }
 
+/*
+ * Attempts to resolve 'name', relative to 'curdentry', without taking any
+ * locks or references; only the dentry we end up with is referenced. This
+ * only works if all entries are in the cache; if this is not the case, or the
+ * walk raced with a rename, zero is returned and the caller must use the
+ * locked walk instead. Otherwise, the lookup result is placed in 'err' and
+ * 'ditem' and 'final' are set up like vfs_lookup_internal() does.
+ */
+static int
+vfs_lookup_fast(struct DENTRY* curdentry, const char* name, struct DENTRY** ditem, int* final, errorcode_t* err)
+{
+	char tmp[VFS_MAX_NAME_LEN + 1];
+
+	unsigned int seq = dcache_rename_seq();
+	if (seq & 1)
+		return 0; /* rename in progress */
+
+	int epoch = epoch_enter();
+	const char* next_name = name;
+	int done = 0;
+	while (1) {
+		if (*next_name == '\0' /* for trailing /-es */) {
+			/* We walked the entire path; grab the result unless a rename interfered */
+			if (dcache_rename_seq() == seq && dentry_ref_lockless(curdentry)) {
+				*ditem = curdentry;
+				*final = 1;
+				*err = ANANAS_ERROR_OK;
+				done = 1;
+			}
+			break;
+		}
+
+		/* Isolate the next part of the part we have to look up */
+		const char* ptr = strchr(next_name, '/');
+		int last = (ptr == NULL);
+		size_t len = !last ? ptr - next_name : strlen(next_name);
+		if (len > VFS_MAX_NAME_LEN)
+			break;
+		memcpy(tmp, next_name, len);
+		tmp[len] = '\0';
+		next_name += len;
+		if (*next_name == '/')
+			next_name++;
+
+		/* If the entry to find is '.', continue to the next one; we are already there */
+		if (strcmp(tmp, ".") == 0)
+			continue;
+
+		/* We can only descend into directories; the locked walk deals with errors */
+		struct VFS_INODE* inode = curdentry->d_inode;
+		if (inode == NULL || !S_ISDIR(inode->i_sb.st_mode))
+			break;
+
+		struct DENTRY* dentry = dcache_lookup_lockless(curdentry, tmp);
+		if (dentry == NULL)
+			break; /* not cached */
+
+		int flags = dentry->d_flags;
+		if (flags & DENTRY_FLAG_NEGATIVE) {
+			/*
+			 * Entry does not exist; if this is the final part, we can tell the caller
+			 * (who may want to create it) right away.
+			 */
+			if (last && dcache_rename_seq() == seq && dentry_ref_lockless(dentry)) {
+				*ditem = dentry;
+				*final = 1;
+				*err = ANANAS_ERROR(NO_FILE);
+				done = 1;
+			}
+			break;
+		}
+
+		if (dentry->d_inode == NULL)
+			break; /* pending */
+		curdentry = dentry;
+	}
+
+	epoch_exit(epoch);
+	return done;
+}
+
 /*
  * Internally used to perform a lookup from directory entry 'name' to an inode;
  * 'curdentry' is the dentry  to start the lookup relative to, or NULL to
@@ -155,6 +241,13 @@ vfs_lookup_internal(struct DENTRY* curdentry, const char* name, struct DENTRY**
 		KASSERT(curdentry != NULL, "no root dentry");
 	}
 
+	/* Try the fast way first; this works for anything that is cached */
+	if (vfs_lookup_lockless) {
+		errorcode_t err;
+		if (vfs_lookup_fast(curdentry, name, ditem, final, &err))
+			return err;
+	}
+
 	/*
 	 * Explicitely reference the dentry; this is normally done by the VFS lookup
 	 * function when it returns an dentry, but we need some place to start. The
@@ -216,7 +309,11 @@ vfs_lookup_internal(struct DENTRY* curdentry, const char* name, struct DENTRY**
 		 */
 		struct DENTRY* dentry;
 		while(1) {
-			dentry = dcache_lookup(curdentry, next_lookup);
+			errorcode_t err = dcache_lookup(curdentry, next_lookup, &dentry);
+			if (err != ANANAS_ERROR_NONE) {
+				dentry_deref(curdentry); /* let go of the ref; we are done with it */
+				return err;
+			}
 			if (dentry != NULL)
 				break;
 			TRACE(VFS, WARN, "dentry item is already pending, waiting...");
@@ -257,12 +354,20 @@ vfs_lookup_internal(struct DENTRY* curdentry, const char* name, struct DENTRY**
 			 * up to the dentry cache, which can re-use the reference we have for it.
 			 */
 			dentry->d_inode = inode;
-		} else {
-			/* Lookup failed; make the entry cache negative */
+		} else if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_NO_FILE) {
+			/* Entry does not exist; make the entry cache negative so we needn't look again */
 			TRACE(VFS, INFO, "making negative dentry for %p:%s\n", curdentry, next_lookup);
 			dentry->d_flags |= DENTRY_FLAG_NEGATIVE;
 			/* No need to touch ditem; it'll be set already to the new dentry (and we can get to the parent from there) */
 			return err;
+		} else {
+			/*
+			 * Lookup failed for some other reason, i.e. an I/O error; the entry may
+			 * well exist, so remove it from the cache so that we will try again.
+			 */
+			dentry->d_flags |= DENTRY_FLAG_NEGATIVE;
+			dcache_purge_entry(dentry);
+			return err;
 		}
 
 		/* Go one level deeper; we've already dereffed curdentry */
@@ -347,6 +452,7 @@ vfs_create(struct DENTRY* parent, struct VFS_FILE* file, const char* dentry, int
 		de->d_flags |= DENTRY_FLAG_NEGATIVE;
 	} else {
 		/* Success; report the inode we created */
+		dirindex_add(parentinode, de->d_entry, de->d_inode->i_fsop);
 		vfs_make_file(file, de);
 	}
 	return err;
@@ -393,6 +499,7 @@ vfs_unlink(struct VFS_FILE* file)
 		return ANANAS_ERROR(BAD_OPERATION);
 	errorcode_t err = inode->i_iops->unlink(inode, file->f_dentry);
 	ANANAS_ERROR_RETURN(err);
+	dirindex_remove(inode, file->f_dentry->d_entry);
 
 	/*
 	 * Purge the dentry from the cache; the unlink operation should have removed
@@ -460,14 +567,23 @@ vfs_rename(struct VFS_FILE* file, struct DENTRY* parent, const char* dest)
 		return ANANAS_ERROR(CROSS_DEVICE);
 	}
 
-	/* All seems to be in order; ask the filesystem to deal with the change */
+	/*
+	 * All seems to be in order; ask the filesystem to deal with the change. Lockless
+	 * lookups must not trust anything they see while the names are changing.
+	 */
+	dcache_rename_begin();
 	err = parent_inode->i_iops->rename(parent_inode, file->f_dentry, dest_inode, de);
+	dcache_rename_end();
 	if (err != ANANAS_ERROR_NONE) {
 		/* If something went wrong, ensure to free the new dentry */
 		dentry_deref(de);
 		return err;
 	}
 
+	/* The entry has a new name, and may have a new FSOP as well */
+	dirindex_remove(parent_inode, file->f_dentry->d_entry);
+	dirindex_add(dest_inode, de->d_entry, de->d_inode->i_fsop);
+
 	/*
 	 * This worked; we should hook the new dentry up and throw away the old one.
 	 * No need to touch the refcount of the new dentry as we're giving our ref to
@@ -18,7 +18,9 @@ KDB_COMMAND(inodes, NULL, "Inode status")
 {
 	struct VFS_MOUNTED_FS* fs = vfs_get_rootfs(); /* XXX only root for now */
 
-	DQUEUE_FOREACH(&fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
+	DQUEUE_FOREACH_IP(&icache_lru, lru, ii, struct ICACHE_ITEM) {
+		if (ii->fs != fs)
+			continue;
 		int expected_refs = 1; /* icache */
 		kprintf("inode=%p, fsop=", ii->inode);
 		for (int i = 0; i < fs->fs_fsop_size; i++) {
@@ -32,7 +34,9 @@ KDB_COMMAND(inodes, NULL, "Inode status")
 	//	if (ii->inode == fs->fs_root_inode) expected_refs++; /* root inode */
 		kprintf(", refcount=%u", ii->inode->i_refcount);
 		const char* dentry_name = "?";
-		DQUEUE_FOREACH(&fs->fs_dcache_inuse, d, struct DENTRY) {
+		DQUEUE_FOREACH_IP(&dcache_lru, lru, d, struct DENTRY) {
+			if (d->d_parent == NULL)
+				continue;
 			if (d->d_inode != ii->inode && d->d_parent->d_inode != ii->inode)
 				continue;
 			if (d->d_inode == ii->inode) {
@@ -65,4 +69,30 @@ KDB_COMMAND(inodes, NULL, "Inode status")
 	}		
 }
 
+KDB_COMMAND(icache, NULL, "Inode cache status")
+{
+	struct ICACHE_STATS is;
+	unsigned int num_entries, max_entries, hash_size;
+	icache_get_stats(&is);
+	icache_get_size(&num_entries, &max_entries, &hash_size);
+	kprintf("entries: %u (%u before purging), hash: %u buckets\n",
+	 num_entries, max_entries, hash_size);
+	kprintf("lookups: %u hits, %u misses, %u waited for pending inode\n",
+	 is.is_hits, is.is_misses, is.is_waits);
+	kprintf("purged: %u inodes\n", is.is_purges);
+}
+
+KDB_COMMAND(dcache, NULL, "Dentry cache status")
+{
+	struct DCACHE_STATS ds;
+	unsigned int num_entries, hash_size;
+	dcache_get_stats(&ds);
+	dcache_get_size(&num_entries, &hash_size);
+	kprintf("entries: %u (%u before purging), hash: %u buckets, %u rehashes\n",
+	 num_entries, DCACHE_MAX_ENTRIES, hash_size, ds.ds_rehashes);
+	kprintf("lookups: %u hits, %u negative hits, %u misses\n",
+	 ds.ds_hits, ds.ds_negative_hits, ds.ds_misses);
+	kprintf("purged: %u entries\n", ds.ds_purges);
+}
+
 /* vim:set ts=2 sw=2: */
@@ -4,6 +4,7 @@
 #include <ananas/kmem.h>
 #include <ananas/lib.h>
 #include <ananas/mm.h>
+#include <ananas/slab.h>
 #include <ananas/error.h>
 #include <ananas/trace.h>
 #include <ananas/vm.h>
@@ -13,6 +14,8 @@ TRACE_SETUP;
 
 #define BYTES_TO_PAGES(len) ((len + PAGE_SIZE - 1) / PAGE_SIZE)
 
+static KMEM_CACHE_DEFINE(vmarea_cache, "vmarea", sizeof(vmarea_t), NULL);
+
 errorcode_t
 vmspace_create(vmspace_t** vmspace)
 {
@@ -75,7 +78,9 @@ vmspace_mapto(vmspace_t* vs, addr_t virt, addr_t phys, size_t len /* bytes */, u
 	if (len == 0)
 		return ANANAS_ERROR(BAD_LENGTH);
 
-	vmarea_t* va = kmalloc(sizeof(*va));
+	vmarea_t* va = kmem_cache_alloc(&vmarea_cache);
+	if (va == NULL)
+		return ANANAS_ERROR(OUT_OF_MEMORY);
 	memset(va, 0, sizeof(*va));
 
 	/*
@@ -302,7 +307,7 @@ vmspace_area_free(vmspace_t* vs, vmarea_t* va)
 			md_unmap_pages(vs, p->p_addr, 1);
 			page_free(p);
 		}
-	kfree(va);
+	kmem_cache_free(&vmarea_cache, va);
 }
 
 void
@@ -46,6 +46,8 @@ _posix_map_error(errorcode_t err)
 			SET_ERRNO(ENOSPC);
 		case ANANAS_ERROR_CROSS_DEVICE:
 			SET_ERRNO(EXDEV);
+		case ANANAS_ERROR_TIMEOUT:
+			SET_ERRNO(ETIMEDOUT);
 		case ANANAS_ERROR_CLONED: /* should never end up here */
 		case ANANAS_ERROR_UNKNOWN:
 		default:
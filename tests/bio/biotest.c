@@ -0,0 +1,556 @@
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ananas/bio.h>
+#include <ananas/device.h>
+#include <ananas/error.h>
+#include <ananas/page.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include "test-framework.h"
+
+/* Time the synthetic disk needs to complete a request, in microseconds */
+#define DISK_LATENCY 200
+/* Number of requests the synthetic disk services at the same time, like AHCI */
+#define DISK_SLOTS 32
+/* Size of the blocks we read */
+#define BLOCK_SIZE 1024
+/* Number of blocks read per benchmark run */
+#define BENCH_BLOCKS 512
+/* Number of adjacent dirty blocks the syncer must write at once */
+#define SYNC_BLOCKS 16
+/* Number of adjacent blocks which are prefetched */
+#define PREFETCH_BLOCKS 16
+/* Size of the memory-backed disk, in bytes */
+#define MEMDISK_SIZE (1024 * 1024)
+/* Value written to a block, so that writes can be verified */
+#define WRITE_PATTERN(block) ((uint32_t)(block) ^ 0x5a5a5a5a)
+
+/* We don't use the per-CPU magazines here, so there are no CPU's */
+struct PCPU*
+pcpu_get(int cpuid)
+{
+	return NULL;
+}
+
+int
+pcpu_get_num_cpus()
+{
+	return 0;
+}
+
+/* Set to make page allocations fail, as if we ran out of memory */
+static int page_alloc_fail;
+
+/* Data pages must be page-aligned, so we over-allocate and remember where the memory came from */
+void*
+page_alloc_order_mapped(int order, struct PAGE** p, int vm_flags)
+{
+	if (page_alloc_fail) {
+		*p = NULL;
+		return NULL;
+	}
+	size_t len = PAGE_SIZE << order;
+	char* mem = malloc(len + PAGE_SIZE);
+	*p = malloc(sizeof(struct PAGE));
+	(*p)->p_addr = (addr_t)mem;
+	(*p)->p_order = order;
+	return (void*)(((addr_t)mem + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+void*
+page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags)
+{
+	int order = 0;
+	while ((PAGE_SIZE << order) < length)
+		order++;
+	return page_alloc_order_mapped(order, p, vm_flags);
+}
+
+void
+page_free(struct PAGE* p)
+{
+	free((void*)p->p_addr);
+	free(p);
+}
+
+void
+page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
+{
+	*total_pages = 65536;
+	*avail_pages = 32768;
+}
+
+void
+kmem_unmap(void* virt, size_t length)
+{
+}
+
+/* Time only advances when we say so */
+static uint64_t test_ticks = 1;
+
+uint64_t
+timer_get_ticks()
+{
+	return test_ticks;
+}
+
+int
+sem_timedwait(semaphore_t* sem, unsigned int ms)
+{
+	struct timespec ts = { 0, 1000000 };
+	for (unsigned int n = 0; n < ms; n++) {
+		spinlock_lock(&sem->sem_lock);
+		if (sem->sem_count > 0) {
+			sem->sem_count--;
+			spinlock_unlock(&sem->sem_lock);
+			return 1;
+		}
+		spinlock_unlock(&sem->sem_lock);
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+/* Kernel threads are host threads, which start once they are resumed */
+static kthread_func_t kthread_func;
+static void* kthread_arg;
+static pthread_t kthread_tid;
+
+errorcode_t
+kthread_init(thread_t* t, const char* name, kthread_func_t func, void* arg)
+{
+	kthread_func = func;
+	kthread_arg = arg;
+	return ANANAS_ERROR_OK;
+}
+
+static void*
+kthread_wrapper(void* arg)
+{
+	kthread_func(kthread_arg);
+	return NULL;
+}
+
+void
+thread_resume(thread_t* t)
+{
+	pthread_create(&kthread_tid, NULL, kthread_wrapper, NULL);
+}
+
+/*
+ * Synthetic disk; every request takes DISK_LATENCY to complete, and up to
+ * DISK_SLOTS requests are serviced at the same time. The data of a block
+ * is its block number, so that reads can be verified.
+ */
+struct DISK_REQUEST {
+	struct BIO*		dr_bio;
+	uint64_t		dr_due;		/* Completion time, in microseconds */
+	struct DISK_REQUEST*	dr_next;
+};
+
+static struct DEVICE disk = {
+	.name = "disk"
+};
+
+/* Memory-backed disk; the cache must use its data as-is, and never read or write it */
+static struct DEVICE memdisk = {
+	.name = "memdisk"
+};
+static char memdisk_data[MEMDISK_SIZE];
+
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_cond = PTHREAD_COND_INITIALIZER;
+static struct DISK_REQUEST* disk_queue; /* Sorted by completion time */
+static uint64_t disk_slot_free[DISK_SLOTS];
+static unsigned int disk_num_reads;
+static unsigned int disk_num_writes;
+static unsigned int disk_bad_writes;
+static unsigned int disk_last_write_len;
+static unsigned int disk_last_write_vecs;
+static int disk_shutdown;
+static int disk_paused;
+
+static uint64_t
+disk_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns the n-th word of a buffer's data, which may consist of several pieces */
+static uint32_t*
+bio_word(struct BIO* bio, unsigned int n)
+{
+	size_t offset = n * sizeof(uint32_t);
+	for (unsigned int v = 0; v < bio_num_vecs(bio); v++) {
+		if (offset < bio_vec_length(bio, v))
+			return (uint32_t*)((char*)bio_vec_data(bio, v) + offset);
+		offset -= bio_vec_length(bio, v);
+	}
+	return NULL;
+}
+
+errorcode_t
+device_bread(device_t dev, struct BIO* bio)
+{
+	EXPECT(dev == &disk);
+	struct DISK_REQUEST* dr = malloc(sizeof(*dr));
+	dr->dr_bio = bio;
+
+	pthread_mutex_lock(&disk_mutex);
+	/* Service the request in the slot that becomes available first */
+	unsigned int slot = 0;
+	for (unsigned int n = 1; n < DISK_SLOTS; n++)
+		if (disk_slot_free[n] < disk_slot_free[slot])
+			slot = n;
+	uint64_t now = disk_now();
+	dr->dr_due = (disk_slot_free[slot] > now ? disk_slot_free[slot] : now) + DISK_LATENCY;
+	disk_slot_free[slot] = dr->dr_due;
+
+	struct DISK_REQUEST** pos = &disk_queue;
+	while (*pos != NULL && (*pos)->dr_due <= dr->dr_due)
+		pos = &(*pos)->dr_next;
+	dr->dr_next = *pos;
+	*pos = dr;
+	disk_num_reads++;
+	pthread_cond_signal(&disk_cond);
+	pthread_mutex_unlock(&disk_mutex);
+	return ANANAS_ERROR_OK;
+}
+
+void*
+device_bmap(device_t dev, blocknr_t block, size_t len)
+{
+	if (dev != &memdisk || block * BIO_SECTOR_SIZE + len > MEMDISK_SIZE)
+		return NULL;
+	return memdisk_data + block * BIO_SECTOR_SIZE;
+}
+
+/* Writes complete immediately; we just check that they contain the right data */
+errorcode_t
+device_bwrite(device_t dev, struct BIO* bio)
+{
+	EXPECT(dev == &disk);
+	for (unsigned int n = 0; n < bio->length / sizeof(uint32_t); n++) {
+		blocknr_t block = bio->io_block + ((n * sizeof(uint32_t)) / BLOCK_SIZE) * (BLOCK_SIZE / BIO_SECTOR_SIZE);
+		if (*bio_word(bio, n) != WRITE_PATTERN(block))
+			disk_bad_writes++;
+	}
+	__sync_fetch_and_add(&disk_num_writes, 1);
+	disk_last_write_len = bio->length;
+	disk_last_write_vecs = bio->num_vecs;
+	bio->flags &= ~BIO_FLAG_DIRTY;
+	bio_set_available(bio);
+	return ANANAS_ERROR_OK;
+}
+
+static void*
+disk_thread(void* arg)
+{
+	pthread_mutex_lock(&disk_mutex);
+	while (!disk_shutdown) {
+		if (disk_queue == NULL || disk_paused) {
+			pthread_cond_wait(&disk_cond, &disk_mutex);
+			continue;
+		}
+		uint64_t now = disk_now();
+		struct DISK_REQUEST* dr = disk_queue;
+		if (dr->dr_due > now) {
+			pthread_mutex_unlock(&disk_mutex);
+			struct timespec ts = { 0, (dr->dr_due - now) * 1000 };
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&disk_mutex);
+			continue;
+		}
+		disk_queue = dr->dr_next;
+		pthread_mutex_unlock(&disk_mutex);
+
+		struct BIO* bio = dr->dr_bio;
+		for (unsigned int n = 0; n < bio->length / sizeof(uint32_t); n++) {
+			blocknr_t block = bio->io_block + ((n * sizeof(uint32_t)) / BLOCK_SIZE) * (BLOCK_SIZE / BIO_SECTOR_SIZE);
+			*bio_word(bio, n) = (uint32_t)block;
+		}
+		free(dr);
+		bio_set_available(bio);
+		pthread_mutex_lock(&disk_mutex);
+	}
+	pthread_mutex_unlock(&disk_mutex);
+	return NULL;
+}
+
+static int
+bio_verify(struct BIO* bio, blocknr_t block)
+{
+	if (BIO_IS_ERROR(bio) || bio->block != block)
+		return 0;
+	for (unsigned int n = 0; n < bio->length / sizeof(uint32_t); n++)
+		if (((uint32_t*)BIO_DATA(bio))[n] != (uint32_t)block)
+			return 0;
+	return 1;
+}
+
+static void
+count_completion(struct BIO* bio, void* arg)
+{
+	__sync_fetch_and_add((unsigned int*)arg, 1);
+}
+
+static void
+bio_async_test()
+{
+	struct BIO* bio[DISK_SLOTS];
+	struct BIO_COMPLETION bc[DISK_SLOTS];
+	unsigned int num_completed = 0;
+
+	/* Every submitted request must complete exactly once */
+	for (unsigned int n = 0; n < DISK_SLOTS; n++) {
+		bc[n].bc_func = count_completion;
+		bc[n].bc_arg = &num_completed;
+		bio[n] = bio_submit(&disk, n * 2, BLOCK_SIZE, 0, &bc[n]);
+	}
+	EXPECT(bio_wait_many(bio, DISK_SLOTS) == ANANAS_ERROR_OK);
+	/* The final callbacks may run after the waiter has been signalled */
+	while (*(volatile unsigned int*)&num_completed != DISK_SLOTS)
+		sched_yield();
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < DISK_SLOTS; n++)
+		if (!bio_verify(bio[n], n * 2))
+			bad++;
+	EXPECT(bad == 0);
+	EXPECT(disk_num_reads == DISK_SLOTS);
+
+	/* Cached blocks complete right away, without going to the disk */
+	num_completed = 0;
+	struct BIO* cached = bio_submit(&disk, 0, BLOCK_SIZE, 0, &bc[0]);
+	EXPECT(cached == bio[0]);
+	EXPECT(num_completed == 1);
+	EXPECT(disk_num_reads == DISK_SLOTS);
+
+	/* The synchronous interface must still work */
+	EXPECT(bio_verify(bio_read(&disk, 1000, BLOCK_SIZE), 1000));
+}
+
+static void
+bio_write(blocknr_t block)
+{
+	struct BIO* bio = bio_get(&disk, block, BLOCK_SIZE, BIO_READ_NODATA);
+	for (unsigned int n = 0; n < BLOCK_SIZE / sizeof(uint32_t); n++)
+		((uint32_t*)BIO_DATA(bio))[n] = WRITE_PATTERN(block);
+	bio_set_dirty(bio);
+}
+
+static void
+bio_sync_test()
+{
+	const blocknr_t first = 50000;
+	const unsigned int sectors_per_block = BLOCK_SIZE / BIO_SECTOR_SIZE;
+
+	/* Adjacent blocks must be merged, no matter in which order they were dirtied */
+	for (int n = SYNC_BLOCKS - 1; n >= 0; n--)
+		bio_write(first + n * sectors_per_block);
+	bio_write(first + 2 * SYNC_BLOCKS * sectors_per_block);
+	EXPECT(disk_num_writes == 0);
+	bio_sync(&disk);
+	EXPECT(disk_num_writes == 2);
+	EXPECT(disk_bad_writes == 0);
+	unsigned int dirty = 0;
+	for (unsigned int n = 0; n < SYNC_BLOCKS; n++)
+		if (BIO_IS_DIRTY(bio_read(&disk, first + n * sectors_per_block, BLOCK_SIZE)))
+			dirty++;
+	EXPECT(dirty == 0);
+
+	/* Nothing left to write */
+	bio_sync(&disk);
+	EXPECT(disk_num_writes == 2);
+
+	/* The syncer must write buffers by itself once they are old enough */
+	bio_write(first);
+	bio_write(first + sectors_per_block);
+	test_ticks += 60 * TIMER_HZ;
+	for (unsigned int n = 0; n < 5000 && disk_num_writes == 2; n++) {
+		struct timespec ts = { 0, 1000000 };
+		nanosleep(&ts, NULL);
+	}
+	EXPECT(disk_num_writes == 3);
+	EXPECT(disk_last_write_len == 2 * BLOCK_SIZE);
+	EXPECT(disk_last_write_vecs == 2);
+	EXPECT(disk_bad_writes == 0);
+}
+
+static void
+bio_prefetch_test()
+{
+	const blocknr_t first = 10000;
+	const unsigned int sectors_per_block = BLOCK_SIZE / BIO_SECTOR_SIZE;
+
+	/* A cached block splits the run in two; every part must take a single read */
+	unsigned int reads = disk_num_reads;
+	EXPECT(bio_verify(bio_read(&disk, first + (PREFETCH_BLOCKS / 2) * sectors_per_block, BLOCK_SIZE),
+	 first + (PREFETCH_BLOCKS / 2) * sectors_per_block));
+	bio_prefetch(&disk, first, BLOCK_SIZE, PREFETCH_BLOCKS);
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < PREFETCH_BLOCKS; n++)
+		if (!bio_verify(bio_read(&disk, first + n * sectors_per_block, BLOCK_SIZE), first + n * sectors_per_block))
+			bad++;
+	EXPECT(bad == 0);
+	EXPECT(disk_num_reads == reads + 3);
+}
+
+/*
+ * Reads BENCH_BLOCKS uncached blocks, keeping up to 'depth' requests in
+ * flight; returns the number of blocks per second.
+ */
+static double
+bio_bench(unsigned int depth, blocknr_t first)
+{
+	struct BIO* bio[DISK_SLOTS];
+	unsigned int bad = 0;
+	uint64_t start = disk_now();
+	for (unsigned int n = 0; n < BENCH_BLOCKS; n += depth) {
+		for (unsigned int i = 0; i < depth; i++)
+			bio[i] = bio_submit(&disk, first + n + i, BLOCK_SIZE, 0, NULL);
+		bio_wait_many(bio, depth);
+		for (unsigned int i = 0; i < depth; i++)
+			if (!bio_verify(bio[i], first + n + i))
+				bad++;
+	}
+	uint64_t elapsed = disk_now() - start;
+	EXPECT(bad == 0);
+	return (BENCH_BLOCKS * 1000000.0) / elapsed;
+}
+
+static void
+bio_mapped_test()
+{
+	unsigned int reads = disk_num_reads, writes = disk_num_writes;
+	struct BIO* bio = bio_read(&memdisk, 4, BLOCK_SIZE);
+	EXPECT(BIO_DATA(bio) == memdisk_data + 4 * BIO_SECTOR_SIZE);
+	EXPECT(!BIO_IS_ERROR(bio) && BIO_IS_MAPPED(bio));
+	EXPECT(bio_read(&memdisk, 4, BLOCK_SIZE) == bio);
+
+	/* Writing modifies the disk itself, so there is nothing to sync */
+	memset(BIO_DATA(bio), 0xaa, BLOCK_SIZE);
+	bio_set_dirty(bio);
+	EXPECT(!BIO_IS_DIRTY(bio));
+	bio_sync(&memdisk);
+
+	/* Nothing needs to be read, not even when prefetching */
+	struct BIO_STATS stats;
+	bio_get_stats(&stats);
+	unsigned int mapped = stats.bs_mapped;
+	bio_prefetch(&memdisk, 16, BLOCK_SIZE, 8);
+	bio_get_stats(&stats);
+	EXPECT(stats.bs_mapped == mapped + 8);
+	EXPECT(disk_num_reads == reads);
+	EXPECT(disk_num_writes == writes);
+	EXPECT(memdisk_data[4 * BIO_SECTOR_SIZE] == (char)0xaa);
+}
+
+static void
+bio_nomem_test()
+{
+	const blocknr_t first = 200000;
+	const unsigned int sectors_per_block = BLOCK_SIZE / BIO_SECTOR_SIZE;
+
+	/* Without memory to grow, new buffers must take the place of old ones */
+	struct BIO_STATS stats;
+	bio_get_stats(&stats);
+	unsigned int pages = stats.bs_pages_added - stats.bs_pages_removed;
+	unsigned int evictions = stats.bs_evictions;
+	unsigned int num_blocks = pages * (PAGE_SIZE / BLOCK_SIZE) + 16;
+	page_alloc_fail = 1;
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < num_blocks; n++)
+		if (!bio_verify(bio_read(&disk, first + n * sectors_per_block, BLOCK_SIZE), first + n * sectors_per_block))
+			bad++;
+	page_alloc_fail = 0;
+	EXPECT(bad == 0);
+	bio_get_stats(&stats);
+	EXPECT(stats.bs_pages_added - stats.bs_pages_removed == pages);
+	EXPECT(stats.bs_evictions >= evictions + 16);
+
+	/*
+	 * Mapped buffers need no data, just the buffer itself; once there is no
+	 * memory for those either, old ones must be reused.
+	 */
+	const blocknr_t first_mapped = 64;
+	evictions = stats.bs_evictions;
+	page_alloc_fail = 1;
+	bad = 0;
+	for (blocknr_t block = first_mapped; block < MEMDISK_SIZE / BIO_SECTOR_SIZE; block++) {
+		struct BIO* bio = bio_read(&memdisk, block, BIO_SECTOR_SIZE);
+		if (BIO_DATA(bio) != memdisk_data + block * BIO_SECTOR_SIZE)
+			bad++;
+	}
+	page_alloc_fail = 0;
+	EXPECT(bad == 0);
+	bio_get_stats(&stats);
+	EXPECT(stats.bs_evictions > evictions);
+}
+
+static void
+bio_queue_test()
+{
+	const blocknr_t first = 300000;
+	struct BIO* bio[DISK_SLOTS];
+
+	/* Submitting must not wait for the disk, so every request is queued at once */
+	pthread_mutex_lock(&disk_mutex);
+	disk_paused = 1;
+	pthread_mutex_unlock(&disk_mutex);
+	for (unsigned int n = 0; n < DISK_SLOTS; n++)
+		bio[n] = bio_submit(&disk, first + n, BLOCK_SIZE, 0, NULL);
+	pthread_mutex_lock(&disk_mutex);
+	unsigned int queued = 0;
+	for (struct DISK_REQUEST* dr = disk_queue; dr != NULL; dr = dr->dr_next)
+		queued++;
+	disk_paused = 0;
+	pthread_cond_signal(&disk_cond);
+	pthread_mutex_unlock(&disk_mutex);
+	EXPECT(queued == DISK_SLOTS);
+
+	EXPECT(bio_wait_many(bio, DISK_SLOTS) == ANANAS_ERROR_OK);
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < DISK_SLOTS; n++)
+		if (!bio_verify(bio[n], first + n))
+			bad++;
+	EXPECT(bad == 0);
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	pthread_t disk_tid;
+	pthread_create(&disk_tid, NULL, disk_thread, NULL);
+
+	bio_async_test();
+	bio_sync_test();
+	bio_prefetch_test();
+	bio_mapped_test();
+	bio_nomem_test();
+	bio_queue_test();
+
+	for (unsigned int depth = 1; depth <= DISK_SLOTS; depth *= 2) {
+		double rate = bio_bench(depth, 100000 * depth);
+		printf("bio: queue depth %u: %.0f blocks/sec\n", depth, rate);
+	}
+
+	pthread_mutex_lock(&disk_mutex);
+	disk_shutdown = 1;
+	pthread_cond_signal(&disk_cond);
+	pthread_mutex_unlock(&disk_mutex);
+	pthread_join(disk_tid, NULL);
+
+	framework_done();
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
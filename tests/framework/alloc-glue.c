@@ -0,0 +1,62 @@
+/*
+ * Kernel memory allocation on the host's heap, for tests which exercise code
+ * using kmalloc() and object caches without linking the kernel's allocator.
+ * Freed cache objects are overwritten, so that any use of a stale object is
+ * noticed.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ananas/types.h>
+#include <ananas/slab.h>
+
+/* Value freed objects are overwritten with */
+#define FREED_PATTERN 0xdb
+
+void*
+kmalloc(size_t len)
+{
+	return malloc(len);
+}
+
+void
+kfree(void* ptr)
+{
+	free(ptr);
+}
+
+struct KMEM_CACHE*
+kmem_cache_create(const char* name, size_t size, kmem_ctor_t ctor)
+{
+	struct KMEM_CACHE* kc = malloc(sizeof(*kc));
+	if (kc == NULL)
+		return NULL;
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct KMEM_CACHE* kc)
+{
+	free(kc);
+}
+
+void*
+kmem_cache_alloc(struct KMEM_CACHE* kc)
+{
+	void* obj = malloc(kc->kc_size);
+	if (obj != NULL && kc->kc_ctor != NULL)
+		kc->kc_ctor(obj);
+	return obj;
+}
+
+void
+kmem_cache_free(struct KMEM_CACHE* kc, void* obj)
+{
+	memset(obj, FREED_PATTERN, kc->kc_size);
+	free(obj);
+}
+
+/* vim:set ts=2 sw=2: */
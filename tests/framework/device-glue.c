@@ -47,12 +47,22 @@ device_bread(device_t dev, struct BIO* bio)
 	off_t off = bio->io_block * 512;
 	if (lseek(dev_fd, off, SEEK_SET) != off)
 		panic("seek error");
-	if (read(dev_fd, bio->data, bio->length) != bio->length)
-		panic("read error");
+	for (unsigned int n = 0; n < bio_num_vecs(bio); n++) {
+		size_t len = bio_vec_length(bio, n);
+		if (read(dev_fd, bio_vec_data(bio, n), len) != len)
+			panic("read error");
+	}
 	bio_set_available(bio);
 	return ANANAS_ERROR_OK;
 }
 
+/* Our image is only accessible using reads */
+void*
+device_bmap(device_t dev, blocknr_t block, size_t len)
+{
+	return NULL;
+}
+
 errorcode_t
 device_bwrite(device_t dev, struct BIO* bio)
 {
@@ -1,6 +1,8 @@
 #include <ananas/lib.h>
+#include <ananas/lock.h>
 #include <ananas/trace.h>
 #include <assert.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "test-framework.h"
@@ -20,15 +22,96 @@ tracef(int fileid, const char* func, const char* fmt, ...)
 	kprintf("\n");
 }
 
-/* There is no need to lock anything, so just stub the locking stuff out */
-struct SPINLOCK;
-struct MUTEX;
-void spinlock_init(struct SPINLOCK* s) {}
-void spinlock_lock(struct SPINLOCK* s) {}
-void spinlock_unlock(struct SPINLOCK* s) {}
-void mutex_init(struct MUTEX* mtx) {}
-void mutex_lock(struct MUTEX* mtx) {}
-void mutex_unlock(struct MUTEX* mtx) {}
+/*
+ * Tests may use multiple host threads, so the locks must actually work; as
+ * there is no scheduler to sleep on, mutexes just spin on their semaphore's
+ * spinlock. There may be more threads than host CPU's, so we yield while
+ * spinning to let the lock holder run.
+ */
+void
+spinlock_init(spinlock_t* s)
+{
+	atomic_set(&s->sl_next, 0);
+	atomic_set(&s->sl_owner, 0);
+}
+
+void
+spinlock_lock(spinlock_t* s)
+{
+	int ticket = atomic_add(&s->sl_next, 1);
+	while (atomic_read(&s->sl_owner) != ticket)
+		sched_yield();
+}
+
+void
+spinlock_unlock(spinlock_t* s)
+{
+	atomic_add(&s->sl_owner, 1);
+}
+
+void
+mutex_init(mutex_t* mtx, const char* name)
+{
+	mtx->mtx_name = name;
+	spinlock_init(&mtx->mtx_sem.sem_lock);
+}
+
+void
+mutex_lock_(mutex_t* mtx, const char* file, int line)
+{
+	spinlock_lock(&mtx->mtx_sem.sem_lock);
+}
+
+void
+mutex_unlock(mutex_t* mtx)
+{
+	spinlock_unlock(&mtx->mtx_sem.sem_lock);
+}
+
+/* There are no interrupts to disable */
+register_t
+spinlock_lock_unpremptible(spinlock_t* s)
+{
+	spinlock_lock(s);
+	return 0;
+}
+
+void
+spinlock_unlock_unpremptible(spinlock_t* s, register_t state)
+{
+	spinlock_unlock(s);
+}
+
+/* Semaphores spin until a unit is available */
+void
+sem_init(semaphore_t* sem, int count)
+{
+	spinlock_init(&sem->sem_lock);
+	sem->sem_count = count;
+}
+
+void
+sem_signal(semaphore_t* sem)
+{
+	spinlock_lock(&sem->sem_lock);
+	sem->sem_count++;
+	spinlock_unlock(&sem->sem_lock);
+}
+
+void
+sem_wait(semaphore_t* sem)
+{
+	for (;;) {
+		spinlock_lock(&sem->sem_lock);
+		if (sem->sem_count > 0) {
+			sem->sem_count--;
+			spinlock_unlock(&sem->sem_lock);
+			return;
+		}
+		spinlock_unlock(&sem->sem_lock);
+		sched_yield();
+	}
+}
 
 /* Waitqueues aren't necessary */
 struct WAITQUEUE;
@@ -38,9 +121,10 @@ void waitqueue_wait(struct WAITER* w) { }
 void waitqueue_remove(struct WAITER* w) { }
 void waitqueue_signal(struct WAITER* w) { }
 
+/* Threads are host threads; all we can do is let the others run */
 void schedule()
 {
-	panic("schedule() must not be called");
+	sched_yield();
 }
 
 void
@@ -0,0 +1,194 @@
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ananas/lock.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include "test-framework.h"
+
+/* Maximum number of host threads allocating at the same time */
+#define BENCH_MAX_THREADS 8
+/* Number of allocations every thread keeps alive */
+#define BENCH_WORKING_SET 64
+/* Number of allocation/free pairs every thread performs */
+#define BENCH_OPS_PER_THREAD 200000
+/* One in this many allocations is too large for the size classes */
+#define BENCH_LARGE_RATIO 64
+
+/* We don't use the per-CPU magazines here, so there are no CPU's */
+struct PCPU*
+pcpu_get(int cpuid)
+{
+	return NULL;
+}
+
+int
+pcpu_get_num_cpus()
+{
+	return 0;
+}
+
+/* Slabs must be page-aligned, so we over-allocate and remember where the memory came from */
+void*
+page_alloc_order_mapped(int order, struct PAGE** p, int vm_flags)
+{
+	size_t len = PAGE_SIZE << order;
+	char* mem = malloc(len + PAGE_SIZE);
+	*p = malloc(sizeof(struct PAGE));
+	(*p)->p_addr = (addr_t)mem;
+	(*p)->p_order = order;
+	return (void*)(((addr_t)mem + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+void*
+page_alloc_length_mapped(size_t length, struct PAGE** p, int vm_flags)
+{
+	int order = 0;
+	while ((PAGE_SIZE << order) < length)
+		order++;
+	return page_alloc_order_mapped(order, p, vm_flags);
+}
+
+void
+page_free(struct PAGE* p)
+{
+	free((void*)p->p_addr);
+	free(p);
+}
+
+void
+kmem_unmap(void* virt, size_t length)
+{
+}
+
+void* dlmalloc(size_t);
+void dlfree(void*);
+
+/* This is how kmalloc() used to work: everything from dlmalloc under a single lock */
+static mutex_t mtx_global;
+
+static void*
+global_alloc(size_t len)
+{
+	mutex_lock(&mtx_global);
+	void* ptr = dlmalloc(len);
+	mutex_unlock(&mtx_global);
+	return ptr;
+}
+
+static void
+global_free(void* ptr)
+{
+	mutex_lock(&mtx_global);
+	dlfree(ptr);
+	mutex_unlock(&mtx_global);
+}
+
+struct BENCH_THREAD {
+	pthread_t	bt_thread;
+	unsigned int	bt_id;
+	void*		(*bt_alloc)(size_t);
+	void		(*bt_free)(void*);
+	unsigned int	bt_corrupted;
+};
+
+static size_t
+bench_size(unsigned int* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	unsigned int r = *seed >> 8;
+	if (r % BENCH_LARGE_RATIO == 0)
+		return 2048 + r % 4096;
+	return 8 + r % 500;
+}
+
+/*
+ * Every thread replaces the allocations in its working set in a round-robin
+ * fashion; every allocation is filled with a pattern which is verified before
+ * it is freed, to ensure no two threads are handed the same memory.
+ */
+static void*
+bench_thread(void* arg)
+{
+	struct BENCH_THREAD* bt = arg;
+	void* ptr[BENCH_WORKING_SET];
+	size_t len[BENCH_WORKING_SET];
+	unsigned int seed = bt->bt_id;
+
+	for (unsigned int n = 0; n < BENCH_WORKING_SET; n++) {
+		len[n] = bench_size(&seed);
+		ptr[n] = bt->bt_alloc(len[n]);
+		memset(ptr[n], bt->bt_id, len[n]);
+	}
+	for (unsigned int op = 0; op < BENCH_OPS_PER_THREAD; op++) {
+		unsigned int n = op % BENCH_WORKING_SET;
+		const unsigned char* p = ptr[n];
+		if (p[0] != (unsigned char)bt->bt_id || p[len[n] - 1] != (unsigned char)bt->bt_id)
+			bt->bt_corrupted++;
+		bt->bt_free(ptr[n]);
+		len[n] = bench_size(&seed);
+		ptr[n] = bt->bt_alloc(len[n]);
+		memset(ptr[n], bt->bt_id, len[n]);
+	}
+	for (unsigned int n = 0; n < BENCH_WORKING_SET; n++)
+		bt->bt_free(ptr[n]);
+	return NULL;
+}
+
+static double
+bench_run(unsigned int num_threads, void* (*alloc)(size_t), void (*dealloc)(void*))
+{
+	struct BENCH_THREAD bt[BENCH_MAX_THREADS];
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned int n = 0; n < num_threads; n++) {
+		bt[n].bt_id = n + 1;
+		bt[n].bt_alloc = alloc;
+		bt[n].bt_free = dealloc;
+		bt[n].bt_corrupted = 0;
+		pthread_create(&bt[n].bt_thread, NULL, bench_thread, &bt[n]);
+	}
+	unsigned int corrupted = 0;
+	for (unsigned int n = 0; n < num_threads; n++) {
+		pthread_join(bt[n].bt_thread, NULL);
+		corrupted += bt[n].bt_corrupted;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	EXPECT(corrupted == 0);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	return (num_threads * (double)BENCH_OPS_PER_THREAD) / secs;
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	mm_init();
+	mutex_init(&mtx_global, "global");
+
+	/* kfree() must accept whatever kmalloc() hands out, including NULL */
+	void* small = kmalloc(1);
+	void* large = kmalloc(3 * PAGE_SIZE);
+	EXPECT(small != NULL && ((addr_t)small & 15) == 0);
+	EXPECT(large != NULL && ((addr_t)large & 15) == 0);
+	kfree(small);
+	kfree(large);
+	kfree(NULL);
+
+	for (unsigned int num_threads = 1; num_threads <= BENCH_MAX_THREADS; num_threads *= 2) {
+		double global = bench_run(num_threads, global_alloc, global_free);
+		double kmalloc_ops = bench_run(num_threads, kmalloc, kfree);
+		printf("kmalloc: %u thread(s): global lock %.0f ops/sec, kmalloc %.0f ops/sec\n",
+		 num_threads, global, kmalloc_ops);
+	}
+
+	framework_done();
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ananas/mm.h>
+#include <ananas/page.h>
+#include <ananas/slab.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include "test-framework.h"
+
+/* Number of objects allocated at once in the tests */
+#define SLAB_NUM_OBJECTS 1000
+/* Size of the objects we allocate; this is about the size of a vmarea_t */
+#define SLAB_OBJECT_SIZE 88
+/* Number of objects that are alive at any time during the benchmark */
+#define BENCH_WORKING_SET 64
+/* Number of allocation/free rounds the benchmark performs */
+#define BENCH_ROUNDS 100000
+
+/* We don't use the per-CPU magazines here, so there are no CPU's */
+struct PCPU*
+pcpu_get(int cpuid)
+{
+	return NULL;
+}
+
+int
+pcpu_get_num_cpus()
+{
+	return 0;
+}
+
+/*
+ * Slabs must be page-aligned, so we over-allocate and remember where the
+ * memory came from in the page.
+ */
+static unsigned int num_pages_in_use = 0;
+
+void*
+page_alloc_order_mapped(int order, struct PAGE** p, int vm_flags)
+{
+	size_t len = PAGE_SIZE << order;
+	char* mem = malloc(len + PAGE_SIZE);
+	*p = malloc(sizeof(struct PAGE));
+	(*p)->p_addr = (addr_t)mem;
+	(*p)->p_order = order;
+	num_pages_in_use += 1 << order;
+	return (void*)(((addr_t)mem + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+void
+page_free(struct PAGE* p)
+{
+	num_pages_in_use -= 1 << p->p_order;
+	free((void*)p->p_addr);
+	free(p);
+}
+
+void
+kmem_unmap(void* virt, size_t length)
+{
+}
+
+#define CTOR_MAGIC 0x12345678
+
+struct TEST_OBJECT {
+	uint32_t	magic;
+	char		data[SLAB_OBJECT_SIZE - sizeof(uint32_t)];
+};
+
+static unsigned int num_ctor_calls = 0;
+
+static void
+test_ctor(void* obj)
+{
+	struct TEST_OBJECT* o = obj;
+	o->magic = CTOR_MAGIC;
+	num_ctor_calls++;
+}
+
+static void
+slab_cache_test()
+{
+	struct KMEM_CACHE* kc = kmem_cache_create("test", sizeof(struct TEST_OBJECT), test_ctor);
+	void** obj = malloc(sizeof(void*) * SLAB_NUM_OBJECTS);
+
+	/* All objects must be constructed, distinct and within a single page */
+	unsigned int unconstructed = 0, overlaps = 0, straddles = 0;
+	for (unsigned int n = 0; n < SLAB_NUM_OBJECTS; n++) {
+		obj[n] = kmem_cache_alloc(kc);
+		struct TEST_OBJECT* o = obj[n];
+		if (o->magic != CTOR_MAGIC)
+			unconstructed++;
+		o->magic = n;
+		addr_t start = (addr_t)o, end = start + sizeof(*o) - 1;
+		if ((start & ~(PAGE_SIZE - 1)) != (end & ~(PAGE_SIZE - 1)))
+			straddles++;
+	}
+	for (unsigned int n = 0; n < SLAB_NUM_OBJECTS; n++)
+		if (((struct TEST_OBJECT*)obj[n])->magic != n)
+			overlaps++;
+	EXPECT(unconstructed == 0);
+	EXPECT(overlaps == 0);
+	EXPECT(straddles == 0);
+	EXPECT(kc->kc_num_inuse == SLAB_NUM_OBJECTS);
+	EXPECT(num_ctor_calls == kc->kc_num_slabs * kc->kc_objs_per_slab);
+
+	/* Freeing everything must give all but a single slab back */
+	for (unsigned int n = 0; n < SLAB_NUM_OBJECTS; n++) {
+		((struct TEST_OBJECT*)obj[n])->magic = CTOR_MAGIC;
+		kmem_cache_free(kc, obj[n]);
+	}
+	EXPECT(kc->kc_num_inuse == 0);
+	EXPECT(kc->kc_num_slabs == 1);
+	EXPECT(num_pages_in_use == 1);
+
+	/* Objects in the remaining slab must not be constructed again */
+	unsigned int ctor_calls = num_ctor_calls;
+	for (unsigned int n = 0; n < kc->kc_objs_per_slab; n++)
+		obj[n] = kmem_cache_alloc(kc);
+	EXPECT(num_ctor_calls == ctor_calls);
+	EXPECT(num_pages_in_use == 1);
+	for (unsigned int n = 0; n < kc->kc_objs_per_slab; n++)
+		kmem_cache_free(kc, obj[n]);
+
+	kmem_cache_destroy(kc);
+	EXPECT(num_pages_in_use == 0);
+	free(obj);
+}
+
+static double
+bench_elapsed(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/*
+ * Compares the object cache with kmalloc(); both keep a working set of
+ * objects alive and replace them in a round-robin fashion, much like the
+ * kernel does with threads and vmareas.
+ */
+static void
+slab_bench()
+{
+	void* obj[BENCH_WORKING_SET];
+	struct KMEM_CACHE* kc = kmem_cache_create("bench", SLAB_OBJECT_SIZE, NULL);
+
+	clock_t start = clock();
+	for (unsigned int n = 0; n < BENCH_WORKING_SET; n++)
+		obj[n] = kmem_cache_alloc(kc);
+	for (unsigned int round = 0; round < BENCH_ROUNDS; round++)
+		for (unsigned int n = 0; n < BENCH_WORKING_SET; n++) {
+			kmem_cache_free(kc, obj[n]);
+			obj[n] = kmem_cache_alloc(kc);
+		}
+	for (unsigned int n = 0; n < BENCH_WORKING_SET; n++)
+		kmem_cache_free(kc, obj[n]);
+	double slab_secs = bench_elapsed(start);
+	kmem_cache_destroy(kc);
+
+	start = clock();
+	for (unsigned int n = 0; n < BENCH_WORKING_SET; n++)
+		obj[n] = kmalloc(SLAB_OBJECT_SIZE);
+	for (unsigned int round = 0; round < BENCH_ROUNDS; round++)
+		for (unsigned int n = 0; n < BENCH_WORKING_SET; n++) {
+			kfree(obj[n]);
+			obj[n] = kmalloc(SLAB_OBJECT_SIZE);
+		}
+	for (unsigned int n = 0; n < BENCH_WORKING_SET; n++)
+		kfree(obj[n]);
+	double kmalloc_secs = bench_elapsed(start);
+
+	unsigned int ops = BENCH_ROUNDS * BENCH_WORKING_SET;
+	printf("slab: %u alloc/free pairs of %u bytes: cache %.3f sec, kmalloc %.3f sec\n",
+	 ops, SLAB_OBJECT_SIZE, slab_secs, kmalloc_secs);
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	slab_cache_test();
+	slab_bench();
+	framework_done();
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
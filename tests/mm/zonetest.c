@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ananas/page.h>
+#include <machine/param.h> /* for PAGE_SIZE */
+#include "test-framework.h"
+
+/* Number of pages in the zone used to check the free lists */
+#define ZONE_NUM_PAGES 1000
+/* Amount of memory used to measure zone setup time, in MB */
+#define BENCH_ZONE_MB 4096
+
+/* Not declared in page.h as only the page code itself needs these */
+struct PAGE* page_alloc_zone(struct PAGE_ZONE* z, unsigned int order);
+void page_free_index(struct PAGE_ZONE* z, unsigned int order, unsigned int index);
+
+struct PCPU;
+
+/* We don't use the per-CPU page caches here, so there are no CPU's */
+struct PCPU*
+pcpu_get(int cpuid)
+{
+	return NULL;
+}
+
+int
+pcpu_get_num_cpus()
+{
+	return 0;
+}
+
+/*
+ * page_zone_add() only maps the administrative pages at the start of the
+ * zone; we hand out fresh memory for them and remember the most recent one,
+ * which is where the zone itself lives.
+ */
+static void* last_mapping = NULL;
+
+void*
+kmem_map(addr_t phys, size_t length, int flags)
+{
+	last_mapping = malloc(length);
+	return last_mapping;
+}
+
+static struct PAGE_ZONE*
+zone_create(unsigned int num_pages)
+{
+	page_zone_add(0x100000, (size_t)num_pages * PAGE_SIZE);
+	return last_mapping;
+}
+
+static unsigned int
+zone_count_free(struct PAGE_ZONE* z, unsigned int order)
+{
+	unsigned int n = 0;
+	if (!DQUEUE_EMPTY(&z->z_free[order])) {
+		DQUEUE_FOREACH(&z->z_free[order], p, struct PAGE) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static void
+zone_layout_test()
+{
+	struct PAGE_ZONE* z = zone_create(ZONE_NUM_PAGES);
+	EXPECT(z->z_num_pages < ZONE_NUM_PAGES);
+	EXPECT(z->z_avail_pages == z->z_num_pages);
+
+	/* Every free block must be properly aligned and add up to the entire zone */
+	unsigned int free_count[PAGE_NUM_ORDERS];
+	unsigned int total = 0, misaligned = 0;
+	for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++) {
+		free_count[order] = zone_count_free(z, order);
+		if (free_count[order] == 0)
+			continue;
+		DQUEUE_FOREACH(&z->z_free[order], p, struct PAGE) {
+			unsigned int index = p - z->z_base;
+			if (p->p_order != order || (index & ((1 << order) - 1)) != 0)
+				misaligned++;
+			total += 1 << order;
+		}
+	}
+	EXPECT(misaligned == 0);
+	EXPECT(total == z->z_num_pages);
+
+	/* Grab every single page; they must all be distinct */
+	struct PAGE** pages = malloc(sizeof(struct PAGE*) * z->z_num_pages);
+	char* seen = calloc(z->z_num_pages, 1);
+	unsigned int dups = 0;
+	for (unsigned int n = 0; n < z->z_num_pages; n++) {
+		pages[n] = page_alloc_zone(z, 0);
+		if (pages[n] == NULL)
+			break;
+		unsigned int index = pages[n] - z->z_base;
+		if (seen[index]++)
+			dups++;
+	}
+	EXPECT(dups == 0);
+	EXPECT(z->z_avail_pages == 0);
+	EXPECT(page_alloc_zone(z, 0) == NULL);
+
+	/* Freeing everything must merge back into exactly the initial blocks */
+	for (unsigned int n = 0; n < z->z_num_pages; n++)
+		page_free_index(z, 0, pages[n] - z->z_base);
+	EXPECT(z->z_avail_pages == z->z_num_pages);
+	unsigned int mismatches = 0;
+	for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++)
+		if (zone_count_free(z, order) != free_count[order])
+			mismatches++;
+	EXPECT(mismatches == 0);
+
+	free(seen);
+	free(pages);
+}
+
+/* Measures how long it takes to set up a zone, as happens for every memory region at boot */
+static void
+zone_bench()
+{
+	unsigned int num_pages = (unsigned int)(((uint64_t)BENCH_ZONE_MB * 1024 * 1024) / PAGE_SIZE);
+
+	clock_t start = clock();
+	struct PAGE_ZONE* z = zone_create(num_pages);
+	clock_t end = clock();
+	EXPECT(z->z_avail_pages == z->z_num_pages);
+	EXPECT(zone_count_free(z, PAGE_NUM_ORDERS - 1) > 0);
+
+	double secs = (double)(end - start) / CLOCKS_PER_SEC;
+	printf("zone: setup of %u MB (%u pages) took %.3f sec\n", BENCH_ZONE_MB, z->z_num_pages, secs);
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	zone_layout_test();
+	zone_bench();
+	framework_done();
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ananas/schedule.h>
+#include "test-framework.h"
+
+/* Number of fake threads to use for the benchmark */
+#define BENCH_NUM_THREADS 4096
+/* Number of pick-next/requeue rounds to run */
+#define BENCH_ROUNDS 1000000
+/* Priority most benchmark threads run at (THREAD_PRIORITY_DEFAULT) */
+#define BENCH_PRIORITY 200
+
+static struct SCHED_RUNQUEUE rq;
+
+static void
+runqueue_order_test()
+{
+	struct SCHED_PRIV sp[5];
+	runqueue_init(&rq);
+	EXPECT(runqueue_first(&rq) == NULL);
+
+	/* Items must be returned most important first, in FIFO order per level */
+	runqueue_add(&rq, &sp[0], 200);
+	runqueue_add(&rq, &sp[1], 10);
+	runqueue_add(&rq, &sp[2], 200);
+	runqueue_add(&rq, &sp[3], 255);
+	runqueue_add(&rq, &sp[4], 0);
+	EXPECT(rq.rq_depth == 5);
+
+	struct SCHED_PRIV* it = runqueue_first(&rq);
+	EXPECT(it == &sp[4]);
+	it = runqueue_next(&rq, it);
+	EXPECT(it == &sp[1]);
+	it = runqueue_next(&rq, it);
+	EXPECT(it == &sp[0]);
+	it = runqueue_next(&rq, it);
+	EXPECT(it == &sp[2]);
+	it = runqueue_next(&rq, it);
+	EXPECT(it == &sp[3]);
+	it = runqueue_next(&rq, it);
+	EXPECT(it == NULL);
+
+	/* Removing the only item of a level must skip that level */
+	runqueue_remove(&rq, &sp[1]);
+	EXPECT(runqueue_next(&rq, &sp[4]) == &sp[0]);
+
+	/* Requeueing an item must place it behind its peers */
+	runqueue_remove(&rq, &sp[0]);
+	runqueue_add(&rq, &sp[0], 200);
+	EXPECT(runqueue_next(&rq, &sp[4]) == &sp[2]);
+	EXPECT(runqueue_next(&rq, &sp[2]) == &sp[0]);
+
+	/* Emptying the queue must clear all bitmaps */
+	runqueue_remove(&rq, &sp[0]);
+	runqueue_remove(&rq, &sp[2]);
+	runqueue_remove(&rq, &sp[3]);
+	runqueue_remove(&rq, &sp[4]);
+	EXPECT(rq.rq_depth == 0);
+	EXPECT(rq.rq_summary == 0);
+	EXPECT(runqueue_first(&rq) == NULL);
+}
+
+/*
+ * Mimics what schedule() does on every involuntary preemption: take the most
+ * important thread and place it at the back of its priority level.
+ */
+static void
+runqueue_bench()
+{
+	struct SCHED_PRIV* sp = malloc(sizeof(struct SCHED_PRIV) * BENCH_NUM_THREADS);
+	runqueue_init(&rq);
+
+	/* Spread the threads over a handful of priorities, like a real system would */
+	for (unsigned int n = 0; n < BENCH_NUM_THREADS; n++)
+		runqueue_add(&rq, &sp[n], (n % 4 == 0) ? BENCH_PRIORITY - 10 : BENCH_PRIORITY);
+	EXPECT(rq.rq_depth == BENCH_NUM_THREADS);
+
+	clock_t start = clock();
+	for (unsigned int n = 0; n < BENCH_ROUNDS; n++) {
+		struct SCHED_PRIV* next = runqueue_first(&rq);
+		runqueue_remove(&rq, next);
+		runqueue_add(&rq, next, next->sp_prio);
+	}
+	clock_t end = clock();
+	EXPECT(rq.rq_depth == BENCH_NUM_THREADS);
+
+	double secs = (double)(end - start) / CLOCKS_PER_SEC;
+	printf("runqueue: %u threads, %u pick/requeue rounds in %.3f sec (%.0f rounds/sec)\n",
+	 BENCH_NUM_THREADS, BENCH_ROUNDS, secs, (secs > 0) ? BENCH_ROUNDS / secs : 0);
+
+	/* Tear down the queue */
+	for (unsigned int n = 0; n < BENCH_NUM_THREADS; n++)
+		runqueue_remove(&rq, &sp[n]);
+	EXPECT(runqueue_first(&rq) == NULL);
+	free(sp);
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	runqueue_order_test();
+	runqueue_bench();
+	framework_done();
+	return 0;
+}
+
+/* vim:set ts=2 sw=2: */
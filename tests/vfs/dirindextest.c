@@ -0,0 +1,274 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/bio.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/dentry.h>
+#include <ananas/vfs/dirindex.h>
+#include <ananas/vfs/generic.h>
+#include <ananas/vfs/icache.h>
+#include "test-framework.h"
+
+/* Number of entries in our directory */
+#define NUM_ENTRIES 20000
+/* Number of entries which may be created during the test */
+#define MAX_CREATED 16
+/* Number of lookups to time */
+#define BENCH_LOOKUPS 200
+
+#define ROOT_INO 1
+#define SLOT_TO_INO(n) ((n) + 2)
+
+/* Our filesystem has a single directory; the index of an entry is its inode number */
+static struct TESTFS_ENTRY {
+	char	e_name[32];
+	int	e_present;
+} testfs_entry[NUM_ENTRIES + MAX_CREATED];
+static unsigned int testfs_num_entries;
+static unsigned int testfs_scans;	/* Number of times the directory was read from the start */
+
+static struct VFS_INODE_OPS testfs_dir_iops;
+static struct VFS_INODE_OPS testfs_file_iops;
+
+void
+page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
+{
+	*total_pages = 65536;
+	*avail_pages = 32768;
+}
+
+/* We never do any block I/O */
+struct BIO*
+bio_get(device_t dev, blocknr_t block, size_t len, int flags)
+{
+	return NULL;
+}
+
+void
+bio_prefetch(device_t dev, blocknr_t block, size_t len, unsigned int num)
+{
+}
+
+void
+bio_free(struct BIO* bio)
+{
+}
+
+void
+bio_set_dirty(struct BIO* bio)
+{
+}
+
+void
+vfs_init_mount()
+{
+}
+
+static errorcode_t
+testfs_read_inode(struct VFS_INODE* inode, void* fsop)
+{
+	uint32_t ino = *(uint32_t*)fsop;
+	inode->i_sb.st_ino = ino;
+	inode->i_sb.st_nlink = 1;
+	inode->i_sb.st_mode = (ino == ROOT_INO) ? S_IFDIR : S_IFREG;
+	inode->i_iops = (ino == ROOT_INO) ? &testfs_dir_iops : &testfs_file_iops;
+	return ANANAS_ERROR_OK;
+}
+
+static struct VFS_FILESYSTEM_OPS testfs_fsops = {
+	.read_inode = testfs_read_inode
+};
+
+static struct VFS_MOUNTED_FS testfs = {
+	.fs_fsop_size = sizeof(uint32_t),
+	.fs_block_size = 1024,
+	.fs_fsops = &testfs_fsops
+};
+
+struct VFS_MOUNTED_FS*
+vfs_get_rootfs()
+{
+	return &testfs;
+}
+
+/* The offset is the slot to continue with */
+static errorcode_t
+testfs_readdir(struct VFS_FILE* file, void* dirents, size_t* len)
+{
+	if (file->f_offset == 0)
+		testfs_scans++;
+
+	size_t written = 0, left = *len;
+	for (/* nothing */; file->f_offset < testfs_num_entries; file->f_offset++) {
+		struct TESTFS_ENTRY* e = &testfs_entry[file->f_offset];
+		if (!e->e_present)
+			continue;
+		uint32_t ino = SLOT_TO_INO(file->f_offset);
+		int filled = vfs_filldirent(&dirents, &left, &ino, sizeof(ino), e->e_name, strlen(e->e_name));
+		if (!filled)
+			break;
+		written += filled;
+	}
+	*len = written;
+	return ANANAS_ERROR_OK;
+}
+
+static int
+testfs_find(const char* name)
+{
+	for (unsigned int n = 0; n < testfs_num_entries; n++)
+		if (testfs_entry[n].e_present && strcmp(testfs_entry[n].e_name, name) == 0)
+			return n;
+	return -1;
+}
+
+/* Adds an entry to the directory and fetches its inode */
+static errorcode_t
+testfs_add(const char* name, struct VFS_INODE** inode)
+{
+	unsigned int n = testfs_num_entries++;
+	strcpy(testfs_entry[n].e_name, name);
+	testfs_entry[n].e_present = 1;
+	uint32_t ino = SLOT_TO_INO(n);
+	return vfs_get_inode(&testfs, &ino, inode);
+}
+
+static errorcode_t
+testfs_create(struct VFS_INODE* dir, struct DENTRY* de, int mode)
+{
+	struct VFS_INODE* inode;
+	errorcode_t err = testfs_add(de->d_entry, &inode);
+	ANANAS_ERROR_RETURN(err);
+	dcache_set_inode(de, inode);
+	return ANANAS_ERROR_OK;
+}
+
+static errorcode_t
+testfs_unlink(struct VFS_INODE* dir, struct DENTRY* de)
+{
+	int n = testfs_find(de->d_entry);
+	if (n < 0)
+		return ANANAS_ERROR(NO_FILE);
+	testfs_entry[n].e_present = 0;
+	de->d_inode->i_sb.st_nlink--;
+	return ANANAS_ERROR_OK;
+}
+
+/* Like FAT, the FSOP changes when an entry is renamed */
+static errorcode_t
+testfs_rename(struct VFS_INODE* old_dir, struct DENTRY* old_dentry, struct VFS_INODE* new_dir, struct DENTRY* new_dentry)
+{
+	int n = testfs_find(old_dentry->d_entry);
+	if (n < 0)
+		return ANANAS_ERROR(NO_FILE);
+	struct VFS_INODE* inode;
+	errorcode_t err = testfs_add(new_dentry->d_entry, &inode);
+	ANANAS_ERROR_RETURN(err);
+	testfs_entry[n].e_present = 0;
+	dcache_set_inode(old_dentry, inode);
+	dcache_set_inode(new_dentry, inode);
+	return ANANAS_ERROR_OK;
+}
+
+static struct VFS_INODE_OPS testfs_dir_iops = {
+	.readdir = testfs_readdir,
+	.lookup = vfs_dirindex_lookup,
+	.create = testfs_create,
+	.unlink = testfs_unlink,
+	.rename = testfs_rename
+};
+
+/* Looks up 'name' directly in the filesystem; returns the inode number or 0 if it does not exist */
+static uint32_t
+lookup(errorcode_t (*lookup_fn)(struct DENTRY*, struct VFS_INODE**, const char*), const char* name)
+{
+	struct VFS_INODE* inode;
+	errorcode_t err = lookup_fn(testfs.fs_root_dentry, &inode, name);
+	if (ANANAS_ERROR_CODE(err) == ANANAS_ERROR_NO_FILE)
+		return 0;
+	if (err != ANANAS_ERROR_OK)
+		return (uint32_t)-1;
+	uint32_t ino = inode->i_sb.st_ino;
+	vfs_deref_inode(inode);
+	return ino;
+}
+
+/* Returns the time it takes to look up names which do not exist, in lookups per second */
+static double
+lookup_bench(errorcode_t (*lookup_fn)(struct DENTRY*, struct VFS_INODE**, const char*))
+{
+	struct timespec start, end;
+	char name[32];
+	unsigned int bad = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned int n = 0; n < BENCH_LOOKUPS; n++) {
+		sprintf(name, "missing%u", n);
+		if (lookup(lookup_fn, name) != 0)
+			bad++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	EXPECT(bad == 0);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	return BENCH_LOOKUPS / secs;
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	icache_init(&testfs);
+	dcache_init(&testfs);
+
+	for (unsigned int n = 0; n < NUM_ENTRIES; n++) {
+		sprintf(testfs_entry[n].e_name, "entry%u", n);
+		testfs_entry[n].e_present = 1;
+	}
+	testfs_num_entries = NUM_ENTRIES;
+	uint32_t root_ino = ROOT_INO;
+	EXPECT(vfs_get_inode(&testfs, &root_ino, &testfs.fs_root_dentry->d_inode) == ANANAS_ERROR_OK);
+
+	/* The directory must only be read once, no matter how many names we look up */
+	char name[32];
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < NUM_ENTRIES; n += 7) {
+		sprintf(name, "entry%u", n);
+		if (lookup(vfs_dirindex_lookup, name) != SLOT_TO_INO(n))
+			bad++;
+	}
+	EXPECT(bad == 0);
+	EXPECT(lookup(vfs_dirindex_lookup, "entry") == 0);
+	EXPECT(lookup(vfs_dirindex_lookup, "entry20000") == 0);
+	EXPECT(testfs_scans == 1);
+
+	/* Creating, renaming and removing entries must keep the index in sync */
+	struct VFS_FILE file;
+	EXPECT(vfs_create(testfs.fs_root_dentry, &file, "created", 0) == ANANAS_ERROR_OK);
+	EXPECT(lookup(vfs_dirindex_lookup, "created") == SLOT_TO_INO(NUM_ENTRIES));
+	EXPECT(vfs_rename(&file, testfs.fs_root_dentry, "renamed") == ANANAS_ERROR_OK);
+	EXPECT(lookup(vfs_dirindex_lookup, "created") == 0);
+	EXPECT(lookup(vfs_dirindex_lookup, "renamed") == SLOT_TO_INO(NUM_ENTRIES + 1));
+	EXPECT(vfs_unlink(&file) == ANANAS_ERROR_OK);
+	EXPECT(lookup(vfs_dirindex_lookup, "renamed") == 0);
+	vfs_close(&file);
+	EXPECT(testfs_scans == 1);
+
+	/* Reading the directory from scratch must give the same answers */
+	EXPECT(lookup(vfs_generic_lookup, "created") == 0);
+	EXPECT(lookup(vfs_generic_lookup, "renamed") == 0);
+	EXPECT(lookup(vfs_generic_lookup, "entry19999") == SLOT_TO_INO(19999));
+
+	double scan_rate = lookup_bench(vfs_generic_lookup);
+	unsigned int scans = testfs_scans;
+	double index_rate = lookup_bench(vfs_dirindex_lookup);
+	printf("dirindex: %u entries: %.0f misses/sec by reading the directory, %.0f misses/sec using the index\n",
+	 NUM_ENTRIES, scan_rate, index_rate);
+
+	/* Names which are not there must be answered by the index alone */
+	EXPECT(testfs_scans == scans);
+
+	framework_done();
+	return 0;
+}
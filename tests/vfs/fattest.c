@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/bio.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/generic.h>
+#include "../../kernel/fs/fat/block.h"
+#include "../../kernel/fs/fat/fatfs.h"
+#include "test-framework.h"
+
+/* Our disk uses 512 byte sectors, and a cluster is a single sector */
+#define SECTOR_SIZE 512
+#define FAT_SECTORS 80
+#define NUM_CLUSTERS 20000
+#define FIRST_DATA_SECTOR (1 + 2 * FAT_SECTORS)
+#define DISK_SECTORS (FIRST_DATA_SECTOR + NUM_CLUSTERS)
+/* The file consists of this many runs of consecutive clusters, scattered over the disk */
+#define FILE_RUNS 40
+#define RUN_LENGTH 100
+#define FILE_CLUSTERS (FILE_RUNS * RUN_LENGTH)
+/* Value every sector of the file starts with, so that reads can be verified */
+#define SECTOR_PATTERN(n) ((uint32_t)(n) ^ 0xa5a5a5a5)
+/* Number of clusters appended to a new file */
+#define APPEND_CLUSTERS 2000
+
+static uint8_t* disk;
+static unsigned int fat_reads;		/* Number of FAT sectors read */
+static unsigned int prefetch_requests;	/* Number of bio_prefetch() calls */
+static unsigned int prefetch_blocks;	/* Number of blocks prefetched */
+
+/* Buffers point straight into our disk, so anything written to them sticks */
+struct BIO*
+bio_get(device_t dev, blocknr_t block, size_t len, int flags)
+{
+	if (block + len / SECTOR_SIZE > DISK_SECTORS)
+		return NULL;
+	if (block >= 1 && block < FIRST_DATA_SECTOR)
+		fat_reads++;
+	struct BIO* bio = malloc(sizeof(struct BIO));
+	memset(bio, 0, sizeof(*bio));
+	bio->block = block;
+	bio->length = len;
+	bio->data = disk + block * SECTOR_SIZE;
+	return bio;
+}
+
+void
+bio_prefetch(device_t dev, blocknr_t block, size_t len, unsigned int num)
+{
+	prefetch_requests++;
+	prefetch_blocks += num;
+}
+
+void
+bio_free(struct BIO* bio)
+{
+	free(bio);
+}
+
+void
+bio_set_dirty(struct BIO* bio)
+{
+}
+
+/* We only have a single inode, which we never throw away */
+void
+vfs_ref_inode(struct VFS_INODE* inode)
+{
+}
+
+void
+vfs_deref_inode(struct VFS_INODE* inode)
+{
+}
+
+errorcode_t
+vfs_get_inode(struct VFS_MOUNTED_FS* fs, void* fsop, struct VFS_INODE** destinode)
+{
+	return ANANAS_ERROR(NO_FILE);
+}
+
+errorcode_t
+vfs_read(struct VFS_FILE* file, void* buf, size_t* len)
+{
+	return ANANAS_ERROR(BAD_OPERATION);
+}
+
+void
+vfs_init_mount()
+{
+}
+
+/* Like the real thing, writing an inode which is no longer linked frees its clusters */
+static errorcode_t
+fat_write_inode(struct VFS_INODE* inode)
+{
+	if (inode->i_sb.st_nlink == 0)
+		return fat_truncate_clusterchain(inode);
+	return ANANAS_ERROR_OK;
+}
+
+static struct VFS_FILESYSTEM_OPS fat_fsops = {
+	.write_inode = fat_write_inode
+};
+
+static struct FAT_FS_PRIVDATA fat_privdata = {
+	.fat_type = 16,
+	.sector_size = SECTOR_SIZE,
+	.sectors_per_cluster = 1,
+	.reserved_sectors = 1,
+	.num_fats = 2,
+	.num_fat_sectors = FAT_SECTORS,
+	.first_rootdir_sector = FIRST_DATA_SECTOR,
+	.first_data_sector = FIRST_DATA_SECTOR,
+	.total_clusters = NUM_CLUSTERS,
+	.next_avail_cluster = 2
+};
+
+static struct VFS_MOUNTED_FS fatfs = {
+	.fs_block_size = SECTOR_SIZE,
+	.fs_fsop_size = sizeof(uint64_t),
+	.fs_fsops = &fat_fsops,
+	.fs_privdata = &fat_privdata
+};
+
+static struct VFS_INODE_OPS fat_file_iops = {
+	.read = vfs_generic_read,
+	.write = vfs_generic_write,
+	.block_map = fat_block_map
+};
+
+static uint16_t
+fat_entry(uint32_t cluster)
+{
+	return FAT_FROM_LE16(disk + SECTOR_SIZE + cluster * 2);
+}
+
+static void
+set_fat_entry(uint32_t cluster, uint16_t val)
+{
+	FAT_TO_LE16(disk + SECTOR_SIZE + cluster * 2, val);
+	FAT_TO_LE16(disk + (1 + FAT_SECTORS) * SECTOR_SIZE + cluster * 2, val);
+}
+
+/* Run n of our file is stored at run (n * 7) % FILE_RUNS of the disk, leaving a gap between the runs */
+static uint32_t
+file_cluster(uint32_t index)
+{
+	uint32_t run = ((index / RUN_LENGTH) * 7) % FILE_RUNS;
+	return 2 + run * (RUN_LENGTH + 3) + index % RUN_LENGTH;
+}
+
+static void
+make_inode(struct VFS_INODE* inode, struct FAT_INODE_PRIVDATA* privdata, uint32_t first_cluster, uint32_t num_clusters)
+{
+	memset(privdata, 0, sizeof(*privdata));
+	mutex_init(&privdata->chain_mtx, "fatchain");
+	mutex_init(&privdata->extent_mtx, "fatextent");
+	privdata->first_cluster = first_cluster;
+	memset(inode, 0, sizeof(*inode));
+	inode->i_fs = &fatfs;
+	inode->i_iops = &fat_file_iops;
+	inode->i_privdata = privdata;
+	inode->i_sb.st_nlink = 1;
+	inode->i_sb.st_size = num_clusters * SECTOR_SIZE;
+	inode->i_sb.st_blocks = num_clusters;
+}
+
+static void
+make_file(struct VFS_INODE* inode, struct FAT_INODE_PRIVDATA* privdata)
+{
+	for (uint32_t n = 0; n < FILE_CLUSTERS; n++) {
+		uint32_t cluster = file_cluster(n);
+		set_fat_entry(cluster, (n == FILE_CLUSTERS - 1) ? 0xffff : file_cluster(n + 1));
+		uint8_t* data = disk + (FIRST_DATA_SECTOR + cluster - 2) * SECTOR_SIZE;
+		memset(data, 0, SECTOR_SIZE);
+		FAT_TO_LE32(data, SECTOR_PATTERN(n));
+	}
+	make_inode(inode, privdata, file_cluster(0), FILE_CLUSTERS);
+}
+
+/* Returns non-zero if the second FAT is identical to the first one */
+static int
+fat_mirrored()
+{
+	return memcmp(disk + SECTOR_SIZE, disk + (1 + FAT_SECTORS) * SECTOR_SIZE, FAT_SECTORS * SECTOR_SIZE) == 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	mutex_init(&fat_privdata.alloc_mtx, "fatalloc");
+	disk = malloc(DISK_SECTORS * SECTOR_SIZE);
+	memset(disk, 0, DISK_SECTORS * SECTOR_SIZE);
+
+	struct VFS_INODE inode;
+	struct FAT_INODE_PRIVDATA privdata;
+	make_file(&inode, &privdata);
+
+	/* Map every block in a random order; the FAT must be walked only once */
+	unsigned int bad = 0;
+	for (uint32_t n = 0; n < FILE_CLUSTERS; n++) {
+		uint32_t index = (n * 1237) % FILE_CLUSTERS;
+		blocknr_t block;
+		if (fat_block_map(&inode, index, &block, 0) != ANANAS_ERROR_OK ||
+		    block != FIRST_DATA_SECTOR + file_cluster(index) - 2)
+			bad++;
+	}
+	EXPECT(bad == 0);
+	EXPECT(privdata.num_extents == FILE_RUNS);
+	blocknr_t block;
+	EXPECT(ANANAS_ERROR_CODE(fat_block_map(&inode, FILE_CLUSTERS, &block, 0)) == ANANAS_ERROR_BAD_RANGE);
+	EXPECT(privdata.extent_complete);
+	EXPECT(fat_reads < FILE_CLUSTERS / 10);
+	unsigned int walk_reads = fat_reads;
+	EXPECT(ANANAS_ERROR_CODE(fat_block_map(&inode, FILE_CLUSTERS, &block, 0)) == ANANAS_ERROR_BAD_RANGE);
+	EXPECT(fat_block_map(&inode, FILE_CLUSTERS - 1, &block, 0) == ANANAS_ERROR_OK);
+	EXPECT(fat_reads == walk_reads);
+	printf("fat: %u clusters in %u extents; %u FAT sectors read\n", FILE_CLUSTERS, privdata.num_extents, fat_reads);
+
+	/* Reading a large part of the file must read runs of consecutive clusters at once */
+	struct DENTRY dentry;
+	memset(&dentry, 0, sizeof(dentry));
+	dentry.d_inode = &inode;
+	struct VFS_FILE file;
+	memset(&file, 0, sizeof(file));
+	file.f_dentry = &dentry;
+	file.f_offset = RUN_LENGTH * SECTOR_SIZE;
+	uint8_t* buf = malloc(FILE_CLUSTERS * SECTOR_SIZE);
+	size_t len = 8 * RUN_LENGTH * SECTOR_SIZE;
+	EXPECT(vfs_generic_read(&file, buf, &len) == ANANAS_ERROR_OK);
+	EXPECT(len == 8 * RUN_LENGTH * SECTOR_SIZE);
+	bad = 0;
+	for (uint32_t n = 0; n < 8 * RUN_LENGTH; n++)
+		if (FAT_FROM_LE32(buf + n * SECTOR_SIZE) != SECTOR_PATTERN(RUN_LENGTH + n))
+			bad++;
+	EXPECT(bad == 0);
+	EXPECT(prefetch_blocks == 8 * RUN_LENGTH);
+	printf("fat: reading %u blocks took %u requests\n", prefetch_blocks, prefetch_requests);
+	EXPECT(prefetch_requests <= 8 * RUN_LENGTH / 16 + 8); /* read-ahead is topped up every 16 blocks */
+
+	/* Appending a cluster must pick the one following the final one, and extend the final extent */
+	uint32_t last = file_cluster(FILE_CLUSTERS - 1);
+	file.f_offset = inode.i_sb.st_size;
+	len = SECTOR_SIZE;
+	EXPECT(vfs_generic_write(&file, buf, &len) == ANANAS_ERROR_OK);
+	EXPECT(fat_entry(last) == last + 1);
+	EXPECT(privdata.num_extents == FILE_RUNS);
+	EXPECT(fat_block_map(&inode, FILE_CLUSTERS, &block, 0) == ANANAS_ERROR_OK);
+	EXPECT(block == FIRST_DATA_SECTOR + last + 1 - 2);
+	EXPECT(fat_mirrored());
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS - FILE_CLUSTERS - 1);
+
+	/* Throwing the extents away must give the same mapping once they are rebuilt */
+	fat_clear_extents(&inode);
+	EXPECT(fat_block_map(&inode, FILE_CLUSTERS, &block, 0) == ANANAS_ERROR_OK);
+	EXPECT(block == FIRST_DATA_SECTOR + last + 1 - 2);
+	EXPECT(privdata.num_extents == FILE_RUNS);
+
+	/*
+	 * Appending to a new file must give it consecutive clusters, and must not
+	 * have to look at the FAT to find them.
+	 */
+	struct VFS_INODE inode2;
+	struct FAT_INODE_PRIVDATA privdata2;
+	make_inode(&inode2, &privdata2, 0, 0);
+	dentry.d_inode = &inode2;
+	fat_privdata.next_avail_cluster = 2 * FILE_RUNS * RUN_LENGTH;
+	fat_reads = 0;
+	file.f_offset = 0;
+	bad = 0;
+	for (unsigned int n = 0; n < APPEND_CLUSTERS; n++) {
+		len = SECTOR_SIZE;
+		if (vfs_generic_write(&file, buf, &len) != ANANAS_ERROR_OK || len != SECTOR_SIZE)
+			bad++;
+	}
+	EXPECT(bad == 0);
+	EXPECT(privdata2.num_extents == 1);
+	EXPECT(inode2.i_sb.st_size == APPEND_CLUSTERS * SECTOR_SIZE);
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS - FILE_CLUSTERS - 1 - APPEND_CLUSTERS);
+	EXPECT(fat_mirrored());
+	printf("fat: appending %u clusters looked up %u FAT sectors\n", APPEND_CLUSTERS, fat_reads);
+	EXPECT(fat_reads <= 4 * APPEND_CLUSTERS + 8); /* two entries per cluster, in both FATs */
+	EXPECT(fat_truncate_clusterchain(&inode2) == ANANAS_ERROR_OK);
+
+	/* Truncating twice must free the chain only once, after which we can append again */
+	EXPECT(inode2.i_sb.st_blocks == 0);
+	EXPECT(privdata2.first_cluster == 0);
+	EXPECT(fat_truncate_clusterchain(&inode2) == ANANAS_ERROR_OK);
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS - FILE_CLUSTERS - 1);
+	EXPECT(fat_block_map(&inode2, 0, &block, 1) == ANANAS_ERROR_OK);
+	EXPECT(privdata2.first_cluster != 0);
+	EXPECT(block == FIRST_DATA_SECTOR + privdata2.first_cluster - 2);
+	EXPECT(fat_entry(privdata2.first_cluster) == 0xfff8);
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS - FILE_CLUSTERS - 2);
+	EXPECT(fat_truncate_clusterchain(&inode2) == ANANAS_ERROR_OK);
+
+	/*
+	 * An unlinked file must keep the cluster it is given, rather than having it
+	 * freed by writing the inode (which must not deadlock either)
+	 */
+	make_inode(&inode2, &privdata2, 0, 0);
+	inode2.i_sb.st_nlink = 0;
+	EXPECT(fat_block_map(&inode2, 0, &block, 1) == ANANAS_ERROR_OK);
+	EXPECT(privdata2.first_cluster != 0);
+	EXPECT(block == FIRST_DATA_SECTOR + privdata2.first_cluster - 2);
+	EXPECT(fat_entry(privdata2.first_cluster) == 0xfff8);
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS - FILE_CLUSTERS - 2);
+	EXPECT(fat_truncate_clusterchain(&inode2) == ANANAS_ERROR_OK);
+	EXPECT(fat_truncate_clusterchain(&inode2) == ANANAS_ERROR_OK);
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS - FILE_CLUSTERS - 1);
+
+	/* Truncating must free every cluster of the chain */
+	EXPECT(fat_truncate_clusterchain(&inode) == ANANAS_ERROR_OK);
+	EXPECT(fat_privdata.num_avail_clusters == NUM_CLUSTERS);
+	EXPECT(fat_mirrored());
+	bad = 0;
+	for (uint32_t n = 2; n < NUM_CLUSTERS; n++)
+		if (fat_entry(n) != 0)
+			bad++;
+	EXPECT(bad == 0);
+	EXPECT(privdata.num_extents == 0);
+
+	free(buf);
+	free(fat_privdata.free_bitmap);
+	free(disk);
+	framework_done();
+	return 0;
+}
@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/lock.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/dirindex.h>
+#include <ananas/vfs/icache.h>
+#include "test-framework.h"
+
+/* Number of distinct inodes on our filesystem */
+#define NUM_FILES 4096
+/* Number of threads looking up inodes at the same time */
+#define NUM_THREADS 16
+/* Number of lookups done by every thread */
+#define LOOKUPS_PER_THREAD 4000
+/* Inodes which every thread keeps looking up */
+#define HOT_FILES 32
+/* Time it takes to read an inode, in microseconds */
+#define READ_LATENCY 50
+/* One in this many inodes can't be read */
+#define FAIL_EVERY 101
+#define INO_FAILS(ino) ((ino) % FAIL_EVERY == FAIL_EVERY - 1)
+/* Inodes whose reads only finish when we say so; the second one fails */
+#define GATE_INO NUM_FILES
+#define GATE_FAIL_INO ((NUM_FILES / FAIL_EVERY + 2) * FAIL_EVERY - 1)
+
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct VFS_INODE* fs_live[NUM_FILES + 2 * FAIL_EVERY];	/* Inodes in memory */
+static unsigned int fs_reads[NUM_FILES + 2 * FAIL_EVERY];	/* Reads per inode */
+static unsigned int fs_duplicates;	/* Inodes which were in memory twice */
+static volatile int fs_gate_open;
+
+/* Our inodes are never directories, so they have no index to throw away */
+void
+dirindex_destroy(struct VFS_INODE* dir)
+{
+}
+
+/* The cache sizes itself using this */
+void
+page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
+{
+	*total_pages = 4096;
+	*avail_pages = 2048;
+}
+
+static uint64_t
+test_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static errorcode_t
+testfs_read_inode(struct VFS_INODE* inode, void* fsop)
+{
+	uint32_t ino = *(uint32_t*)fsop;
+	pthread_mutex_lock(&fs_mutex);
+	fs_reads[ino]++;
+	pthread_mutex_unlock(&fs_mutex);
+
+	if (ino == GATE_INO || ino == GATE_FAIL_INO) {
+		while (!fs_gate_open)
+			sched_yield();
+	} else {
+		struct timespec ts = { 0, READ_LATENCY * 1000 };
+		nanosleep(&ts, NULL);
+	}
+	if (INO_FAILS(ino))
+		return ANANAS_ERROR(IO);
+
+	inode->i_sb.st_ino = ino;
+	inode->i_sb.st_nlink = 1;
+	pthread_mutex_lock(&fs_mutex);
+	if (fs_live[ino] != NULL)
+		fs_duplicates++;
+	fs_live[ino] = inode;
+	pthread_mutex_unlock(&fs_mutex);
+	return ANANAS_ERROR_OK;
+}
+
+static void
+testfs_destroy_inode(struct VFS_INODE* inode)
+{
+	uint32_t ino = *(uint32_t*)inode->i_fsop;
+	pthread_mutex_lock(&fs_mutex);
+	if (fs_live[ino] == inode)
+		fs_live[ino] = NULL;
+	pthread_mutex_unlock(&fs_mutex);
+	vfs_destroy_inode(inode);
+}
+
+static struct VFS_FILESYSTEM_OPS testfs_fsops = {
+	.read_inode = testfs_read_inode,
+	.destroy_inode = testfs_destroy_inode
+};
+
+static struct VFS_MOUNTED_FS testfs = {
+	.fs_fsop_size = sizeof(uint32_t),
+	.fs_block_size = 1024,
+	.fs_fsops = &testfs_fsops
+};
+
+/* Looks up an inode and checks whether we got the correct one; returns zero if not */
+static int
+lookup(uint32_t ino)
+{
+	struct VFS_INODE* inode;
+	errorcode_t err = vfs_get_inode(&testfs, &ino, &inode);
+	if (INO_FAILS(ino))
+		return ANANAS_ERROR_CODE(err) == ANANAS_ERROR_IO;
+	if (err != ANANAS_ERROR_OK)
+		return 0;
+	int ok = inode->i_sb.st_ino == ino;
+	vfs_deref_inode(inode);
+	return ok;
+}
+
+struct WORKER {
+	pthread_t	w_tid;
+	unsigned int	w_num;
+	unsigned int	w_lookups;
+	unsigned int	w_bad;
+};
+
+static void*
+worker_thread(void* arg)
+{
+	struct WORKER* w = arg;
+	for (unsigned int n = 0; n < w->w_lookups; n++) {
+		/* Mix hot inodes, which will be cached or pending, with a sweep over all files */
+		uint32_t ino;
+		if (n % 4 == 0)
+			ino = (n / 4) % HOT_FILES;
+		else
+			ino = (n * 7 + w->w_num * (NUM_FILES / NUM_THREADS)) % NUM_FILES;
+		if (!lookup(ino))
+			w->w_bad++;
+	}
+	return NULL;
+}
+
+/* Runs 'num_threads' threads doing 'lookups' lookups each; returns the number of lookups per second */
+static double
+icache_bench(unsigned int num_threads, unsigned int lookups)
+{
+	struct WORKER w[NUM_THREADS];
+	uint64_t start = test_now();
+	for (unsigned int n = 0; n < num_threads; n++) {
+		w[n].w_num = n;
+		w[n].w_lookups = lookups;
+		w[n].w_bad = 0;
+		pthread_create(&w[n].w_tid, NULL, worker_thread, &w[n]);
+	}
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < num_threads; n++) {
+		pthread_join(w[n].w_tid, NULL);
+		bad += w[n].w_bad;
+	}
+	uint64_t elapsed = test_now() - start;
+	EXPECT(bad == 0);
+	EXPECT(fs_duplicates == 0);
+	return (num_threads * lookups * 1000000.0) / elapsed;
+}
+
+struct GATE_LOOKUP {
+	pthread_t		gl_tid;
+	uint32_t		gl_ino;
+	errorcode_t		gl_err;
+	struct VFS_INODE*	gl_inode;
+};
+
+static void*
+gate_thread(void* arg)
+{
+	struct GATE_LOOKUP* gl = arg;
+	gl->gl_err = vfs_get_inode(&testfs, &gl->gl_ino, &gl->gl_inode);
+	return NULL;
+}
+
+/*
+ * Looks up a gated inode from two threads; the second one must wait for the
+ * first to finish reading. Returns the number of times the inode was read.
+ */
+static unsigned int
+icache_pending_lookup(uint32_t ino, struct GATE_LOOKUP* gl)
+{
+	struct ICACHE_STATS stats;
+	icache_get_stats(&stats);
+	unsigned int waits = stats.is_waits;
+
+	fs_gate_open = 0;
+	gl[0].gl_ino = ino;
+	gl[1].gl_ino = ino;
+	pthread_create(&gl[0].gl_tid, NULL, gate_thread, &gl[0]);
+	while (*(volatile unsigned int*)&fs_reads[ino] == 0)
+		sched_yield();
+	pthread_create(&gl[1].gl_tid, NULL, gate_thread, &gl[1]);
+	do {
+		sched_yield();
+		icache_get_stats(&stats);
+	} while (stats.is_waits == waits);
+	fs_gate_open = 1;
+	pthread_join(gl[0].gl_tid, NULL);
+	pthread_join(gl[1].gl_tid, NULL);
+	return fs_reads[ino];
+}
+
+static void
+icache_pending_test()
+{
+	struct GATE_LOOKUP gl[2];
+
+	/* Both threads must end up with the same inode, which is read only once */
+	EXPECT(icache_pending_lookup(GATE_INO, gl) == 1);
+	EXPECT(gl[0].gl_err == ANANAS_ERROR_OK && gl[1].gl_err == ANANAS_ERROR_OK);
+	EXPECT(gl[0].gl_inode == gl[1].gl_inode);
+	EXPECT(gl[0].gl_inode->i_refcount == 3);
+	vfs_deref_inode(gl[0].gl_inode);
+	vfs_deref_inode(gl[1].gl_inode);
+
+	/* If the read fails, the waiting thread must try for itself */
+	EXPECT(icache_pending_lookup(GATE_FAIL_INO, gl) == 2);
+	EXPECT(ANANAS_ERROR_CODE(gl[0].gl_err) == ANANAS_ERROR_IO);
+	EXPECT(ANANAS_ERROR_CODE(gl[1].gl_err) == ANANAS_ERROR_IO);
+
+	/* Reads of different inodes must not wait for each other */
+	unsigned int reads = fs_reads[GATE_FAIL_INO];
+	fs_gate_open = 0;
+	gl[0].gl_ino = GATE_FAIL_INO;
+	pthread_create(&gl[0].gl_tid, NULL, gate_thread, &gl[0]);
+	while (*(volatile unsigned int*)&fs_reads[GATE_FAIL_INO] == reads)
+		sched_yield();
+	EXPECT(lookup(GATE_INO + 1));
+	EXPECT(fs_reads[GATE_INO + 1] == 1);
+	fs_gate_open = 1;
+	pthread_join(gl[0].gl_tid, NULL);
+	EXPECT(ANANAS_ERROR_CODE(gl[0].gl_err) == ANANAS_ERROR_IO);
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	icache_init(&testfs);
+
+	icache_pending_test();
+
+	/* Thousands of files do not fit in the cache; old ones must be purged */
+	double single_rate = icache_bench(1, LOOKUPS_PER_THREAD);
+	double rate = icache_bench(NUM_THREADS, LOOKUPS_PER_THREAD);
+	struct ICACHE_STATS stats;
+	unsigned int num_entries, max_entries, hash_size;
+	icache_get_stats(&stats);
+	icache_get_size(&num_entries, &max_entries, &hash_size);
+	printf("icache: 1 thread: %.0f lookups/sec, %u threads: %.0f lookups/sec\n",
+	 single_rate, NUM_THREADS, rate);
+	printf("icache: %u hits, %u misses, %u waits, %u purged; %u entries (max %u), %u buckets\n",
+	 stats.is_hits, stats.is_misses, stats.is_waits, stats.is_purges, num_entries, max_entries, hash_size);
+	EXPECT(stats.is_purges > 0);
+	EXPECT(num_entries <= max_entries + NUM_THREADS);
+
+	framework_done();
+	return 0;
+}
@@ -0,0 +1,281 @@
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ananas/types.h>
+#include <ananas/error.h>
+#include <ananas/vfs.h>
+#include <ananas/vfs/dentry.h>
+#include <ananas/vfs/dirindex.h>
+#include <ananas/vfs/icache.h>
+#include "test-framework.h"
+
+/* Every directory has this many subdirectories... */
+#define DIR_FANOUT 4
+/* ... down to this depth, where each directory holds FILES_PER_DIR files */
+#define DIR_DEPTH 4
+#define FILES_PER_DIR 8
+/* Number of threads looking up paths at the same time */
+#define NUM_THREADS 8
+/* Number of lookups done by every thread */
+#define LOOKUPS_PER_THREAD 20000
+
+extern int vfs_lookup_lockless;
+
+/* Our filesystem's objects are identified by number and type */
+struct TESTFS_FSOP {
+	uint32_t	ino;
+	uint32_t	is_dir;
+};
+
+static struct VFS_INODE_OPS testfs_dir_iops;
+static struct VFS_INODE_OPS testfs_file_iops;
+static volatile int test_done;
+
+/* Our directories are looked up without an index, so there is nothing to maintain */
+void
+dirindex_add(struct VFS_INODE* dir, const char* name, const void* fsop)
+{
+}
+
+void
+dirindex_remove(struct VFS_INODE* dir, const char* name)
+{
+}
+
+void
+dirindex_destroy(struct VFS_INODE* dir)
+{
+}
+
+void
+page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
+{
+	*total_pages = 65536;
+	*avail_pages = 32768;
+}
+
+static errorcode_t
+testfs_read_inode(struct VFS_INODE* inode, void* fsop)
+{
+	struct TESTFS_FSOP* f = fsop;
+	inode->i_sb.st_ino = f->ino;
+	inode->i_sb.st_nlink = 1;
+	inode->i_sb.st_mode = f->is_dir ? S_IFDIR : S_IFREG;
+	inode->i_iops = f->is_dir ? &testfs_dir_iops : &testfs_file_iops;
+	return ANANAS_ERROR_OK;
+}
+
+static struct VFS_FILESYSTEM_OPS testfs_fsops = {
+	.read_inode = testfs_read_inode
+};
+
+static struct VFS_MOUNTED_FS testfs = {
+	.fs_fsop_size = sizeof(struct TESTFS_FSOP),
+	.fs_block_size = 1024,
+	.fs_fsops = &testfs_fsops
+};
+
+struct VFS_MOUNTED_FS*
+vfs_get_rootfs()
+{
+	return &testfs;
+}
+
+/* Directory 'dN' has inode (parent * 32 + N + 1), file 'fN' (parent * 32 + N + 17) */
+static errorcode_t
+testfs_lookup(struct DENTRY* parent, struct VFS_INODE** destinode, const char* dentry)
+{
+	struct TESTFS_FSOP fsop;
+	uint32_t parent_ino = parent->d_inode->i_sb.st_ino;
+	int depth = 0;
+	for (uint32_t i = parent_ino; i > 1; i = (i - 1) / 32)
+		depth++;
+	int n = atoi(&dentry[1]);
+	if (dentry[0] == 'd' && depth < DIR_DEPTH && n < DIR_FANOUT) {
+		fsop.ino = parent_ino * 32 + n + 1;
+		fsop.is_dir = 1;
+	} else if (dentry[0] == 'f' && depth == DIR_DEPTH && n < FILES_PER_DIR) {
+		fsop.ino = parent_ino * 32 + n + 17;
+		fsop.is_dir = 0;
+	} else
+		return ANANAS_ERROR(NO_FILE);
+	return vfs_get_inode(&testfs, &fsop, destinode);
+}
+
+static struct VFS_INODE_OPS testfs_dir_iops = {
+	.lookup = testfs_lookup
+};
+
+/* Builds the path of file number 'num', and returns the inode it should have */
+static uint32_t
+make_path(unsigned int num, char* path)
+{
+	uint32_t ino = 1;
+	path[0] = '\0';
+	for (int n = 0; n < DIR_DEPTH; n++) {
+		unsigned int d = num % DIR_FANOUT;
+		num /= DIR_FANOUT;
+		sprintf(path + strlen(path), "/d%u", d);
+		ino = ino * 32 + d + 1;
+	}
+	unsigned int f = num % FILES_PER_DIR;
+	sprintf(path + strlen(path), "/f%u", f);
+	return ino * 32 + f + 17;
+}
+
+#define NUM_FILES (DIR_FANOUT * DIR_FANOUT * DIR_FANOUT * DIR_FANOUT * FILES_PER_DIR)
+
+struct WORKER {
+	pthread_t	w_tid;
+	unsigned int	w_num;
+	unsigned int	w_bad;
+};
+
+static void*
+worker_thread(void* arg)
+{
+	struct WORKER* w = arg;
+	char path[64];
+	for (unsigned int n = 0; n < LOOKUPS_PER_THREAD; n++) {
+		uint32_t ino = make_path((n * 13 + w->w_num * 101) % NUM_FILES, path);
+		struct DENTRY* de;
+		if (vfs_lookup(NULL, &de, path) != ANANAS_ERROR_OK) {
+			w->w_bad++;
+			continue;
+		}
+		if (de->d_inode == NULL || de->d_inode->i_sb.st_ino != ino)
+			w->w_bad++;
+		dentry_deref(de);
+	}
+	return NULL;
+}
+
+/*
+ * Keeps looking up names that do not exist; the negative entries force the
+ * cache to throw away old entries, which the other threads may be using.
+ */
+static void*
+churn_thread(void* arg)
+{
+	unsigned int* bad = arg;
+	char path[64];
+	for (unsigned int n = 0; !test_done; n++) {
+		sprintf(path, "/d%u/x%u", n % DIR_FANOUT, n);
+		struct DENTRY* de;
+		if (ANANAS_ERROR_CODE(vfs_lookup(NULL, &de, path)) != ANANAS_ERROR_NO_FILE)
+			(*bad)++;
+	}
+	return NULL;
+}
+
+/* Runs all worker threads; returns the number of lookups per second */
+static double
+lookup_bench(int lockless, int churn)
+{
+	struct WORKER w[NUM_THREADS];
+	pthread_t churn_tid;
+	unsigned int churn_bad = 0;
+	struct timespec start, end;
+
+	vfs_lookup_lockless = lockless;
+	test_done = 0;
+	if (churn)
+		pthread_create(&churn_tid, NULL, churn_thread, &churn_bad);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned int n = 0; n < NUM_THREADS; n++) {
+		w[n].w_num = n;
+		w[n].w_bad = 0;
+		pthread_create(&w[n].w_tid, NULL, worker_thread, &w[n]);
+	}
+	unsigned int bad = 0;
+	for (unsigned int n = 0; n < NUM_THREADS; n++) {
+		pthread_join(w[n].w_tid, NULL);
+		bad += w[n].w_bad;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	test_done = 1;
+	if (churn)
+		pthread_join(churn_tid, NULL);
+	EXPECT(bad == 0);
+	EXPECT(churn_bad == 0);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	return (NUM_THREADS * LOOKUPS_PER_THREAD) / secs;
+}
+
+static void
+lookup_test()
+{
+	char path[64];
+	struct DENTRY* de;
+	uint32_t ino = make_path(NUM_FILES - 1, path);
+
+	/* The first lookup has to ask the filesystem; the second is served from the cache */
+	vfs_lookup_lockless = 1;
+	EXPECT(vfs_lookup(NULL, &de, path) == ANANAS_ERROR_OK);
+	EXPECT(de->d_inode->i_sb.st_ino == ino);
+	struct DENTRY* de2;
+	EXPECT(vfs_lookup(NULL, &de2, path) == ANANAS_ERROR_OK);
+	EXPECT(de2 == de);
+	EXPECT(atomic_read(&de->d_refcount) == 3); /* cache + both lookups */
+	dentry_deref(de2);
+
+	/* Relative lookups, '.' and trailing slashes work as well */
+	struct DENTRY* dir;
+	EXPECT(vfs_lookup(NULL, &dir, "/d3/d3/./d3/") == ANANAS_ERROR_OK);
+	EXPECT(vfs_lookup(dir, &de2, "d3/f7") == ANANAS_ERROR_OK);
+	EXPECT(de2 == de);
+	dentry_deref(de2);
+	dentry_deref(dir);
+
+	/* Names that don't exist are found as negative entries the second time */
+	EXPECT(ANANAS_ERROR_CODE(vfs_lookup(NULL, &de2, "/d0/nothere")) == ANANAS_ERROR_NO_FILE);
+	EXPECT(ANANAS_ERROR_CODE(vfs_lookup(NULL, &de2, "/d0/nothere")) == ANANAS_ERROR_NO_FILE);
+	EXPECT(ANANAS_ERROR_CODE(vfs_lookup(NULL, &de2, "/d0/nothere/f0")) == ANANAS_ERROR_NO_FILE);
+
+	/* A file isn't a directory */
+	EXPECT(ANANAS_ERROR_CODE(vfs_lookup(NULL, &de2, "/d3/d3/d3/d3/f7/f0")) == ANANAS_ERROR_NO_FILE);
+	dentry_deref(de);
+}
+
+int
+main(int argc, char* argv[])
+{
+	framework_init();
+	icache_init(&testfs);
+	dcache_init(&testfs);
+
+	/* Hook up the root directory */
+	struct TESTFS_FSOP root_fsop = { 1, 1 };
+	EXPECT(vfs_get_inode(&testfs, &root_fsop, &testfs.fs_root_dentry->d_inode) == ANANAS_ERROR_OK);
+
+	lookup_test();
+
+	/* Warm the cache, then compare the locked walk to the lockless one */
+	lookup_bench(1, 0);
+	struct DCACHE_STATS stats;
+	dcache_get_stats(&stats);
+	unsigned int misses = stats.ds_misses;
+	double locked_rate = lookup_bench(0, 0);
+	double lockless_rate = lookup_bench(1, 0);
+	printf("lookup: %u threads, %u deep: locked %.0f lookups/sec, lockless %.0f lookups/sec\n",
+	 NUM_THREADS, DIR_DEPTH + 1, locked_rate, lockless_rate);
+
+	/* Once everything is cached, neither walk may ask the filesystem */
+	dcache_get_stats(&stats);
+	EXPECT(stats.ds_misses == misses);
+
+	/* Entries must stay valid for lockless lookups while the cache throws them away */
+	double churn_rate = lookup_bench(1, 1);
+	lookup_bench(1, 1);
+	dcache_get_stats(&stats);
+	printf("lookup: with purging: %.0f lookups/sec; %u purged\n", churn_rate, stats.ds_purges);
+	EXPECT(stats.ds_purges > 0);
+
+	framework_done();
+	return 0;
+}
@@ -1,9 +1,17 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ananas/types.h>
 #include <ananas/error.h>
 #include <ananas/bio.h>
+#include <ananas/page.h>
+#include <ananas/thread.h>
+#include <ananas/timer.h>
 #include <ananas/vfs.h>
+#include <ananas/vfs/dentry.h>
+#include <ananas/vfs/icache.h>
+#include <machine/param.h> /* for PAGE_SIZE */
 #include "test-framework.h"
 
 /* Files to use for testing */
@@ -13,6 +21,7 @@
 #define FILE4 "notthere"
 #define FILENAME_NONE "doesnotexist.%u"
 #define FILENAME_DUMMY "%02i"
+#define NUM_DUMMY_FILES 100
 
 #define CHECK_OK(x) \
 	check_err((x), ANANAS_ERROR_NONE, STRINGIFY(x))
@@ -22,6 +31,59 @@
 
 char* vfstest_fsimage = NULL;
 
+/* Sets up our image as the only device; provided by the framework */
+void device_init();
+
+/* The caches size themselves using this */
+void
+page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
+{
+	*total_pages = 4096;
+	*avail_pages = 2048;
+}
+
+/* Buffer data pages must be page-aligned, so we over-allocate and remember where the memory came from */
+void*
+page_alloc_order_mapped(int order, struct PAGE** p, int vm_flags)
+{
+	size_t len = PAGE_SIZE << order;
+	char* mem = malloc(len + PAGE_SIZE);
+	*p = malloc(sizeof(struct PAGE));
+	(*p)->p_addr = (addr_t)mem;
+	(*p)->p_order = order;
+	return (void*)(((addr_t)mem + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+void
+page_free(struct PAGE* p)
+{
+	free((void*)p->p_addr);
+	free(p);
+}
+
+void
+kmem_unmap(void* virt, size_t length)
+{
+}
+
+uint64_t
+timer_get_ticks()
+{
+	return 1;
+}
+
+/* We never write, so the syncer needn't run */
+errorcode_t
+kthread_init(thread_t* t, const char* name, kthread_func_t func, void* arg)
+{
+	return ANANAS_ERROR_OK;
+}
+
+void
+thread_resume(thread_t* t)
+{
+}
+
 static void
 check_err(errorcode_t err, errorcode_t e, const char* func)
 {
@@ -31,26 +93,72 @@ check_err(errorcode_t err, errorcode_t e, const char* func)
 	EXPECT(0);
 }
 
-#define CALCULATE_ICACHE_SIZE(fs,i) \
-	do { \
-		(i) = 0; \
-		if(!DQUEUE_EMPTY(&(fs)->fs_icache_inuse)) \
-			DQUEUE_FOREACH(&(fs)->fs_icache_inuse, ii, struct ICACHE_ITEM) { (i)++; } \
-	} while(0)
+/*
+ * All filesystems share the inode and dentry caches; these walk the items of
+ * a single filesystem, most recently used first.
+ */
+static struct ICACHE_ITEM*
+icache_next(struct VFS_MOUNTED_FS* fs, struct ICACHE_ITEM* ii)
+{
+	ii = (ii == NULL) ? DQUEUE_HEAD(&icache_lru) : DQUEUE_NEXT_IP(ii, lru);
+	while (ii != NULL && ii->fs != fs)
+		ii = DQUEUE_NEXT_IP(ii, lru);
+	return ii;
+}
 
-#define CALCULATE_DCACHE_SIZE(fs,i) \
-	do { \
-		(i) = 0; \
-		if(!DQUEUE_EMPTY(&(fs)->fs_dcache_inuse)) \
-			DQUEUE_FOREACH(&(fs)->fs_dcache_inuse, di, struct DENTRY_CACHE_ITEM) { (i)++; } \
-	} while(0)
+static struct DENTRY*
+dcache_next(struct VFS_MOUNTED_FS* fs, struct DENTRY* d)
+{
+	d = (d == NULL) ? DQUEUE_HEAD(&dcache_lru) : DQUEUE_NEXT_IP(d, lru);
+	while (d != NULL && d->d_fs != fs)
+		d = DQUEUE_NEXT_IP(d, lru);
+	return d;
+}
+
+static int
+icache_size(struct VFS_MOUNTED_FS* fs)
+{
+	int n = 0;
+	for (struct ICACHE_ITEM* ii = icache_next(fs, NULL); ii != NULL; ii = icache_next(fs, ii))
+		n++;
+	return n;
+}
+
+static int
+dcache_size(struct VFS_MOUNTED_FS* fs)
+{
+	int n = 0;
+	for (struct DENTRY* d = dcache_next(fs, NULL); d != NULL; d = dcache_next(fs, d))
+		n++;
+	return n;
+}
+
+/* Returns the number of times an inode is in the cache */
+static int
+icache_count_inode(struct VFS_INODE* inode)
+{
+	int n = 0;
+	for (struct ICACHE_ITEM* ii = icache_next(inode->i_fs, NULL); ii != NULL; ii = icache_next(inode->i_fs, ii))
+		if (ii->inode == inode)
+			n++;
+	return n;
+}
+
+/* Returns the cached entry of a given name, or NULL */
+static struct DENTRY*
+dcache_find(struct VFS_MOUNTED_FS* fs, const char* name)
+{
+	for (struct DENTRY* d = dcache_next(fs, NULL); d != NULL; d = dcache_next(fs, d))
+		if ((d->d_flags & DENTRY_FLAG_CACHED) && strcmp(d->d_entry, name) == 0)
+			return d;
+	return NULL;
+}
 
 int
 main(int argc, char* argv[])
 {
-	int icache_size, dcache_size;
 	struct ICACHE_ITEM* ii;
-	struct DENTRY_CACHE_ITEM* di;
+	struct DENTRY* di;
 
 	if (argc != 2) {
 		fprintf(stderr, "usage: vfstest image.ext2\n");
@@ -64,74 +172,75 @@ main(int argc, char* argv[])
 	/* Give the subsystems a go, as we depend on them */
 	device_init();
 
-	/*
-	 * For now, we assume we can store at least a many entries in the dentry
-	 * cache than in the actual inode cache; this makes sense as we cache
-	 * negative lookups as well.
-	 *
-	 * This property is used in part 3 of the tests.
-	 */
-	EXPECT(DCACHE_ITEMS_PER_FS >= ICACHE_ITEMS_PER_FS);
-
 	/*
 	 * Part 1: Basic mounting, inodes, inode refcounts and dentry checks.
 	 */
-	
+
 	/* Mount a root filesystem */
 	CHECK_OK(vfs_mount("vfile", "/", "ext2", NULL));
 
-	/* Obtain an inode to the root */
-	struct VFS_INODE* root_inode;
-	CHECK_OK(vfs_lookup(NULL, &root_inode, "/"));
+	/* Obtain the root entry */
+	struct DENTRY* root_dentry;
+	CHECK_OK(vfs_lookup(NULL, &root_dentry, "/"));
+	struct VFS_MOUNTED_FS* rootfs = root_dentry->d_fs;
+	struct VFS_INODE* root_inode = root_dentry->d_inode;
+	EXPECT(root_dentry == rootfs->fs_root_dentry);
+	EXPECT(root_inode != NULL);
 
 	/* There should now be a single inode in the cache */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 1);
+	EXPECT(icache_size(rootfs) == 1);
 
-	/* The entry must be identical to the root_inode and filesystem root inode */
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
+	/* The entry must be identical to the root inode */
+	ii = icache_next(rootfs, NULL);
 	EXPECT(ii->inode == root_inode);
-	EXPECT(ii->inode == root_inode->i_fs->fs_root_inode);
 
-	/*
-	 * Refcount must be 3 (fs->root_inode, root_inode and cache) - it will not be
- 	 * in the dentry cache
-	 */
-	EXPECT(ii->inode->i_refcount == 3);
+	/* Refcount must be 2 (root dentry and cache) */
+	EXPECT(root_inode->i_refcount == 2);
 
-	/* Thus, there should be nothing in the dentry cache */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == 0);
+	/* The only entry in the dentry cache must be the root itself... */
+	EXPECT(dcache_size(rootfs) == 1);
+	di = dcache_next(rootfs, NULL);
+	EXPECT(di == root_dentry);
+	EXPECT(di->d_parent == NULL);
+	/* ...which is permanent */
+	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) != 0);
+	/* ...and is referenced by at least the filesystem and our lookup */
+	int root_refs = atomic_read(&di->d_refcount);
+	EXPECT(root_refs >= 2);
 
 	/* Now, open a file in the root */
 	struct VFS_FILE file1;
 	CHECK_OK(vfs_open(FILE1, NULL, &file1));
+	struct VFS_INODE* file1inode = file1.f_dentry->d_inode;
 
 	/* There should now be two entries in the inode cache... */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
+	EXPECT(icache_size(rootfs) == 2);
 	/* First is the file we just opened (as it is most recently used) */
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
-	EXPECT(ii->inode == file1.f_inode);
-	/* With a refcount of 3 (file, dentry cache, inode cache) */
-	EXPECT(ii->inode->i_refcount == 3);
+	ii = icache_next(rootfs, NULL);
+	EXPECT(ii->inode == file1inode);
+	/* With a refcount of 2 (dentry, inode cache) */
+	EXPECT(file1inode->i_refcount == 2);
 	/* ...second is the root inode ... */
-	ii = DQUEUE_NEXT(ii);
+	ii = icache_next(rootfs, ii);
 	EXPECT(ii->inode == root_inode);
-	/* ... with a refcount of 4 (fs->root_inode, root_inode, dentry.parent and cache) */
-	EXPECT(root_inode->i_refcount == 4);
+	/* ... whose refcount is untouched, as entries reference their parent entry */
+	EXPECT(root_inode->i_refcount == 2);
 
-	/* There should be a single item in the entry cache... */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == 1);
+	/* There should be an extra item in the entry cache... */
+	EXPECT(dcache_size(rootfs) == 2);
 
 	/* ... namely the file we opened */
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	EXPECT(di->d_dir_inode == root_inode);
-	EXPECT(di->d_entry_inode == file1.f_inode);
+	di = dcache_next(rootfs, NULL);
+	EXPECT(di == file1.f_dentry);
+	EXPECT(di->d_parent == root_dentry);
+	EXPECT(di->d_inode == file1inode);
 	EXPECT(strcmp(di->d_entry, FILE1) == 0);
-	/* And it must not be a negative entry */
+	/* It must not be a negative entry... */
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
+	/* ...and have 2 refs (file, cache) */
+	EXPECT(atomic_read(&di->d_refcount) == 2);
+	/* The root entry gains a ref for its child */
+	EXPECT(atomic_read(&root_dentry->d_refcount) == root_refs + 1);
 
 	/*
 	 * Let's try to read our test file and compare it. We read in oddly-sized
@@ -158,40 +267,41 @@ main(int argc, char* argv[])
 	fclose(f);
 
 	/* Now, we close the VFS file */
-	struct VFS_INODE* file1inode = file1.f_inode;
+	struct DENTRY* file1dentry = file1.f_dentry;
 	CHECK_OK(vfs_close(&file1));
 
 	/* Now, the backing inode must still exist in the cache... */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
+	EXPECT(icache_size(rootfs) == 2);
+	ii = icache_next(rootfs, NULL);
 	EXPECT(ii->inode == file1inode);
-	/* ... but the refcount must be only one (inode cache, dentry cache) */
+	/* ... as the entry still references it */
 	EXPECT(file1inode->i_refcount == 2);
+	/* The entry itself is only referenced by the cache now */
+	EXPECT(atomic_read(&file1dentry->d_refcount) == 1);
 
 	/* Try to open a nonexistant file */
 	struct VFS_FILE file2;
 	CHECK_ERROR(vfs_open(FILE2, NULL, &file2), NO_FILE);
 
 	/* The inode cache mustn't have changed */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
+	EXPECT(icache_size(rootfs) == 2);
 
 	/* The entry cache must have an extra item... */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == 2);
+	EXPECT(dcache_size(rootfs) == 3);
 
 	/* ...namely our lookup... */
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	EXPECT(di->d_dir_inode == root_inode);
+	di = dcache_next(rootfs, NULL);
+	EXPECT(di->d_parent == root_dentry);
 	EXPECT(strcmp(di->d_entry, FILE2) == 0);
 
-	/* ...which must have failed */
-	EXPECT(di->d_entry_inode == NULL);
+	/* ...which must have failed... */
+	EXPECT(di->d_inode == NULL);
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) != 0);
+	/* ...and is only referenced by the cache */
+	EXPECT(atomic_read(&di->d_refcount) == 1);
 
-	/* Regardless, the root inode's refcount must be one higher (+dentry dirinode) */
-	EXPECT(root_inode->i_refcount == 5);
+	/* Regardless, the root entry's refcount must be one higher (+child entry) */
+	EXPECT(atomic_read(&root_dentry->d_refcount) == root_refs + 2);
 
 	/*
 	 * Part 2: Nested filesystems check.
@@ -200,19 +310,22 @@ main(int argc, char* argv[])
 	/* Mount a device filesystem on top of our filesystem */
 	CHECK_OK(vfs_mount(NULL, "/" DEVFS_MOUNTPOINT, "devfs", NULL));
 
-	/* We must still have 2 inodes in the root filesystem's inode cache... */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
-
-	/* The first is the file inode... */
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
-	/* ...with 2 refs (dentry cache, inode cache) */
+	/*
+	 * The root filesystem's inode cache gained the directory we mounted on; it
+	 * is only referenced by the cache, as the entry now refers to the device
+	 * filesystem instead.
+	 */
+	EXPECT(icache_size(rootfs) == 3);
+	ii = icache_next(rootfs, NULL);
+	EXPECT(ii->inode->i_refcount == 1);
+	/* Then the file inode, with 2 refs (dentry cache, inode cache)... */
+	ii = icache_next(rootfs, ii);
+	EXPECT(ii->inode == file1inode);
 	EXPECT(ii->inode->i_refcount == 2);
-	/* And then the root inode... */
-	ii = DQUEUE_NEXT(ii);
+	/* And then the root inode, which must not have changed */
+	ii = icache_next(rootfs, ii);
 	EXPECT(ii->inode == root_inode);
-	/* ...with a refcount of 6 (5 + dentry for /dev dir)... */
-	EXPECT(ii->inode->i_refcount == 6);
+	EXPECT(ii->inode->i_refcount == 2);
 
 	/*
 	 * Obtain the new filesystem's root inode; we can't check the inode or entry
@@ -220,286 +333,220 @@ main(int argc, char* argv[])
 	 */
 	struct VFS_FILE file3;
 	CHECK_OK(vfs_open(DEVFS_MOUNTPOINT, NULL, &file3));
+	struct VFS_INODE* devfs_inode = file3.f_dentry->d_inode;
+	struct VFS_MOUNTED_FS* devfs = devfs_inode->i_fs;
+	EXPECT(devfs != rootfs);
 
 	/* The filesystem must have a single inode in cache... */
-	CALCULATE_ICACHE_SIZE(file3.f_inode->i_fs, icache_size);
-	EXPECT(icache_size == 1);
+	EXPECT(icache_size(devfs) == 1);
 
 	/* ...and it should be our inode, the root one... */
-	ii = DQUEUE_HEAD(&file3.f_inode->i_fs->fs_icache_inuse);
-	EXPECT(ii->inode == file3.f_inode);
-	EXPECT(ii->inode == file3.f_inode->i_fs->fs_root_inode);
+	ii = icache_next(devfs, NULL);
+	EXPECT(ii->inode == devfs_inode);
+	EXPECT(ii->inode == devfs->fs_root_dentry->d_inode);
 
-	/* ...and it must have 3 refs (file3, fs->root_inode, cache) */
+	/* ...and it must have 3 refs (mountpoint entry, root entry, cache) */
 	EXPECT(ii->inode->i_refcount == 3);
 
-	/* The entry cache of the new filesystem must be empty */
-	CALCULATE_DCACHE_SIZE(file3.f_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == 0);
+	/* The entry cache of the new filesystem must only contain its root */
+	EXPECT(dcache_size(devfs) == 1);
+	EXPECT(dcache_next(devfs, NULL) == devfs->fs_root_dentry);
 
-	/* The root filesystem must have 3 entries in the inode cache... */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == 3);
+	/* The root filesystem must have 4 entries in the dentry cache... */
+	EXPECT(dcache_size(rootfs) == 4);
 
 	/* ...where the first one is our mountpoint... */
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	EXPECT(di->d_dir_inode == root_inode);
-	EXPECT(di->d_entry_inode == file3.f_inode);
+	di = dcache_next(rootfs, NULL);
+	EXPECT(di == file3.f_dentry);
+	EXPECT(di->d_parent == root_dentry);
+	EXPECT(di->d_inode == devfs_inode);
 	EXPECT(strcmp(di->d_entry, DEVFS_MOUNTPOINT) == 0);
 	/* ...it must not be a negative entry... */
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
-	/* ...but marked permant */
+	/* ...but marked permanent */
 	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) != 0);
+	CHECK_OK(vfs_close(&file3));
 
-	/* Check the refcount of the root filesystem; it must not have changed */	
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
-	/* First is the file inode... */
-	EXPECT(ii->inode == file1inode);
-	/* ... but the refcount must be two (inode cache, dentry cache) */
-	EXPECT(file1inode->i_refcount == 2);
-	ii = DQUEUE_NEXT(ii);
-	/* Then the root inode ... */
-	EXPECT(ii->inode == root_inode);
-	/* ... refcount must be 6 (fs->root_inode, root_inode, cache, 3x dentry parent dir) */
-	EXPECT(ii->inode->i_refcount == 6);
+	/* Walking into the mountpoint must end up on the new filesystem */
+	struct DENTRY* devfs_dentry;
+	CHECK_OK(vfs_lookup(NULL, &devfs_dentry, "/" DEVFS_MOUNTPOINT "/."));
+	EXPECT(devfs_dentry->d_inode == devfs_inode);
+	dentry_deref(devfs_dentry);
 
 	/*
 	 * Part 3: Overload conditions.
 	 */
 
 	/*
-	 * First, overflow the root filesystem's dentry cache by requesting a bunch of
-	 * nonexisting files. Before we do so, ensure the cache consists of 3 entries,
-	 * FILE1, FILE2 and DEVFS_MOUNTPOINT (even though all files are closed)
-	 * 
+	 * First, overflow the dentry cache by requesting a bunch of nonexisting
+	 * files. Before we do so, ensure the cache consists of 4 entries,
+	 * DEVFS_MOUNTPOINT, FILE2, FILE1 and the root (even though all files are
+	 * closed)
 	 */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == 3);
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	/* First entry must be DEFS_MOUNTPOINT in the root (most recently used)... */
-	EXPECT(di->d_dir_inode == root_inode);
+	EXPECT(dcache_size(rootfs) == 4);
+	di = dcache_next(rootfs, NULL);
+	/* First entry must be DEVFS_MOUNTPOINT in the root (most recently used)... */
+	EXPECT(di->d_parent == root_dentry);
 	EXPECT(strcmp(di->d_entry, DEVFS_MOUNTPOINT) == 0);
 	/* ...which is present and permanent */
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
 	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) != 0);
-	di = DQUEUE_NEXT(di);
+	di = dcache_next(rootfs, di);
 	/* Second entry is FILE2 in the root... */
-	EXPECT(di->d_dir_inode == root_inode);
+	EXPECT(di->d_parent == root_dentry);
 	EXPECT(strcmp(di->d_entry, FILE2) == 0);
 	/* ...which is negative but not permanent */
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) != 0);
 	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-	di = DQUEUE_NEXT(di);
-	/* Final entry is FILE1 in the root... */
-	EXPECT(di->d_dir_inode == root_inode);
+	di = dcache_next(rootfs, di);
+	/* Third entry is FILE1 in the root... */
+	EXPECT(di == file1dentry);
 	EXPECT(strcmp(di->d_entry, FILE1) == 0);
 	/* ...which is neither negative nor permanent */
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
 	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
+	/* Final entry is the root itself */
+	di = dcache_next(rootfs, di);
+	EXPECT(di == root_dentry);
 
 	/* Now, fill the dentry cache to the brim */
-	for (int i = 3; i < DCACHE_ITEMS_PER_FS; i++) {
+	unsigned int num_entries, hash_size, num_none = 0;
+	dcache_get_size(&num_entries, &hash_size);
+	while (num_entries < DCACHE_MAX_ENTRIES) {
 		struct VFS_FILE file;
 		char filename[64 /* XXX */];
-		snprintf(filename, sizeof(filename), FILENAME_NONE, i);
+		snprintf(filename, sizeof(filename), FILENAME_NONE, num_none);
 		CHECK_ERROR(vfs_open(filename, NULL, &file), NO_FILE);
+		num_none++;
+		dcache_get_size(&num_entries, &hash_size);
 	}
 
-	/* OK, dentry cache must be filled completely now */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == DCACHE_ITEMS_PER_FS);
+	/* OK, dentry cache must be filled completely now; it must have grown its hash table */
+	EXPECT(num_entries == DCACHE_MAX_ENTRIES);
+	EXPECT(hash_size > 64);
 
-	/* Namely with FILENAME_NONE[DCACHE_ITEMS_PER_FS .. 3] entries */
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	for (int i = DCACHE_ITEMS_PER_FS - 1; i >= 3; i--) {
+	/* Namely with FILENAME_NONE[num_none - 1 .. 0] entries */
+	di = dcache_next(rootfs, NULL);
+	for (int i = num_none - 1; i >= 0; i--) {
 		/* Which have the correct filename... */
 		char filename[64 /* XXX */];
 		snprintf(filename, sizeof(filename), FILENAME_NONE, i);
-		EXPECT(strcmp(di->d_entry, filename) == 0);
+		if (strcmp(di->d_entry, filename) != 0)
+			EXPECT(0); /* wrapped to ensure the cache size doesn't influence the number of tests */
 		/* ...and are negative yet not permanent */
-		EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) != 0);
-		EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-		di = DQUEUE_NEXT(di);
+		if ((di->d_flags & (DENTRY_FLAG_NEGATIVE | DENTRY_FLAG_PERMANENT)) != DENTRY_FLAG_NEGATIVE)
+			EXPECT(0);
+		di = dcache_next(rootfs, di);
 	}
 
 	/*
 	 * Now we'll expect to see the mountpoint entry. If it's there, we don't bother
 	 * to check the other entries because they'll likely be there.
 	 */
-	EXPECT(di->d_dir_inode == root_inode);
+	EXPECT(di->d_parent == root_dentry);
 	EXPECT(strcmp(di->d_entry, DEVFS_MOUNTPOINT) == 0);
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
 	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) != 0);
 
-	/* Check the inode cache; there must only be two items in there */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
-	/* First the file inode... */
-	EXPECT(ii->inode == file1inode);
-	/* ... but the refcount must remain at two (inode cache, dentry cache) */
+	/* As we have only requested non-present inodes, the inode cache must not have changed */
+	EXPECT(icache_size(rootfs) == 3);
 	EXPECT(file1inode->i_refcount == 2);
-	ii = DQUEUE_NEXT(ii);
-	/* And then the root inode... */
-	EXPECT(ii->inode == root_inode);
-	/* ... refcount must be 3 (fs->root_inode, root_inode, inode cache) +  #cache_items */
-	EXPECT(ii->inode->i_refcount == 3 + DCACHE_ITEMS_PER_FS);
+	EXPECT(root_inode->i_refcount == 2);
 
 	/* Now, let's request yet another nonexistent file ... */
 	struct VFS_FILE file4;
 	CHECK_ERROR(vfs_open(FILE4, NULL, &file4), NO_FILE);
 
-	/* ... the dentry cache size cannot have changed */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT(dcache_size == DCACHE_ITEMS_PER_FS);
+	/* ... which must have caused the least recently used entries to be thrown away */
+	dcache_get_size(&num_entries, &hash_size);
+	EXPECT(num_entries < DCACHE_MAX_ENTRIES);
 
 	/* We expect our first entry to be the file we just asked for... */
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	EXPECT(di->d_dir_inode == root_inode);
+	di = dcache_next(rootfs, NULL);
+	EXPECT(di->d_parent == root_dentry);
 	EXPECT(strcmp(di->d_entry, FILE4) == 0);
 	/* ...which is negative but not permanent */
 	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) != 0);
 	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-	di = DQUEUE_NEXT(di);
-
-	/* The next entries entry should be the files we asked for in the loop... */
-	for (int i = DCACHE_ITEMS_PER_FS - 1; i >= 3; i--) {
-		/* Which have the correct filename... */
-		char filename[64 /* XXX */];
-		snprintf(filename, sizeof(filename), FILENAME_NONE, i);
-		EXPECT(strcmp(di->d_entry, filename) == 0);
-		/* ...and are negative yet not permanent */
-		EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) != 0);
-		EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-		di = DQUEUE_NEXT(di);
-	}
-
-	/* The pre-final entry must be the device filesystem entry... */
-	EXPECT(di->d_dir_inode == root_inode);
-	EXPECT(strcmp(di->d_entry, DEVFS_MOUNTPOINT) == 0);
-	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
-	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) != 0);
-	di = DQUEUE_NEXT(di);
-
-	/* And finally, we have FILE1 (because we prefer to remove non-negative entries) */
-	EXPECT(strcmp(di->d_entry, FILE1) == 0);
-	EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
-	EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-	EXPECT(DQUEUE_NEXT(di) == NULL); /* just a safeguard to verify the logic above */
-
-	/*
-	 * As we have only requested non-present inodes, the inode cache must not
-	 * have changed (except for the file1 inode, which has only a single ref
-	 * now)
-	 */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == 2);
-
-	ii = DQUEUE_HEAD(&root_inode->i_fs->fs_icache_inuse);
-	/* First the file inode.. .*/
-	EXPECT(ii->inode == file1inode);
-	/* ... yet file1's refcount must be two (inode and dentry cache) */
-	EXPECT(file1inode->i_refcount == 2);
-	ii = DQUEUE_NEXT(ii);
-	/* Then the root inode... */
-	EXPECT(ii->inode == root_inode);
-	/* .. .refcount must be 3 (fs->root_inode, root_inode, inode cache) + #cache_items */
-	EXPECT(ii->inode->i_refcount == 3 + DCACHE_ITEMS_PER_FS);
+	di = dcache_next(rootfs, di);
+
+	/* The next entry should be the final file we asked for in the loop */
+	char filename[64 /* XXX */];
+	snprintf(filename, sizeof(filename), FILENAME_NONE, num_none - 1);
+	EXPECT(strcmp(di->d_entry, filename) == 0);
+
+	/* The oldest entries are gone, even positive ones... */
+	snprintf(filename, sizeof(filename), FILENAME_NONE, 0);
+	EXPECT(dcache_find(rootfs, filename) == NULL);
+	EXPECT(dcache_find(rootfs, FILE2) == NULL);
+	EXPECT(dcache_find(rootfs, FILE1) == NULL);
+	/* ...but permanent ones remain */
+	EXPECT(dcache_find(rootfs, DEVFS_MOUNTPOINT) != NULL);
+	EXPECT(dcache_next(devfs, NULL) == devfs->fs_root_dentry);
+
+	/* The file inode must still be cached... */
+	EXPECT(icache_count_inode(file1inode) == 1);
+
+	/* ...so opening it again must yield the very same inode */
+	CHECK_OK(vfs_open(FILE1, NULL, &file1));
+	EXPECT(file1.f_dentry != file1dentry);
+	EXPECT(file1.f_dentry->d_inode == file1inode);
+	EXPECT(icache_size(rootfs) == 3);
+	CHECK_OK(vfs_close(&file1));
 
 	/*
 	 * Fill the inode cache by requesting files that actually exist; we
-	 * immediately close them afterwards. This may cause the dentry cache
-	 * to overflow, but that is alright as we verified it above here.
+	 * immediately close them afterwards. Their entries stay in the cache, and
+	 * so do their inodes.
 	 */
-	for (int i = 0; i < ICACHE_ITEMS_PER_FS - 2; i++) {
+	for (int i = 0; i < NUM_DUMMY_FILES; i++) {
 		struct VFS_FILE file;
-		char filename[64 /* XXX */];
 		snprintf(filename, sizeof(filename), FILENAME_DUMMY, i);
 		CHECK_OK(vfs_open(filename, NULL, &file));
 		CHECK_OK(vfs_close(&file));
 	}
 
-	/* Inode cache must be completely filled now */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == ICACHE_ITEMS_PER_FS);
+	/* Inode cache must hold all of them now */
+	EXPECT(icache_size(rootfs) == 3 + NUM_DUMMY_FILES);
 
-	/*
-	 * Verify the dentry cache - this uses the fact that DCACHE_ITEMS_PER_FS >=
-	 * ICACHE_ITEMS_PER_FS; all of our inode items have to be in the dentry cache
-	 * because the latter is larger.
-	 */
-	di = DQUEUE_HEAD(&root_inode->i_fs->fs_dcache_inuse);
-	for (int i = ICACHE_ITEMS_PER_FS - 3; i >= 0; i--) {
-		char filename[64 /* XXX */];
+	/* Verify the dentry cache; it must contain every file we opened, most recent first */
+	di = dcache_next(rootfs, NULL);
+	for (int i = NUM_DUMMY_FILES - 1; i >= 0; i--) {
 		snprintf(filename, sizeof(filename), FILENAME_DUMMY, i);
-		EXPECT(strcmp(di->d_entry, filename) == 0);
+		if (strcmp(di->d_entry, filename) != 0)
+			EXPECT(0); /* wrapped to ensure the file count doesn't influence the number of tests */
 		/* Entry should be present and not permanent */
-		EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
-		EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-		EXPECT(di->d_dir_inode == root_inode);
-		EXPECT(di->d_entry_inode != NULL);
+		if ((di->d_flags & (DENTRY_FLAG_NEGATIVE | DENTRY_FLAG_PERMANENT)) != 0)
+			EXPECT(0);
+		if (di->d_parent != root_dentry || di->d_inode == NULL)
+			EXPECT(0);
 		/*
 		 * Ensure there is exactly one entry in the inode cache for this item; this
-		 * ensures the inode cache is valid.
+		 * ensures the inode cache is valid. It must be referenced by the entry
+		 * and the cache.
 		 */
-		int found = 0;
-		DQUEUE_FOREACH(&root_inode->i_fs->fs_icache_inuse, ii, struct ICACHE_ITEM) {
-			if (ii->inode == di->d_entry_inode)
-				found++;
-		}
-		EXPECT(found == 1);
-		di = DQUEUE_NEXT(di);
+		if (icache_count_inode(di->d_inode) != 1 || di->d_inode->i_refcount != 2)
+			EXPECT(0);
+		di = dcache_next(rootfs, di);
 	}
 
 	/*
-	 * OK - inode cache is fully filled, dentry cache is fully filled. Now, fill
-	 * the entire dentry cache with requests. Because it is at least the inode
-	 * cache size, this cannot be satisfied.
+	 * Request all files again; as everything is cached, this must not change the
+	 * caches at all.
 	 */
-	for (int i = 0; i < DCACHE_ITEMS_PER_FS; i++) {
+	struct DCACHE_STATS ds_before, ds_after;
+	dcache_get_stats(&ds_before);
+	for (int i = 0; i < NUM_DUMMY_FILES; i++) {
 		struct VFS_FILE file;
-		char filename[64 /* XXX */];
 		snprintf(filename, sizeof(filename), FILENAME_DUMMY, i);
 		CHECK_OK(vfs_open(filename, NULL, &file));
+		if (file.f_dentry->d_inode->i_refcount != 2)
+			EXPECT(0);
 		CHECK_OK(vfs_close(&file));
 	}
-
-	/* Inode cache must be completely filled now... */
-	CALCULATE_ICACHE_SIZE(root_inode->i_fs, icache_size);
-	EXPECT(icache_size == ICACHE_ITEMS_PER_FS);
-
-	/*
-	 * ... yet we can't expect the dentry cache to be completely filled,
-	 * because the inode code is free to clear it; all we can do is check
-	 * that at least the files we opened are in there, but as the test
-	 * filesystem image isn't specially generated, matching them is quite
-	 * hard - so we just have to settle for a check that at least the
-	 * cache entries are in there.
-	 *
-	 * TODO The VFS currently doesn't behave like we intended (it removes
-	 * more items than it should) so the tests are flagged as such.
-	 */
-	CALCULATE_DCACHE_SIZE(root_inode->i_fs, dcache_size);
-	EXPECT_FAILURE(dcache_size >= ICACHE_ITEMS_PER_FS);
-	for (int i = 0; i < DCACHE_ITEMS_PER_FS; i++) {
-		struct VFS_FILE file;
-		char filename[64 /* XXX */];
-		snprintf(filename, sizeof(filename), FILENAME_DUMMY, i);
-
-		/* See if the filename lives in the dentry cache; it should because the latter is larger */
-		int found = 0;
-		DQUEUE_FOREACH(&root_inode->i_fs->fs_dcache_inuse, di, struct DENTRY_CACHE_ITEM) {
-			if (strcmp(di->d_entry, filename) != 0)
-				continue;
-			/* Got it; it must be non-negative and non-permanent */
-			EXPECT((di->d_flags & DENTRY_FLAG_NEGATIVE) == 0);
-			EXPECT((di->d_flags & DENTRY_FLAG_PERMANENT) == 0);
-			found++;
-		}
-		EXPECT_FAILURE(found == 1);
-	}
+	dcache_get_stats(&ds_after);
+	EXPECT(ds_after.ds_misses == ds_before.ds_misses);
+	EXPECT(icache_size(rootfs) == 3 + NUM_DUMMY_FILES);
 
 	/* Clean up the test framework; this will also output test results */
 	framework_done();